@@ -46,6 +46,7 @@ enum {
 #define AIFF_QUANT_FIXED	0x0000	/* Quantile: fixed computations */
 #define AIFF_QUANT_ADD1		0x0100	/* Quantile: add current packet */
 #define AIFF_QUANT_ORIG		0x0200	/* Quantile: original computations */
+#define AIFF_EXACT_FLOW		0x1000	/* Full hash and key, no collisions */
 
 /* statistics exported to userspace */
 struct tc_aifo_xstats {
@@ -57,12 +58,14 @@ struct tc_aifo_xstats {
 	__u32	qlen_peak;	/* Maximum queue length */
 	__u32	backlog_peak;	/* Maximum backlog */
 	__u32	quant_avg_1k;	/* Average quantile * 1024 */
+	__u32	admit_cycles;	/* Average cycles per admit decision */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
 };
 
 
 static void explain(void)
 {
-	fprintf(stderr, "Usage: ... aifo-stfq [ limit PACKETS ] [ burst PACKETS ] [ buckets NUMBER ] [ hash_mask MASK ] [ samples NUMBER ] [ speriod PACKETS ]\n");
+	fprintf(stderr, "Usage: ... aifo-stfq [ limit PACKETS ] [ burst PACKETS ] [ buckets NUMBER ] [ hash_mask MASK ] [ samples NUMBER ] [ speriod PACKETS ] [ exact_flow | noexact_flow ]\n");
 }
 
 static unsigned int ilog2(unsigned int val)
@@ -145,6 +148,12 @@ static int aifo_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 				return -1;
 			}
 			flags_upd = true;
+		} else if (strcmp(*argv, "exact_flow") == 0) {
+			flags |= AIFF_EXACT_FLOW;
+			flags_upd = true;
+		} else if (strcmp(*argv, "noexact_flow") == 0) {
+			flags &= ~AIFF_EXACT_FLOW;
+			flags_upd = true;
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -248,6 +257,8 @@ static int aifo_print_opt(struct qdisc_util *qu, FILE *f,
 		unsigned int flags;
 		flags = rta_getattr_u32(tb[TCA_AIFO_FLAGS]);
 		print_uint(PRINT_ANY, "flags", "flags 0x%X ", flags);
+		if (flags & AIFF_EXACT_FLOW)
+			print_bool(PRINT_ANY, "exact_flow", "exact_flow ", true);
 	}
 	return 0;
 }
@@ -272,6 +283,14 @@ static int aifo_print_xstats(struct qdisc_util *qu, FILE *f,
 	print_uint(PRINT_ANY, "drop_mark", " drop_mark %u", st->drop_mark);
 	print_float(PRINT_ANY, "quant_avg", " quant_avg %.3f",
 		    (float) st->quant_avg_1k / 1024.0);
+	if (st->admit_cycles != 0) {
+		print_uint(PRINT_ANY, "admit_cycles", " admit_cycles %u",
+			   st->admit_cycles);
+	}
+	if (st->hash_collisions != 0) {
+		print_uint(PRINT_ANY, "hash_collisions", " hash_collisions %u",
+			   st->hash_collisions);
+	}
 	if (st->backlog_peak != 0 || st->qlen_peak != 0) {
 		print_uint(PRINT_ANY, "backlog_peak", "  backlog_peak %ub",
 			   st->backlog_peak);
@@ -43,6 +43,7 @@ enum {
 	TCA_FQ_PI2_FLAGS,	/* See flags below */
 	TCA_FQ_PI2_MON_FL_PORT,	/* Transport port for flow instrumentation */
 	TCA_FQ_PI2_UDP_PLIMIT,	/* Target backlog size for UDP (bytes) */
+	TCA_FQ_PI2_CLOCK,	/* Clock source, see below */
 	__TCA_FQ_PI2_MAX
 };
 #define TCA_FQ_PI2_MAX   (__TCA_FQ_PI2_MAX - 1)
@@ -58,6 +59,11 @@ enum {
 
 #endif	/* TCA_FQ_PI2_MAX */
 
+/* FQ_PI2_CLOCK, in order */
+static const char *pi2_clock_names[] = {
+	"ktime", "cycles", "tstamp",
+};
+
 #define PROBA_NORMA	0x100000000LL	/* Normalise : probability 1 is 2^32 */
 #define PROBA_MAX	0xFFFFFFFFLL	/* Max probability : 2^32 - 1 */
 
@@ -94,6 +100,19 @@ struct tc_fq_pi2_xstats {
 	__u32	fl_drop_mark;	/* Sub-Q pkts dropped due to PI2 AQM */
 	__u32	fl_ecn_mark;	/* Sub-Q pkts marked with ECN, classic TCP */
 	__u32	fl_sce_mark;	/* Sub-Q pkts marked with ECN, scalable TCP */
+	__u32	clock_saved;	/* ktime_get_ns() calls avoided */
+};
+
+/* Stats of one flow, as a class */
+struct tc_fq_pi2_flow_xstats {
+	__u32	flow_idx;	/* Hash value for this flow */
+	__u32	qlen;		/* Packets queued */
+	__u32	backlog;	/* Bytes queued */
+	__u32	drops;		/* Packets dropped from this flow */
+	__s32	credit;		/* Deficit of the flow */
+	__u32	sojourn_us;	/* Time in queue of the head packet */
+	__u32	proba;		/* Current raw probability */
+	__u32	qdelay_us;	/* Last estimated sub-queue delay */
 };
 
 
@@ -102,7 +121,8 @@ static void explain(void)
 	fprintf(stderr,
 		"Usage: ... fq_pi2 [ limit PACKETS ] [ buckets NUMBER ] [ hash_mask MASK ]\n"
 		"                  [ flow_limit PACKETS ] [target TIME us] [ecn|noecn]\n"
-		"                [tupdate TIME us] [alpha ALPHA] [beta BETA] [coupling COUPLING]\n");
+		"                [tupdate TIME us] [alpha ALPHA] [beta BETA] [coupling COUPLING]\n"
+		"                [clock ktime|cycles|tstamp]\n");
 }
 
 static unsigned int ilog2(unsigned int val)
@@ -170,6 +190,7 @@ static int fq_pi2_parse_opt(struct qdisc_util *qu,
 	bool		flags_upd = false;
 	uint16_t	mon_fl_port = 0xFFFF;
 	uint32_t	udp_plimit = 0xFFFFFFFF;
+	uint32_t	clock = 0xFFFFFFFF;
 	struct rtattr *tail;
 
 	while (argc > 0) {
@@ -310,6 +331,16 @@ static int fq_pi2_parse_opt(struct qdisc_util *qu,
 				fprintf(stderr, "Illegal \"udp_limit\"\n");
 				return -1;
 			}
+		} else if (strcmp(*argv, "clock") == 0) {
+			NEXT_ARG();
+			for (clock = 0; clock < ARRAY_SIZE(pi2_clock_names);
+			     clock++)
+				if (strcmp(*argv, pi2_clock_names[clock]) == 0)
+					break;
+			if (clock == ARRAY_SIZE(pi2_clock_names)) {
+				fprintf(stderr, "Illegal \"clock\"\n");
+				return -1;
+			}
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -360,6 +391,8 @@ static int fq_pi2_parse_opt(struct qdisc_util *qu,
 		addattr16(n, 1024, TCA_FQ_PI2_MON_FL_PORT, mon_fl_port);
 	if (udp_plimit != 0xFFFFFFFF)
 		addattr32(n, 1024, TCA_FQ_PI2_UDP_PLIMIT, udp_plimit);
+	if (clock != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_FQ_PI2_CLOCK, clock);
 	
 	addattr_nest_end(n, tail);
 	// tail->rta_len = (void *)NLMSG_TAIL(n) - (void *)tail;
@@ -507,11 +540,37 @@ static int fq_pi2_print_opt(struct qdisc_util *qu,
 		    print_uint(PRINT_ANY, "udp_limit", "udp_limit %up ",
 			       udp_plimit);
 	    }
+	    if (tb[TCA_FQ_PI2_CLOCK] &&
+		RTA_PAYLOAD(tb[TCA_FQ_PI2_CLOCK]) >= sizeof(__u32)) {
+		    unsigned int clock;
+		    clock = rta_getattr_u32(tb[TCA_FQ_PI2_CLOCK]);
+		    if (clock < ARRAY_SIZE(pi2_clock_names))
+			print_string(PRINT_ANY, "clock", "clock %s ",
+				     pi2_clock_names[clock]);
+		    else
+			print_uint(PRINT_ANY, "clock", "clock %u ", clock);
+	    }
 	}
 
 	return 0;
 }
 
+/* Each flow is a class, see 'tc -s class show' */
+static int fq_pi2_print_flow_xstats(struct tc_fq_pi2_flow_xstats *st)
+{
+	print_0xhex(PRINT_ANY, "flow_idx", "  flow 0x%08llx", st->flow_idx);
+	print_uint(PRINT_ANY, "qlen", " qlen %u", st->qlen);
+	print_uint(PRINT_ANY, "backlog", " backlog %ub", st->backlog);
+	print_uint(PRINT_ANY, "drops", " drops %u", st->drops);
+	print_int(PRINT_ANY, "credit", " credit %d", st->credit);
+	print_uint(PRINT_ANY, "proba", " proba %u", st->proba);
+	print_uint(PRINT_ANY, "qdelay_us", " qdelay %uus", st->qdelay_us);
+	if (st->sojourn_us != 0)
+		print_uint(PRINT_ANY, "sojourn_us", " sojourn %uus",
+			   st->sojourn_us);
+	return 0;
+}
+
 static int fq_pi2_print_xstats(struct qdisc_util *qu, FILE *f,
 			     struct rtattr *xstats)
 {
@@ -520,6 +579,9 @@ static int fq_pi2_print_xstats(struct qdisc_util *qu, FILE *f,
 	if (xstats == NULL)
 		return 0;
 	
+	if (RTA_PAYLOAD(xstats) == sizeof(struct tc_fq_pi2_flow_xstats))
+		return fq_pi2_print_flow_xstats(RTA_DATA(xstats));
+
 	if (RTA_PAYLOAD(xstats) < sizeof(*st))
 		return -1;
 
@@ -569,6 +631,9 @@ static int fq_pi2_print_xstats(struct qdisc_util *qu, FILE *f,
 	print_uint(PRINT_ANY, "drop_mark", " drop_mark %u", st->drop_mark);
 	print_uint(PRINT_ANY, "ecn_mark", " ecn_mark %u", st->ecn_mark);
 	print_uint(PRINT_ANY, "sce_mark", " sce_mark %u", st->sce_mark);
+	if (st->clock_saved != 0)
+		print_uint(PRINT_ANY, "clock_saved", " clock_saved %u",
+			   st->clock_saved);
 
 	return 0;
 }
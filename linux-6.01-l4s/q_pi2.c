@@ -46,6 +46,7 @@ enum {
 	TCA_PI2_BETA,
 	TCA_PI2_COUPLING,
 	TCA_PI2_PI2_FLAGS,
+	TCA_PI2_CLOCK,
 	__TCA_PI2_MAX
 };
 
@@ -61,6 +62,11 @@ enum {
 
 #endif	/* TCA_PI2_MAX */
 
+/* PI2_CLOCK, in order */
+static const char *pi2_clock_names[] = {
+	"ktime", "cycles", "tstamp",
+};
+
 #define PROBA_NORMA	0x100000000LL	/* Normalise : probability 1 is 2^32 */
 #define PROBA_MAX	0xFFFFFFFFLL	/* Max probability : 2^32 - 1 */
 
@@ -82,13 +88,15 @@ struct tc_pi2_xstats {
 	__u32	proba_peak;	/* Maximum raw probability experienced */
 	__u32	delay_us;	/* Current estimated queue delay */
 	__u32	delay_peak_us;	/* Maximum queuing delay experienced */
+	__u32	clock_saved;	/* ktime_get_ns() calls avoided */
 };
 
 static void explain(void)
 {
 	fprintf(stderr,
 		"Usage: ... pi2 [limit BYTES] [target TIME us] [ecn|noecn] [sce|nosce]\n"
-		"               [tupdate TIME us] [alpha ALPHA] [beta BETA] [coupling COUPLING]\n");
+		"               [tupdate TIME us] [alpha ALPHA] [beta BETA] [coupling COUPLING]\n"
+		"               [clock ktime|cycles|tstamp]\n");
 }
 
 static int get_float(float *val, const char *arg, float min, float max)
@@ -133,6 +141,7 @@ static int pi2_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 	uint32_t	coupling = ALPHA_BETA_INVALID;
 	uint32_t	pi2_flags = 0x0;
 	bool		flags_upd = false;
+	uint32_t	clock = 0xFFFFFFFF;
 	struct rtattr *	tail;
 
 	while (argc > 0) {
@@ -218,6 +227,16 @@ static int pi2_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 				return -1;
 			}
 			flags_upd = true;
+		} else if (strcasecmp(*argv, "clock") == 0) {
+			NEXT_ARG();
+			for (clock = 0; clock < ARRAY_SIZE(pi2_clock_names);
+			     clock++)
+				if (strcasecmp(*argv, pi2_clock_names[clock]) == 0)
+					break;
+			if (clock == ARRAY_SIZE(pi2_clock_names)) {
+				fprintf(stderr, "Illegal \"clock\"\n");
+				return -1;
+			}
 		} else if (strcasecmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -247,6 +266,8 @@ static int pi2_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 		addattr32(n, MAX_MSG, TCA_PI2_COUPLING, coupling);
 	if (flags_upd)
 		addattr32(n, MAX_MSG, TCA_PI2_PI2_FLAGS, pi2_flags);
+	if (clock != 0xFFFFFFFF)
+		addattr32(n, MAX_MSG, TCA_PI2_CLOCK, clock);
 
 	tail->rta_len = (void *)NLMSG_TAIL(n) - (void *)tail;
 	return 0;
@@ -324,6 +345,16 @@ static int pi2_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt)
 		    print_float(PRINT_ANY, "coupling", "coupling %.1f ",
 				coupling);
 	    }
+	    if (tb[TCA_PI2_CLOCK] &&
+		RTA_PAYLOAD(tb[TCA_PI2_CLOCK]) >= sizeof(__u32)) {
+		    unsigned int clock;
+		    clock = rta_getattr_u32(tb[TCA_PI2_CLOCK]);
+		    if (clock < ARRAY_SIZE(pi2_clock_names))
+			print_string(PRINT_ANY, "clock", "clock %s ",
+				     pi2_clock_names[clock]);
+		    else
+			print_uint(PRINT_ANY, "clock", "clock %u ", clock);
+	    }
 	}
 
 	return 0;
@@ -354,6 +385,9 @@ static int pi2_print_xstats(struct qdisc_util *qu, FILE *f,
 		    (float) st->delay_us / 1000.0);
 	print_float(PRINT_ANY, "delay_peak", " delay_peak %.3fms",
 		    (float) st->delay_peak_us / 1000.0);
+	if (st->clock_saved != 0)
+		print_uint(PRINT_ANY, "clock_saved", "\n  clock_saved %u",
+			   st->clock_saved);
 	return 0;
 
 }
@@ -31,12 +31,67 @@ enum {
 	TCA_SCRR_HASH_MASK,	/* mask applied to skb hashes */
 	TCA_SCRR_FLOW_PLIMIT,	/* limit of packets per flow */
 	TCA_SCRR_FLAGS,		/* Options */
+	TCA_SCRR_CLASSIFIER,	/* Flow table backend */
+	TCA_SCRR_HASH_LOAD,	/* flows per bucket before growing hash */
+	TCA_SCRR_GC_AGE,	/* idle time before flow is collected, in us */
+	TCA_SCRR_TARGET,	/* PI2 target queuing delay (us) */
+	TCA_SCRR_TUPDATE,	/* Time between proba updates (us) */
+	TCA_SCRR_ALPHA,		/* Integral coefficient */
+	TCA_SCRR_BETA,		/* Proportional coefficient */
+	TCA_SCRR_COUPLING,	/* Coupling between scalable and classical */
+	TCA_SCRR_UDP_PLIMIT,	/* Target backlog size for UDP (packets) */
+	TCA_SCRR_MAX_FLOWS,	/* Size of the preallocated flow pool */
+	TCA_SCRR_WEIGHT_SRC,	/* Where the weight class of packets comes from */
+	TCA_SCRR_WEIGHTS,	/* Weight of each class, u8 array */
+	TCA_SCRR_GSO_SPLIT,	/* Split GSO packets larger than this (bytes) */
+	TCA_SCRR_SK_CACHE,	/* Entries of the socket flow cache */
+	TCA_SCRR_FLOW_BLIMIT,	/* max bytes per flow, 0 = no limit */
+	TCA_SCRR_HORIZON,	/* Drop packets paced further out, in us */
+	TCA_SCRR_TELEMETRY,	/* Record 1 packet in N to the relay, 0 = off */
 	__TCA_SCRR_MAX
 };
 #define TCA_SCRR_MAX	(__TCA_SCRR_MAX - 1)
 
-/* TCA_SCRR_FLAGS */
+/* TCA_SCRR_FLAGS, AQM flags have the same values as PI2F_XXX of fq_pi2 */
+#define SCF_MARK_ECN		0x0001	/* Mark ECT_0 pkts with Classical ECN */
+#define SCF_MARK_SCE		0x0002	/* Mark ECT_1 pkts with Scalable-ECN */
+#define SCF_OVERLOAD_ECN	0x0004	/* Keep doing ECN/SCE on overload */
+#define SCF_RANDOM_MARK		0x0008	/* Randomise marking, like RED */
 #define SCF_PEAK_NORESET	0x0020	/* Don't reset peak statistics */
+#define SCF_UDP_TAILDROP	0x0040	/* Tail-drop UDP packets */
+#define SCF_FLOW_SHARE		0x0080	/* Out of flows, share a collision flow */
+#define SCF_SOJOURN_HIST	0x0100	/* Sojourn time histograms */
+#define SCF_BYPASS		0x0200	/* Stack may skip us when empty */
+#define SCF_EXACT_FLOW		0x0400	/* Full hash and key, no collisions */
+#define SCF_FAT_DROP		0x0800	/* On overload, drop from fattest flow */
+#define SCF_PACING		0x1000	/* Honor skb->tstamp (EDT) */
+
+/* TCA_SCRR_CLASSIFIER */
+#define SCRR_CLASSIFIER_RBTREE	0	/* Hash of RB trees, like sch_fq */
+#define SCRR_CLASSIFIER_OA	1	/* Open addressing, cacheline buckets */
+
+/* TCA_SCRR_WEIGHT_SRC */
+#define SCRR_WEIGHT_NONE	0	/* All flows have the same weight */
+#define SCRR_WEIGHT_PRIORITY	1	/* Class is skb->priority */
+#define SCRR_WEIGHT_MARK	2	/* Class is skb->mark */
+#define SCRR_WEIGHT_CLASSID	3	/* Minor of skb->priority, if it's ours */
+#define SCRR_WEIGHT_CLASSES	16	/* Entries of the weight table */
+
+static const char *scrr_weight_src_names[] = {
+	[SCRR_WEIGHT_NONE]	= "none",
+	[SCRR_WEIGHT_PRIORITY]	= "priority",
+	[SCRR_WEIGHT_MARK]	= "mark",
+	[SCRR_WEIGHT_CLASSID]	= "classid",
+};
+
+/* alpha, beta and coupling of scrr_pi2, same encoding as fq_pi2 :
+ * fixed point normalised at 256, in 1/256th increments. */
+#define ALPHA_BETA_SCALE	(1 << 8)	/* Convert fraction-> integer */
+#define ALPHA_BETA_MAX		((1 << 16) - 1)	/* Up to 65535 */
+#define ALPHA_BETA_INVALID	(~((uint32_t)0))
+
+/* Sojourn histograms, log2 buckets of 1024ns, the last one is above 4s */
+#define SCRR_SOJOURN_BUCKETS	24
 
 /* statistics exported to userspace */
 struct tc_scrr_xstats {
@@ -51,6 +106,41 @@ struct tc_scrr_xstats {
 	__u32	burst_peak;	/* Maximum burst size */
 	__u32	burst_avg;	/* Average burst size */
 	__u32	sched_empty;	/* Schedule with no packet */
+	__u32	probe_avg_1k;	/* Average buckets probed per lookup (x1000) */
+	__u32	probe_peak;	/* Maximum buckets probed for a lookup */
+	__u32	table_full;	/* Flow table full on insertion */
+	__u32	gc_lat_peak_ms;	/* Maximum delay past gc_age before collection */
+	__u32	gc_lat_avg_ms;	/* Average delay past gc_age before collection */
+	__u32	gc_deferred;	/* GC passes which hit their budget */
+	__u64	mem_used;	/* Bytes used by flows and flow table */
+	__u32	ecn_mark;	/* Packets marked with ECN, classic TCP */
+	__u32	sce_mark;	/* Packets marked with ECN, scalable TCP */
+	__u32	pool_free;	/* Flows left in the preallocated pool */
+	__u32	flow_shared;	/* Packets sent to the collision flow */
+	__u32	sojourn_light[SCRR_SOJOURN_BUCKETS]; /* Flows in new list */
+	__u32	sojourn_heavy[SCRR_SOJOURN_BUCKETS]; /* Flows in old list */
+	__u32	gso_split;	/* GSO packets split at dequeue */
+	__u32	bypass;		/* Packets sent by the stack, skipping us */
+	__u32	sk_cache_hit;	/* Flow found in the socket cache */
+	__u32	sk_cache_miss;	/* Socket not in the cache, or stale */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
+	__u32	fat_drop;	/* Packets dropped from the fattest flow */
+	__u32	flows_throttled; /* Flows waiting for their EDT */
+	__u32	throttled;	/* Flows parked in the pacing wheel */
+	__u32	horizon_drops;	/* Packets paced beyond the horizon */
+	__u32	telem_records;	/* Packets sampled by the telemetry */
+	__u32	telem_lost;	/* Records lost, the reader was too slow */
+};
+
+/* Statistics of one flow, as a class */
+struct tc_scrr_flow_xstats {
+	__u64	virtual_finish;	/* Virtual of next incoming packet */
+	__u32	flow_idx;	/* Hash value for this flow */
+	__u32	flow_key;	/* Second hash, with SCF_EXACT_FLOW */
+	__u32	qlen;		/* Packets queued */
+	__u32	backlog;	/* Bytes queued */
+	__u32	drops;		/* Packets dropped from this flow */
+	__u32	sojourn_us;	/* Time in queue of the head packet */
 };
 
 
@@ -58,7 +148,22 @@ static void explain(void)
 {
 	fprintf(stderr,
 		"Usage: ... scrr [ limit PACKETS ] [ buckets NUMBER ] [ hash_mask MASK ]\n"
-		"                [ flow_limit PACKETS ]\n");
+		"                [ flow_limit PACKETS ] [ flow_blimit BYTES ]\n"
+		"                [ classifier rbtree|oa ] [ fat_drop|nofat_drop ]\n"
+		"                [ hash_load FLOWS ] [ gc_age TIME ]\n"
+		"                [ max_flows FLOWS ] [ flow_share|noflow_share ]\n"
+		"                [ sojourn_hist|nosojourn_hist ] [ bypass|nobypass ]\n"
+		"                [ exact_flow|noexact_flow ]\n"
+		"                [ weight_src none|priority|mark|classid ]\n"
+		"                [ weights W0 W1 ... W15 ] [ gso_split BYTES ]\n"
+		"                [ sk_cache ENTRIES ]\n"
+		"                [ pacing|nopacing ] [ horizon TIME ]\n"
+		"                [ telemetry 1_IN_N ]\n"
+		"  scrr_pi2 only : [ target TIME ] [ tupdate TIME ]\n"
+		"                [ alpha ALPHA ] [ beta BETA ] [ coupling COUPLING ]\n"
+		"                [ ecn|noecn ] [ sce|nosce ] [ overload_ecn|nooverload_ecn ]\n"
+		"                [ random|norandom ] [ udp_taildrop|noudp_taildrop ]\n"
+		"                [ udp_limit PACKETS ]\n");
 }
 
 static unsigned int ilog2(unsigned int val)
@@ -73,6 +178,36 @@ static unsigned int ilog2(unsigned int val)
 	return res;
 }
 
+static int get_float(float *val, const char *arg, float min, float max)
+{
+	float res;
+	char *ptr;
+
+	if (!arg || !*arg)
+		return -1;
+	res = strtof(arg, &ptr);
+	if (!ptr || ptr == arg || *ptr)
+		return -1;
+	if (res < min || res > max)
+		return -1;
+	*val = res;
+	return 0;
+}
+
+static uint32_t parse_alpha_beta(const char *name, char *argv)
+{
+	float field_f;
+
+	if (get_float(&field_f, argv, 0.0, ALPHA_BETA_MAX)) {
+		fprintf(stderr, "Illegal \"%s\"\n", name);
+		return ALPHA_BETA_INVALID;
+	}
+	else if (field_f < 1.0f / ALPHA_BETA_SCALE)
+		fprintf(stderr, "Warning: \"%s\" is too small and will be "
+			"rounded to zero.\n", name);
+	return (uint32_t)(field_f * ALPHA_BETA_SCALE);
+}
+
 static int scrr_parse_opt(struct qdisc_util *qu,
 			  int argc,
 			  char **argv,
@@ -83,8 +218,26 @@ static int scrr_parse_opt(struct qdisc_util *qu,
 	unsigned int	buckets = 0;
 	uint32_t	hash_mask = 0x0;
 	uint32_t	flow_plimit = 0xFFFFFFFF;
+	unsigned int	flow_blimit = 0xFFFFFFFF;
 	uint32_t	flags = 0x0;
 	bool		flags_upd = false;
+	uint32_t	classifier = 0xFFFFFFFF;
+	uint32_t	hash_load = 0xFFFFFFFF;
+	unsigned int	gc_age = 0xFFFFFFFF;
+	unsigned int	horizon = 0xFFFFFFFF;
+	unsigned int	gso_split = 0xFFFFFFFF;
+	unsigned int	sk_cache = 0xFFFFFFFF;
+	unsigned int	telemetry = 0xFFFFFFFF;
+	unsigned int	target = 0xFFFFFFFF;
+	unsigned int	tupdate = 0xFFFFFFFF;
+	uint32_t	alpha = ALPHA_BETA_INVALID;
+	uint32_t	beta = ALPHA_BETA_INVALID;
+	uint32_t	coupling = ALPHA_BETA_INVALID;
+	uint32_t	udp_plimit = 0xFFFFFFFF;
+	uint32_t	max_flows = 0xFFFFFFFF;
+	uint32_t	weight_src = 0xFFFFFFFF;
+	__u8		weights[SCRR_WEIGHT_CLASSES];
+	int		weights_num = 0;
 	struct rtattr *tail;
 
 	while (argc > 0) {
@@ -112,6 +265,12 @@ static int scrr_parse_opt(struct qdisc_util *qu,
 				fprintf(stderr, "Illegal \"flow_limit\"\n");
 				return -1;
 			}
+		} else if (strcmp(*argv, "flow_blimit") == 0) {
+			NEXT_ARG();
+			if (get_size(&flow_blimit, *argv)) {
+				fprintf(stderr, "Illegal \"flow_blimit\"\n");
+				return -1;
+			}
 		} else if (strcasecmp(*argv, "flags") == 0) {
 			NEXT_ARG();
 			if (get_u32(&flags, *argv, 0)) {
@@ -119,6 +278,202 @@ static int scrr_parse_opt(struct qdisc_util *qu,
 				return -1;
 			}
 			flags_upd = true;
+		} else if (strcasecmp(*argv, "peak_noreset") == 0) {
+			flags |= SCF_PEAK_NORESET;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "nopeak_noreset") == 0) {
+			flags &= ~SCF_PEAK_NORESET;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "target") == 0) {
+			NEXT_ARG();
+			if (get_time(&target, *argv)) {
+				fprintf(stderr, "Illegal \"target\"\n");
+				return -1;
+			}
+		} else if (strcasecmp(*argv, "tupdate") == 0) {
+			NEXT_ARG();
+			if (get_time(&tupdate, *argv)) {
+				fprintf(stderr, "Illegal \"tupdate\"\n");
+				return -1;
+			}
+		} else if (strcasecmp(*argv, "alpha") == 0) {
+			NEXT_ARG();
+			alpha = parse_alpha_beta("alpha", *argv);
+			if (alpha == ALPHA_BETA_INVALID)
+				return -1;
+		} else if (strcasecmp(*argv, "beta") == 0) {
+			NEXT_ARG();
+			beta = parse_alpha_beta("beta", *argv);
+			if (beta == ALPHA_BETA_INVALID)
+				return -1;
+		} else if ( (strcasecmp(*argv, "coupling") == 0)
+			    || (strcasecmp(*argv, "coupling_factor") == 0) ) {
+			NEXT_ARG();
+			coupling = parse_alpha_beta("coupling", *argv);
+			if (coupling == ALPHA_BETA_INVALID)
+				return -1;
+		} else if (strcasecmp(*argv, "ecn") == 0) {
+			flags |= SCF_MARK_ECN;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "noecn") == 0) {
+			flags &= ~SCF_MARK_ECN;
+			flags_upd = true;
+		} else if ( (strcasecmp(*argv, "sce") == 0)
+			    || (strcasecmp(*argv, "scaecn") == 0)
+			    || (strcasecmp(*argv, "accecn") == 0) ) {
+			flags |= SCF_MARK_SCE;
+			flags_upd = true;
+		} else if ( (strcasecmp(*argv, "nosce") == 0)
+			    || (strcasecmp(*argv, "noscaecn") == 0)
+			    || (strcasecmp(*argv, "noaccecn") == 0) ) {
+			flags &= ~SCF_MARK_SCE;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "overload_ecn") == 0) {
+			flags |= SCF_OVERLOAD_ECN;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "nooverload_ecn") == 0) {
+			flags &= ~SCF_OVERLOAD_ECN;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "random") == 0) {
+			flags |= SCF_RANDOM_MARK;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "norandom") == 0) {
+			flags &= ~SCF_RANDOM_MARK;
+			flags_upd = true;
+		} else if ( (strcasecmp(*argv, "udp_taildrop") == 0)
+			    || (strcasecmp(*argv, "udp_nomark") == 0) ) {
+			flags |= SCF_UDP_TAILDROP;
+			flags_upd = true;
+		} else if ( (strcasecmp(*argv, "noudp_taildrop") == 0)
+			    || (strcasecmp(*argv, "noudp_nomark") == 0) ) {
+			flags &= ~SCF_UDP_TAILDROP;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "flow_share") == 0) {
+			flags |= SCF_FLOW_SHARE;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "noflow_share") == 0) {
+			flags &= ~SCF_FLOW_SHARE;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "sojourn_hist") == 0) {
+			flags |= SCF_SOJOURN_HIST;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "nosojourn_hist") == 0) {
+			flags &= ~SCF_SOJOURN_HIST;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "bypass") == 0) {
+			flags |= SCF_BYPASS;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "nobypass") == 0) {
+			flags &= ~SCF_BYPASS;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "exact_flow") == 0) {
+			flags |= SCF_EXACT_FLOW;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "noexact_flow") == 0) {
+			flags &= ~SCF_EXACT_FLOW;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "fat_drop") == 0) {
+			flags |= SCF_FAT_DROP;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "nofat_drop") == 0) {
+			flags &= ~SCF_FAT_DROP;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "pacing") == 0) {
+			flags |= SCF_PACING;
+			flags_upd = true;
+		} else if (strcasecmp(*argv, "nopacing") == 0) {
+			flags &= ~SCF_PACING;
+			flags_upd = true;
+		} else if (strcmp(*argv, "horizon") == 0) {
+			NEXT_ARG();
+			if (get_time(&horizon, *argv)) {
+				fprintf(stderr, "Illegal \"horizon\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "weight_src") == 0) {
+			NEXT_ARG();
+			for (weight_src = SCRR_WEIGHT_NONE;
+			     weight_src <= SCRR_WEIGHT_CLASSID; weight_src++)
+				if (strcmp(*argv,
+					   scrr_weight_src_names[weight_src]) == 0)
+					break;
+			if (weight_src > SCRR_WEIGHT_CLASSID) {
+				fprintf(stderr, "Illegal \"weight_src\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "weights") == 0) {
+			/* Like priomap of prio, a list of numbers */
+			weights_num = 0;
+			while (argc > 1 && weights_num < SCRR_WEIGHT_CLASSES) {
+				unsigned int weight;
+
+				if (get_unsigned(&weight, argv[1], 0))
+					break;
+				if (weight == 0 || weight > 255) {
+					fprintf(stderr, "Illegal \"weights\", must be 1 to 255\n");
+					return -1;
+				}
+				weights[weights_num++] = weight;
+				NEXT_ARG();
+			}
+			if (weights_num == 0) {
+				fprintf(stderr, "Illegal \"weights\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "gso_split") == 0) {
+			NEXT_ARG();
+			if (get_size(&gso_split, *argv)) {
+				fprintf(stderr, "Illegal \"gso_split\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "sk_cache") == 0) {
+			NEXT_ARG();
+			if (get_u32(&sk_cache, *argv, 0)) {
+				fprintf(stderr, "Illegal \"sk_cache\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "telemetry") == 0) {
+			NEXT_ARG();
+			if (get_u32(&telemetry, *argv, 0)
+			    || telemetry == 0xFFFFFFFF) {
+				fprintf(stderr, "Illegal \"telemetry\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "max_flows") == 0) {
+			NEXT_ARG();
+			if (get_u32(&max_flows, *argv, 0)) {
+				fprintf(stderr, "Illegal \"max_flows\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "udp_limit") == 0) {
+			NEXT_ARG();
+			if (get_u32(&udp_plimit, *argv, 0)) {
+				fprintf(stderr, "Illegal \"udp_limit\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "hash_load") == 0) {
+			NEXT_ARG();
+			if (get_u32(&hash_load, *argv, 0)) {
+				fprintf(stderr, "Illegal \"hash_load\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "gc_age") == 0) {
+			NEXT_ARG();
+			if (get_time(&gc_age, *argv)) {
+				fprintf(stderr, "Illegal \"gc_age\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "classifier") == 0) {
+			NEXT_ARG();
+			if (strcmp(*argv, "rbtree") == 0)
+				classifier = SCRR_CLASSIFIER_RBTREE;
+			else if ( (strcmp(*argv, "oa") == 0)
+				  || (strcmp(*argv, "open_addressing") == 0) )
+				classifier = SCRR_CLASSIFIER_OA;
+			else {
+				fprintf(stderr, "Illegal \"classifier\"\n");
+				return -1;
+			}
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -147,6 +502,41 @@ static int scrr_parse_opt(struct qdisc_util *qu,
 		addattr32(n, 1024, TCA_SCRR_FLOW_PLIMIT, flow_plimit);
 	if (flags_upd)
 		addattr32(n, 1024, TCA_SCRR_FLAGS, flags);
+	if (classifier != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_CLASSIFIER, classifier);
+	if (hash_load != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_HASH_LOAD, hash_load);
+	if (gc_age != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_GC_AGE, gc_age);
+	if (target != 0xFFFFFFFF)
+		/* Zero will return an error. */
+		addattr32(n, 1024, TCA_SCRR_TARGET, target);
+	if (tupdate != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_TUPDATE, tupdate);
+	if (alpha != ALPHA_BETA_INVALID)
+		addattr32(n, 1024, TCA_SCRR_ALPHA, alpha);
+	if (beta != ALPHA_BETA_INVALID)
+		addattr32(n, 1024, TCA_SCRR_BETA, beta);
+	if (coupling != ALPHA_BETA_INVALID)
+		addattr32(n, 1024, TCA_SCRR_COUPLING, coupling);
+	if (udp_plimit != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_UDP_PLIMIT, udp_plimit);
+	if (max_flows != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_MAX_FLOWS, max_flows);
+	if (weight_src != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_WEIGHT_SRC, weight_src);
+	if (weights_num != 0)
+		addattr_l(n, 1024, TCA_SCRR_WEIGHTS, weights, weights_num);
+	if (gso_split != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_GSO_SPLIT, gso_split);
+	if (sk_cache != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_SK_CACHE, sk_cache);
+	if (flow_blimit != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_FLOW_BLIMIT, flow_blimit);
+	if (horizon != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_HORIZON, horizon);
+	if (telemetry != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SCRR_TELEMETRY, telemetry);
 	
 	addattr_nest_end(n, tail);
 	// tail->rta_len = (void *)NLMSG_TAIL(n) - (void *)tail;
@@ -159,6 +549,7 @@ static int scrr_print_opt(struct qdisc_util *qu,
 			  struct rtattr *opt)
 {
 	struct rtattr *tb[TCA_SCRR_MAX + 1];
+	SPRINT_BUF(b1);
 
 	if (opt == NULL)
 		return 0;
@@ -196,12 +587,274 @@ static int scrr_print_opt(struct qdisc_util *qu,
 			   flow_plimit);
 	}
 
+	if (tb[TCA_SCRR_FLOW_BLIMIT] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_FLOW_BLIMIT]) >= sizeof(__u32)) {
+		unsigned int flow_blimit;
+		flow_blimit = rta_getattr_u32(tb[TCA_SCRR_FLOW_BLIMIT]);
+		if (flow_blimit != 0) {
+			print_uint(PRINT_JSON, "flow_blimit", NULL, flow_blimit);
+			print_string(PRINT_FP, NULL, "flow_blimit %s ",
+				     sprint_size(flow_blimit, b1));
+		}
+	}
+
 	if (tb[TCA_SCRR_FLAGS] &&
 	    RTA_PAYLOAD(tb[TCA_SCRR_FLAGS]) >= sizeof(__u32)) {
 		unsigned int flags;
 		flags = rta_getattr_u32(tb[TCA_SCRR_FLAGS]);
 		print_uint(PRINT_ANY, "flags", "flags 0x%X ", flags);
 	}
+
+	if (tb[TCA_SCRR_CLASSIFIER] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_CLASSIFIER]) >= sizeof(__u32)) {
+		unsigned int classifier;
+		classifier = rta_getattr_u32(tb[TCA_SCRR_CLASSIFIER]);
+		print_string(PRINT_ANY, "classifier", "classifier %s ",
+			     classifier == SCRR_CLASSIFIER_OA ? "oa" : "rbtree");
+	}
+
+	if (tb[TCA_SCRR_HASH_LOAD] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_HASH_LOAD]) >= sizeof(__u32)) {
+		unsigned int hash_load;
+		hash_load = rta_getattr_u32(tb[TCA_SCRR_HASH_LOAD]);
+		print_uint(PRINT_ANY, "hash_load", "hash_load %u ", hash_load);
+	}
+
+	if (tb[TCA_SCRR_GC_AGE] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_GC_AGE]) >= sizeof(__u32)) {
+		unsigned int gc_age;
+		gc_age = rta_getattr_u32(tb[TCA_SCRR_GC_AGE]);
+		print_uint(PRINT_JSON, "gc_age", NULL, gc_age);
+		print_string(PRINT_FP, NULL, "gc_age %s ",
+			     sprint_time(gc_age, b1));
+	}
+
+	if (tb[TCA_SCRR_GSO_SPLIT] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_GSO_SPLIT]) >= sizeof(__u32)) {
+		unsigned int gso_split;
+		gso_split = rta_getattr_u32(tb[TCA_SCRR_GSO_SPLIT]);
+		if (gso_split != 0) {
+			print_uint(PRINT_JSON, "gso_split", NULL, gso_split);
+			print_string(PRINT_FP, NULL, "gso_split %s ",
+				     sprint_size(gso_split, b1));
+		}
+	}
+
+	if (tb[TCA_SCRR_SK_CACHE] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_SK_CACHE]) >= sizeof(__u32)) {
+		unsigned int sk_cache;
+		sk_cache = rta_getattr_u32(tb[TCA_SCRR_SK_CACHE]);
+		if (sk_cache != 0)
+			print_uint(PRINT_ANY, "sk_cache", "sk_cache %u ",
+				   sk_cache);
+	}
+
+	if (tb[TCA_SCRR_MAX_FLOWS] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_MAX_FLOWS]) >= sizeof(__u32)) {
+		unsigned int max_flows;
+		max_flows = rta_getattr_u32(tb[TCA_SCRR_MAX_FLOWS]);
+		if (max_flows != 0)
+			print_uint(PRINT_ANY, "max_flows", "max_flows %u ",
+				   max_flows);
+	}
+
+	if (tb[TCA_SCRR_FLAGS] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_FLAGS]) >= sizeof(__u32)) {
+		unsigned int flags;
+		flags = rta_getattr_u32(tb[TCA_SCRR_FLAGS]);
+		if (flags & SCF_FLOW_SHARE)
+			print_bool(PRINT_ANY, "flow_share", "flow_share ", true);
+		if (flags & SCF_SOJOURN_HIST)
+			print_bool(PRINT_ANY, "sojourn_hist", "sojourn_hist ",
+				   true);
+		if (flags & SCF_BYPASS)
+			print_bool(PRINT_ANY, "bypass", "bypass ", true);
+		if (flags & SCF_EXACT_FLOW)
+			print_bool(PRINT_ANY, "exact_flow", "exact_flow ", true);
+		if (flags & SCF_FAT_DROP)
+			print_bool(PRINT_ANY, "fat_drop", "fat_drop ", true);
+		if (flags & SCF_PACING)
+			print_bool(PRINT_ANY, "pacing", "pacing ", true);
+	}
+
+	if (tb[TCA_SCRR_HORIZON] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_HORIZON]) >= sizeof(__u32)) {
+		unsigned int horizon;
+		horizon = rta_getattr_u32(tb[TCA_SCRR_HORIZON]);
+		print_uint(PRINT_JSON, "horizon", NULL, horizon);
+		print_string(PRINT_FP, NULL, "horizon %s ",
+			     sprint_time(horizon, b1));
+	}
+
+	if (tb[TCA_SCRR_TELEMETRY] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_TELEMETRY]) >= sizeof(__u32)) {
+		unsigned int telemetry;
+		telemetry = rta_getattr_u32(tb[TCA_SCRR_TELEMETRY]);
+		if (telemetry != 0)
+			print_uint(PRINT_ANY, "telemetry", "telemetry %u ",
+				   telemetry);
+	}
+
+	if (tb[TCA_SCRR_WEIGHT_SRC] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_WEIGHT_SRC]) >= sizeof(__u32)) {
+		unsigned int weight_src;
+		weight_src = rta_getattr_u32(tb[TCA_SCRR_WEIGHT_SRC]);
+		if (weight_src != SCRR_WEIGHT_NONE
+		    && weight_src <= SCRR_WEIGHT_CLASSID) {
+			print_string(PRINT_ANY, "weight_src", "weight_src %s ",
+				     scrr_weight_src_names[weight_src]);
+			if (tb[TCA_SCRR_WEIGHTS]) {
+				__u8 *weights = RTA_DATA(tb[TCA_SCRR_WEIGHTS]);
+				int len = RTA_PAYLOAD(tb[TCA_SCRR_WEIGHTS]);
+				int i;
+
+				open_json_array(PRINT_ANY, is_json_context() ?
+						"weights" : "weights ");
+				for (i = 0; i < len; i++)
+					print_uint(PRINT_ANY, NULL, "%u ",
+						   weights[i]);
+				close_json_array(PRINT_ANY, "");
+			}
+		}
+	}
+
+	/* Only scrr_pi2 reports a target */
+	if (tb[TCA_SCRR_TARGET] &&
+	    RTA_PAYLOAD(tb[TCA_SCRR_TARGET]) >= sizeof(__u32)) {
+		unsigned int target;
+		target = rta_getattr_u32(tb[TCA_SCRR_TARGET]);
+		print_uint(PRINT_JSON, "target", NULL, target);
+		print_string(PRINT_FP, NULL, "\n\ttarget %s ",
+			     sprint_time(target, b1));
+
+		if (tb[TCA_SCRR_FLAGS] &&
+		    RTA_PAYLOAD(tb[TCA_SCRR_FLAGS]) >= sizeof(__u32)) {
+			unsigned int flags;
+			flags = rta_getattr_u32(tb[TCA_SCRR_FLAGS]);
+			if (flags & SCF_MARK_ECN)
+				print_bool(PRINT_ANY, "ecn", "ecn ", true);
+			if (flags & SCF_MARK_SCE)
+				print_bool(PRINT_ANY, "sce", "sce ", true);
+			if (flags & SCF_OVERLOAD_ECN)
+				print_bool(PRINT_ANY, "overload_ecn",
+					   "overload_ecn ", true);
+			if (flags & SCF_RANDOM_MARK)
+				print_bool(PRINT_ANY, "random", "random ", true);
+			if (flags & SCF_UDP_TAILDROP)
+				print_bool(PRINT_ANY, "udp_taildrop",
+					   "udp_taildrop ", true);
+		}
+		if (tb[TCA_SCRR_TUPDATE] &&
+		    RTA_PAYLOAD(tb[TCA_SCRR_TUPDATE]) >= sizeof(__u32)) {
+			unsigned int tupdate;
+			tupdate = rta_getattr_u32(tb[TCA_SCRR_TUPDATE]);
+			print_uint(PRINT_JSON, "tupdate", NULL, tupdate);
+			print_string(PRINT_FP, NULL, "tupdate %s ",
+				     sprint_time(tupdate, b1));
+		}
+		if (tb[TCA_SCRR_ALPHA] &&
+		    RTA_PAYLOAD(tb[TCA_SCRR_ALPHA]) >= sizeof(__u32)) {
+			float alpha;
+			alpha = ( ((float) rta_getattr_u32(tb[TCA_SCRR_ALPHA]))
+				  / ALPHA_BETA_SCALE );
+			print_float(PRINT_ANY, "alpha", "alpha %.3f ", alpha);
+		}
+		if (tb[TCA_SCRR_BETA] &&
+		    RTA_PAYLOAD(tb[TCA_SCRR_BETA]) >= sizeof(__u32)) {
+			float beta;
+			beta = ( ((float) rta_getattr_u32(tb[TCA_SCRR_BETA]))
+				 / ALPHA_BETA_SCALE );
+			print_float(PRINT_ANY, "beta", "beta %.3f ", beta);
+		}
+		if (tb[TCA_SCRR_COUPLING] &&
+		    RTA_PAYLOAD(tb[TCA_SCRR_COUPLING]) >= sizeof(__u32)) {
+			float coupling;
+			coupling = ( ((float) rta_getattr_u32(tb[TCA_SCRR_COUPLING]))
+				     / ALPHA_BETA_SCALE );
+			print_float(PRINT_ANY, "coupling", "coupling %.1f ",
+				    coupling);
+		}
+		if (tb[TCA_SCRR_UDP_PLIMIT] &&
+		    RTA_PAYLOAD(tb[TCA_SCRR_UDP_PLIMIT]) >= sizeof(__u32)) {
+			unsigned int udp_plimit;
+			udp_plimit = rta_getattr_u32(tb[TCA_SCRR_UDP_PLIMIT]);
+			print_uint(PRINT_ANY, "udp_limit", "udp_limit %up ",
+				   udp_plimit);
+		}
+	}
+	return 0;
+}
+
+/* Percentile of a sojourn histogram, in us. Within a bucket, assume
+ * packets are spread evenly. The last bucket has no upper bound,
+ * return its lower bound. */
+static unsigned int scrr_sojourn_pct(const __u32 *hist, __u64 total,
+				     double pct)
+{
+	double rank = pct * total;
+	double low;
+	double high;
+	__u64 cumul = 0;
+	int i;
+
+	for (i = 0; i < SCRR_SOJOURN_BUCKETS; i++) {
+		if (hist[i] == 0 || cumul + hist[i] < rank) {
+			cumul += hist[i];
+			continue;
+		}
+		low = i ? 1024.0 * (1U << (i - 1)) : 0.0;
+		high = 1024.0 * (1U << i);
+		if (i == SCRR_SOJOURN_BUCKETS - 1)
+			return (unsigned int) (low / 1000.0);
+		return (unsigned int) ( (low + (high - low) * (rank - cumul)
+					 / hist[i]) / 1000.0 );
+	}
+	return 0;
+}
+
+static void scrr_print_sojourn(const char *name, const __u32 *hist)
+{
+	__u64 total = 0;
+	unsigned int p50, p99, p999;
+	SPRINT_BUF(b1);
+	int i;
+
+	for (i = 0; i < SCRR_SOJOURN_BUCKETS; i++)
+		total += hist[i];
+	if (total == 0)
+		return;
+
+	p50 = scrr_sojourn_pct(hist, total, 0.5);
+	p99 = scrr_sojourn_pct(hist, total, 0.99);
+	p999 = scrr_sojourn_pct(hist, total, 0.999);
+
+	open_json_object(name);
+	print_string(PRINT_FP, NULL, "\n  %s", name);
+	print_u64(PRINT_ANY, "packets", " packets %llu", total);
+	print_uint(PRINT_JSON, "p50", NULL, p50);
+	print_string(PRINT_FP, NULL, " p50 %s", sprint_time(p50, b1));
+	print_uint(PRINT_JSON, "p99", NULL, p99);
+	print_string(PRINT_FP, NULL, " p99 %s", sprint_time(p99, b1));
+	print_uint(PRINT_JSON, "p999", NULL, p999);
+	print_string(PRINT_FP, NULL, " p999 %s", sprint_time(p999, b1));
+	close_json_object();
+}
+
+/* Each flow is a class, see 'tc -s class show' */
+static int scrr_print_flow_xstats(struct tc_scrr_flow_xstats *st)
+{
+	print_0xhex(PRINT_ANY, "flow_idx", "  flow 0x%08llx", st->flow_idx);
+	if (st->flow_key != 0)
+		print_0xhex(PRINT_ANY, "flow_key", " key 0x%08llx",
+			    st->flow_key);
+	print_uint(PRINT_ANY, "qlen", " qlen %u", st->qlen);
+	print_uint(PRINT_ANY, "backlog", " backlog %ub", st->backlog);
+	print_uint(PRINT_ANY, "drops", " drops %u", st->drops);
+	print_lluint(PRINT_ANY, "virtual_finish", " vfinish %llu",
+		     st->virtual_finish);
+	if (st->sojourn_us != 0)
+		print_uint(PRINT_ANY, "sojourn_us", " sojourn %uus",
+			   st->sojourn_us);
 	return 0;
 }
 
@@ -213,6 +866,9 @@ static int scrr_print_xstats(struct qdisc_util *qu, FILE *f,
 	if (xstats == NULL)
 		return 0;
 	
+	if (RTA_PAYLOAD(xstats) == sizeof(struct tc_scrr_flow_xstats))
+		return scrr_print_flow_xstats(RTA_DATA(xstats));
+
 	if (RTA_PAYLOAD(xstats) < sizeof(*st))
 		return -1;
 
@@ -225,6 +881,10 @@ static int scrr_print_xstats(struct qdisc_util *qu, FILE *f,
 		   st->alloc_errors);
 	print_uint(PRINT_ANY, "no_mark", " \n  no_mark %u", st->no_mark);
 	print_uint(PRINT_ANY, "drop_mark", " drop_mark %u", st->drop_mark);
+	if (st->ecn_mark != 0 || st->sce_mark != 0) {
+		print_uint(PRINT_ANY, "ecn_mark", " ecn_mark %u", st->ecn_mark);
+		print_uint(PRINT_ANY, "sce_mark", " sce_mark %u", st->sce_mark);
+	}
 	if (st->burst_peak != 0) {
 		print_uint(PRINT_ANY, "burst_peak", " burst_peak %u", st->burst_peak);
 	}
@@ -237,6 +897,60 @@ static int scrr_print_xstats(struct qdisc_util *qu, FILE *f,
 			   st->backlog_peak);
 		print_uint(PRINT_ANY, "qlen_peak", " %up", st->qlen_peak);
 	}
+	if (st->probe_avg_1k != 0 || st->table_full != 0) {
+		print_float(PRINT_ANY, "probe_avg", "\n  probe_avg %.3f",
+			    (float) st->probe_avg_1k / 1000.0);
+		print_uint(PRINT_ANY, "probe_peak", " probe_peak %u",
+			   st->probe_peak);
+		print_uint(PRINT_ANY, "table_full", " table_full %u",
+			   st->table_full);
+	}
+	if (st->gc_lat_peak_ms != 0 || st->gc_deferred != 0) {
+		print_uint(PRINT_ANY, "gc_lat_peak", "\n  gc_lat_peak %ums",
+			   st->gc_lat_peak_ms);
+		print_uint(PRINT_ANY, "gc_lat_avg", " gc_lat_avg %ums",
+			   st->gc_lat_avg_ms);
+		print_uint(PRINT_ANY, "gc_deferred", " gc_deferred %u",
+			   st->gc_deferred);
+	}
+	print_u64(PRINT_ANY, "mem_used", "\n  mem_used %llu", st->mem_used);
+	if (st->pool_free != 0 || st->flow_shared != 0) {
+		print_uint(PRINT_ANY, "pool_free", " pool_free %u",
+			   st->pool_free);
+		print_uint(PRINT_ANY, "flow_shared", " flow_shared %u",
+			   st->flow_shared);
+	}
+	if (st->gso_split != 0)
+		print_uint(PRINT_ANY, "gso_split", " gso_split %u",
+			   st->gso_split);
+	if (st->bypass != 0)
+		print_uint(PRINT_ANY, "bypass", " bypass %u", st->bypass);
+	if (st->sk_cache_hit != 0 || st->sk_cache_miss != 0) {
+		print_uint(PRINT_ANY, "sk_cache_hit", " sk_cache_hit %u",
+			   st->sk_cache_hit);
+		print_uint(PRINT_ANY, "sk_cache_miss", " sk_cache_miss %u",
+			   st->sk_cache_miss);
+	}
+	if (st->hash_collisions != 0)
+		print_uint(PRINT_ANY, "hash_collisions", " hash_collisions %u",
+			   st->hash_collisions);
+	if (st->fat_drop != 0)
+		print_uint(PRINT_ANY, "fat_drop", " fat_drop %u", st->fat_drop);
+	if (st->throttled != 0 || st->horizon_drops != 0) {
+		print_uint(PRINT_ANY, "flows_throttled", "\n  throttled %u",
+			   st->flows_throttled);
+		print_uint(PRINT_ANY, "throttled", " (total %u)", st->throttled);
+		print_uint(PRINT_ANY, "horizon_drops", " horizon_drops %u",
+			   st->horizon_drops);
+	}
+	if (st->telem_records != 0) {
+		print_uint(PRINT_ANY, "telem_records", "\n  telemetry %u",
+			   st->telem_records);
+		print_uint(PRINT_ANY, "telem_lost", " (lost %u)",
+			   st->telem_lost);
+	}
+	scrr_print_sojourn("sojourn_light", st->sojourn_light);
+	scrr_print_sojourn("sojourn_heavy", st->sojourn_heavy);
 
 	return 0;
 }
@@ -282,3 +996,158 @@ struct qdisc_util scrr_basic_qdisc_util = {
 	.print_qopt = scrr_print_opt,
 	.print_xstats = scrr_print_xstats,
 };
+
+struct qdisc_util scrr_pi2_qdisc_util = {
+	.id = "scrr_pi2",
+	.parse_qopt = scrr_parse_opt,
+	.print_qopt = scrr_print_opt,
+	.print_xstats = scrr_print_xstats,
+};
+
+struct qdisc_util scrr_mq_qdisc_util = {
+	.id = "scrr_mq",
+	.parse_qopt = scrr_parse_opt,
+	.print_qopt = scrr_print_opt,
+	.print_xstats = scrr_print_xstats,
+};
+
+/* ----------------------- HSCRR ----------------------- */
+
+enum {
+	TCA_HSCRR_UNSPEC,
+	TCA_HSCRR_WEIGHT,	/* class weight, 1 to 255 */
+	TCA_HSCRR_DEFAULT,	/* minor of default class, 0 is none */
+	__TCA_HSCRR_MAX
+};
+#define TCA_HSCRR_MAX	(__TCA_HSCRR_MAX - 1)
+
+#define HSCRR_WEIGHT_MAX	255
+
+static void hscrr_explain(void)
+{
+	fprintf(stderr,
+		"Usage: ... hscrr [ default MINOR ]\n"
+		"       ... class add ... hscrr [ weight WEIGHT ]\n"
+		"Classes use a scrr qdisc, graft another one to change it.\n");
+}
+
+static int hscrr_parse_opt(struct qdisc_util *qu,
+			   int argc,
+			   char **argv,
+			   struct nlmsghdr *n,
+			   const char *dev)
+{
+	uint32_t	defcls = 0xFFFFFFFF;
+	struct rtattr *tail;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "default") == 0) {
+			NEXT_ARG();
+			if (get_u32(&defcls, *argv, 16)
+			    || defcls > 0xFFFF) {
+				fprintf(stderr, "Illegal \"default\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "help") == 0) {
+			hscrr_explain();
+			return -1;
+		} else {
+			fprintf(stderr, "What is \"%s\"?\n", *argv);
+			hscrr_explain();
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	tail = addattr_nest(n, 1024, TCA_OPTIONS);
+	if (defcls != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_HSCRR_DEFAULT, defcls);
+	addattr_nest_end(n, tail);
+
+	return 0;
+}
+
+static int hscrr_print_opt(struct qdisc_util *qu,
+			   FILE *f,
+			   struct rtattr *opt)
+{
+	struct rtattr *tb[TCA_HSCRR_MAX + 1];
+
+	if (opt == NULL)
+		return 0;
+
+	parse_rtattr_nested(tb, TCA_HSCRR_MAX, opt);
+
+	if (tb[TCA_HSCRR_DEFAULT] &&
+	    RTA_PAYLOAD(tb[TCA_HSCRR_DEFAULT]) >= sizeof(__u32)) {
+		unsigned int defcls;
+		defcls = rta_getattr_u32(tb[TCA_HSCRR_DEFAULT]);
+		print_0xhex(PRINT_ANY, "default", "default %#llx ", defcls);
+	}
+	return 0;
+}
+
+static int hscrr_parse_class_opt(struct qdisc_util *qu,
+				 int argc,
+				 char **argv,
+				 struct nlmsghdr *n,
+				 const char *dev)
+{
+	uint32_t	weight = 0xFFFFFFFF;
+	struct rtattr *tail;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "weight") == 0) {
+			NEXT_ARG();
+			if (get_u32(&weight, *argv, 0)
+			    || weight == 0 || weight > HSCRR_WEIGHT_MAX) {
+				fprintf(stderr, "Illegal \"weight\", must be between 1 and %d\n",
+					HSCRR_WEIGHT_MAX);
+				return -1;
+			}
+		} else if (strcmp(*argv, "help") == 0) {
+			hscrr_explain();
+			return -1;
+		} else {
+			fprintf(stderr, "What is \"%s\"?\n", *argv);
+			hscrr_explain();
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	tail = addattr_nest(n, 1024, TCA_OPTIONS);
+	if (weight != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_HSCRR_WEIGHT, weight);
+	addattr_nest_end(n, tail);
+
+	return 0;
+}
+
+static int hscrr_print_class_opt(struct qdisc_util *qu,
+				 FILE *f,
+				 struct rtattr *opt)
+{
+	struct rtattr *tb[TCA_HSCRR_MAX + 1];
+
+	if (opt == NULL)
+		return 0;
+
+	parse_rtattr_nested(tb, TCA_HSCRR_MAX, opt);
+
+	if (tb[TCA_HSCRR_WEIGHT] &&
+	    RTA_PAYLOAD(tb[TCA_HSCRR_WEIGHT]) >= sizeof(__u32)) {
+		unsigned int weight;
+		weight = rta_getattr_u32(tb[TCA_HSCRR_WEIGHT]);
+		print_uint(PRINT_ANY, "weight", "weight %u ", weight);
+	}
+	return 0;
+}
+
+struct qdisc_util hscrr_qdisc_util = {
+	.id = "hscrr",
+	.parse_qopt = hscrr_parse_opt,
+	.print_qopt = hscrr_print_opt,
+	.parse_copt = hscrr_parse_class_opt,
+	.print_copt = hscrr_print_class_opt,
+};
@@ -32,13 +32,15 @@ enum {
 	TCA_SPPIFO_HASH_MASK,	/* mask applied to skb hashes */
 	TCA_SPPIFO_BAND_PLIMIT,	/* limit of packets per flow */
 	TCA_SPPIFO_FLAGS,		/* Options */
+	TCA_SPPIFO_BANDS,	/* Number of bands */
 	__TCA_SPPIFO_MAX
 };
 #define TCA_SPPIFO_MAX	(__TCA_SPPIFO_MAX - 1)
 
 /* TCA_SPPIFO_FLAGS */
 #define SCF_PEAK_NORESET	0x0020	/* Don't reset peak statistics */
-#define SPPIFO_BANDS_XSTATS	8		/* Number of bands we report statistics for in the tc stats */
+#define SCF_EXACT_FLOW		0x0400	/* Full hash and key, no collisions */
+#define SPPIFO_BANDS_XSTATS	32		/* Number of bands we report statistics for in the tc stats */
 
 /* statistics exported to userspace */
 struct tc_sppifo_xstats {
@@ -55,6 +57,8 @@ struct tc_sppifo_xstats {
 	__u32	num_reordering;	/* Number of reordering (dequeue) */
 	__u32	band_tx[SPPIFO_BANDS_XSTATS];	/* Number of SKBs sent from each band */
 	__u32	band_qlen[SPPIFO_BANDS_XSTATS];	/* Number of SKBs queued in each band */
+	__u32	bands;		/* Number of bands */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
 };
 
 
@@ -62,7 +66,8 @@ static void explain(void)
 {
 	fprintf(stderr,
 		"Usage: ... sppifo_stfq [ limit PACKETS ] [ buckets NUMBER ] [ hash_mask MASK ]\n"
-		"                [ band_limit PACKETS ]\n");
+		"                [ band_limit PACKETS ] [ bands NUMBER ]\n"
+		"                [ exact_flow | noexact_flow ]\n");
 }
 
 static unsigned int ilog2(unsigned int val)
@@ -87,6 +92,7 @@ static int sppifo_parse_opt(struct qdisc_util *qu,
 	unsigned int	buckets = 0;
 	uint32_t	hash_mask = 0x0;
 	uint32_t	band_plimit = 0xFFFFFFFF;
+	uint32_t	bands = 0xFFFFFFFF;
 	uint32_t	flags = 0x0;
 	bool		flags_upd = false;
 	struct rtattr *tail;
@@ -116,6 +122,13 @@ static int sppifo_parse_opt(struct qdisc_util *qu,
 				fprintf(stderr, "Illegal \"band_limit\"\n");
 				return -1;
 			}
+		} else if (strcmp(*argv, "bands") == 0) {
+			NEXT_ARG();
+			if (get_u32(&bands, *argv, 0) ||
+			    bands == 0 || bands > SPPIFO_BANDS_XSTATS) {
+				fprintf(stderr, "Illegal \"bands\"\n");
+				return -1;
+			}
 		} else if (strcasecmp(*argv, "flags") == 0) {
 			NEXT_ARG();
 			if (get_u32(&flags, *argv, 0)) {
@@ -123,6 +136,12 @@ static int sppifo_parse_opt(struct qdisc_util *qu,
 				return -1;
 			}
 			flags_upd = true;
+		} else if (strcmp(*argv, "exact_flow") == 0) {
+			flags |= SCF_EXACT_FLOW;
+			flags_upd = true;
+		} else if (strcmp(*argv, "noexact_flow") == 0) {
+			flags &= ~SCF_EXACT_FLOW;
+			flags_upd = true;
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -151,6 +170,8 @@ static int sppifo_parse_opt(struct qdisc_util *qu,
 		addattr32(n, 1024, TCA_SPPIFO_BAND_PLIMIT, band_plimit);
 	if (flags_upd)
 		addattr32(n, 1024, TCA_SPPIFO_FLAGS, flags);
+	if (bands != 0xFFFFFFFF)
+		addattr32(n, 1024, TCA_SPPIFO_BANDS, bands);
 	
 	addattr_nest_end(n, tail);
 	// tail->rta_len = (void *)NLMSG_TAIL(n) - (void *)tail;
@@ -205,6 +226,15 @@ static int sppifo_print_opt(struct qdisc_util *qu,
 		unsigned int flags;
 		flags = rta_getattr_u32(tb[TCA_SPPIFO_FLAGS]);
 		print_uint(PRINT_ANY, "flags", "flags 0x%X ", flags);
+		if (flags & SCF_EXACT_FLOW)
+			print_bool(PRINT_ANY, "exact_flow", "exact_flow ", true);
+	}
+
+	if (tb[TCA_SPPIFO_BANDS] &&
+	    RTA_PAYLOAD(tb[TCA_SPPIFO_BANDS]) >= sizeof(__u32)) {
+		unsigned int bands;
+		bands = rta_getattr_u32(tb[TCA_SPPIFO_BANDS]);
+		print_uint(PRINT_ANY, "bands", "bands %u ", bands);
 	}
 	return 0;
 }
@@ -213,6 +243,7 @@ static int sppifo_print_xstats(struct qdisc_util *qu, FILE *f,
 			     struct rtattr *xstats)
 {
 	struct tc_sppifo_xstats *st;
+	unsigned int bands;
 	int i;
 
 	if (xstats == NULL)
@@ -234,6 +265,10 @@ static int sppifo_print_xstats(struct qdisc_util *qu, FILE *f,
 	if (st->burst_avg != 0) {
 		print_uint(PRINT_ANY, "burst_avg", " burst_avg %u", st->burst_avg);
 	}
+	if (st->hash_collisions != 0) {
+		print_uint(PRINT_ANY, "hash_collisions", " hash_collisions %u",
+			   st->hash_collisions);
+	}
 	if (st->backlog_peak != 0 || st->qlen_peak != 0) {
 		print_uint(PRINT_ANY, "backlog_peak", "  backlog_peak %ub",
 			   st->backlog_peak);
@@ -241,13 +276,16 @@ static int sppifo_print_xstats(struct qdisc_util *qu, FILE *f,
 	}
 	print_uint(PRINT_ANY, "num_inversions", "\n  num_inversions %u", st->num_inversions);
 	print_uint(PRINT_ANY, "num_reordering", " num_reordering %u\n  band_qlen", st->num_reordering);
-	for(i = 0; i < SPPIFO_BANDS_XSTATS - 1 ; i++)
+	bands = st->bands;
+	if (bands == 0 || bands > SPPIFO_BANDS_XSTATS)
+		bands = SPPIFO_BANDS_XSTATS;
+	for(i = 0; i < bands - 1 ; i++)
 	{
 		print_uint(PRINT_ANY, "band_qlen", " %u", st->band_qlen[i]);
 	}
 	print_uint(PRINT_ANY, "band_qlen", " %u \n  band_tx", st->band_qlen[i]);
 
-	for(i = 0; i < SPPIFO_BANDS_XSTATS; i++)
+	for(i = 0; i < bands; i++)
 	{
 		print_uint(PRINT_ANY, "band_tx", " %u", st->band_tx[i]);
 	}
@@ -32,12 +32,16 @@ enum {
 	TCA_STFQ_HASH_MASK,	/* mask applied to skb hashes */
 	TCA_STFQ_FLOW_PLIMIT,	/* limit of packets per flow */
 	TCA_STFQ_FLAGS,		/* Options */
+	TCA_STFQ_CAL_GRAN_LOG,	/* log2(calendar bucket granularity) */
 	__TCA_STFQ_MAX
 };
 #define TCA_STFQ_MAX	(__TCA_STFQ_MAX - 1)
 
 /* TCA_STFQ_FLAGS */
 #define SCF_PEAK_NORESET	0x0020	/* Don't reset peak statistics */
+#define SCF_CALENDAR		0x0040	/* Schedule with calendar queue */
+#define SCF_BYPASS		0x0200	/* Stack may skip us when empty */
+#define SCF_EXACT_FLOW		0x0400	/* Full hash and key, no collisions */
 
 /* statistics exported to userspace */
 struct tc_stfq_xstats {
@@ -52,6 +56,18 @@ struct tc_stfq_xstats {
 	__u32	burst_peak;	/* Maximum burst size */
 	__u32	burst_avg;	/* Average burst size */
 	__u32	sched_empty;	/* Schedule with no packet */
+	__u32	cal_clamp;	/* Flows beyond the calendar window */
+	__u32	bypass;		/* Packets sent by the stack, skipping us */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
+};
+
+/* Statistics of one flow, as a class */
+struct tc_stfq_flow_xstats {
+	__u64	virtual_tail;	/* Virtual of next incoming packet */
+	__u32	flow_idx;	/* Hash value for this flow */
+	__u32	qlen;		/* Packets queued */
+	__u32	backlog;	/* Bytes queued */
+	__u32	drops;		/* Packets dropped from this flow */
 };
 
 
@@ -59,7 +75,9 @@ static void explain(void)
 {
 	fprintf(stderr,
 		"Usage: ... stfq [ limit PACKETS ] [ buckets NUMBER ] [ hash_mask MASK ]\n"
-		"                [ flow_limit PACKETS ]\n");
+		"                [ flow_limit PACKETS ] [ calendar | rbtree ]\n"
+		"                [ calendar_gran BYTES ] [ bypass | nobypass ]\n"
+		"                [ exact_flow | noexact_flow ]\n");
 }
 
 static unsigned int ilog2(unsigned int val)
@@ -84,6 +102,7 @@ static int stfq_parse_opt(struct qdisc_util *qu,
 	unsigned int	buckets = 0;
 	uint32_t	hash_mask = 0x0;
 	uint32_t	flow_plimit = 0xFFFFFFFF;
+	unsigned int	cal_gran = 0;
 	uint32_t	flags = 0x0;
 	bool		flags_upd = false;
 	struct rtattr *tail;
@@ -120,6 +139,30 @@ static int stfq_parse_opt(struct qdisc_util *qu,
 				return -1;
 			}
 			flags_upd = true;
+		} else if (strcmp(*argv, "calendar") == 0) {
+			flags |= SCF_CALENDAR;
+			flags_upd = true;
+		} else if (strcmp(*argv, "rbtree") == 0) {
+			flags &= ~SCF_CALENDAR;
+			flags_upd = true;
+		} else if (strcmp(*argv, "bypass") == 0) {
+			flags |= SCF_BYPASS;
+			flags_upd = true;
+		} else if (strcmp(*argv, "nobypass") == 0) {
+			flags &= ~SCF_BYPASS;
+			flags_upd = true;
+		} else if (strcmp(*argv, "calendar_gran") == 0) {
+			NEXT_ARG();
+			if (get_unsigned(&cal_gran, *argv, 0) || cal_gran == 0) {
+				fprintf(stderr, "Illegal \"calendar_gran\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "exact_flow") == 0) {
+			flags |= SCF_EXACT_FLOW;
+			flags_upd = true;
+		} else if (strcmp(*argv, "noexact_flow") == 0) {
+			flags &= ~SCF_EXACT_FLOW;
+			flags_upd = true;
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -148,6 +191,10 @@ static int stfq_parse_opt(struct qdisc_util *qu,
 		addattr32(n, 1024, TCA_STFQ_FLOW_PLIMIT, flow_plimit);
 	if (flags_upd)
 		addattr32(n, 1024, TCA_STFQ_FLAGS, flags);
+	if (cal_gran != 0) {
+		unsigned int cal_gran_log = ilog2(cal_gran);
+		addattr32(n, 1024, TCA_STFQ_CAL_GRAN_LOG, cal_gran_log);
+	}
 	
 	addattr_nest_end(n, tail);
 	// tail->rta_len = (void *)NLMSG_TAIL(n) - (void *)tail;
@@ -202,10 +249,36 @@ static int stfq_print_opt(struct qdisc_util *qu,
 		unsigned int flags;
 		flags = rta_getattr_u32(tb[TCA_STFQ_FLAGS]);
 		print_uint(PRINT_ANY, "flags", "flags 0x%X ", flags);
+		if (flags & SCF_EXACT_FLOW)
+			print_bool(PRINT_ANY, "exact_flow", "exact_flow ", true);
+		if (flags & SCF_CALENDAR)
+			print_string(PRINT_ANY, "scheduler", "%s ", "calendar");
+		if (flags & SCF_BYPASS)
+			print_bool(PRINT_ANY, "bypass", "bypass ", true);
+	}
+
+	if (tb[TCA_STFQ_CAL_GRAN_LOG] &&
+	    RTA_PAYLOAD(tb[TCA_STFQ_CAL_GRAN_LOG]) >= sizeof(__u32)) {
+		unsigned int cal_gran_log;
+		cal_gran_log = rta_getattr_u32(tb[TCA_STFQ_CAL_GRAN_LOG]);
+		print_uint(PRINT_ANY, "calendar_gran", "calendar_gran %ub ",
+			   1U << cal_gran_log);
 	}
 	return 0;
 }
 
+/* Each flow is a class, see 'tc -s class show' */
+static int stfq_print_flow_xstats(struct tc_stfq_flow_xstats *st)
+{
+	print_0xhex(PRINT_ANY, "flow_idx", "  flow 0x%08llx", st->flow_idx);
+	print_uint(PRINT_ANY, "qlen", " qlen %u", st->qlen);
+	print_uint(PRINT_ANY, "backlog", " backlog %ub", st->backlog);
+	print_uint(PRINT_ANY, "drops", " drops %u", st->drops);
+	print_lluint(PRINT_ANY, "virtual_tail", " vtail %llu",
+		     st->virtual_tail);
+	return 0;
+}
+
 static int stfq_print_xstats(struct qdisc_util *qu, FILE *f,
 			     struct rtattr *xstats)
 {
@@ -214,6 +287,9 @@ static int stfq_print_xstats(struct qdisc_util *qu, FILE *f,
 	if (xstats == NULL)
 		return 0;
 	
+	if (RTA_PAYLOAD(xstats) == sizeof(struct tc_stfq_flow_xstats))
+		return stfq_print_flow_xstats(RTA_DATA(xstats));
+
 	if (RTA_PAYLOAD(xstats) < sizeof(*st))
 		return -1;
 
@@ -233,6 +309,16 @@ static int stfq_print_xstats(struct qdisc_util *qu, FILE *f,
 		print_uint(PRINT_ANY, "burst_avg", " burst_avg %u", st->burst_avg);
 		print_uint(PRINT_ANY, "sched_empty", " sched_empty %u", st->sched_empty);
 	}
+	if (st->cal_clamp != 0) {
+		print_uint(PRINT_ANY, "cal_clamp", " cal_clamp %u", st->cal_clamp);
+	}
+	if (st->bypass != 0) {
+		print_uint(PRINT_ANY, "bypass", " bypass %u", st->bypass);
+	}
+	if (st->hash_collisions != 0) {
+		print_uint(PRINT_ANY, "hash_collisions", " hash_collisions %u",
+			   st->hash_collisions);
+	}
 	if (st->backlog_peak != 0 || st->qlen_peak != 0) {
 		print_uint(PRINT_ANY, "backlog_peak", "  backlog_peak %ub",
 			   st->backlog_peak);
@@ -36,8 +36,11 @@
 #include <linux/slab.h>
 #include <linux/rbtree.h>
 #include <linux/hash.h>
+#include <linux/siphash.h>
+#include <linux/random.h>
 #include <linux/prefetch.h>
 #include <linux/vmalloc.h>
+#include <linux/timex.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 #include <net/sock.h>
@@ -50,6 +53,7 @@
 //#define AIFO_DEBUG_QUANTILE
 //#define AIFO_DEBUG_STFQ_DEQUEUE
 #define AIFO_DEBUG_QUANT_AVG
+#define AIFO_DEBUG_ADMIT_CYCLES
 #define AIFO_DEBUG_STATS_PEAK
 
 #define AIFO_PLIMIT_DEFLT		(10000)		/* packets */
@@ -79,6 +83,7 @@ enum {
 #define AIFF_QUANT_FIXED	0x0000	/* Quantile: fixed computations */
 #define AIFF_QUANT_ADD1		0x0100	/* Quantile: add current packet */
 #define AIFF_QUANT_ORIG		0x0200	/* Quantile: original computations */
+#define AIFF_EXACT_FLOW		0x1000	/* Full hash and key, no collisions */
 
 #define AIFF_MASK_QUANT		(0x0F00)	/* Quantile mode */
 
@@ -92,6 +97,8 @@ struct tc_aifo_xstats {
 	__u32	qlen_peak;	/* Maximum queue length */
 	__u32	backlog_peak;	/* Maximum backlog */
 	__u32	quant_avg_1k;	/* Average quantile * 1024 */
+	__u32	admit_cycles;	/* Average cycles per admit decision */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
 };
 
 /*
@@ -102,6 +109,7 @@ struct aifo_flow {
 	struct rb_node	hash_node;	/* anchor in hash_root[] trees */
 	u64		virtual_finish;	/* Virtual of next incoming packet */
 	u32		flow_idx;	/* Hash value for this flow */
+	u32		flow_key;	/* Second hash, with AIFF_EXACT_FLOW */
 } ____cacheline_aligned_in_smp;
 
 static struct kmem_cache *aifo_flow_cachep __read_mostly;
@@ -118,6 +126,7 @@ struct aifo_sched_data {
 	u16		sample_size;
 	u16		sample_period;
 	u32		flags;		/* Bitmask of AIFF_XXX flags */
+	siphash_key_t	flow_key_seed;	/* For flow_key of AIFF_EXACT_FLOW */
 
 	/* Parameters */
 	struct rb_root	*hash_root;		/* Hash of tree roots */
@@ -143,8 +152,24 @@ static inline struct aifo_skb_cb *aifo_skb_cb(struct sk_buff *skb)
 	return (struct aifo_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+/* Identity of a flow in the classifier, flow_idx then flow_key.
+ * Without AIFF_EXACT_FLOW, flow_key is always 0. */
+static inline bool aifo_flow_id_eq(const struct aifo_flow *f,
+				   u32 flow_idx, u32 flow_key)
+{
+	return f->flow_idx == flow_idx && f->flow_key == flow_key;
+}
+
+static inline bool aifo_flow_id_gt(const struct aifo_flow *f,
+				   u32 flow_idx, u32 flow_key)
+{
+	return ( f->flow_idx > flow_idx
+		 || (f->flow_idx == flow_idx && f->flow_key > flow_key) );
+}
+
 static inline struct aifo_flow *aifo_create_flow(struct aifo_sched_data *q,
-						 uint32_t flow_idx)
+						 uint32_t flow_idx,
+						 uint32_t flow_key)
 {
 	struct aifo_flow *flow_new;
 
@@ -155,6 +180,7 @@ static inline struct aifo_flow *aifo_create_flow(struct aifo_sched_data *q,
 	}
 
 	flow_new->flow_idx = flow_idx;
+	flow_new->flow_key = flow_key;
 
 	/* Initialise virtual time of the flow. */
 	flow_new->virtual_finish = q->virtual_dequeue;
@@ -175,7 +201,8 @@ static bool inline aifo_gc_candidate(const struct aifo_flow *f)
 
 static void aifo_gc(struct aifo_sched_data *q,
 		    struct rb_root *	root,
-		    uint32_t		flow_idx)
+		    uint32_t		flow_idx,
+		    uint32_t		flow_key)
 {
 	struct rb_node **p, *parent;
 	void *tofree[AIFO_GC_MAX];
@@ -188,7 +215,7 @@ static void aifo_gc(struct aifo_sched_data *q,
 		parent = *p;
 
 		f = rb_entry(parent, struct aifo_flow, hash_node);
-		if (f->flow_idx == flow_idx)
+		if (aifo_flow_id_eq(f, flow_idx, flow_key))
 			break;
 
 		if (aifo_gc_candidate(f)) {
@@ -197,7 +224,7 @@ static void aifo_gc(struct aifo_sched_data *q,
 				break;
 		}
 
-		if (f->flow_idx > flow_idx)
+		if (aifo_flow_id_gt(f, flow_idx, flow_key))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
@@ -224,11 +251,18 @@ static struct aifo_flow *aifo_classify(struct sk_buff *skb,
 	struct rb_node **	p;
 	struct rb_node *	parent;
 	uint32_t		flow_idx;
+	uint32_t		flow_key = 0;
 	struct rb_root *	root;
 	struct aifo_flow *	flow_cur;
 
-	/* Get hash value for the packet */
-	flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
+	/* Get hash value for the packet. With AIFF_EXACT_FLOW, the full
+	 * hash, and a second hash of the headers to tell apart the flows
+	 * which still collide. */
+	if (unlikely(q->flags & AIFF_EXACT_FLOW)) {
+		flow_idx = skb_get_hash(skb);
+		flow_key = skb_get_hash_perturb(skb, &q->flow_key_seed);
+	} else
+		flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
 
 	/* Get the root of the tree from the hash */
 	root = &q->hash_root[ flow_idx & (q->hash_buckets - 1) ];
@@ -241,7 +275,7 @@ static struct aifo_flow *aifo_classify(struct sk_buff *skb,
 	if ( (q->stats.flows >= (q->hash_buckets * 2))
 	     && ( ( time_after(jiffies, q->age_next_gc) )
 		  || (sch->q.qlen == 0) ) )
-		aifo_gc(q, root, flow_idx);
+		aifo_gc(q, root, flow_idx, flow_key);
 
 	/* Find flow in that specific tree */
 	p = &root->rb_node;
@@ -251,17 +285,20 @@ static struct aifo_flow *aifo_classify(struct sk_buff *skb,
 
 		flow_cur = rb_entry(parent, struct aifo_flow, hash_node);
 		if (flow_cur->flow_idx == flow_idx) {
-			/* Found ! */
-			return flow_cur;
+			if (likely(flow_cur->flow_key == flow_key)) {
+				/* Found ! */
+				return flow_cur;
+			}
+			q->stats.hash_collisions++;
 		}
-		if (flow_cur->flow_idx > flow_idx)
+		if (aifo_flow_id_gt(flow_cur, flow_idx, flow_key))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
 	}
 
 	/* Create a new flow */
-	flow_cur = aifo_create_flow(q, flow_idx);
+	flow_cur = aifo_create_flow(q, flow_idx, flow_key);
 	if (unlikely(flow_cur == NULL)) {
 		return NULL;
 	}
@@ -305,6 +342,43 @@ static struct aifo_flow *aifo_classify(struct sk_buff *skb,
 	return flow_cur;
 }
 
+/* Count how many of the most recent samples have a lower rank.
+ * The most recent sample is at spl_tail, the ring is walked backward.
+ * This is done in at most two contiguous runs, so there is no remainder
+ * per sample, and the comparison is added to the count instead of
+ * being tested, so there is no unpredictable branch per sample.
+ * Both help the compiler unroll the loop. */
+static inline long aifo_count_lower(const struct aifo_sched_data *q,
+				    u64 virtual_pkt,
+				    long sample_num)
+{
+	const u64 *	ranks = q->sample_ranks;
+	long		lower_spl_num = 0;
+	long		tail;
+	long		first;
+	long		i;
+
+	if (sample_num > q->sample_size)
+		sample_num = q->sample_size;
+	if (sample_num <= 0)
+		return 0;
+
+	/* sample_size may have changed since last sample */
+	tail = q->spl_tail % q->sample_size;
+	first = tail + 1 - sample_num;
+
+	/* Oldest samples, before the ring wraps around */
+	if (first < 0) {
+		for (i = first + q->sample_size; i < q->sample_size; i++)
+			lower_spl_num += time_after64(virtual_pkt, ranks[i]);
+		first = 0;
+	}
+	for (i = first; i <= tail; i++)
+		lower_spl_num += time_after64(virtual_pkt, ranks[i]);
+
+	return lower_spl_num;
+}
+
 static inline bool aifo_admit_packet(struct Qdisc *sch, struct sk_buff *skb)
 {
 	struct aifo_sched_data *q = qdisc_priv(sch);
@@ -313,9 +387,10 @@ static inline bool aifo_admit_packet(struct Qdisc *sch, struct sk_buff *skb)
 	long	sample_num;
 	long	flow_limit;
 	long	lower_spl_num = 0;
-	int	spl_idx;
-	int	i;
 	bool	drop;
+#ifdef AIFO_DEBUG_ADMIT_CYCLES
+	cycles_t	cycles_start;
+#endif	/* AIFO_DEBUG_ADMIT_CYCLES */
 
 	/* Get flow for this packet */
 	flow_cur = aifo_classify(skb, sch);
@@ -332,6 +407,10 @@ static inline bool aifo_admit_packet(struct Qdisc *sch, struct sk_buff *skb)
 	else
 		virtual_pkt = flow_cur->virtual_finish;
 
+#ifdef AIFO_DEBUG_ADMIT_CYCLES
+	cycles_start = get_cycles();
+#endif	/* AIFO_DEBUG_ADMIT_CYCLES */
+
 	/* Quantile computation. Black magic. Jean II */
 	switch (q->flags & AIFF_MASK_QUANT) {
 
@@ -340,14 +419,7 @@ static inline bool aifo_admit_packet(struct Qdisc *sch, struct sk_buff *skb)
 		sample_num = (sch->q.qlen * q->sample_size) / sch->limit;
 		if (sample_num > sch->q.qlen)
 			sample_num = sch->q.qlen;
-		lower_spl_num = 0;
-		for (i = 0; i < sample_num; i++) {
-			spl_idx = ( (q->spl_tail + q->sample_size - i)
-				     % q->sample_size );
-			if ( time_after64(virtual_pkt,
-					  q->sample_ranks[spl_idx]) )
-				lower_spl_num++;
-		}
+		lower_spl_num = aifo_count_lower(q, virtual_pkt, sample_num);
 		break;
 
 	default:
@@ -369,18 +441,10 @@ static inline bool aifo_admit_packet(struct Qdisc *sch, struct sk_buff *skb)
 		/* Compute quantile of this rank.
 		 * We compute the percent of packets with lower rank in
 		 * the sliding window of samples. */
-		lower_spl_num = 0;
-		for (i = 0; i < sample_num; i++) {
-			/* '%' is remainder, not modulo. Jean II */
-			spl_idx = ( (q->spl_tail + q->sample_size - i)
-				     % q->sample_size );
-			if ( time_after64(virtual_pkt,
-					  q->sample_ranks[spl_idx]) )
-				lower_spl_num++;
+		lower_spl_num = aifo_count_lower(q, virtual_pkt, sample_num);
 #ifdef AIFO_DEBUG_QUANTILE
-			printk(KERN_DEBUG "AIFO: quantile: i:%d; vi:%lld; vp:%lld; lw:%ld\n", spl_idx, q->sample_ranks[spl_idx], virtual_pkt, lower_spl_num);
+		printk(KERN_DEBUG "AIFO: quantile: tail:%d; vp:%lld; sn:%ld; lw:%ld\n", q->spl_tail, virtual_pkt, sample_num, lower_spl_num);
 #endif	/* AIFO_DEBUG_QUANTILE */
-		}
 
 		/* Quantile: fudges original to get queue to grow... */
 		if ( (q->flags & AIFF_MASK_QUANT) == AIFF_QUANT_ADD1) {
@@ -438,6 +502,18 @@ static inline bool aifo_admit_packet(struct Qdisc *sch, struct sk_buff *skb)
 	drop = ( lower_spl_num * (sch->limit - q->burst)
 		 > (sch->limit - sch->q.qlen) * sample_num );
 
+#ifdef AIFO_DEBUG_ADMIT_CYCLES
+	{
+		u32 cycles = (u32) (get_cycles() - cycles_start);
+
+		if (q->stats.admit_cycles == 0)
+			q->stats.admit_cycles = cycles;
+		else
+			q->stats.admit_cycles = ( ( q->stats.admit_cycles * 15
+						    + cycles ) / 16 );
+	}
+#endif	/* AIFO_DEBUG_ADMIT_CYCLES */
+
 #ifdef AIFO_DEBUG_ADMIT
 	printk(KERN_DEBUG "AIFO: admit: idx:%d; sn:%ld; lw:%ld; li:%d; ql:%d; vp:%lld; vdq:%lld; vf:%lld; d:%d\n", flow_cur->flow_idx, sample_num, lower_spl_num, sch->limit, sch->q.qlen, virtual_pkt, q->virtual_dequeue, virtual_pkt + qdisc_pkt_len(skb), drop);
 #endif	/* AIFO_DEBUG_ADMIT */
@@ -575,9 +651,9 @@ static void aifo_rehash(struct aifo_sched_data *q,
 				parent = *np;
 
 				nf = rb_entry(parent, struct aifo_flow, hash_node);
-				BUG_ON(nf->flow_idx == of->flow_idx);
+				BUG_ON(aifo_flow_id_eq(nf, of->flow_idx, of->flow_key));
 
-				if (nf->flow_idx > of->flow_idx)
+				if (aifo_flow_id_gt(nf, of->flow_idx, of->flow_key))
 					np = &parent->rb_right;
 				else
 					np = &parent->rb_left;
@@ -790,6 +866,8 @@ static int aifo_qdisc_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 	st.qlen_peak		= q->stats.qlen_peak;
 	st.backlog_peak		= q->stats.backlog_peak;
 	st.quant_avg_1k		= q->stats.quant_avg_1k;
+	st.admit_cycles		= q->stats.admit_cycles;
+	st.hash_collisions	= q->stats.hash_collisions;
 
 	/* Reset some of the statistics, unless disabled */
 	if ( ! (q->flags & AIFF_PEAK_NORESET) ) {
@@ -819,6 +897,7 @@ static int aifo_qdisc_init(struct Qdisc *sch,
 	q->burst		= 1;			/* 1 packet */
 	q->flow_plimit		= AIFO_FLOW_PLIMIT_DEFLT;
 	q->hash_mask		= AIFO_HASH_MASK_DEFLT;
+	get_random_bytes(&q->flow_key_seed, sizeof(q->flow_key_seed));
 	q->sample_size		= AIFO_SAMPLE_SIZE_DEFLT;
 	q->sample_period	= AIFO_SAMPLE_PERIOD_DEFLT;
 
@@ -850,8 +929,8 @@ static void aifo_qdisc_reset(struct Qdisc *sch)
 	struct aifo_flow *flow_cur;
 	unsigned int idx;
 
-	sch->q.qlen = 0;
-	sch->qstats.backlog = 0;
+	/* Packets live in the qdisc queue, the core won't free them */
+	qdisc_reset_queue(sch);
 
 	if (!q->hash_root)
 		return;
@@ -872,6 +951,8 @@ static void aifo_qdisc_reset(struct Qdisc *sch)
 	q->stats.qlen_peak	= 0;
 	q->stats.backlog_peak	= 0;
 	q->stats.quant_avg_1k	= 0;
+	q->stats.admit_cycles	= 0;
+	q->stats.hash_collisions = 0;
 }
 
 static void aifo_qdisc_destroy(struct Qdisc *sch)
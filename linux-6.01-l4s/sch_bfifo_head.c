@@ -15,10 +15,29 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/skbuff.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <net/pkt_sched.h>
 
+/* The packets are kept in a preallocated ring of skb pointers, instead
+ * of the skb list of the qdisc. Each slot also records the number of
+ * bytes enqueued up to and including its packet, so the number of
+ * packets to drop at the head to make space for a new packet is found
+ * with a binary search on those byte offsets, and the whole run is
+ * removed from the ring at once by moving the head index. The dropped
+ * skbs are chained on to_free, and freed in bulk by the stack after
+ * the root lock is released.
+ * The ring has one slot per BFIFO_RING_PKT_MIN bytes of limit. A queue
+ * full of smaller packets drops at the head when the ring is full,
+ * before the byte limit is reached.
+ */
+
 //#define BFIFO_DEBUG
 
+#define BFIFO_RING_PKT_MIN	64		/* Bytes of limit per slot */
+#define BFIFO_RING_MIN		64		/* Slots */
+#define BFIFO_RING_MAX		(1 << 20)	/* Slots, 12MB */
+
 /* Stats exported to userspace */
 struct tc_bfifo_head_xstats {
 	__u32	skb_num;	/* Number of skbs */
@@ -28,9 +47,93 @@ struct tc_bfifo_head_xstats {
 
 /* private data for the Qdisc */
 struct bfifo_head_sched_data {
+	struct sk_buff **	ring;		/* Packets, ring_mask + 1 slots */
+	u32 *			ring_end;	/* Bytes enqueued up to slot */
+	u32			ring_mask;	/* Ring size - 1, power of two */
+	u32			head;		/* Index of first packet */
+	u32			bytes_in;	/* Bytes enqueued, wrapping */
+	u32			bytes_head;	/* Bytes before first packet */
 	struct tc_bfifo_head_xstats	stats;
 };
 
+static inline void bfifo_ring_add(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+	u32 idx = (q->head + sch->q.qlen) & q->ring_mask;
+
+	q->bytes_in += qdisc_pkt_len(skb);
+	q->ring[idx] = skb;
+	q->ring_end[idx] = q->bytes_in;
+	sch->q.qlen++;
+	qdisc_qstats_backlog_inc(sch, skb);
+}
+
+/* Remove the first 'num' packets of the ring, return their size.
+ * With no packet, the slot before the head may be stale, don't read it. */
+static inline u32 bfifo_ring_cut(struct Qdisc *sch, u32 num)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+	u32 last_end;
+	u32 bytes;
+
+	if (!num)
+		return 0;
+	last_end = q->ring_end[(q->head + num - 1) & q->ring_mask];
+	bytes = last_end - q->bytes_head;
+	q->head = (q->head + num) & q->ring_mask;
+	q->bytes_head = last_end;
+	sch->q.qlen -= num;
+	sch->qstats.backlog -= bytes;
+	return bytes;
+}
+
+/* Number of packets at the head holding at least 'bytes' bytes.
+ * The byte offsets grow along the ring, so do a binary search. */
+static u32 bfifo_ring_count(struct bfifo_head_sched_data *q, u32 qlen,
+			    u32 bytes)
+{
+	u32 lo = 1;
+	u32 hi = qlen;
+
+	if (!qlen)
+		return 0;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		u32 end = q->ring_end[(q->head + mid - 1) & q->ring_mask];
+
+		if (end - q->bytes_head >= bytes)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static struct sk_buff *bfifo_head_dequeue(struct Qdisc *sch)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb;
+
+	if (!sch->q.qlen)
+		return NULL;
+
+	skb = q->ring[q->head];
+	bfifo_ring_cut(sch, 1);
+	if (sch->q.qlen)
+		prefetch(q->ring[q->head]);
+	qdisc_bstats_update(sch, skb);
+	return skb;
+}
+
+static struct sk_buff *bfifo_head_peek(struct Qdisc *sch)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+
+	if (!sch->q.qlen)
+		return NULL;
+	return q->ring[q->head];
+}
+
 static int bfifo_head_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 			      struct sk_buff **to_free)
 {
@@ -38,6 +141,8 @@ static int bfifo_head_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 	unsigned int prev_backlog;
 	unsigned int prev_qlen;
 	unsigned int backlog_new;
+	u32 drop_num;
+	u32 i;
 
 	/* bstats->packets keep track of the number of actual Ethernet
 	 * packets. Unfortunately, all other stats are in number of
@@ -56,22 +161,33 @@ static int bfifo_head_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 		q->stats.backlog_peak = backlog_new;
 
 	/* If there is space in the queue, easy peasy... */
-	if (likely(sch->qstats.backlog + qdisc_pkt_len(skb) <= sch->limit))
-		return qdisc_enqueue_tail(skb, sch);
+	if (likely( (backlog_new <= sch->limit)
+		    && (sch->q.qlen <= q->ring_mask) )) {
+		bfifo_ring_add(sch, skb);
+		return NET_XMIT_SUCCESS;
+	}
 
 	prev_qlen = sch->q.qlen;
 	prev_backlog = sch->qstats.backlog;
 
-	/* Remove as many skbs as necessary to make space.
-	 * Check 'head' in case limit is lower than gso size... */
-	while ( (sch->qstats.backlog + qdisc_pkt_len(skb) > sch->limit)
-		&& (qdisc_peek_head(sch) != NULL) ) {
-		/* Queue full, remove one skb, decrease backlog */
-		__qdisc_queue_drop_head(sch, &sch->q, to_free);
-		qdisc_qstats_drop(sch);
-	}
+	/* Remove as many skbs as necessary to make space, in one go.
+	 * If limit is lower than gso size, the queue is emptied... */
+	if (backlog_new > sch->limit)
+		drop_num = bfifo_ring_count(q, prev_qlen,
+					    backlog_new - sch->limit);
+	else
+		drop_num = 0;
+	/* Ring full of small packets, need one slot */
+	if (prev_qlen - drop_num > q->ring_mask)
+		drop_num = prev_qlen - q->ring_mask;
+
+	for (i = 0; i < drop_num; i++)
+		__qdisc_drop(q->ring[(q->head + i) & q->ring_mask], to_free);
+	bfifo_ring_cut(sch, drop_num);
+	sch->qstats.drops += drop_num;
+
 	/* Now we can enqueue */
-	qdisc_enqueue_tail(skb, sch);
+	bfifo_ring_add(sch, skb);
 
 	/* We can't call qdisc_tree_reduce_backlog() if our qlen is 0,
 	 * or HTB crashes. Fortunately, that's not possible here. */
@@ -115,20 +231,99 @@ static int bfifo_tail_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 		q->stats.backlog_peak = backlog_new;
 
 	/* Simple queuing */
-	if (likely(sch->qstats.backlog + qdisc_pkt_len(skb) <= sch->limit))
-		return qdisc_enqueue_tail(skb, sch);
+	if (likely( (backlog_new <= sch->limit)
+		    && (sch->q.qlen <= q->ring_mask) )) {
+		bfifo_ring_add(sch, skb);
+		return NET_XMIT_SUCCESS;
+	}
 
 	return qdisc_drop(skb, sch, to_free);
 }
 
-static int bfifo_head_init(struct Qdisc *sch, struct nlattr *opt,
-			   struct netlink_ext_ack *extack)
+static void bfifo_head_reset(struct Qdisc *sch)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+	u32 i;
+
+	for (i = 0; i < sch->q.qlen; i++)
+		rtnl_kfree_skbs(q->ring[(q->head + i) & q->ring_mask],
+				q->ring[(q->head + i) & q->ring_mask]);
+	sch->q.qlen = 0;
+	sch->qstats.backlog = 0;
+	q->head = 0;
+	q->bytes_in = 0;
+	q->bytes_head = 0;
+}
+
+/* Size the ring for the limit, moving the packets to the new ring.
+ * The packets that don't fit are dropped at the head. */
+static int bfifo_ring_resize(struct Qdisc *sch)
 {
 	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+	struct sk_buff **ring;
+	struct sk_buff **ring_old;
+	u32 *ring_end;
+	u32 size;
+	u32 drop_num;
+	u32 drop_len;
+	u32 i;
+
+	size = clamp_t(u32, sch->limit / BFIFO_RING_PKT_MIN,
+		       BFIFO_RING_MIN, BFIFO_RING_MAX);
+	size = roundup_pow_of_two(size);
+	if (q->ring && (size == q->ring_mask + 1))
+		return 0;
+
+	ring = kvcalloc(size, sizeof(*ring) + sizeof(*ring_end), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	ring_end = (u32 *) (ring + size);
+
+	sch_tree_lock(sch);
+
+	ring_old = q->ring;
+	if (ring_old) {
+		drop_num = 0;
+		drop_len = 0;
+		if (sch->q.qlen > size) {
+			drop_num = sch->q.qlen - size;
+			for (i = 0; i < drop_num; i++) {
+				struct sk_buff *skb =
+					q->ring[(q->head + i) & q->ring_mask];
+
+				rtnl_kfree_skbs(skb, skb);
+			}
+			drop_len = bfifo_ring_cut(sch, drop_num);
+			sch->qstats.drops += drop_num;
+		}
+		/* Offsets restart from the head of the new ring */
+		for (i = 0; i < sch->q.qlen; i++) {
+			u32 idx = (q->head + i) & q->ring_mask;
+
+			ring[i] = q->ring[idx];
+			ring_end[i] = q->ring_end[idx] - q->bytes_head;
+		}
+		qdisc_tree_reduce_backlog(sch, drop_num, drop_len);
+	}
+	q->ring = ring;
+	q->ring_end = ring_end;
+	q->ring_mask = size - 1;
+	q->head = 0;
+	q->bytes_in -= q->bytes_head;
+	q->bytes_head = 0;
+
+	sch_tree_unlock(sch);
+
+	kvfree(ring_old);
+	return 0;
+}
+
+static int bfifo_head_change(struct Qdisc *sch, struct nlattr *opt,
+			     struct netlink_ext_ack *extack)
+{
 	bool bypass;
 	bool is_bfifo = true;
-
-	q->stats.skb_num = 0;
+	int err;
 
 	if (opt == NULL) {
 		u32 limit = qdisc_dev(sch)->tx_queue_len;
@@ -146,6 +341,10 @@ static int bfifo_head_init(struct Qdisc *sch, struct nlattr *opt,
 		sch->limit = ctl->limit;
 	}
 
+	err = bfifo_ring_resize(sch);
+	if (err)
+		return err;
+
 	if (is_bfifo)
 		bypass = sch->limit >= psched_mtu(qdisc_dev(sch));
 	else
@@ -159,6 +358,32 @@ static int bfifo_head_init(struct Qdisc *sch, struct nlattr *opt,
 	return 0;
 }
 
+static int bfifo_head_init(struct Qdisc *sch, struct nlattr *opt,
+			   struct netlink_ext_ack *extack)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+
+	q->ring = NULL;
+	q->ring_mask = 0;
+	q->head = 0;
+	q->bytes_in = 0;
+	q->bytes_head = 0;
+	q->stats.skb_num = 0;
+
+	return bfifo_head_change(sch, opt, extack);
+}
+
+static void bfifo_head_destroy(struct Qdisc *sch)
+{
+	struct bfifo_head_sched_data *q = qdisc_priv(sch);
+
+	if (!q->ring)
+		return;
+	bfifo_head_reset(sch);
+	kvfree(q->ring);
+	q->ring = NULL;
+}
+
 static int bfifo_head_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
 	struct tc_fifo_qopt opt = { .limit = sch->limit };
@@ -191,11 +416,12 @@ struct Qdisc_ops bfifo_head_drop_qdisc_ops __read_mostly = {
 	.id		=	"bfifo_head_drop",
 	.priv_size	=	sizeof(struct bfifo_head_sched_data),
 	.enqueue	=	bfifo_head_enqueue,
-	.dequeue	=	qdisc_dequeue_head,
-	.peek		=	qdisc_peek_head,
+	.dequeue	=	bfifo_head_dequeue,
+	.peek		=	bfifo_head_peek,
 	.init		=	bfifo_head_init,
-	.reset		=	qdisc_reset_queue,
-	.change		=	bfifo_head_init,
+	.reset		=	bfifo_head_reset,
+	.destroy	=	bfifo_head_destroy,
+	.change		=	bfifo_head_change,
 	.dump		=	bfifo_head_dump,
 	.dump_stats	=	bfifo_head_dump_xstats,
 	.owner		=	THIS_MODULE,
@@ -205,11 +431,12 @@ struct Qdisc_ops bfifo_tail_drop_qdisc_ops __read_mostly = {
 	.id		=	"bfifo_tail_drop",
 	.priv_size	=	sizeof(struct bfifo_head_sched_data),
 	.enqueue	=	bfifo_tail_enqueue,
-	.dequeue	=	qdisc_dequeue_head,
-	.peek		=	qdisc_peek_head,
+	.dequeue	=	bfifo_head_dequeue,
+	.peek		=	bfifo_head_peek,
 	.init		=	bfifo_head_init,
-	.reset		=	qdisc_reset_queue,
-	.change		=	bfifo_head_init,
+	.reset		=	bfifo_head_reset,
+	.destroy	=	bfifo_head_destroy,
+	.change		=	bfifo_head_change,
 	.dump		=	bfifo_head_dump,
 	.dump_stats	=	bfifo_head_dump_xstats,
 	.owner		=	THIS_MODULE,
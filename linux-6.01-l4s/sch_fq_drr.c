@@ -2,10 +2,10 @@
 /*
  *  Copyright (C) 2013-2015 Eric Dumazet <edumazet@google.com>
  *
- *  Meant to be mostly used for locally generated traffic :
- *  Fast classification depends on skb->sk being set before reaching us.
- *  If not, (router workload), we use rxhash as fallback, with 32 bits wide hash.
- *  All packets belonging to a socket are considered as a 'flow'.
+ *  Unlike sch_fq, flows are not keyed by skb->sk : every packet, locally
+ *  generated or forwarded, is classified by skb_get_hash() in a hash
+ *  table of RB trees. All packets with the same hash are considered as
+ *  a 'flow'.
  *
  *  Flows are dynamically allocated and stored in a hash table of RB trees
  *  They are also part of one Round Robin 'queues' (new or old flows)
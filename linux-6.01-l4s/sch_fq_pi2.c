@@ -33,10 +33,10 @@
  * From sch_fq.c :
  *  Copyright (C) 2013-2015 Eric Dumazet <edumazet@google.com>
  *
- *  Meant to be mostly used for locally generated traffic :
- *  Fast classification depends on skb->sk being set before reaching us.
- *  If not, (router workload), we use rxhash as fallback, with 32 bits wide hash.
- *  All packets belonging to a socket are considered as a 'flow'.
+ *  Unlike sch_fq, flows are not keyed by skb->sk : every packet, locally
+ *  generated or forwarded, is classified by skb_get_hash() in a hash
+ *  table of RB trees. All packets with the same hash are considered as
+ *  a 'flow'.
  *
  *  Flows are dynamically allocated and stored in a hash table of RB trees
  *  They are also part of one Round Robin 'queues' (new or old flows)
@@ -130,6 +130,12 @@
  * If you really want GSO segmentation, please use TBF+PI2 (PI2 as a leaf
  * to the TBF qdisc), just set a low MTU (1500) and high rate on TBF.
  *
+ * ---- Clock source ----
+ *
+ * Same clock sources as sch_pi2.c, selected with 'clock' :
+ * ktime (default), cycles and tstamp. 'clock_saved' counts the
+ * ktime_get_ns() calls avoided.
+ *
  * Jean II
  */
 
@@ -137,6 +143,7 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/jiffies.h>
+#include <linux/sched/clock.h>
 #include <linux/string.h>
 #include <linux/in.h>
 #include <linux/errno.h>
@@ -226,6 +233,8 @@
 #define NM24_SCALE	(1 << NM24_SHIFT)
 
 #define PI2_LIMIT_DEFLT (1000000)		/* 1MB */
+#define FQ_WALK_CHUNK	(64)		/* Flows per class dump lock */
+#define FQ_WALK_BUCKETS	(1024)		/* Buckets per class dump lock */
 
 #ifndef TCA_FQ_PI2_MAX
 /* FQ_PI2 */
@@ -246,6 +255,7 @@ enum {
 	TCA_FQ_PI2_FLAGS,	/* See flags below */
 	TCA_FQ_PI2_MON_FL_PORT,	/* Transport port for flow instrumentation */
 	TCA_FQ_PI2_UDP_PLIMIT,	/* Target backlog size for UDP (bytes) */
+	TCA_FQ_PI2_CLOCK,	/* Clock source, see below */
 	__TCA_FQ_PI2_MAX
 };
 #define TCA_FQ_PI2_MAX   (__TCA_FQ_PI2_MAX - 1)
@@ -261,6 +271,12 @@ enum {
 
 #define PI2F_MASK_OVERLOAD	(~0x3)	/* Mask out two lowest bits */
 
+/* FQ_PI2_CLOCK */
+#define PI2_CLOCK_KTIME		0	/* ktime_get_ns() for every event */
+#define PI2_CLOCK_CYCLES	1	/* local_clock(), anchored to ktime */
+#define PI2_CLOCK_TSTAMP	2	/* Cycles, enqueue uses skb->tstamp */
+#define PI2_CLOCK_MAX		PI2_CLOCK_TSTAMP
+
 #endif	/* TCA_FQ_PI2_MAX */
 
 /* Stats exported to userspace */
@@ -288,6 +304,19 @@ struct tc_fq_pi2_xstats {
 	__u32	fl_drop_mark;	/* Sub-Q pkts dropped due to PI2 AQM */
 	__u32	fl_ecn_mark;	/* Sub-Q pkts marked with ECN, classic TCP */
 	__u32	fl_sce_mark;	/* Sub-Q pkts marked with ECN, scalable TCP */
+	__u32	clock_saved;	/* ktime_get_ns() calls avoided */
+};
+
+/* Stats of one flow, as a class, see fq_pi2_walk() */
+struct tc_fq_pi2_flow_xstats {
+	__u32	flow_idx;	/* Hash value for this flow */
+	__u32	qlen;		/* Packets queued */
+	__u32	backlog;	/* Bytes queued */
+	__u32	drops;		/* Packets dropped from this flow */
+	__s32	credit;		/* Deficit of the flow */
+	__u32	sojourn_us;	/* Time in queue of the head packet */
+	__u32	proba;		/* Current raw probability */
+	__u32	qdelay_us;	/* Last estimated sub-queue delay */
 };
 
 /* PI2 Parameters configured from user space */
@@ -299,6 +328,7 @@ struct pi2_config {
 	u32	coupling;	/* Coupling rate factor between
 				 * Classic TCP and Scalable TCP */
 	u32	flags;		/* Bitmask of PI2F_XXX flags */
+	u32	clock;		/* Clock source, PI2_CLOCK_XXX */
 };
 
 /* PI2 Internal state and helpful variables */
@@ -310,6 +340,9 @@ struct pi2_param {
 	u32	proba_max;	/* Maximum raw probability. */
 	u32	reduce_qlen;	/* Pending qlen to be reduced on parent */
 	u32	reduce_backlog;	/* Pending backlog to be reduced on parent */
+	s64	clock_ns;	/* Last time returned by pi2_clock_now() */
+	s64	clock_offset_ns;	/* ktime minus local_clock() */
+	unsigned long	clock_jiffies;	/* When clock was last read */
 };
 
 /* Flow state for PI2 */
@@ -340,6 +373,7 @@ struct fq_pi2_flow {
 	u32		flow_idx;	/* Hash value for this flow */
 	int		qlen;		/* number of packets in flow queue */
 	int		credit;		/* Deficit */
+	u32		drops;		/* Packets dropped, for the class stats */
 
 	struct fq_pi2_flow *next;	/* next flow in RR lists */
 
@@ -392,6 +426,17 @@ struct fq_pi2_sched_data {
 #ifdef PI2_UDP_TAILDROP_PACKETS
 	u32	udp_plimit;	/* Target queue length for UDP (in packets) */
 #endif	/* PI2_UDP_TAILDROP_PACKETS */
+
+	/* Per flow classes, see fq_pi2_walk() */
+	struct fq_walk_snap *walk_snap;	/* Flows of the current chunk */
+	u32		walk_snap_cnt;	/* Entries in walk_snap */
+	u32		walk_snap_pos;	/* Next entry to hand out */
+	u32		walk_idx;	/* Next bucket of hash_root[] */
+	u32		walk_sub;	/* Flows of that bucket already taken */
+	int		walk_count;	/* Classes dumped when we stopped */
+	/* Walker that stopped at walk_count, NULL if none */
+	int		(*walk_fn)(struct Qdisc *, unsigned long,
+				   struct qdisc_walker *);
 };
 
 struct pi2_skb_cb {
@@ -406,6 +451,56 @@ static struct pi2_skb_cb *pi2_skb_cb(struct sk_buff *skb)
 	return (struct pi2_skb_cb *) qdisc_skb_cb(skb)->data;
 }
 
+/* Get the time for PI2 computations from the configured clock source. */
+static s64 pi2_clock_now(struct fq_pi2_sched_data *q)
+{
+	struct pi2_param *param = &q->pi2_param;
+	s64 now;
+
+	switch (q->pi2_config.clock) {
+	case PI2_CLOCK_CYCLES:
+	case PI2_CLOCK_TSTAMP:
+		if (param->clock_jiffies == jiffies) {
+			now = local_clock() + param->clock_offset_ns;
+			q->stats.clock_saved++;
+		} else {
+			now = ktime_get_ns();
+			param->clock_offset_ns = now - (s64) local_clock();
+			param->clock_jiffies = jiffies;
+		}
+		/* local_clock() is only monotonic on a single CPU, and
+		 * drifts from ktime between anchors. Never go back in
+		 * time, the delay would become negative. */
+		if (now < param->clock_ns)
+			now = param->clock_ns;
+		break;
+
+	default:
+		return ktime_get_ns();
+	}
+
+	param->clock_ns = now;
+	return now;
+}
+
+/* Timestamp of a packet at enqueue. With the tstamp clock, use the
+ * delivery time set by the stack (TCP EDT, SO_TXTIME), unless the
+ * packet is paced in the future, its delay would be negative. */
+static s64 pi2_skb_tstamp(struct fq_pi2_sched_data *q, struct sk_buff *skb,
+			  s64 now)
+{
+	s64 tstamp;
+
+	if ( (q->pi2_config.clock != PI2_CLOCK_TSTAMP)
+	     || (!skb->mono_delivery_time) )
+		return now;
+
+	tstamp = ktime_to_ns(skb->tstamp);
+	if ( (tstamp <= 0) || (tstamp > now) )
+		return now;
+	return tstamp;
+}
+
 #ifdef PI2_ECN_IS_ECT1
 static inline int IP_ECN_is_ect1(struct iphdr *iph)
 {
@@ -1114,11 +1209,12 @@ static int fq_pi2_qdisc_enqueue_tail(struct sk_buff *	skb,
 	}
 	if (unlikely(flow_cur->qlen >= q->flow_plimit)) {
 		qdisc_qstats_overlimit(sch);
+		flow_cur->drops++;
 		return qdisc_drop(skb, sch, to_free);
 	}
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 	/* If sub-queue was empty, reset delay.
 	 * This will make use underestimate the queuing delay, but
@@ -1131,6 +1227,7 @@ static int fq_pi2_qdisc_enqueue_tail(struct sk_buff *	skb,
 	if (udp_is_taildrop_config(sch, skb)) {
 		if (udp_try_drop_pkt(sch, flow_cur, skb, now)) {
 			/* Stats already updated */
+			flow_cur->drops++;
 			return qdisc_drop(skb, sch, to_free);
 		}
 		/* Skip PI2 processing.
@@ -1152,13 +1249,14 @@ static int fq_pi2_qdisc_enqueue_tail(struct sk_buff *	skb,
 	pi2_drop = pi2_try_drop_mark_pkt(sch, flow_cur, skb);
 	if (pi2_drop) {
 		/* Stats already updated */
+		flow_cur->drops++;
 		return qdisc_drop(skb, sch, to_free);
 	}
 
 skip_pi2:
 	/* Set timestamp on packet to measure avg queue delay */
 	cb = pi2_skb_cb(skb);
-	cb->ts = now;
+	cb->ts = pi2_skb_tstamp(q, skb, now);
 
 	/* Schedule this sub-queue if not part of schedule */
 	if (fq_flow_is_detached(flow_cur)) {
@@ -1294,24 +1392,26 @@ static int fq_pi2_qdisc_enqueue_head(struct sk_buff *	skb,
 	}
 	if (unlikely(flow_cur->qlen >= q->flow_plimit)) {
 		qdisc_qstats_overlimit(sch);
+		flow_cur->drops++;
 		return qdisc_drop(skb, sch, to_free);
 	}
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 	if (udp_is_taildrop_config(sch, skb)) {
 		if (flow_cur->qlen == 0)
 			flow_cur->pi2.head_ns = now;
 		if (udp_try_drop_pkt(sch, flow_cur, skb, now)) {
 			/* Stats already updated */
+			flow_cur->drops++;
 			return qdisc_drop(skb, sch, to_free);
 		}
 	}
 
 	/* Set timestamp on packet to measure avg queue delay */
 	cb = pi2_skb_cb(skb);
-	cb->ts = now;
+	cb->ts = pi2_skb_tstamp(q, skb, now);
 
 	/* Schedule this sub-queue if not part of schedule */
 	if (fq_flow_is_detached(flow_cur)) {
@@ -1361,7 +1461,7 @@ static struct sk_buff *fq_pi2_qdisc_dequeue_head(struct Qdisc *sch)
 		return NULL;
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 begin:
 	head = &q->new_flows;
@@ -1444,6 +1544,7 @@ begin:
 
 		/* Packet must be dropped, so do it ! */
 		qdisc_qstats_drop(sch);
+		flow_cur->drops++;
 		consume_skb(skb);		/* Same as kfree_skb(skb); */
 
 		/* Get another packet */
@@ -1627,6 +1728,7 @@ static const struct nla_policy fq_pi2_policy[TCA_FQ_PI2_MAX + 1] = {
 	[TCA_FQ_PI2_FLAGS]		= { .type = NLA_U32 },
 	[TCA_FQ_PI2_MON_FL_PORT]	= { .type = NLA_U16 },
 	[TCA_FQ_PI2_UDP_PLIMIT]		= { .type = NLA_U32 },
+	[TCA_FQ_PI2_CLOCK]		= { .type = NLA_U32 },
 };
 
 static void pi2_aqm_param_update(struct fq_pi2_sched_data *q)
@@ -1765,6 +1867,9 @@ static int fq_pi2_qdisc_change(struct Qdisc *sch,
 		if (target_us == 0)
 			return -EINVAL;
         }
+	if (tb[TCA_FQ_PI2_CLOCK] &&
+	    nla_get_u32(tb[TCA_FQ_PI2_CLOCK]) > PI2_CLOCK_MAX)
+		return -EINVAL;
 
 	sch_tree_lock(sch);
 
@@ -1853,6 +1958,12 @@ static int fq_pi2_qdisc_change(struct Qdisc *sch,
 	}
 	if (tb[TCA_FQ_PI2_FLAGS])
                 q->pi2_config.flags = nla_get_u32(tb[TCA_FQ_PI2_FLAGS]);
+	if (tb[TCA_FQ_PI2_CLOCK]) {
+		q->pi2_config.clock = nla_get_u32(tb[TCA_FQ_PI2_CLOCK]);
+		/* Force a real clock read, the local_clock() anchor
+		 * may not be set. */
+		q->pi2_param.clock_jiffies = jiffies - 1;
+	}
 
 #if defined(PI2_STATS_FLOW_QLEN) || defined(PI2_STATS_FLOW_QDELAY) || defined(PI2_STATS_FLOW_MARK)
 	if (tb[TCA_FQ_PI2_MON_FL_PORT])
@@ -1929,6 +2040,9 @@ static int fq_pi2_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 	}
 	if (nla_put_u32(skb, TCA_FQ_PI2_FLAGS, q->pi2_config.flags))
 		goto nla_put_failure;
+	if ( (q->pi2_config.clock != PI2_CLOCK_KTIME)
+	     && nla_put_u32(skb, TCA_FQ_PI2_CLOCK, q->pi2_config.clock) )
+		goto nla_put_failure;
 #if defined(PI2_STATS_FLOW_QLEN) || defined(PI2_STATS_FLOW_QDELAY) || defined(PI2_STATS_FLOW_MARK)
 	if ( q->mon_fl_port != 0 ) {
 		if (nla_put_u16(skb, TCA_FQ_PI2_MON_FL_PORT, q->mon_fl_port))
@@ -2002,11 +2116,15 @@ static int fq_pi2_qdisc_init(struct Qdisc *sch,
 	q->pi2_config.tupdate_ns = q->pi2_config.target_ns;
 	q->pi2_config.coupling = PI2_COUPL_DEFLT;	/* 2.0 - from dualpi2 */
 	q->pi2_config.flags = 0x0;		/* Only drop */
+	q->pi2_config.clock = PI2_CLOCK_KTIME;
 	/* PI2 params */
 	q->pi2_param.reduce_qlen = 0;
 	q->pi2_param.reduce_backlog = 0;
 	q->pi2_param.fl_qdelay_ns = 0LL;
 	q->pi2_param.fl_qdelay_peak_ns = 0LL;
+	q->pi2_param.clock_ns = 0LL;
+	q->pi2_param.clock_offset_ns = 0LL;
+	q->pi2_param.clock_jiffies = jiffies - 1;
 	pi2_aqm_param_update(q);
 
 #if defined(PI2_STATS_FLOW_QLEN) || defined(PI2_STATS_FLOW_QDELAY) || defined(PI2_STATS_FLOW_MARK) || defined(DRR_DEBUG_FLOW_NEW)
@@ -2063,6 +2181,7 @@ static void fq_pi2_qdisc_reset(struct Qdisc *sch)
 	q->stats.fl_drop_mark	= 0;
 	q->stats.fl_ecn_mark	= 0;
 	q->stats.fl_sce_mark	= 0;
+	q->stats.clock_saved	= 0;
 
 #ifdef STFQ_STATS_BURST_AVG
 	q->flow_sched_prev	= 0;
@@ -2097,9 +2216,219 @@ static void fq_pi2_qdisc_destroy(struct Qdisc *sch)
 
 	fq_pi2_qdisc_reset(sch);
 	fq_hash_free(q->hash_root);
+	kvfree(q->walk_snap);
+}
+
+/* ---------------------- PER FLOW CLASSES ---------------------- */
+
+/*
+ * Each active flow shows up as a class, like fq_codel. Same as
+ * sch_scrr.c, the hash table is walked in chunks, each chunk is a
+ * snapshot taken under the lock, and the next part of a dump resumes
+ * at the cursor, so that a large table never holds the lock for long.
+ */
+
+struct fq_walk_snap {
+	struct tc_fq_pi2_flow_xstats st;
+	u32		minor;		/* Class minor, position in the dump */
+};
+
+static void fq_walk_snap_flow(struct fq_pi2_sched_data *q,
+			      struct fq_pi2_flow *flow,
+			      u64 now)
+{
+	struct fq_walk_snap *snap = &q->walk_snap[q->walk_snap_cnt++];
+	struct sk_buff *skb;
+	u64 ts;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->st.flow_idx = flow->flow_idx;
+	snap->st.qlen = flow->qlen;
+	snap->st.drops = flow->drops;
+	snap->st.credit = flow->credit;
+	snap->st.proba = flow->pi2.proba;
+	if (flow->pi2.qdelay_ns > 0)
+		snap->st.qdelay_us = div_u64(flow->pi2.qdelay_ns,
+					     NSEC_PER_USEC);
+	/* At most flow_plimit packets */
+	for (skb = flow->head; skb != NULL; skb = skb->next)
+		snap->st.backlog += qdisc_pkt_len(skb);
+
+	/* Whatever the clock source, the timestamp is in ktime */
+	skb = fq_peek_skb(flow);
+	if (skb == NULL)
+		return;
+	ts = pi2_skb_cb(skb)->ts;
+	if (ts <= now)
+		snap->st.sojourn_us = div_u64(now - ts, NSEC_PER_USEC);
+}
+
+/* Snapshot the active flows of one bucket, false if the chunk is full.
+ * The first walk_sub active flows were taken by the previous chunk. */
+static bool fq_walk_bucket(struct fq_pi2_sched_data *q, u32 idx, u64 now)
+{
+	struct fq_pi2_flow *flow;
+	struct rb_node *p;
+	u32 seen = 0;
+
+	for (p = rb_first(&q->hash_root[idx]); p != NULL; p = rb_next(p)) {
+		flow = rb_entry(p, struct fq_pi2_flow, hash_node);
+		/* Inactive flows have no head, and no stats worth a class */
+		if (fq_flow_is_detached(flow))
+			continue;
+		if (seen++ < q->walk_sub)
+			continue;
+		if (q->walk_snap_cnt >= FQ_WALK_CHUNK) {
+			q->walk_sub = seen - 1;
+			return false;
+		}
+		fq_walk_snap_flow(q, flow, now);
+	}
+	q->walk_sub = 0;
+	return true;
+}
+
+/* Fill the snapshot with the next chunk of flows, under the lock.
+ * The hash may have been resized since the last chunk. */
+static void fq_walk_chunk(struct Qdisc *sch)
+{
+	struct fq_pi2_sched_data *q = qdisc_priv(sch);
+	u32 budget = FQ_WALK_BUCKETS;
+	u64 now;
+
+	sch_tree_lock(sch);
+	now = ktime_get_ns();
+	q->walk_snap_cnt = 0;
+	q->walk_snap_pos = 0;
+	while (q->walk_idx < q->hash_buckets && budget > 0) {
+		if (!fq_walk_bucket(q, q->walk_idx, now))
+			break;
+		q->walk_idx++;
+		budget--;
+	}
+	sch_tree_unlock(sch);
+}
+
+static void fq_pi2_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct fq_pi2_sched_data *q = qdisc_priv(sch);
+
+	if (arg->stop)
+		return;
+
+	/* Under RTNL, like all the class operations */
+	if (q->walk_snap == NULL) {
+		q->walk_snap = kvmalloc_array(FQ_WALK_CHUNK,
+					      sizeof(struct fq_walk_snap),
+					      GFP_KERNEL);
+		if (q->walk_snap == NULL) {
+			arg->stop = 1;
+			return;
+		}
+	}
+
+	/* Next part of a dump that stopped on a full buffer, resume at
+	 * the cursor. The cursor is shared by all walkers, so only if
+	 * this is the same kind of walker, and the last one to use the
+	 * cursor stopped exactly where this one did. Otherwise, walk
+	 * from the start and skip arg->skip classes, like other qdiscs. */
+	if ( arg->skip != 0 && arg->fn == q->walk_fn
+	     && arg->skip == q->walk_count ) {
+		arg->count = arg->skip;
+	} else {
+		q->walk_idx = 0;
+		q->walk_sub = 0;
+		q->walk_snap_cnt = 0;
+		q->walk_snap_pos = 0;
+		arg->count = 0;
+	}
+
+	for (;;) {
+		while (q->walk_snap_pos < q->walk_snap_cnt) {
+			if (arg->count >= arg->skip) {
+				q->walk_snap[q->walk_snap_pos].minor =
+					(arg->count % TC_H_MIN_MASK) + 1;
+				if (arg->fn(sch, q->walk_snap_pos + 1, arg) < 0) {
+					arg->stop = 1;
+					break;
+				}
+			}
+			arg->count++;
+			q->walk_snap_pos++;
+		}
+		if (arg->stop || q->walk_idx >= q->hash_buckets)
+			break;
+		fq_walk_chunk(sch);
+	}
+	/* Keep the cursor only if we stopped on a class, at the end of
+	 * the walk there is nothing to resume */
+	if (arg->stop && q->walk_snap_pos < q->walk_snap_cnt) {
+		q->walk_fn = arg->fn;
+		q->walk_count = arg->count;
+	} else {
+		q->walk_fn = NULL;
+		q->walk_count = 0;
+	}
+}
+
+static struct fq_walk_snap *fq_walk_class(struct Qdisc *sch,
+					  unsigned long cl)
+{
+	struct fq_pi2_sched_data *q = qdisc_priv(sch);
+
+	if (cl == 0 || cl > q->walk_snap_cnt)
+		return NULL;
+	return &q->walk_snap[cl - 1];
 }
 
+static struct Qdisc *fq_pi2_leaf(struct Qdisc *sch, unsigned long cl)
+{
+	return NULL;
+}
+
+static unsigned long fq_pi2_find(struct Qdisc *sch, u32 classid)
+{
+	return 0;
+}
+
+static int fq_pi2_dump_class(struct Qdisc *sch, unsigned long cl,
+			     struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct fq_walk_snap *snap = fq_walk_class(sch, cl);
+
+	if (snap == NULL)
+		return -EINVAL;
+	tcm->tcm_parent = TC_H_ROOT;
+	tcm->tcm_handle |= TC_H_MIN(snap->minor);
+	return 0;
+}
+
+static int fq_pi2_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+				   struct gnet_dump *d)
+{
+	struct fq_walk_snap *snap = fq_walk_class(sch, cl);
+	struct gnet_stats_queue qs = { 0 };
+
+	if (snap == NULL)
+		return -1;
+	qs.qlen = snap->st.qlen;
+	qs.backlog = snap->st.backlog;
+	qs.drops = snap->st.drops;
+	if (gnet_stats_copy_queue(d, NULL, &qs, qs.qlen) < 0)
+		return -1;
+	return gnet_stats_copy_app(d, &snap->st, sizeof(snap->st));
+}
+
+static const struct Qdisc_class_ops fq_pi2_class_ops = {
+	.leaf		=	fq_pi2_leaf,
+	.find		=	fq_pi2_find,
+	.walk		=	fq_pi2_walk,
+	.dump		=	fq_pi2_dump_class,
+	.dump_stats	=	fq_pi2_dump_class_stats,
+};
+
 static struct Qdisc_ops fq_pi2_tail_qdisc_ops __read_mostly = {
+	.cl_ops		=	&fq_pi2_class_ops,
 	.id		=	"fq_pi2",
 	.priv_size	=	sizeof(struct fq_pi2_sched_data),
 
@@ -2116,6 +2445,7 @@ static struct Qdisc_ops fq_pi2_tail_qdisc_ops __read_mostly = {
 };
 
 static struct Qdisc_ops fq_pi2_head_qdisc_ops __read_mostly = {
+	.cl_ops		=	&fq_pi2_class_ops,
 	.id		=	"fq_pi2_head",
 	.priv_size	=	sizeof(struct fq_pi2_sched_data),
 
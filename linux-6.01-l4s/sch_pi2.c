@@ -27,6 +27,8 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/skbuff.h>
+#include <linux/jiffies.h>
+#include <linux/sched/clock.h>
 #include <net/pkt_sched.h>
 #include <net/inet_ecn.h>
 
@@ -99,6 +101,22 @@
  * If you really want GSO segmentation, please use TBF+PI2 (PI2 as a leaf
  * to the TBF qdisc), just set a low MTU (1500) and high rate on TBF.
  *
+ * ---- Clock source ----
+ *
+ * PI2 timestamps every packet at enqueue and reads the clock again at
+ * dequeue. The default is to call ktime_get_ns() every time, which is
+ * cheap with the TSC clocksource, but not with every clocksource or
+ * in every VM. The 'clock' parameter selects a cheaper source :
+ *	o ktime : ktime_get_ns() for every event, the default.
+ *	o cycles : local_clock(), which scales the cycle counter with a
+ *	  precomputed multiplier, anchored to ktime once per jiffy so that
+ *	  all timestamps stay in the ktime domain.
+ *	o tstamp : like cycles, but use skb->tstamp as enqueue timestamp
+ *	  when the stack set a delivery time that is not in the future.
+ * PI2 computes the delay at tupdate granularity, so the drift between
+ * anchors is small relative to target. 'clock_saved' counts the
+ * ktime_get_ns() calls avoided, one per event between anchors.
+ *
  * Jean II */
 
 #define PI2_ECN_IS_ECT1
@@ -175,6 +193,7 @@ enum {
 	TCA_PI2_BETA,		/* Proportional coefficient */
 	TCA_PI2_COUPLING,	/* Coupling between scalable and classical */
 	TCA_PI2_PI2_FLAGS,	/* See flags below */
+	TCA_PI2_CLOCK,		/* Clock source, see below */
 	__TCA_PI2_MAX
 };
 
@@ -194,6 +213,12 @@ enum {
 #define PI2F_MASK_OVERLOAD	(~0x3)	/* Mask out two lowest bits */
 #define PI2F_MASK_RAPID		(0x0300)	/* Rapid signalling */
 
+/* PI2_CLOCK */
+#define PI2_CLOCK_KTIME		0	/* ktime_get_ns() for every event */
+#define PI2_CLOCK_CYCLES	1	/* local_clock(), anchored to ktime */
+#define PI2_CLOCK_TSTAMP	2	/* Cycles, enqueue uses skb->tstamp */
+#define PI2_CLOCK_MAX		PI2_CLOCK_TSTAMP
+
 #endif
 
 /* Stats exported to userspace */
@@ -206,6 +231,7 @@ struct tc_pi2_xstats {
 	__u32	proba_peak;	/* Maximum raw probability experienced */
 	__u32	delay_us;	/* Current estimated queue delay */
 	__u32	delay_peak_us;	/* Maximum queuing delay experienced */
+	__u32	clock_saved;	/* ktime_get_ns() calls avoided */
 };
 
 /* Parameters configured from user space */
@@ -217,6 +243,7 @@ struct pi2_config {
 	u32	coupling;	/* Coupling rate factor between
 				 * Classic TCP and Scalable TCP */
 	u32	pi2_flags;	/* Bitmask of PI2F_XXX flags */
+	u32	clock;		/* Clock source, PI2_CLOCK_XXX */
 };
 
 /* Internal state and helpful variables */
@@ -236,6 +263,9 @@ struct pi2_param {
 	u32	recur_scalable;	/* Mark counter for scalable TCP */
 	u32	reduce_qlen;	/* Pending qlen to be reduced on parent */
 	u32	reduce_backlog;	/* Pending backlog to be reduced on parent */
+	s64	clock_ns;	/* Last time returned by pi2_clock_now() */
+	s64	clock_offset_ns;	/* ktime minus local_clock() */
+	unsigned long	clock_jiffies;	/* When clock was last read */
 #ifdef PI2_BOB_BRISCOE
 	u64	dequeue_last_ns; /* Last time we dequeued a packet */
 	u64	service_avg_ns;	/* Average service time */
@@ -263,6 +293,56 @@ static struct pi2_skb_cb *pi2_skb_cb(struct sk_buff *skb)
 	return (struct pi2_skb_cb *) qdisc_skb_cb(skb)->data;
 }
 
+/* Get the time for PI2 computations from the configured clock source. */
+static s64 pi2_clock_now(struct pi2_sched_data *q)
+{
+	struct pi2_param *param = &q->param;
+	s64 now;
+
+	switch (q->config.clock) {
+	case PI2_CLOCK_CYCLES:
+	case PI2_CLOCK_TSTAMP:
+		if (param->clock_jiffies == jiffies) {
+			now = local_clock() + param->clock_offset_ns;
+			q->stats.clock_saved++;
+		} else {
+			now = ktime_get_ns();
+			param->clock_offset_ns = now - (s64) local_clock();
+			param->clock_jiffies = jiffies;
+		}
+		/* local_clock() is only monotonic on a single CPU, and
+		 * drifts from ktime between anchors. Never go back in
+		 * time, the delay would become negative. */
+		if (now < param->clock_ns)
+			now = param->clock_ns;
+		break;
+
+	default:
+		return ktime_get_ns();
+	}
+
+	param->clock_ns = now;
+	return now;
+}
+
+/* Timestamp of a packet at enqueue. With the tstamp clock, use the
+ * delivery time set by the stack (TCP EDT, SO_TXTIME), unless the
+ * packet is paced in the future, its delay would be negative. */
+static s64 pi2_skb_tstamp(struct pi2_sched_data *q, struct sk_buff *skb,
+			  s64 now)
+{
+	s64 tstamp;
+
+	if ( (q->config.clock != PI2_CLOCK_TSTAMP)
+	     || (!skb->mono_delivery_time) )
+		return now;
+
+	tstamp = ktime_to_ns(skb->tstamp);
+	if ( (tstamp <= 0) || (tstamp > now) )
+		return now;
+	return tstamp;
+}
+
 #ifdef PI2_ECN_IS_ECT1
 static inline int IP_ECN_is_ect1(struct iphdr *iph)
 {
@@ -553,7 +633,7 @@ static int pi2_qdisc_enqueue_tail(struct sk_buff *skb, struct Qdisc *sch,
 	}
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 	/* If sub-queue was empty, reset delay.
 	 * This will make use underestimate the queuing delay, but
@@ -578,7 +658,7 @@ static int pi2_qdisc_enqueue_tail(struct sk_buff *skb, struct Qdisc *sch,
 	if (enqueue) {
 		/* Set timestamp on packet to measure avg queue delay */
 		cb = pi2_skb_cb(skb);
-		cb->ts = now;
+		cb->ts = pi2_skb_tstamp(q, skb, now);
 
 		/* Add to queue, update stats, etc... */
 		return qdisc_enqueue_tail(skb, sch);
@@ -625,11 +705,11 @@ static int pi2_qdisc_enqueue_head(struct sk_buff *skb, struct Qdisc *sch,
 	}
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 	/* Set timestamp on packet to measure avg queue delay */
 	cb = pi2_skb_cb(skb);
-	cb->ts = now;
+	cb->ts = pi2_skb_tstamp(q, skb, now);
 #ifdef PI2_BOB_BRISCOE
 	cb->backlog = sch->qstats.backlog + qdisc_pkt_len(skb);
 #endif	/* PI2_BOB_BRISCOE */
@@ -669,7 +749,7 @@ static struct sk_buff *pi2_qdisc_dequeue_head(struct Qdisc *sch)
 	struct sk_buff *skb;
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 	/* Until we get a valid packet. The vast majority of times,
 	 * we only iterate once, especially if ECN is enabled... Jean II */
@@ -861,7 +941,7 @@ static struct sk_buff *pi2_qdisc_dequeue_rapid(struct Qdisc *sch)
 	struct sk_buff *skb;
 
 	/* Fortunately, this is cheap on modern CPUs ;-) */
-	now = ktime_get_ns();
+	now = pi2_clock_now(q);
 
 	/* Until we get a valid packet. The vast majority of times,
 	 * we only iterate once, especially if ECN is enabled... Jean II */
@@ -952,6 +1032,7 @@ static const struct nla_policy pi2_policy[TCA_PI2_MAX + 1] = {
 	[TCA_PI2_BETA]		= { .type = NLA_U32 },
 	[TCA_PI2_COUPLING]	= { .type = NLA_U32 },
 	[TCA_PI2_PI2_FLAGS]	= { .type = NLA_U32 },
+	[TCA_PI2_CLOCK]		= { .type = NLA_U32 },
 };
 
 static void pi2_aqm_param_update(struct pi2_sched_data *aqm, u32 tupdate_ns_old)
@@ -1104,6 +1185,9 @@ static int pi2_qdisc_change(struct Qdisc *sch, struct nlattr *opt,
 		if (target_us == 0)
 			return -EINVAL;
         }
+	if (tb[TCA_PI2_CLOCK] &&
+	    nla_get_u32(tb[TCA_PI2_CLOCK]) > PI2_CLOCK_MAX)
+		return -EINVAL;
 
 	sch_tree_lock(sch);
 
@@ -1153,6 +1237,12 @@ static int pi2_qdisc_change(struct Qdisc *sch, struct nlattr *opt,
 	}
 	if (tb[TCA_PI2_PI2_FLAGS])
                 q->config.pi2_flags = nla_get_u32(tb[TCA_PI2_PI2_FLAGS]);
+	if (tb[TCA_PI2_CLOCK]) {
+		q->config.clock = nla_get_u32(tb[TCA_PI2_CLOCK]);
+		/* Force a real clock read, the local_clock() anchor
+		 * may not be set. */
+		q->param.clock_jiffies = jiffies - 1;
+	}
 
 	/* Update internal parameters */
 	pi2_aqm_param_update(q, tupdate_ns_old);
@@ -1208,6 +1298,9 @@ static int pi2_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 	}
 	if (nla_put_u32(skb, TCA_PI2_PI2_FLAGS, q->config.pi2_flags))
 		goto nla_put_failure;
+	if ( (q->config.clock != PI2_CLOCK_KTIME)
+	     && nla_put_u32(skb, TCA_PI2_CLOCK, q->config.clock) )
+		goto nla_put_failure;
 
 	return nla_nest_end(skb, opts);
 
@@ -1251,6 +1344,7 @@ static void pi2_config_init(struct pi2_config *config)
 	config->tupdate_ns = config->target_ns;
 	config->coupling = PI2_COUPL_DEFLT;	/* 2.0 - from dualpi2 */
 	config->pi2_flags = 0x0;		/* Only drop */
+	config->clock = PI2_CLOCK_KTIME;
 }
 
 static void pi2_param_init(struct pi2_param *param)
@@ -1266,6 +1360,9 @@ static void pi2_param_init(struct pi2_param *param)
 	param->overload_ns = 0LL;
 	param->reduce_qlen = 0;
 	param->reduce_backlog = 0;
+	param->clock_ns = param->tupd_next_ns;
+	param->clock_offset_ns = 0LL;
+	param->clock_jiffies = jiffies - 1;
 #ifdef PI2_BOB_BRISCOE
 	param->dequeue_last_ns = param->tupd_next_ns;
 	param->service_avg_ns = 0LL;
@@ -1282,6 +1379,7 @@ static void pi2_stats_reset(struct tc_pi2_xstats *stats)
 	stats->sce_mark = 0;
         stats->proba = 0;
 	stats->proba_peak = 0;
+	stats->clock_saved = 0;
 }
 
 static int pi2_qdisc_init(struct Qdisc *sch, struct nlattr *opt,
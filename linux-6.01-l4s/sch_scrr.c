@@ -14,7 +14,8 @@
  *	o Fairness : flows have the same bandwidth and latency
  *	o Burstiness : scheduling burst les than two max packet sizes
  *	o Efficient : computational complexity is O(1)
- *	o Only scheduling : should be combined with AQM or Tail-Drop
+ *	o Only scheduling : should be combined with AQM or Tail-Drop,
+ *	  or use the scrr-pi2 version, which includes a PI2 AQM
  * It has some big advantages over Deficit Round Robin :
  *	o No quantum - schedule advance adapts to packet sizes
  *	o Less CPU overhead for light flows (flow goes in-out schedule)
@@ -49,6 +50,19 @@
  *  Note : When a flow becomes empty, we do not immediately remove it from
  *  rb trees, for performance reasons (its expected to send additional packets,
  *  or SLAB cache will reuse socket for another flow)
+ *
+ * ---------------------------------------------------------------- *
+ *
+ * PI2 AQM of the scrr_pi2 version based on sch_fq_pi2.c :
+ *	Copyright 2024-2025 Hewlett Packard Enterprise Development LP.
+ *	Author: Jean Tourrilhes <tourrilhes.hpl@gmail.com>
+ *
+ *  Stacking a PI2 qdisc on top of SCRR doubles the per packet cost,
+ *  and PI2 only sees the delay of the aggregate. scrr_pi2 keeps the PI2
+ *  state in each flow, and marks/drops at dequeue based on the sojourn
+ *  time of the packet in its own sub-queue, like fq_pi2_head. The AQM
+ *  options are the same as fq_pi2 (target, tupdate, alpha, beta,
+ *  coupling and the marking flags).
  */
 
 #include <linux/module.h>
@@ -63,14 +77,23 @@
 #include <linux/slab.h>
 #include <linux/rbtree.h>
 #include <linux/hash.h>
+#include <linux/siphash.h>
+#include <linux/random.h>
 #include <linux/prefetch.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/relay.h>
+#include <linux/debugfs.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
+#include <net/pkt_cls.h>
 #include <net/sock.h>
 #include <net/tcp_states.h>
 #include <net/tcp.h>
 
+#define CREATE_TRACE_POINTS
+#include "sch_scrr_trace.h"
+
 //#define SCRR_DEBUG_CONFIG
 //#define SCRR_DEBUG_FLOW_NEW
 //#define SCRR_DEBUG_STFQ_ENQUEUE
@@ -78,12 +101,31 @@
 //#define SCRR_DEBUG_NOEMPTY_ENQUEUE
 //#define SCRR_DEBUG_NOEMPTY_DEQUEUE
 //#define SCRR_DEBUG_STATS_PEAK
+//#define SCRR_DEBUG_PI2_CONFIG
+//#define SCRR_DEBUG_PI2_COMPUTE
+//#define SCRR_DEBUG_PI2_REDUCE
 #define SCRR_DEBUG_BURST_AVG
 
 #define SCRR_PLIMIT_DEFLT		(10000)		/* packets */
 #define SCRR_FLOW_PLIMIT_DEFLT		(100)		/* packets */
 #define SCRR_HASH_NUM_DEFLT		(1024)		/* num tree roots */
 #define SCRR_HASH_MASK_DEFLT		(1024 - 1)	/* bitmask */
+#define SCRR_HASH_LOAD_DEFLT		(8)		/* flows per tree */
+#define SCRR_HASH_LOG_MAX		(18)		/* 256k num tree roots */
+#define SCRR_MAX_FLOWS_MAX		(4*1024*1024)	/* flows in pool */
+#define SCRR_SK_CACHE_MIN		(64)		/* socket cache entries */
+#define SCRR_SK_CACHE_MAX		(1024*1024)	/* socket cache entries */
+#define SCRR_FAT_BUCKETS		(32)		/* log2 backlog buckets */
+#define SCRR_FAT_DROP_BATCH		(16)		/* packets per fat drop */
+#define SCRR_HORIZON_DEFLT		(10ULL * NSEC_PER_SEC) /* like sch_fq */
+#define SCRR_WHEEL_SLOTS		(512)		/* pacing wheel slots */
+#define SCRR_WHEEL_TICK_LOG		(13)		/* 8.2 us per slot */
+#define SCRR_WEIGHT_CLASSES		(16)		/* entries of weight table */
+#define SCRR_WEIGHT_SHIFT		(16)		/* fixed point of weights */
+#define SCRR_WALK_CHUNK			(64)		/* flows per class dump lock */
+#define SCRR_WALK_BUCKETS		(1024)		/* buckets per class dump lock */
+#define SCRR_TELEM_SUBBUF		(32*1024)	/* bytes, telemetry relay */
+#define SCRR_TELEM_SUBBUFS		(16)		/* per CPU, telemetry relay */
 
 enum {
 	TCA_SCRR_UNSPEC,
@@ -92,12 +134,55 @@ enum {
 	TCA_SCRR_HASH_MASK,	/* mask applied to skb hashes */
 	TCA_SCRR_FLOW_PLIMIT,	/* limit of packets per flow */
 	TCA_SCRR_FLAGS,		/* Options */
+	TCA_SCRR_CLASSIFIER,	/* Flow table backend */
+	TCA_SCRR_HASH_LOAD,	/* flows per bucket before growing hash */
+	TCA_SCRR_GC_AGE,	/* idle time before flow is collected, in us */
+	TCA_SCRR_TARGET,	/* PI2 target queuing delay (us) */
+	TCA_SCRR_TUPDATE,	/* Time between proba updates (us) */
+	TCA_SCRR_ALPHA,		/* Integral coefficient */
+	TCA_SCRR_BETA,		/* Proportional coefficient */
+	TCA_SCRR_COUPLING,	/* Coupling between scalable and classical */
+	TCA_SCRR_UDP_PLIMIT,	/* Target backlog size for UDP (packets) */
+	TCA_SCRR_MAX_FLOWS,	/* Size of the preallocated flow pool */
+	TCA_SCRR_WEIGHT_SRC,	/* Where the weight class of packets comes from */
+	TCA_SCRR_WEIGHTS,	/* Weight of each class, u8 array */
+	TCA_SCRR_GSO_SPLIT,	/* Split GSO packets above this size, in bytes */
+	TCA_SCRR_SK_CACHE,	/* Entries of the socket flow cache, 0 = off */
+	TCA_SCRR_FLOW_BLIMIT,	/* max bytes per flow, 0 = no limit */
+	TCA_SCRR_HORIZON,	/* Drop packets paced further out, in us */
+	TCA_SCRR_TELEMETRY,	/* Record 1 packet in N to the relay, 0 = off */
 	__TCA_SCRR_MAX
 };
 #define TCA_SCRR_MAX	(__TCA_SCRR_MAX - 1)
 
-/* TCA_SCRR_FLAGS */
+/* TCA_SCRR_FLAGS, AQM flags have the same values as PI2F_XXX of fq_pi2 */
+#define SCF_MARK_ECN		0x0001	/* Mark ECT_0 pkts with Classical ECN */
+#define SCF_MARK_SCE		0x0002	/* Mark ECT_1 pkts with Scalable-ECN */
+#define SCF_OVERLOAD_ECN	0x0004	/* Keep doing ECN/SCE on overload */
+#define SCF_RANDOM_MARK		0x0008	/* Randomise marking, like RED */
 #define SCF_PEAK_NORESET	0x0020	/* Don't reset peak statistics */
+#define SCF_UDP_TAILDROP	0x0040	/* Tail-drop UDP packets */
+#define SCF_FLOW_SHARE		0x0080	/* Out of flows, share a collision flow */
+#define SCF_SOJOURN_HIST	0x0100	/* Sojourn time histograms */
+#define SCF_BYPASS		0x0200	/* Stack may skip us when empty */
+#define SCF_EXACT_FLOW		0x0400	/* Full hash and key, no collisions */
+#define SCF_FAT_DROP		0x0800	/* On overload, drop from fattest flow */
+#define SCF_PACING		0x1000	/* Honor skb->tstamp (EDT) */
+
+#define SCF_MASK_OVERLOAD	(~0x3)	/* Mask out two lowest bits */
+
+/* TCA_SCRR_CLASSIFIER */
+#define SCRR_CLASSIFIER_RBTREE	0	/* Hash of RB trees, like sch_fq */
+#define SCRR_CLASSIFIER_OA	1	/* Open addressing, cacheline buckets */
+
+/* TCA_SCRR_WEIGHT_SRC */
+#define SCRR_WEIGHT_NONE	0	/* All flows have the same weight */
+#define SCRR_WEIGHT_PRIORITY	1	/* Class is skb->priority */
+#define SCRR_WEIGHT_MARK	2	/* Class is skb->mark */
+#define SCRR_WEIGHT_CLASSID	3	/* Minor of skb->priority, if it's ours */
+
+/* Sojourn histograms, log2 buckets of 1024ns, the last one is above 4s */
+#define SCRR_SOJOURN_BUCKETS	24
 
 /* statistics gathering */
 struct tc_scrr_xstats {
@@ -112,24 +197,107 @@ struct tc_scrr_xstats {
 	__u32	burst_peak;	/* Maximum burst size */
 	__u32	burst_avg;	/* Average burst size */
 	__u32	sched_empty;	/* Schedule with no packet */
+	__u32	probe_avg_1k;	/* Average buckets probed per lookup (x1000) */
+	__u32	probe_peak;	/* Maximum buckets probed for a lookup */
+	__u32	table_full;	/* Flow table full on insertion */
+	__u32	gc_lat_peak_ms;	/* Maximum delay past gc_age before collection */
+	__u32	gc_lat_avg_ms;	/* Average delay past gc_age before collection */
+	__u32	gc_deferred;	/* GC passes which hit their budget */
+	__u64	mem_used;	/* Bytes used by flows and flow table */
+	__u32	ecn_mark;	/* Packets marked with ECN, classic TCP */
+	__u32	sce_mark;	/* Packets marked with ECN, scalable TCP */
+	__u32	pool_free;	/* Flows left in the preallocated pool */
+	__u32	flow_shared;	/* Packets sent to the collision flow */
+	__u32	sojourn_light[SCRR_SOJOURN_BUCKETS]; /* Flows in new list */
+	__u32	sojourn_heavy[SCRR_SOJOURN_BUCKETS]; /* Flows in old list */
+	__u32	gso_split;	/* GSO packets split at dequeue */
+	__u32	bypass;		/* Packets sent by the stack, skipping us */
+	__u32	sk_cache_hit;	/* Flow found in the socket cache */
+	__u32	sk_cache_miss;	/* Socket not in the cache, or stale */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
+	__u32	fat_drop;	/* Packets dropped from the fattest flow */
+	__u32	flows_throttled; /* Flows waiting for their EDT */
+	__u32	throttled;	/* Flows parked in the pacing wheel */
+	__u32	horizon_drops;	/* Packets paced beyond the horizon */
+	__u32	telem_records;	/* Packets sampled by the telemetry */
+	__u32	telem_lost;	/* Records lost, the reader was too slow */
+};
+
+/* Telemetry record of one sampled packet, written at dequeue to the
+ * relay files in debugfs, see scrr_telem_record() and scrr_telem.c */
+#define SCRR_TELEM_LIST_OLD	0	/* Flow was in the old list */
+#define SCRR_TELEM_LIST_NEW	1	/* Flow was in the new list */
+
+struct scrr_telem_rec {
+	__u64	ts_ns;		/* Dequeue time, ktime */
+	__u64	virtual_pkt;	/* Virtual start of the packet */
+	__u64	virtual_advance; /* Virtual clock of the round */
+	__u64	sojourn_ns;	/* Time in the qdisc */
+	__u32	flow_idx;	/* Hash value of the flow */
+	__u32	len;		/* Packet length */
+	__u32	flow_qlen;	/* Packets left in the flow */
+	__u32	list;		/* SCRR_TELEM_LIST_XXX */
+};
+
+/* Statistics of one flow, as a class, see scrr_walk() */
+struct tc_scrr_flow_xstats {
+	__u64	virtual_finish;	/* Virtual of next incoming packet */
+	__u32	flow_idx;	/* Hash value for this flow */
+	__u32	flow_key;	/* Second hash, with SCF_EXACT_FLOW */
+	__u32	qlen;		/* Packets queued */
+	__u32	backlog;	/* Bytes queued */
+	__u32	drops;		/* Packets dropped from this flow */
+	__u32	sojourn_us;	/* Time in queue of the head packet */
 };
 
 /*
  * Per flow structure, dynamically allocated.
+ * The flow is split in two halves. The hot half has what dequeue uses,
+ * and is half a cacheline. The cold half has what only the classifier,
+ * enqueue and the AQM need, see scrr_flow_cold().
  */
 struct scrr_flow {
-	struct sk_buff	*head;		/* list of skbs for this flow : first skb */
 	union {
-		struct sk_buff *tail;	/* last skb in the list */
-		unsigned long  age;	/* (jiffies | 1UL) when flow was emptied, for gc */
+		struct {
+			struct sk_buff	 *head;	/* list of skbs for this flow : first skb */
+			struct scrr_flow *next;	/* next flow in RR lists */
+		};
+		struct list_head gc_node; /* anchor in gc_list, when detached */
 	};
-	struct rb_node	hash_node;	/* anchor in hash_root[] trees */
 	u64		virtual_finish;	/* Virtual of next incoming packet */
-	u32		flow_idx;	/* Hash value for this flow */
 	int		qlen;		/* number of packets in flow queue */
+	u32		age;		/* (jiffies | 1) when flow was emptied, for gc */
+} __aligned(32);
 
-	struct scrr_flow *next;		/* next flow in RR lists */
-} ____cacheline_aligned_in_smp;
+struct scrr_flow_cold {
+	struct rb_node	hash_node;	/* anchor in hash_root[] trees */
+	struct sk_buff	*tail;		/* last skb in the list */
+	u32		flow_idx;	/* Hash value for this flow */
+	u32		flow_key;	/* Second hash, with SCF_EXACT_FLOW */
+	u32		sk_slot;	/* Socket cache entry, if still ours */
+	u32		backlog;	/* Bytes queued, if backlog_track */
+	struct list_head fat_node;	/* anchor in fat_buckets[], if backlog */
+	u32		drops;		/* Packets dropped, for the class stats */
+};
+
+/*
+ * Flow allocated from the kmem_cache, both halves together. The cache
+ * is cacheline aligned, so the hot half at the start of the object
+ * never straddles two lines, at the cost of padding the object.
+ */
+struct scrr_flow_obj {
+	struct scrr_flow	flow;
+	struct scrr_flow_cold	cold;
+};
+
+/*
+ * Entry of the socket cache, see scrr_classify().
+ */
+struct scrr_sk_cache {
+	const struct sock *sk;		/* Socket, only compared */
+	struct scrr_flow  *flow;	/* Flow of this socket */
+	u32		  flow_idx;	/* Hash of the socket, when cached */
+};
 
 /*
  * Container for list of flows. Round Robin will go through those lists.
@@ -139,7 +307,118 @@ struct scrr_flow_head {
 	struct scrr_flow *last;
 };
 
+/*
+ * Bucket of the open addressing flow table, exactly one cacheline.
+ * The tag is the full flow_idx, so a lookup never needs to touch the
+ * flows themselves. A bucket only overflows to the next ones when full.
+ */
+#define SCRR_OA_SLOTS		5	/* Slots per bucket */
+#define SCRR_OA_PROBE_MAX	4	/* Max buckets probed */
+
+struct scrr_oa_bucket {
+	u32		tags[SCRR_OA_SLOTS];	/* flow_idx of each slot */
+	u32		overflow;	/* Flows which probed past this bucket */
+	struct scrr_flow *flows[SCRR_OA_SLOTS];	/* NULL if slot is free */
+} ____cacheline_aligned;
+
+/*
+ * PI2 AQM of scrr_pi2, see sch_fq_pi2.c for the details.
+ * alpha and beta are scaled with the target delay, so that the reaction
+ * is always the same with respect to the target delay.
+ * Our reference is       target= 1ms, tupdate= 1ms, alpha=2.250, beta=48.0
+ */
+#define PROBA_NORMA	0x100000000LL	/* Normalise : probability 1 is 2^32 */
+#define PROBA_MAX	0xFFFFFFFFLL	/* Max probability : 2^32 - 1 */
+
+#define PI2_TUPDATE_REF	(1 * NSEC_PER_MSEC)	/* Reference tupdate */
+#define PI2_TARGET_REF	(1 * NSEC_PER_MSEC)	/* Reference target */
+#define PI2_TARGET_DEFLT (15 * NSEC_PER_MSEC)	/* 15 ms - from dualpi2 */
+#define PI2_ALPHA_DEFLT	(576)			/* 2.25 @ 1;1ms */
+#define PI2_BETA_DEFLT	(12288)			/* 48.0 @ 1;1ms */
+#define PI2_COUPL_DEFLT	(2 * ALPHA_BETA_SCALE)	/* Factor 2 - from PI2 paper */
+
+/* alpha, beta and coupling are encoded in fixed point, in 1/256th. */
+#define ALPHA_BETA_SCALE	(1 << 8)	/* Convert fraction-> integer */
+
+/* Internal alpha and beta are shifted to keep precision in fixed point
+ * computations, alpha needs 24 extra bits, see sch_fq_pi2.c. */
+#define NM16_SHIFT	16
+#define NM16_SCALE	(1 << NM16_SHIFT)
+#define NM24_SHIFT	24
+#define NM24_SCALE	(1 << NM24_SHIFT)
+
+/* PI2 Parameters configured from user space */
+struct pi2_config {
+	s64	target_ns;	/* Target queue delay (in ns) */
+	u32	tupdate_ns;	/* Update timer frequency (in ns) */
+	u32	alpha;		/* Integral coefficient, in 1/256th */
+	u32	beta;		/* Proportional coefficient, in 1/256th */
+	u32	coupling;	/* Coupling rate factor between
+				 * Classic TCP and Scalable TCP */
+};
+
+/* PI2 Internal state and helpful variables */
+struct pi2_param {
+	u32	alpha_nm40;	/* Scaled by target_ns, shifted 40 bits */
+	u32	beta_nm16;	/* Scaled by target_ns, shifted 16 bits */
+	u32	proba_max;	/* Maximum raw probability. */
+	u32	reduce_qlen;	/* Pending qlen to be reduced on parent */
+	u32	reduce_backlog;	/* Pending backlog to be reduced on parent */
+};
+
+/* Flow state for PI2 */
+struct pi2_flow {
+	s64	tupd_next_ns;	/* Next time to do a probability update */
+	u64	overload_ns;	/* When overload condition will start */
+	u64	head_ns;	/* When last head of queue was enqueue'd */
+	s64	qdelay_ns;	/* Last computed queuing delay */
+	u32	proba_2;	/* Probability for Classical TCP. */
+	u32	proba_cpl;	/* Probability for Scalable TCP. */
+	u32	proba;		/* Raw probability. */
+	u32	flags_live;	/* Bitmask of SCF_XXX flags */
+	u32	recur_classic;	/* Mark counter for classical TCP */
+	u32	recur_scalable;	/* Mark counter for scalable TCP */
+};
+
+/*
+ * Per flow structure of scrr_pi2.
+ * The PI2 state is part of the cold half, so that the other variants
+ * keep their flows in a single cacheline. The scheduler only sees the
+ * scrr_flow, the PI2 code gets back to the container.
+ */
+struct scrr_pi2_flow_cold {
+	struct scrr_flow_cold	cold;	/* Must be first, see scrr_flow_pi2() */
+	struct pi2_flow		pi2;	/* PI2 per flow data */
+};
+
+struct scrr_pi2_flow {
+	struct scrr_flow		flow;
+	struct scrr_pi2_flow_cold	cold;
+} ____cacheline_aligned_in_smp;
+
 static struct kmem_cache *scrr_flow_cachep __read_mostly;
+static struct kmem_cache *scrr_pi2_flow_cachep __read_mostly;
+
+/*
+ * Preallocated flows of one instance, see scrr_flow_alloc().
+ */
+struct scrr_flow_pool {
+	void		*base;		/* Array of hot halves, NULL if no pool */
+	void		*cold;		/* Array of cold halves */
+	void		*free;		/* Free list, linked by first word */
+	u32		size;		/* Number of flows in the arrays */
+	u32		obj_size;	/* Size of each flow, both halves */
+	u32		cold_size;	/* Size of each cold half */
+};
+
+/*
+ * Virtual clock shared by all the SCRR instances of a scrr_mq.
+ * Each instance has its own lock, so this is only loosely synchronised.
+ */
+struct scrr_mq_clock {
+	atomic64_t	virtual_advance;	/* Latest advance of all instances */
+	refcount_t	refcnt;			/* Root + each child instance */
+};
 
 /*
  * Private data for the Qdisc
@@ -150,13 +429,55 @@ struct scrr_sched_data {
 	u8		hash_trees_log;	/* log(number buckets) */
 	u32		flow_plimit;	/* max packets per flow */
 	u32		flags;		/* Bitmask of AIFF_XXX flags */
+	siphash_key_t	flow_key_seed;	/* For flow_key of SCF_EXACT_FLOW */
+	u32		weight_src;	/* SCRR_WEIGHT_XXX */
+	u32		weight_inv[SCRR_WEIGHT_CLASSES]; /* 2^16 / weight */
+	u8		weights[SCRR_WEIGHT_CLASSES];
 
 	/* Classifier */
+	u32		classifier;	/* SCRR_CLASSIFIER_XXX */
 	struct rb_root	*hash_root;	/* Hash of tree roots */
+	struct scrr_oa_bucket *oa_table; /* Open addressing table */
 	u32		hash_buckets;
+	u32		hash_load;	/* Grow hash above this, 0 = never */
+	struct rb_root	*hash_root_old;	/* Being migrated to hash_root */
+	u32		hash_buckets_old;
+	u32		rehash_idx;	/* Next old bucket to migrate */
+	struct rb_root	*hash_root_drained; /* Migrated, to be freed */
+	struct work_struct hash_work;	/* Grow/free hash outside datapath */
+	struct Qdisc	*sch;		/* Back pointer for hash_work */
+	unsigned long	gc_age;		/* Idle time before gc, in jiffies */
+	struct list_head gc_list;	/* Detached flows, oldest first */
+	u32		gso_split;	/* Split GSO above this size, 0 = never */
+	struct kmem_cache *flow_cachep;	/* scrr_flow or scrr_pi2_flow */
+	struct scrr_flow_pool pool;	/* Flows, if max_flows is set */
+	struct scrr_flow *flow_shared;	/* Collision flow, SCF_FLOW_SHARE */
+	struct scrr_sk_cache *sk_cache;	/* Socket to flow, if enabled */
+	u32		sk_cache_size;	/* Entries, power of two, or 0 */
+	u8		sk_cache_log;	/* log(sk_cache_size) */
+	u32		flow_blimit;	/* max bytes per flow, 0 = none */
+
+	/* Longest queue, SCF_FAT_DROP or flow_blimit */
+	u8		backlog_track;	/* Flows keep their backlog */
+	u32		fat_bitmap;	/* Non empty fat_buckets[] */
+	struct list_head fat_buckets[SCRR_FAT_BUCKETS]; /* By log2(backlog) */
+
+	/* EDT pacing, SCF_PACING */
+	u64		horizon_ns;	/* Drop packets paced further out */
+	u64		wheel_tick;	/* Next tick of the wheel to run */
+	struct qdisc_watchdog watchdog;	/* Wakes us for the next slot */
+	DECLARE_BITMAP(wheel_map, SCRR_WHEEL_SLOTS); /* Non empty slots */
+	struct scrr_flow *wheel[SCRR_WHEEL_SLOTS]; /* Throttled flows */
+
+	/* AQM, scrr_pi2 only */
+	struct pi2_config pi2_config;
+	struct pi2_param  pi2_param;
+	u32		udp_plimit;	/* Target queue length for UDP (packets) */
 
 	/* Stats and instrumentation */
 	struct tc_scrr_xstats  stats;
+	u64		sojourn_start_ns; /* SCF_SOJOURN_HIST enabled at */
+	u64		packets_sched;	/* Part of bstats.packets we sent */
 #ifdef SCRR_DEBUG_BURST_AVG
 	u32		flow_sched_prev;	/* Previously active flow */
 	u32		burst_cur;	/* Current burst size */
@@ -169,6 +490,26 @@ struct scrr_sched_data {
 	u64		virtual_dequeue;  /* Virtual of last dequeue */
 	u64		virtual_advance;  /* Virtual where flows advance */
 	u64		virtual_previous; /* Virtual of previous cycle */
+	struct scrr_mq_clock *mq_clock;	  /* Shared clock, scrr_mq only */
+
+	/* Telemetry, see scrr_telem_record() */
+	struct rchan	*telem_chan;	/* Relay channel, NULL if off */
+	struct dentry	*telem_dir;	/* Our directory in debugfs */
+	u32		telem_sample;	/* Record 1 packet in N */
+	u32		telem_left;	/* Packets before the next record */
+	u64		telem_start_ns;	/* Packets timestamped since */
+
+	/* Per flow classes, see scrr_walk() */
+	struct scrr_walk_snap *walk_snap; /* Flows of the current chunk */
+	u32		walk_snap_cnt;	/* Entries in walk_snap */
+	u32		walk_snap_pos;	/* Next entry to hand out */
+	u32		walk_table;	/* SCRR_WALK_XXX, table being walked */
+	u32		walk_idx;	/* Next bucket of that table */
+	u32		walk_sub;	/* Flows of that bucket already taken */
+	int		walk_count;	/* Classes dumped when we stopped */
+	/* Walker that stopped at walk_count, NULL if none */
+	int		(*walk_fn)(struct Qdisc *, unsigned long,
+				   struct qdisc_walker *);
 };
 
 /*
@@ -176,6 +517,8 @@ struct scrr_sched_data {
  */
 struct scrr_skb_cb {
 	u64	virtual_start;		/* Virtual start-time of packet */
+	u64	ts;			/* Timestamp at enqueue, scrr_pi2
+					 * or SCF_SOJOURN_HIST */
 };
 
 static inline struct scrr_skb_cb *scrr_skb_cb(struct sk_buff *skb)
@@ -184,930 +527,1583 @@ static inline struct scrr_skb_cb *scrr_skb_cb(struct sk_buff *skb)
 	return (struct scrr_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+/* ----------------------- FLOW LAYOUT ----------------------- */
+
 /*
- * flow->tail and flow->age share the same location.
- * We can use the low order bit to differentiate if this location points
- * to a sk_buff or contains a jiffies value, if we force this value to be odd.
- * This assumes flow->tail low order bit must be 0 since
- * alignof(struct sk_buff) >= 2
+ * Hot and cold halves of flows.
+ * Flows from the kmem_cache have their cold half right after the hot
+ * half, in the same object. Flows from the pool have their hot halves
+ * packed in one array, two per cacheline, and their cold halves in a
+ * separate array, at the same index. Scheduling many active flows only
+ * touches the hot array, which is half the cachelines.
  */
-static void scrr_flow_set_detached(struct scrr_flow *flow)
+static bool scrr_pool_owns(const struct scrr_flow_pool *pool,
+			   const void *flow)
 {
-	flow->age = jiffies | 1UL;
+	return ( (flow >= pool->base)
+		 && (flow < pool->base + ( (size_t) pool->size
+					   * sizeof(struct scrr_flow) )) );
 }
 
-static bool scrr_flow_is_detached(const struct scrr_flow *flow)
+static bool scrr_pool_owns_cold(const struct scrr_flow_pool *pool,
+				const void *cold)
 {
-	return !!(flow->age & 1UL);
+	return ( (cold >= pool->cold)
+		 && (cold < pool->cold + (size_t) pool->size * pool->cold_size) );
 }
 
-static inline struct scrr_flow *scrr_create_flow(struct scrr_sched_data *q,
-						 uint32_t flow_idx)
+static inline struct scrr_flow_cold *
+scrr_flow_cold(const struct scrr_sched_data *q, const struct scrr_flow *flow)
 {
-	struct scrr_flow *flow_new;
+	const struct scrr_flow_pool *pool = &q->pool;
+	size_t idx;
 
-	flow_new = kmem_cache_zalloc(scrr_flow_cachep, GFP_ATOMIC | __GFP_NOWARN);
-	if (unlikely(flow_new == NULL)) {
-		q->stats.alloc_errors++;
-		return NULL;
-	}
+	if (!scrr_pool_owns(pool, flow))
+		return (struct scrr_flow_cold *) (flow + 1);
+	idx = ((void *) flow - pool->base) / sizeof(struct scrr_flow);
+	return pool->cold + idx * pool->cold_size;
+}
 
-	scrr_flow_set_detached(flow_new);
-	flow_new->flow_idx = flow_idx;
+static inline struct scrr_flow *
+scrr_cold_flow(const struct scrr_sched_data *q,
+	       const struct scrr_flow_cold *cold)
+{
+	const struct scrr_flow_pool *pool = &q->pool;
+	size_t idx;
 
-	/* Initialise virtual time of the flow.
-	 * Make sure it is before the current scheduling round. */
-	flow_new->virtual_finish = q->virtual_previous;
+	if (!scrr_pool_owns_cold(pool, cold))
+		return (struct scrr_flow *) cold - 1;
+	idx = ((void *) cold - pool->cold) / pool->cold_size;
+	return pool->base + idx * sizeof(struct scrr_flow);
+}
 
-	q->stats.flows++;
-	q->stats.flows_inactive++;
+/* Flow of a node of the hash_root[] trees */
+static inline struct scrr_flow *scrr_hash_flow(const struct scrr_sched_data *q,
+					       const struct rb_node *node)
+{
+	return scrr_cold_flow(q, rb_entry(node, struct scrr_flow_cold,
+					  hash_node));
+}
 
-	return flow_new;
+static inline u32 scrr_flow_idx(const struct scrr_sched_data *q,
+				const struct scrr_flow *flow)
+{
+	return scrr_flow_cold(q, flow)->flow_idx;
 }
 
-static inline void scrr_flow_purge(struct scrr_flow *flow)
+static inline u32 scrr_flow_key(const struct scrr_sched_data *q,
+				const struct scrr_flow *flow)
 {
-	rtnl_kfree_skbs(flow->head, flow->tail);
-	flow->head = NULL;
-	flow->qlen = 0;
+	return scrr_flow_cold(q, flow)->flow_key;
 }
 
-/* limit number of collected flows per round */
-#define SCRR_GC_MAX 8
-#define SCRR_GC_AGE (3*HZ)
+/* Identity of a flow in the classifier, flow_idx then flow_key.
+ * Without SCF_EXACT_FLOW, flow_key is always 0. */
+static inline bool scrr_flow_id_eq(const struct scrr_flow_cold *cold,
+				   u32 flow_idx, u32 flow_key)
+{
+	return cold->flow_idx == flow_idx && cold->flow_key == flow_key;
+}
 
-static bool scrr_gc_candidate(const struct scrr_flow *f)
+static inline bool scrr_flow_id_gt(const struct scrr_flow_cold *cold,
+				   u32 flow_idx, u32 flow_key)
 {
-	return scrr_flow_is_detached(f) &&
-	       time_after(jiffies, f->age + SCRR_GC_AGE);
+	return ( cold->flow_idx > flow_idx
+		 || (cold->flow_idx == flow_idx && cold->flow_key > flow_key) );
 }
 
-static void scrr_gc(struct scrr_sched_data *q,
-		    struct rb_root *	root,
-		    uint32_t		flow_idx)
+static inline struct pi2_flow *scrr_flow_pi2(const struct scrr_sched_data *q,
+					     struct scrr_flow *flow)
 {
-	struct rb_node **p, *parent;
-	void *tofree[SCRR_GC_MAX];
-	struct scrr_flow *f;
-	int i, fcnt = 0;
+	return &container_of(scrr_flow_cold(q, flow),
+			     struct scrr_pi2_flow_cold, cold)->pi2;
+}
 
-	p = &root->rb_node;
-	parent = NULL;
-	while (*p) {
-		parent = *p;
+/* ----------------------- PI2 COMPUTATIONS ----------------------- */
 
-		f = rb_entry(parent, struct scrr_flow, hash_node);
-		if (f->flow_idx == flow_idx)
-			break;
+/* Same as sch_fq_pi2.c, except that PI2 state is in struct scrr_pi2_flow
+ * and the configuration flags are the SCF_XXX flags of the qdisc.
+ * The per flow instrumentation of fq_pi2 (mon_fl_port) is not there,
+ * the qdisc statistics are enough for now. */
 
-		if (scrr_gc_candidate(f)) {
-			tofree[fcnt++] = f;
-			if (fcnt == SCRR_GC_MAX)
-				break;
-		}
+static inline int IP_ECN_is_ect1(struct iphdr *iph)
+{
+	return (iph->tos & INET_ECN_MASK) == INET_ECN_ECT_1;
+}
 
-		if (f->flow_idx > flow_idx)
-			p = &parent->rb_right;
-		else
-			p = &parent->rb_left;
+static inline int IP6_ECN_is_ect1(struct ipv6hdr *iph)
+{
+	return (ipv6_get_dsfield(iph) & INET_ECN_MASK) == INET_ECN_ECT_1;
+}
+
+static inline int INET_ECN_is_ect1(struct sk_buff *skb)
+{
+	switch (skb_protocol(skb, true)) {
+	case cpu_to_be16(ETH_P_IP):
+		if (skb_network_header(skb) + sizeof(struct iphdr) <=
+		    skb_tail_pointer(skb))
+			return IP_ECN_is_ect1(ip_hdr(skb));
+		break;
+
+	case cpu_to_be16(ETH_P_IPV6):
+		if (skb_network_header(skb) + sizeof(struct ipv6hdr) <=
+		    skb_tail_pointer(skb))
+			return IP6_ECN_is_ect1(ipv6_hdr(skb));
+		break;
 	}
 
-	if (!fcnt)
-		return;
+	return 0;
+}
 
-	for (i = fcnt; i > 0; ) {
-		f = tofree[--i];
-		rb_erase(&f->hash_node, root);
-		/* No need to call scrr_flow_purge(), flow was idle */
+static inline int INET_is_UDP(struct sk_buff *skb)
+{
+	switch (skb_protocol(skb, true)) {
+	case cpu_to_be16(ETH_P_IP):
+		if (skb_network_header(skb) + sizeof(struct iphdr) <=
+		    skb_tail_pointer(skb)) {
+			return ip_hdr(skb)->protocol == IPPROTO_UDP;
+		}
+		break;
+
+	case cpu_to_be16(ETH_P_IPV6):
+		if (skb_network_header(skb) + sizeof(struct ipv6hdr) <=
+		    skb_tail_pointer(skb)) {
+			return ipv6_hdr(skb)->nexthdr == IPPROTO_UDP;
+		}
+		break;
 	}
-	q->stats.flows -= fcnt;
-	q->stats.flows_inactive -= fcnt;
-	q->stats.flows_gc += fcnt;
 
-	kmem_cache_free_bulk(scrr_flow_cachep, fcnt, tofree);
+	return 0;
 }
 
-static struct scrr_flow *scrr_classify(struct sk_buff *skb,
-				       struct scrr_sched_data *q)
+static inline bool udp_is_taildrop_config(struct scrr_sched_data *q,
+					  struct sk_buff *skb)
 {
-	struct rb_node **	p;
-	struct rb_node *	parent;
-	uint32_t		flow_idx;
-	struct rb_root *	root;
-	struct scrr_flow *	flow_cur;
-
-	/* Get hash value for the packet */
-	flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
+	return (q->flags & SCF_UDP_TAILDROP) && INET_is_UDP(skb);
+}
 
-	/* Get the root of the tree from the hash */
-	root = &q->hash_root[ flow_idx & (q->hash_buckets - 1) ];
+/* Tail drop UDP packets above udp_plimit.
+ * Most UDP applications don't support ECN, and are not going to react
+ * to ECN signals and just fill up the queue. */
+static inline bool udp_try_drop_pkt(struct scrr_sched_data *q,
+				    struct scrr_flow *flow)
+{
+	/* Never mark/drop if we have a standing queue of less than 2 skbs. */
+	if ( (flow->qlen > 2) && (flow->qlen > q->udp_plimit) ) {
+		q->stats.drop_mark++;
+		return true;
+	}
+	return false;
+}
 
-	/* I personally feel that the garbage collection policy is
-	 * not aggressive enough. Also, garbage collection only scan
-	 * a subset of the trees, so I think there might be flows never
-	 * garbage collected. Unfortunately, I don't have time and
-	 * inclination to play with it. Jean II */
-	if (q->stats.flows >= (q->hash_buckets * 2) &&
-	    q->stats.flows_inactive > q->stats.flows/2)
-		scrr_gc(q, root, flow_idx);
+static void pi2_flow_init(struct scrr_sched_data *q, struct pi2_flow *pi2)
+{
+	/* When the first proba computation will happen. */
+	pi2->tupd_next_ns = ktime_get_ns() + ((s64) q->pi2_config.tupdate_ns);
 
-	/* Find flow in that specific tree */
-	p = &root->rb_node;
-	parent = NULL;
-	while (*p) {
-		parent = *p;
+	/* Not overloaded at init, just copy the flags. */
+	pi2->flags_live = q->flags;
+}
 
-		flow_cur = rb_entry(parent, struct scrr_flow, hash_node);
-		if (flow_cur->flow_idx == flow_idx) {
-			/* Found ! */
-			return flow_cur;
+static void pi2_calculate_proba(struct scrr_sched_data *q,
+				struct pi2_flow *pi2,
+				s64 qdelay_ns,
+				s64 now,
+				s64 elapsed_ns)
+{
+	s64	delta;		/* Change +/- in probability */
+	s64	delta_alpha;	/* Change +/- in probability from alpha */
+	s64	delta_beta;	/* Change +/- in probability from beta */
+	s64	proba;		/* New probability */
+
+	/* PI controller, alpha is the integral weight and beta is the
+	 * proportional weight. Only the term alpha needs to be scaled
+	 * by the time elapsed. */
+	delta_alpha = ( ( ( (qdelay_ns - q->pi2_config.target_ns)
+			    * q->pi2_param.alpha_nm40 )
+			  / NM24_SCALE )
+			* elapsed_ns);
+	delta_beta = ( (qdelay_ns - pi2->qdelay_ns) * q->pi2_param.beta_nm16 );
+	delta = ( delta_alpha + delta_beta ) / NM16_SCALE;
+
+	proba = (s64) pi2->proba + delta;
+#ifdef SCRR_DEBUG_PI2_COMPUTE
+	printk_ratelimited(KERN_DEBUG "SCRR: qdelay %lld ; delta %lld (%lld + %lld); proba %lld\n", qdelay_ns, delta, delta_alpha / NM16_SCALE, delta_beta / NM16_SCALE, proba);
+#endif	/* SCRR_DEBUG_PI2_COMPUTE */
+
+	/* Limit the max marking probability to 100%, and switch to drop
+	 * only after a while at max proba (overload). */
+	if (proba >= q->pi2_param.proba_max) {
+		proba = q->pi2_param.proba_max;
+
+		if ( ! (q->flags & SCF_OVERLOAD_ECN) ) {
+			if (pi2->overload_ns == 0LL)
+				/* First time in overload, wait a bit */
+				pi2->overload_ns = now + (q->pi2_config.target_ns/4);
+			else if (now > pi2->overload_ns)
+				/* Overload, disable ECN & SCE markings */
+				pi2->flags_live &= SCF_MASK_OVERLOAD;
 		}
-		if (flow_cur->flow_idx > flow_idx)
-			p = &parent->rb_right;
-		else
-			p = &parent->rb_left;
-	}
+	} else {
+		if (proba < 0)
+			proba = 0;
 
-	/* Create a new flow */
-	flow_cur = scrr_create_flow(q, flow_idx);
-	if (unlikely(flow_cur == NULL)) {
-		return NULL;
+		/* No overload condition, re-enable ECN & SCE markings */
+		pi2->flags_live = q->flags;
+		pi2->overload_ns = 0LL;
 	}
 
-	/* Insert new flow into classifer */
-	rb_link_node(&flow_cur->hash_node, parent, p);
-	rb_insert_color(&flow_cur->hash_node, root);
+	pi2->proba = (u32) proba;
 
-#ifdef SCRR_DEBUG_FLOW_NEW
-	{
-		struct iphdr *ih;
-		__be16 src_port;
-		__be16 dest_port; 
+	/* Scalable TCP : raw probability multiplied by coupling. */
+	pi2->proba_cpl = (u32) (proba * q->pi2_config.coupling
+				/ ALPHA_BETA_SCALE);
 
-		if (skb->protocol == htons(ETH_P_IP)) {
-			ih = ip_hdr(skb);
-			switch (ih->protocol) {
-			case IPPROTO_TCP: {
-				struct tcphdr *th = tcp_hdr(skb);
-				src_port = th->source;
-				dest_port = th->dest;
-				break;
-			}
-			case IPPROTO_UDP: {
-				struct udphdr *uh = udp_hdr(skb);
-				src_port = uh->source;
-				dest_port = uh->dest;
-				break;
-			}
-			default:
-				src_port = 0;
-				dest_port = 0;
-			}
-			printk(KERN_DEBUG "SCRR: flow new: idx:%d, src_addr:%d, dst_addr:%d, src_port:%d, dst_port:%d\n", flow_idx, ntohl(ih->saddr), ntohl(ih->daddr), ntohs(src_port), ntohs(dest_port));
-		} else {
-			printk(KERN_DEBUG "SCRR: flow new: idx:%d\n", flow_idx);
-		}
-	}
-#endif	/* SCRR_DEBUG_FLOW_NEW */
+	/* Classical TCP : square of the raw probability. */
+	pi2->proba_2 = (u32) (proba * proba / PROBA_NORMA);
 
-	return flow_cur;
+	pi2->qdelay_ns = qdelay_ns;
 }
 
-/* Add a flow at the end of the list used by Round Robin. */
-static void scrr_robin_add_tail(struct scrr_flow_head *head,
-				struct scrr_flow *flow)
+static void pi2_tupdate(struct scrr_sched_data *q,
+			struct pi2_flow *pi2,
+			s64 now)
 {
-	if (head->first)
-		head->last->next = flow;
-	else
-		head->first = flow;
-	head->last = flow;
-	flow->next = NULL;
-}
+	s64	tupd_elapsed;
 
-static inline struct sk_buff *scrr_peek_skb(struct scrr_flow *flow)
-{
-	struct sk_buff *head = flow->head;
+	/* Figure out how many tupdate periods have elapsed. */
+	tupd_elapsed = now - pi2->tupd_next_ns + q->pi2_config.tupdate_ns;
+	pi2->tupd_next_ns = now + ((s64) q->pi2_config.tupdate_ns);
 
-	return head;
+	/* head_ns is the enqueue time of the packet being dequeued. */
+	pi2_calculate_proba(q, pi2, now - pi2->head_ns, now, tupd_elapsed);
 }
 
-/* Add one skb to the flow queue. */
-static inline void scrr_enqueue_skb(struct Qdisc *	sch,
-				    struct scrr_flow *	flow,
-				    struct sk_buff *	skb)
+/* Returns true if the packet must be dropped. */
+static bool pi2_try_drop_mark_pkt(struct scrr_sched_data *q,
+				  struct scrr_flow *flow,
+				  struct pi2_flow *pi2,
+				  struct sk_buff *skb)
 {
-	if (flow->head == NULL)
-		flow->head = skb;
-	else
-		flow->tail->next = skb;
-	flow->tail = skb;
-	skb->next = NULL;
+	u32 rnd_classic;
+	u32 rnd_scalable;
+	int is_ect1;
+
+	/* Never mark/drop if we have a standing queue of less than 1 skbs. */
+	if (flow->qlen <= 1)
+		return false;
+
+	if (pi2->flags_live & SCF_RANDOM_MARK) {
+		/* Use the fast, non-crypto random generator, only once. */
+		rnd_classic = get_random_u32();
+		rnd_scalable = rnd_classic;
+	} else {
+		/* Derandomised marking. The counters roll over, which
+		 * keeps the reminder of the probability. */
+		pi2->recur_classic += pi2->proba_2;
+		pi2->recur_scalable += pi2->proba_cpl;
 
-	flow->qlen++;
-	qdisc_qstats_backlog_inc(sch, skb);
-	sch->q.qlen++;
+		rnd_classic = pi2->recur_classic;
+		rnd_scalable = pi2->recur_scalable;
+	}
+
+	is_ect1 = INET_ECN_is_ect1(skb);
+	if ( is_ect1 && (pi2->flags_live & SCF_MARK_SCE) ) {
+		/* Scalable TCP : never dropped */
+		if ( (rnd_scalable < pi2->proba_cpl)
+		     && (INET_ECN_set_ce(skb)) )
+			q->stats.sce_mark++;
+	} else if (rnd_classic < pi2->proba_2) {
+		/* Classic TCP : ECN if we can, otherwise drop. */
+		if ( (pi2->flags_live & SCF_MARK_ECN)
+		     && (!is_ect1)
+		     && (INET_ECN_set_ce(skb)) ) {
+			q->stats.ecn_mark++;
+		} else {
+			q->stats.drop_mark++;
+			return true;
+		}
+	}
+	return false;
 }
 
-/* Remove one skb from flow queue. */
-static inline struct sk_buff *scrr_dequeue_skb(struct Qdisc *	sch,
-					       struct scrr_flow *	flow)
+/* AQM processing at dequeue, returns true if the packet must be dropped.
+ * The sojourn time is exact, it's the time in the sub-queue of this
+ * packet. */
+static inline bool scrr_pi2_dequeue_drop(struct scrr_sched_data *q,
+					 struct scrr_flow *flow,
+					 struct sk_buff *skb,
+					 s64 now)
 {
-	struct sk_buff *	skb;
+	struct pi2_flow *pi2 = scrr_flow_pi2(q, flow);
 
-	skb = flow->head;
-	if (skb == NULL)
-		return NULL;
+	pi2->head_ns = scrr_skb_cb(skb)->ts;
 
-	flow->head = skb->next;
-	skb_mark_not_on_list(skb);
+	/* Done at enqueue, this would mess up the proba. */
+	if (udp_is_taildrop_config(q, skb))
+		return false;
 
-	flow->qlen--;
-	qdisc_qstats_backlog_dec(sch, skb);
-	sch->q.qlen--;
+	/* If more than an update period has elapsed,
+	 * we need to recompute the probability. */
+	if (now > pi2->tupd_next_ns)
+		pi2_tupdate(q, pi2, now);
 
-	return skb;
+	return pi2_try_drop_mark_pkt(q, flow, pi2, skb);
 }
 
-/* QDisc add a new packet to our queue - tail of queue.
- * Basic version of SCRR, no enhancements. */
-static int scrr_qdisc_enqueue(struct sk_buff *	skb,
-			      struct Qdisc *	sch,
-			      struct sk_buff **	to_free)
+/* Packets dropped at dequeue need to be removed from our parents.
+ * We can't call qdisc_tree_reduce_backlog() if our qlen is 0, or HTB
+ * crashes, so defer it until we have packets. */
+static inline void scrr_pi2_reduce_backlog(struct Qdisc *sch)
 {
 	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow *	flow_cur;
-	u64			virtual_pkt;
 
-	/* Tail-drop when queue is full - pfifo style limit */
-	if (unlikely(sch->q.qlen >= sch->limit)) {
-		qdisc_qstats_overlimit(sch);
-		return qdisc_drop(skb, sch, to_free);
+	if ( (q->pi2_param.reduce_qlen > 0) && qdisc_qlen(sch) ) {
+#ifdef SCRR_DEBUG_PI2_REDUCE
+		printk_ratelimited(KERN_DEBUG "SCRR: reduce qlen %u backlog %u\n", q->pi2_param.reduce_qlen, q->pi2_param.reduce_backlog);
+#endif	/* SCRR_DEBUG_PI2_REDUCE */
+		qdisc_tree_reduce_backlog(sch,
+					  q->pi2_param.reduce_qlen,
+					  q->pi2_param.reduce_backlog);
+		q->pi2_param.reduce_qlen = 0;
+		q->pi2_param.reduce_backlog = 0;
 	}
+}
 
-	/* Find or create flow for this packet. */
-	flow_cur = scrr_classify(skb, q);
-	if (unlikely(flow_cur == NULL)) {
-		/* Alt : enqueue packet on random flow, Jean II */
-		return qdisc_drop(skb, sch, to_free);
-	}
+/* Precompute alpha, beta and max proba, see sch_fq_pi2.c. */
+static void pi2_aqm_param_update(struct scrr_sched_data *q)
+{
+	u64	alpha_nm40;
+	u64	beta_nm16;
+	u64	proba_max;
 
-	/* Check sub-queue size. */
-	if (unlikely(flow_cur->qlen >= q->flow_plimit)) {
-		q->stats.drop_mark++;
-		return qdisc_drop(skb, sch, to_free);
-	}
-	/* bstats->packets keep track of the number of actual Ethernet
-	 * packets. Unfortunately, all other stats are in number of
-	 * sbks. The packet count and skb count are different due
-	 * to GSO. This counter allow to count skbs and therefore
-	 * have something consistent with the other stats. Jean II */
-	q->stats.no_mark++;
+	if (q->pi2_config.target_ns <= 0 || !q->pi2_config.coupling)
+		return;
 
-	/* Check if flow was inactive, i.e. not scheduled. */
-	if (scrr_flow_is_detached(flow_cur)) {
+	/* Scalable proba must max out at 1.0, so divide by coupling. */
+	proba_max = ( ( PROBA_NORMA * ALPHA_BETA_SCALE
+			/ (u64) q->pi2_config.coupling )
+		      - 1 );
+	if ( (q->pi2_config.coupling <= ALPHA_BETA_SCALE)
+	     || (proba_max >= PROBA_MAX) )
+		q->pi2_param.proba_max = (u32) PROBA_MAX;
+	else
+		q->pi2_param.proba_max = (u32) proba_max;
+
+	/* Rescale alpha and beta from the reference target & tupdate. */
+	alpha_nm40 = ( (u64) q->pi2_config.alpha
+		       * ( PI2_TARGET_REF * PI2_TARGET_REF
+			   / PI2_TUPDATE_REF
+			   * ( (PROBA_NORMA * NM16_SCALE) / ALPHA_BETA_SCALE
+			       / NSEC_PER_SEC ) )
+		       / (u64) q->pi2_config.target_ns
+		       * (u64) NM24_SCALE
+		       / (u64) q->pi2_config.target_ns );
+	beta_nm16 = ( (u64) q->pi2_config.beta
+		      * ( PI2_TARGET_REF
+			  * ( (PROBA_NORMA * NM16_SCALE) / ALPHA_BETA_SCALE
+			      / NSEC_PER_SEC ) )
+		      / (u64) q->pi2_config.target_ns );
+	q->pi2_param.alpha_nm40 = (u32) alpha_nm40;
+	q->pi2_param.beta_nm16 = (u32) beta_nm16;
+
+#ifdef SCRR_DEBUG_PI2_CONFIG
+	printk(KERN_DEBUG "SCRR: alpha_nm40 %u ; beta_nm16 %u ; proba_max %u\n", q->pi2_param.alpha_nm40, q->pi2_param.beta_nm16, q->pi2_param.proba_max);
+#endif	/* SCRR_DEBUG_PI2_CONFIG */
+}
 
-		q->stats.flows_inactive--;
+/* ----------------------- FLOW MANAGEMENT ----------------------- */
 
-		/* Put inactive flow into list of new flows for
-		 * immediate scheduling. Jean II */
-		scrr_robin_add_tail(&q->new_flows, flow_cur);
+/*
+ * Flow memory.
+ * By default, flows come from the global kmem_cache, with GFP_ATOMIC on
+ * the datapath, which may fail under memory pressure. With max_flows,
+ * each instance preallocates all its flows on the NUMA node of its
+ * device queue, and recycles them through a free list. Flows are only
+ * allocated and freed under the qdisc lock, so the free list needs no
+ * locking of its own, and both are O(1). The pool can be created at
+ * runtime, so flows from the kmem_cache are recognised by address.
+ */
+static struct scrr_flow *scrr_flow_alloc(struct scrr_sched_data *q)
+{
+	struct scrr_flow_pool *pool = &q->pool;
+	void *flow;
 
-		/* One more flow in the current round robin cycle */
-		q->rounds_advance++;
-	}
+	if (pool->base == NULL)
+		return kmem_cache_zalloc(q->flow_cachep,
+					 GFP_ATOMIC | __GFP_NOWARN);
 
-	/* STFQ : Get virtual time of the flow == start-time on this packet.
-	 * Get the later of the finish-time of previous packet (flow was
-	 * busy) and the current virtual time (flow was idle). Jean II */
-	if ( time_after64(q->virtual_advance, flow_cur->virtual_finish) )
-		virtual_pkt = q->virtual_advance;
-	else
-		virtual_pkt = flow_cur->virtual_finish;
-
-	/* Save virtual time in packet to be used in dequeue */
-	scrr_skb_cb(skb)->virtual_start = virtual_pkt;
-
-	/* Update flow virtual time.
-	 * STFQ : All flows have the same weight. Jean II */
-	flow_cur->virtual_finish = virtual_pkt + qdisc_pkt_len(skb);
-
-	/* Note: this overwrites flow_cur->age */
-	scrr_enqueue_skb(sch, flow_cur, skb);
+	flow = pool->free;
+	if (unlikely(flow == NULL))
+		return NULL;
+	pool->free = *(void **) flow;
+	q->stats.pool_free--;
 
-#ifdef SCRR_DEBUG_STFQ_ENQUEUE
-	printk(KERN_DEBUG "SCRR: enqueue: idx:%d; vadv:%lld; vpkt:%lld; vfin:%lld\n", flow_cur->flow_idx, q->virtual_advance, virtual_pkt, flow_cur->virtual_finish);
-#endif	/* SCRR_DEBUG_STFQ_ENQUEUE */
+	memset(flow, 0, sizeof(struct scrr_flow));
+	memset(scrr_flow_cold(q, flow), 0, pool->cold_size);
+	return flow;
+}
 
-#ifdef SCRR_DEBUG_STATS_PEAK
-	/* Keep track of peak statistics */
-	if (sch->q.qlen >= q->stats.qlen_peak)
-		q->stats.qlen_peak = sch->q.qlen;
+/* The socket cache must never point to a freed flow. A flow is in at
+ * most one entry, the one in sk_slot, if that entry still has it. */
+static void scrr_sk_cache_forget(struct scrr_sched_data *q,
+				 struct scrr_flow *flow)
+{
+	struct scrr_sk_cache *entry;
+	u32 slot;
 
-	if ( (sch->qstats.backlog > q->stats.backlog_peak)
-	     && (sch->qstats.backlog < 2147483648) )
-		q->stats.backlog_peak = sch->qstats.backlog;
-#endif	/* SCRR_DEBUG_STATS_PEAK */
+	if (q->sk_cache == NULL)
+		return;
+	slot = scrr_flow_cold(q, flow)->sk_slot;
+	if (slot >= q->sk_cache_size)
+		return;
+	entry = &q->sk_cache[slot];
+	if (entry->flow == flow) {
+		entry->sk = NULL;
+		entry->flow = NULL;
+	}
+}
 
-	return NET_XMIT_SUCCESS;
+static void scrr_flow_free(struct scrr_sched_data *q, struct scrr_flow *flow)
+{
+	struct scrr_flow_pool *pool = &q->pool;
+
+	scrr_sk_cache_forget(q, flow);
+	if (scrr_pool_owns(pool, flow)) {
+		*(void **) flow = pool->free;
+		pool->free = flow;
+		q->stats.pool_free++;
+	} else
+		kmem_cache_free(q->flow_cachep, flow);
 }
 
-/* Update virtual clock at the end of a scheduling round.
- * Helper to remove code duplication. Jean II */
-static inline void scrr_try_virtual_advance(struct scrr_sched_data *q)
+static void scrr_flow_free_bulk(struct scrr_sched_data *q,
+				size_t nr, void **flows)
 {
-	/* Check if it is time to update the virtual advance.
-	 * We update it only once for every complete schedule through
-	 * the active flows to minimise advance and guarantee the
-	 * smallest burst size. Jean II */
-	if (q->rounds_advance <= 0) {
-		/* Scheduling round is done, start a new round.
-		 * Make sure to not override previous if there is no advance
-		 * to not disable initial advance. Jean II */
-		if (q->virtual_dequeue != q->virtual_advance) {
-			q->virtual_previous = q->virtual_advance;
-			q->virtual_advance = q->virtual_dequeue;
-		}
+	size_t i;
 
-		/* The number of active flows may change.
-		 * The current number of active flows is exactly how
-		 * many there are in the round robin list. The next
-		 * cycle may take longer if new flows become active,
-		 * but it can't be shorter. Jean II */
-		q->rounds_advance = q->stats.flows - q->stats.flows_inactive;
+	if (q->pool.base == NULL) {
+		if (q->sk_cache != NULL)
+			for (i = 0; i < nr; i++)
+				scrr_sk_cache_forget(q, flows[i]);
+		kmem_cache_free_bulk(q->flow_cachep, nr, flows);
+		return;
 	}
-
-	/* We are only called upon schedule, so update remaining number of
-	 * schedules in this round.
-	 * This is initialised at zero, which is why we test before
-	 * decrement. Jean II */
-	q->rounds_advance--;
+	for (i = 0; i < nr; i++)
+		scrr_flow_free(q, flows[i]);
 }
 
-/* QDisc remove a packet from our queue - head of queue.
- * Basic version of SCRR, no enhancements. */
-static struct sk_buff *scrr_qdisc_dequeue(struct Qdisc *sch)
+/* Create the pool, outside the datapath. The pool can't be resized or
+ * removed, flows in use point into it. */
+static int scrr_pool_create(struct Qdisc *sch, u32 max_flows)
 {
 	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow_head *	head;
-	struct scrr_flow *	flow_cur;
-	struct sk_buff *	skb;
-	u64			virtual_pkt;
-	u64			virtual_next;
-
-	/* If all sub-queues are empty, nothing to schedule. */
-	if (unlikely(sch->q.qlen == 0))
-		return NULL;
+	struct scrr_flow_pool *pool = &q->pool;
+	size_t cold_size;
+	void *free = NULL;
+	void *base;
+	u32 i;
 
-retry_flow:
-	/* If there are flows in the new list (rare), use that list. */
-	head = &q->new_flows;
-	if (likely(head->first == NULL)) {
-		/* Default case : use list of currently active flows. */
-		head = &q->old_flows;
-		if (unlikely(head->first == NULL)) {
-			printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
-			return NULL;
-		}
-	}
-	/* Pick first flow of the list. The list is rotated as needed. */
-	flow_cur = head->first;
+	if (max_flows == pool->size)
+		return 0;
+	if (pool->base != NULL || max_flows > SCRR_MAX_FLOWS_MAX)
+		return -EINVAL;
 
-	/* Always dequeue a packet. Or try. Jean II */
-	skb = scrr_dequeue_skb(sch, flow_cur);
+	if (q->flow_cachep == scrr_pi2_flow_cachep)
+		cold_size = sizeof(struct scrr_pi2_flow_cold);
+	else
+		cold_size = sizeof(struct scrr_flow_cold);
 
-	if (skb == NULL) {
-		/* If the sub-queue was empty, that flow becomes inactive.
-		 * It may be reactived in scrr_qdisc_enqueue(). Jean II */
+	/* Hot halves first, then cold halves */
+	base = kvzalloc_node((sizeof(struct scrr_flow) + cold_size) * max_flows,
+			     GFP_KERNEL | __GFP_RETRY_MAYFAIL,
+			     netdev_queue_numa_node_read(sch->dev_queue));
+	if (!base)
+		return -ENOMEM;
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	/* Hand out flows in address order */
+	for (i = max_flows; i > 0; i--) {
+		void *flow = base + (size_t) (i - 1) * sizeof(struct scrr_flow);
 
-		/* Flow goes inactive */
-		scrr_flow_set_detached(flow_cur);
-		q->stats.flows_inactive++;
+		*(void **) flow = free;
+		free = flow;
+	}
 
-#ifdef SCRR_DEBUG_BURST_AVG
-		q->stats.sched_empty++;
-#endif	/* SCRR_DEBUG_BURST_AVG */
+	sch_tree_lock(sch);
+	pool->base = base;
+	pool->cold = base + (size_t) max_flows * sizeof(struct scrr_flow);
+	pool->free = free;
+	pool->size = max_flows;
+	pool->obj_size = sizeof(struct scrr_flow) + cold_size;
+	pool->cold_size = cold_size;
+	q->stats.pool_free = max_flows;
+	sch_tree_unlock(sch);
 
-		/* Advance the global clock as needed, but after
-		 * updating the number of flows. Jean II */
-		scrr_try_virtual_advance(q);
+	return 0;
+}
 
-		/* Pick another flow.
-		 * This won't infinite loop because sch->q.qlen != 0
-		 * and the list of flows will become empty. */
-		goto retry_flow;
-	}
+/*
+ * flow->age is the low 32 bits of jiffies when the flow was emptied,
+ * forced to be odd, and zero when the flow is scheduled. That's enough
+ * for gc, as long as gc_age is under 24 days...
+ *
+ * Detached flows are also put at the end of gc_list, so this list is
+ * sorted by age and gc only needs to look at its head. head and next
+ * are not used when detached, gc_node reuses their location, to keep
+ * the hot half of the flow small.
+ */
+static void scrr_flow_set_detached(struct scrr_sched_data *q,
+				   struct scrr_flow *flow)
+{
+	flow->age = (u32) jiffies | 1U;
+	list_add_tail(&flow->gc_node, &q->gc_list);
+}
 
-	/* Qdisc stats accounting */
-	qdisc_bstats_update(sch, skb);
+static bool scrr_flow_is_detached(const struct scrr_flow *flow)
+{
+	return !!(flow->age & 1U);
+}
 
-#ifdef SCRR_DEBUG_BURST_AVG
-	/* Check if packet is part of the same burst.
-	 * If there is only one active flow, burstiness does not make sense */
-	if ( (flow_cur->flow_idx == q->flow_sched_prev)
-	     && (q->stats.flows - q->stats.flows_inactive > 1) ) {
-		/* Part of same burst, just add */
-		q->burst_cur += qdisc_pkt_len(skb);
-	} else {
-		/* Add previous burst to average */
-		if (q->burst_cur > q->stats.burst_peak)
-			q->stats.burst_peak = q->burst_cur;
-		if (q->stats.burst_avg == 0)
-			q->stats.burst_avg = q->burst_cur;
-		else
-			q->stats.burst_avg = ( ( q->stats.burst_avg * 7
-						 + q->burst_cur ) / 8 );
-		/* Start new burst */
-		q->burst_cur = qdisc_pkt_len(skb);
-		q->flow_sched_prev = flow_cur->flow_idx;
-	}
-#endif	/* SCRR_DEBUG_BURST_AVG */
+/* Flow is scheduled again, take it out of gc_list. */
+static void scrr_flow_set_attached(struct scrr_flow *flow)
+{
+	__list_del_entry(&flow->gc_node);
+	flow->head = NULL;
+	flow->next = NULL;
+	flow->age = 0;
+}
 
-	/* Get virtual tag of this packet. */
-	virtual_pkt = scrr_skb_cb(skb)->virtual_start;
-	/* Compute virtual tag of next packet in the sub-queue (if any).
-	 * The finish time of the current packet is after virtual_dequeue. */
-	virtual_next = virtual_pkt + qdisc_pkt_len(skb);
+/* Free a detached flow removed from the classifier. */
+static void scrr_flow_free_detached(struct scrr_sched_data *q,
+				    struct scrr_flow *flow)
+{
+	trace_scrr_flow_gc(q->sch, scrr_flow_idx(q, flow),
+			   flow->virtual_finish);
+	__list_del_entry(&flow->gc_node);
+	scrr_flow_free(q, flow);
+	q->stats.flows--;
+	q->stats.flows_inactive--;
+	q->stats.flows_gc++;
+}
 
-#ifdef SCRR_DEBUG_STFQ_DEQUEUE
-	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, sch->q.qlen);
-#endif	/* SCRR_DEBUG_STFQ_DEQUEUE */
+static inline struct scrr_flow *scrr_create_flow(struct scrr_sched_data *q,
+						 uint32_t flow_idx,
+						 uint32_t flow_key)
+{
+	struct scrr_flow *flow_new;
 
-	/* Update virtual time - Check if queue is busy */
-	if (sch->q.qlen == 0) {
-		q->virtual_dequeue = virtual_pkt + qdisc_pkt_len(skb);
-		q->virtual_previous = q->virtual_advance;
-		q->virtual_advance = q->virtual_dequeue;
-	} else {
-		/* In SCRR, packets are dequeued out of order,
-		 * so the virtual time of STFQ can not be tracked
-		 * easily. We would need to find the smallest
-		 * rank amongst all packets in the queue.
-		 * Approximate by taking the time of this packet.
-		 * But, prevent time going backwards. Jean II */
-		if ( time_after64(virtual_pkt, q->virtual_dequeue) )
-			q->virtual_dequeue = virtual_pkt;
+	flow_new = scrr_flow_alloc(q);
+	if (unlikely(flow_new == NULL)) {
+		q->stats.alloc_errors++;
+		return NULL;
 	}
 
-	/* SCRR: Self Clocked Round Robin Scheduling. Jean II */
-	/* If the sub-queue does not have a next packet,
-	 * or if the next packet of the sub-queue is after the
-	 * current virtual-time, we need to schedule another
-	 * sub-queue. Jean II */
-	if ( (scrr_peek_skb(flow_cur) == NULL)
-	     || ( time_after64(virtual_next, q->virtual_advance) ) ) {
+	scrr_flow_set_detached(q, flow_new);
+	scrr_flow_cold(q, flow_new)->flow_idx = flow_idx;
+	scrr_flow_cold(q, flow_new)->flow_key = flow_key;
 
-		/* Advance the global clock as needed */
-		scrr_try_virtual_advance(q);
+	/* Initialise virtual time of the flow.
+	 * Make sure it is before the current scheduling round. */
+	flow_new->virtual_finish = q->virtual_previous;
+	trace_scrr_flow_create(q->sch, flow_idx, flow_new->virtual_finish);
 
-		/* We could make the flows without packets inactive here.
-		 * The problem is that it would increase the chance of
-		 * starvation for the old flows, though that flow coming
-		 * back to the new list. This would happen if a flow drips
-		 * packets without accumulating them in the sub-queue.
-		 * We could always place inactive flows at the back of the
-		 * old list, however light flows would loose their place
-		 * in the schedule, impacting fairness. Jean II */
+	/* scrr_pi2 : the rest of the PI2 state starts at zero */
+	if (q->flow_cachep == scrr_pi2_flow_cachep)
+		pi2_flow_init(q, scrr_flow_pi2(q, flow_new));
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	q->stats.flows++;
+	q->stats.flows_inactive++;
 
-		/* Add current flow at end of list of active flows */
-		scrr_robin_add_tail(&q->old_flows, flow_cur);
-	}
-	/* Else : if the next packet is older than the current virtual-time,
-	 * remain on the same sub-queue, so it will be scheduled.
-	 * next time. Jean II */
+	return flow_new;
+}
 
-	return skb;
+static inline void scrr_flow_purge(struct scrr_sched_data *q,
+				   struct scrr_flow *flow)
+{
+	/* head is part of gc_node */
+	if (scrr_flow_is_detached(flow))
+		return;
+	rtnl_kfree_skbs(flow->head, scrr_flow_cold(q, flow)->tail);
+	flow->head = NULL;
+	flow->qlen = 0;
+	/* Reset or destroy, fat_buckets[] are reset as well */
+	scrr_flow_cold(q, flow)->backlog = 0;
 }
 
-/* QDisc add a new packet to our queue - tail of queue.
- * Version No Packet Metadata, previously called Self Contained */
-static int scrr_qdisc_npm_enqueue(struct sk_buff *	skb,
-				  struct Qdisc *	sch,
-				  struct sk_buff **	to_free)
+/* The collision flow takes packets of all flows we could not create.
+ * It is counted as a flow, but it is not in the classifier, so gc
+ * just takes it off gc_list and never frees it. */
+static void scrr_flow_shared_init(struct scrr_sched_data *q,
+				  struct scrr_flow *flow)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow *	flow_cur;
+	memset(flow, 0, kmem_cache_size(q->flow_cachep));
+	flow->age = (u32) jiffies | 1U;
+	INIT_LIST_HEAD(&flow->gc_node);
+	flow->virtual_finish = q->virtual_previous;
+	if (q->flow_cachep == scrr_pi2_flow_cachep)
+		pi2_flow_init(q, scrr_flow_pi2(q, flow));
 
-	/* Tail-drop when queue is full - pfifo style limit */
-	if (unlikely(sch->q.qlen >= sch->limit)) {
-		qdisc_qstats_overlimit(sch);
-		return qdisc_drop(skb, sch, to_free);
-	}
+	q->stats.flows++;
+	q->stats.flows_inactive++;
+}
 
-	/* Find or create flow for this packet. */
-	flow_cur = scrr_classify(skb, q);
-	if (unlikely(flow_cur == NULL)) {
-		/* Alt : enqueue packet on random flow, Jean II */
-		return qdisc_drop(skb, sch, to_free);
-	}
+/* Limit number of collected flows per packet */
+#define SCRR_GC_MAX 8
+#define SCRR_GC_AGE_DEFLT (3*HZ)
 
-	/* Check sub-queue size. */
-	if (unlikely(flow_cur->qlen >= q->flow_plimit)) {
-		q->stats.drop_mark++;
-		return qdisc_drop(skb, sch, to_free);
-	}
-	/* bstats->packets keep track of the number of actual Ethernet
-	 * packets. Unfortunately, all other stats are in number of
-	 * sbks. The packet count and skb count are different due
-	 * to GSO. This counter allow to count skbs and therefore
-	 * have something consistent with the other stats. Jean II */
-	q->stats.no_mark++;
+static bool scrr_gc_candidate(const struct scrr_sched_data *q,
+			      const struct scrr_flow *f)
+{
+	return scrr_flow_is_detached(f) &&
+	       time_after32((u32) jiffies, f->age + (u32) q->gc_age);
+}
 
-	/* Check if flow was inactive, i.e. not scheduled. */
-	if (scrr_flow_is_detached(flow_cur)) {
+/* Incremental rehash.
+ * Rehashing all flows in one go stalls the datapath for milliseconds
+ * when there are many flows. Instead, we keep the old array of trees
+ * next to the new one, and migrate a few trees on each enqueue and
+ * dequeue. New flows always go in the new array, and lookups check the
+ * old array only for trees not yet migrated, so a flow is never in both.
+ */
+#define SCRR_REHASH_STEP	4	/* Trees migrated per packet */
 
-		q->stats.flows_inactive--;
+static void scrr_rehash_bucket(struct scrr_sched_data *q,
+			       struct rb_root *oroot,
+			       struct rb_root *new_array, u32 new_log)
+{
+	struct rb_node *op, **np, *parent;
+	struct rb_root *nroot;
+	struct scrr_flow_cold *oc, *nc;
+	struct scrr_flow *of;
+
+	while ((op = rb_first(oroot)) != NULL) {
+		rb_erase(op, oroot);
+		oc = rb_entry(op, struct scrr_flow_cold, hash_node);
+		of = scrr_cold_flow(q, oc);
+		if (scrr_gc_candidate(q, of)) {
+			scrr_flow_free_detached(q, of);
+			continue;
+		}
+		/* Must match scrr_classify() */
+		nroot = &new_array[oc->flow_idx & ((1U << new_log) - 1)];
 
-		/* Put inactive flow into list of new flows for
-		 * immediate scheduling. Jean II */
-		scrr_robin_add_tail(&q->new_flows, flow_cur);
+		np = &nroot->rb_node;
+		parent = NULL;
+		while (*np) {
+			parent = *np;
 
-		/* One more flow in the current round robin cycle */
-		q->rounds_advance++;
+			nc = rb_entry(parent, struct scrr_flow_cold, hash_node);
+			BUG_ON(scrr_flow_id_eq(nc, oc->flow_idx, oc->flow_key));
+
+			if (scrr_flow_id_gt(nc, oc->flow_idx, oc->flow_key))
+				np = &parent->rb_right;
+			else
+				np = &parent->rb_left;
+		}
+
+		rb_link_node(&oc->hash_node, parent, np);
+		rb_insert_color(&oc->hash_node, nroot);
 	}
+}
 
-	/* Note: this overwrites flow_cur->age */
-	scrr_enqueue_skb(sch, flow_cur, skb);
+/* Migrate a bounded number of trees. Called from the datapath. */
+static void scrr_rehash_step(struct scrr_sched_data *q)
+{
+	u32 idx_end = min(q->rehash_idx + SCRR_REHASH_STEP,
+			  q->hash_buckets_old);
+
+	for (; q->rehash_idx < idx_end; q->rehash_idx++)
+		scrr_rehash_bucket(q, &q->hash_root_old[q->rehash_idx],
+				   q->hash_root, q->hash_trees_log);
+
+	if (q->rehash_idx >= q->hash_buckets_old) {
+		/* Can't kvfree() from here, let the work do it. */
+		q->hash_root_drained = q->hash_root_old;
+		q->hash_root_old = NULL;
+		schedule_work(&q->hash_work);
+	}
+}
 
-#ifdef SCRR_DEBUG_STFQ_ENQUEUE
-	printk(KERN_DEBUG "SCRR: enqueue: idx:%d; vadv:%lld; vpv:%lld; vfin:%lld\n", flow_cur->flow_idx, q->virtual_advance, q->virtual_previous, flow_cur->virtual_finish);
-#endif	/* SCRR_DEBUG_STFQ_ENQUEUE */
+/* Migrate all remaining trees, return old array for the caller to free.
+ * Called with the tree lock, outside the datapath. */
+static struct rb_root *scrr_rehash_finish(struct scrr_sched_data *q)
+{
+	struct rb_root *old_array = q->hash_root_old;
 
-#ifdef SCRR_DEBUG_STATS_PEAK
-	/* Keep track of peak statistics */
-	if (sch->q.qlen >= q->stats.qlen_peak)
-		q->stats.qlen_peak = sch->q.qlen;
+	if (old_array == NULL)
+		return NULL;
 
-	if ( (sch->qstats.backlog > q->stats.backlog_peak)
-	     && (sch->qstats.backlog < 2147483648) )
-		q->stats.backlog_peak = sch->qstats.backlog;
-#endif	/* SCRR_DEBUG_STATS_PEAK */
+	for (; q->rehash_idx < q->hash_buckets_old; q->rehash_idx++)
+		scrr_rehash_bucket(q, &old_array[q->rehash_idx],
+				   q->hash_root, q->hash_trees_log);
+	q->hash_root_old = NULL;
+	return old_array;
+}
 
-	return NET_XMIT_SUCCESS;
+/* Install new array, current array will be migrated incrementally.
+ * No migration must be in progress. */
+static void scrr_rehash_start(struct scrr_sched_data *q,
+			      struct rb_root *new_array, u32 new_log)
+{
+	q->hash_root_old = q->hash_root;
+	q->hash_buckets_old = q->hash_buckets;
+	q->rehash_idx = 0;
+
+	q->classifier = SCRR_CLASSIFIER_RBTREE;
+	q->hash_root = new_array;
+	q->hash_trees_log = new_log;
+	q->hash_buckets = 1U << new_log;
 }
 
-/* QDisc remove a packet from our queue - head of queue.
- * Version No Packet Metadata, previously called Self Contained */
-static struct sk_buff *scrr_qdisc_npm_dequeue(struct Qdisc *sch)
+/* Check old array, in case this flow has not been migrated yet. */
+static struct scrr_flow *scrr_rehash_lookup(struct scrr_sched_data *q,
+					    uint32_t		flow_idx,
+					    uint32_t		flow_key)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow_head *	head;
-	struct scrr_flow *	flow_cur;
-	struct sk_buff *	skb;
-	u64			virtual_pkt;
-	u64			virtual_next;
+	u32			idx_old = flow_idx & (q->hash_buckets_old - 1);
+	struct rb_node *	p;
+	struct scrr_flow_cold *	cold_cur;
 
-	/* If all sub-queues are empty, nothing to schedule. */
-	if (unlikely(sch->q.qlen == 0))
+	if (idx_old < q->rehash_idx)
 		return NULL;
 
-retry_flow:
-	/* If there are flows in the new list (rare), use that list. */
-	head = &q->new_flows;
-	if (likely(head->first == NULL)) {
-		/* Default case : use list of currently active flows. */
-		head = &q->old_flows;
-		if (unlikely(head->first == NULL)) {
-			printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
-			return NULL;
-		}
+	p = q->hash_root_old[idx_old].rb_node;
+	while (p) {
+		cold_cur = rb_entry(p, struct scrr_flow_cold, hash_node);
+		if (scrr_flow_id_eq(cold_cur, flow_idx, flow_key))
+			return scrr_cold_flow(q, cold_cur);
+		if (scrr_flow_id_gt(cold_cur, flow_idx, flow_key))
+			p = p->rb_right;
+		else
+			p = p->rb_left;
 	}
-	/* Pick first flow of the list. The list is rotated as needed. */
-	flow_cur = head->first;
+	return NULL;
+}
 
-	/* Always dequeue a packet. Or try. Jean II */
-	skb = scrr_dequeue_skb(sch, flow_cur);
-
-	if (skb == NULL) {
-		/* If the sub-queue was empty, that flow becomes inactive.
-		 * It may be reactived in scrr_qdisc_enqueue(). Jean II */
-
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
-
-		/* Flow goes inactive */
-		scrr_flow_set_detached(flow_cur);
-		q->stats.flows_inactive++;
-
-#ifdef SCRR_DEBUG_BURST_AVG
-		q->stats.sched_empty++;
-#endif	/* SCRR_DEBUG_BURST_AVG */
+/* Auto-grow : too many flows per tree, time to add more trees.
+ * Only for RB trees, the open addressing table can't be migrated
+ * incrementally. */
+static inline bool scrr_hash_need_grow(struct scrr_sched_data *q)
+{
+	return ( q->hash_load != 0
+		 && q->classifier == SCRR_CLASSIFIER_RBTREE
+		 && q->hash_root_old == NULL
+		 && q->hash_trees_log < SCRR_HASH_LOG_MAX
+		 && (u32) q->stats.flows > q->hash_buckets * q->hash_load );
+}
 
-		/* Advance the global clock as needed, but after
-		 * updating the number of flows. Jean II */
-		scrr_try_virtual_advance(q);
+/* Open addressing flow table.
+ * With many flows, walking the RB tree has one cache miss per level.
+ * Here, a lookup usually touches a single cacheline. Flows beyond the
+ * capacity of their home bucket go into the next buckets, and the home
+ * bucket counts those overflows so that lookups know when to stop.
+ */
+static inline u32 scrr_oa_probe_max(u32 buckets)
+{
+	return min_t(u32, SCRR_OA_PROBE_MAX, buckets);
+}
 
-		/* Pick another flow.
-		 * This won't infinite loop because sch->q.qlen != 0
-		 * and the list of flows will become empty. */
-		goto retry_flow;
+/* The tag filters out the other flows, flow_key is checked only on the
+ * flow with the same hash, in its cold half, which enqueue touches
+ * right after anyway to append the packet. */
+static struct scrr_flow *scrr_oa_lookup(struct scrr_sched_data *q,
+					u32			flow_idx,
+					u32			flow_key,
+					u32 *			probes)
+{
+	struct scrr_oa_bucket *table = q->oa_table;
+	u32 buckets = q->hash_buckets;
+	u32 home = flow_idx & (buckets - 1);
+	u32 probe_max = scrr_oa_probe_max(buckets);
+	struct scrr_oa_bucket *bucket;
+	struct scrr_flow *f;
+	u32 probe;
+	int slot;
+
+	for (probe = 0; probe < probe_max; probe++) {
+		bucket = &table[(home + probe) & (buckets - 1)];
+		for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+			f = bucket->flows[slot];
+			if (bucket->tags[slot] != flow_idx || f == NULL)
+				continue;
+			if (likely(scrr_flow_key(q, f) == flow_key)) {
+				*probes = probe + 1;
+				return f;
+			}
+			q->stats.hash_collisions++;
+		}
+		/* No flow from here went past this bucket, we are done. */
+		if (!bucket->overflow)
+			break;
 	}
+	*probes = min(probe + 1, probe_max);
+	return NULL;
+}
 
-	/* Qdisc stats accounting */
-	qdisc_bstats_update(sch, skb);
+/* Caller must have checked that the flow is not already in the table.
+ * Return false if all the probed buckets are full. */
+static bool scrr_oa_insert(struct scrr_oa_bucket *	table,
+			   u32				buckets,
+			   struct scrr_flow *		flow,
+			   u32				flow_idx)
+{
+	u32 home = flow_idx & (buckets - 1);
+	u32 probe_max = scrr_oa_probe_max(buckets);
+	struct scrr_oa_bucket *bucket;
+	u32 probe;
+	u32 idx;
+	int slot;
 
-#ifdef SCRR_DEBUG_BURST_AVG
-	/* Check if packet is part of the same burst.
-	 * If there is only one active flow, burstiness does not make sense */
-	if ( (flow_cur->flow_idx == q->flow_sched_prev)
-	     && (q->stats.flows - q->stats.flows_inactive > 1) ) {
-		/* Part of same burst, just add */
-		q->burst_cur += qdisc_pkt_len(skb);
-	} else {
-		/* Add previous burst to average */
-		if (q->burst_cur > q->stats.burst_peak)
-			q->stats.burst_peak = q->burst_cur;
-		if (q->stats.burst_avg == 0)
-			q->stats.burst_avg = q->burst_cur;
-		else
-			q->stats.burst_avg = ( ( q->stats.burst_avg * 7
-						 + q->burst_cur ) / 8 );
-		/* Start new burst */
-		q->burst_cur = qdisc_pkt_len(skb);
-		q->flow_sched_prev = flow_cur->flow_idx;
+	for (probe = 0; probe < probe_max; probe++) {
+		bucket = &table[(home + probe) & (buckets - 1)];
+		for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+			if (bucket->flows[slot] == NULL)
+				goto found;
+		}
 	}
-#endif	/* SCRR_DEBUG_BURST_AVG */
+	return false;
+
+found:
+	bucket->tags[slot] = flow_idx;
+	bucket->flows[slot] = flow;
+	/* Let lookups know they need to probe past the home bucket */
+	for (idx = 0; idx < probe; idx++)
+		table[(home + idx) & (buckets - 1)].overflow++;
+	return true;
+}
 
-	/* Figure out the virtual time of the packet. */
-	/* STFQ : Get virtual time of the flow == start-time on this packet.
-	 * Get the later of the finish-time of previous packet (flow was
-	 * busy) and the current virtual time (flow was idle). Jean II */
-	/* For the self contained version, we would need to compare to
-	 * virtual_dequeue as it was when the flow was enqueued. Instead,
-	 * we compare it to the virtual_advance of the previous cycle
-	 * through the queues. It means that the sub-queue had no packet
-	 * sent in the previous schedule, i.e. it was idle. Jean II */
-	if ( time_after_eq64(q->virtual_previous, flow_cur->virtual_finish) )
-		/* We don't have the exact time at enqueue, good enough. Jean */
-		virtual_pkt = q->virtual_advance;
-	else
-		virtual_pkt = flow_cur->virtual_finish;
+static void scrr_oa_remove(struct scrr_oa_bucket *	table,
+			   u32				buckets,
+			   struct scrr_flow *		flow,
+			   u32				flow_idx)
+{
+	u32 home = flow_idx & (buckets - 1);
+	u32 probe_max = scrr_oa_probe_max(buckets);
+	struct scrr_oa_bucket *bucket;
+	u32 probe;
+	u32 idx;
+	int slot;
+
+	for (probe = 0; probe < probe_max; probe++) {
+		bucket = &table[(home + probe) & (buckets - 1)];
+		for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+			if (bucket->flows[slot] == flow) {
+				bucket->flows[slot] = NULL;
+				for (idx = 0; idx < probe; idx++)
+					table[(home + idx) & (buckets - 1)].overflow--;
+				return;
+			}
+		}
+	}
+}
 
-	/* Compute virtual tag of next packet in the sub-queue (if any).
-	 * The finish time of the current packet is after virtual_dequeue. */
-	virtual_next = virtual_pkt + qdisc_pkt_len(skb);
+/* All probed buckets are full, make room by evicting the inactive flow
+ * that has been idle the longest, even if it's not old enough for gc.
+ * Losing its virtual time is better than dropping the packet. */
+static bool scrr_oa_evict(struct scrr_sched_data *q,
+			  uint32_t		flow_idx)
+{
+	u32 home = flow_idx & (q->hash_buckets - 1);
+	u32 probe_max = scrr_oa_probe_max(q->hash_buckets);
+	struct scrr_oa_bucket *bucket;
+	struct scrr_flow *victim = NULL;
+	struct scrr_flow *f;
+	u32 probe;
+	int slot;
+
+	for (probe = 0; probe < probe_max; probe++) {
+		bucket = &q->oa_table[(home + probe) & (q->hash_buckets - 1)];
+		for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+			f = bucket->flows[slot];
+			if (f != NULL && scrr_flow_is_detached(f)
+			    && (victim == NULL
+				|| time_before32(f->age, victim->age)))
+				victim = f;
+		}
+	}
+	if (victim == NULL)
+		return false;
 
-	/* Update flow virtual time.
-	 * STFQ : All flows have the same weight. Jean II */
-	flow_cur->virtual_finish = virtual_next;
+	scrr_oa_remove(q->oa_table, q->hash_buckets, victim,
+		       scrr_flow_idx(q, victim));
+	scrr_flow_free_detached(q, victim);
+	return true;
+}
 
-#ifdef SCRR_DEBUG_STFQ_DEQUEUE
-	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, sch->q.qlen);
-#endif	/* SCRR_DEBUG_STFQ_DEQUEUE */
+/* Garbage collection of idle flows.
+ * gc_list is sorted by age, so we only look at its head, and stop at
+ * the first flow which is not old enough. This is O(1) when there is
+ * nothing to collect, and every idle flow is eventually collected,
+ * unlike scanning the tree we happen to lookup.
+ * The number of flows collected per packet is bounded, whatever is
+ * left is deferred to the next packets. */
+static void scrr_gc(struct scrr_sched_data *q)
+{
+	void *tofree[SCRR_GC_MAX];
+	struct scrr_flow_cold *fc;
+	struct scrr_flow *f;
+	struct rb_root *root;
+	unsigned long lat;
+	u32 idx_old;
+	int fcnt = 0;
 
-	/* Update virtual time - Check if queue is busy */
-	if (sch->q.qlen == 0) {
-		q->virtual_dequeue = virtual_next;
-		q->virtual_previous = q->virtual_advance;
-		q->virtual_advance = q->virtual_dequeue;
-	} else {
-		/* In SCRR, packets are dequeued out of order,
-		 * so the virtual time of STFQ can not be tracked
-		 * easily. We would need to find the smallest
-		 * rank amongst all packets in the queue.
-		 * Approximate by taking the time of this packet.
-		 * But, prevent time going backwards. Jean II */
-		if ( time_after64(virtual_pkt, q->virtual_dequeue) )
-			q->virtual_dequeue = virtual_pkt;
-	}
+	while ((f = list_first_entry_or_null(&q->gc_list, struct scrr_flow,
+					     gc_node)) != NULL) {
+		if (unlikely(f == q->flow_shared)) {
+			list_del_init(&f->gc_node);
+			continue;
+		}
+		if (!scrr_gc_candidate(q, f))
+			break;
+		if (fcnt == SCRR_GC_MAX) {
+			q->stats.gc_deferred++;
+			break;
+		}
 
-	/* SCRR: Self Clocked Round Robin Scheduling. Jean II */
-	/* If the sub-queue does not have a next packet,
-	 * or if the next packet of the sub-queue is after the
-	 * current virtual-time, we need to schedule another
-	 * sub-queue. Jean II */
-	if ( (scrr_peek_skb(flow_cur) == NULL)
-	     || ( time_after64(virtual_next, q->virtual_advance) ) ) {
+		/* Remove from the classifier */
+		fc = scrr_flow_cold(q, f);
+		if (q->classifier == SCRR_CLASSIFIER_OA) {
+			scrr_oa_remove(q->oa_table, q->hash_buckets, f,
+				       fc->flow_idx);
+		} else {
+			idx_old = fc->flow_idx & (q->hash_buckets_old - 1);
+			if (q->hash_root_old != NULL && idx_old >= q->rehash_idx)
+				root = &q->hash_root_old[idx_old];
+			else
+				root = &q->hash_root[fc->flow_idx
+						     & (q->hash_buckets - 1)];
+			rb_erase(&fc->hash_node, root);
+		}
+		__list_del_entry(&f->gc_node);
+		/* No need to call scrr_flow_purge(), flow was idle */
+		trace_scrr_flow_gc(q->sch, fc->flow_idx, f->virtual_finish);
 
-		/* Advance the global clock as needed */
-		scrr_try_virtual_advance(q);
+		/* How late we are, usually because no packet came by */
+		lat = jiffies_to_msecs((u32) jiffies
+				       - (f->age + (u32) q->gc_age));
+		if (lat > q->stats.gc_lat_peak_ms)
+			q->stats.gc_lat_peak_ms = lat;
+		q->stats.gc_lat_avg_ms = ( ( q->stats.gc_lat_avg_ms * 7
+					     + lat ) / 8 );
 
-		/* We could make the flows without packets inactive here.
-		 * The problem is that it would increase the chance of
-		 * starvation for the old flows, though that flow coming
-		 * back to the new list. This would happen if a flow drips
-		 * packets without accumulating them in the sub-queue.
-		 * We could always place inactive flows at the back of the
-		 * old list, however light flows would loose their place
-		 * in the schedule, impacting fairness. Jean II */
+		tofree[fcnt++] = f;
+	}
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	if (!fcnt)
+		return;
 
-		/* Add current flow at end of list of active flows */
-		scrr_robin_add_tail(&q->old_flows, flow_cur);
-	}
-	/* Else : if the next packet is older than the current virtual-time,
-	 * remain on the same sub-queue, so it will be scheduled.
-	 * next time. Jean II */
+	q->stats.flows -= fcnt;
+	q->stats.flows_inactive -= fcnt;
+	q->stats.flows_gc += fcnt;
 
-	return skb;
+	scrr_flow_free_bulk(q, fcnt, tofree);
 }
 
-/* QDisc remove a packet from our queue - head of queue.
- * Version No Packet Metadata + Initial Advance */
-static struct sk_buff *scrr_qdisc_nmia_dequeue(struct Qdisc *sch)
+static struct scrr_flow *scrr_oa_classify(struct scrr_sched_data *q,
+					  uint32_t		flow_idx,
+					  uint32_t		flow_key)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow_head *	head;
 	struct scrr_flow *	flow_cur;
-	struct sk_buff *	skb;
-	u64			virtual_pkt;
-	u64			virtual_next;
+	u32			probes;
 
-	/* If all sub-queues are empty, nothing to schedule. */
-	if (unlikely(sch->q.qlen == 0))
+	flow_cur = scrr_oa_lookup(q, flow_idx, flow_key, &probes);
+
+	/* Keep track of probe length */
+	if (probes > q->stats.probe_peak)
+		q->stats.probe_peak = probes;
+	q->stats.probe_avg_1k = ( ( q->stats.probe_avg_1k * 7
+				    + probes * 1000 ) / 8 );
+
+	if (flow_cur != NULL)
+		return flow_cur;
+
+	/* Create a new flow */
+	flow_cur = scrr_create_flow(q, flow_idx, flow_key);
+	if (unlikely(flow_cur == NULL))
 		return NULL;
 
-retry_flow:
-	/* If there are flows in the new list (rare), use that list. */
-	head = &q->new_flows;
-	if (likely(head->first == NULL)) {
-		/* Default case : use list of currently active flows. */
-		head = &q->old_flows;
-		if (unlikely(head->first == NULL)) {
-			printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
+	/* Insert new flow into classifer */
+	if (unlikely(!scrr_oa_insert(q->oa_table, q->hash_buckets,
+				     flow_cur, flow_idx))) {
+		q->stats.table_full++;
+		if ( (!scrr_oa_evict(q, flow_idx))
+		     || (!scrr_oa_insert(q->oa_table, q->hash_buckets,
+					 flow_cur, flow_idx)) ) {
+			/* All the flows around are active, give up. */
+			__list_del_entry(&flow_cur->gc_node);
+			scrr_flow_free(q, flow_cur);
+			q->stats.flows--;
+			q->stats.flows_inactive--;
 			return NULL;
 		}
 	}
-	/* Pick first flow of the list. The list is rotated as needed. */
-	flow_cur = head->first;
-
-	/* Always dequeue a packet. Or try. Jean II */
-	skb = scrr_dequeue_skb(sch, flow_cur);
-
-	if (skb == NULL) {
-		/* If the sub-queue was empty, that flow becomes inactive.
-		 * It may be reactived in scrr_qdisc_enqueue(). Jean II */
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	return flow_cur;
+}
 
-		/* Flow goes inactive */
-		scrr_flow_set_detached(flow_cur);
-		q->stats.flows_inactive++;
+static struct scrr_flow *scrr_hash_classify(struct sk_buff *skb,
+					    struct scrr_sched_data *q,
+					    uint32_t flow_idx,
+					    uint32_t flow_key)
+{
+	struct rb_node **	p;
+	struct rb_node *	parent;
+	struct rb_root *	root;
+	struct scrr_flow_cold *	cold_cur;
+	struct scrr_flow *	flow_cur;
 
-#ifdef SCRR_DEBUG_BURST_AVG
-		q->stats.sched_empty++;
-#endif	/* SCRR_DEBUG_BURST_AVG */
+	if (q->classifier == SCRR_CLASSIFIER_OA)
+		return scrr_oa_classify(q, flow_idx, flow_key);
 
-		/* Advance the global clock as needed, but after
-		 * updating the number of flows. Jean II */
-		scrr_try_virtual_advance(q);
+	/* Move a few more trees, if we are rehashing */
+	if (unlikely(q->hash_root_old != NULL))
+		scrr_rehash_step(q);
 
-		/* Pick another flow.
-		 * This won't infinite loop because sch->q.qlen != 0
-		 * and the list of flows will become empty. */
-		goto retry_flow;
-	}
+	/* Get the root of the tree from the hash */
+	root = &q->hash_root[ flow_idx & (q->hash_buckets - 1) ];
 
-	/* Qdisc stats accounting */
-	qdisc_bstats_update(sch, skb);
+	/* Find flow in that specific tree */
+	p = &root->rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
 
-#ifdef SCRR_DEBUG_BURST_AVG
-	/* Check if packet is part of the same burst.
-	 * If there is only one active flow, burstiness does not make sense */
-	if ( (flow_cur->flow_idx == q->flow_sched_prev)
-	     && (q->stats.flows - q->stats.flows_inactive > 1) ) {
-		/* Part of same burst, just add */
-		q->burst_cur += qdisc_pkt_len(skb);
-	} else {
-		/* Add previous burst to average */
-		if (q->burst_cur > q->stats.burst_peak)
-			q->stats.burst_peak = q->burst_cur;
-		if (q->stats.burst_avg == 0)
-			q->stats.burst_avg = q->burst_cur;
+		cold_cur = rb_entry(parent, struct scrr_flow_cold, hash_node);
+		if (cold_cur->flow_idx == flow_idx) {
+			if (likely(cold_cur->flow_key == flow_key)) {
+				/* Found ! */
+				return scrr_cold_flow(q, cold_cur);
+			}
+			q->stats.hash_collisions++;
+		}
+		if (scrr_flow_id_gt(cold_cur, flow_idx, flow_key))
+			p = &parent->rb_right;
 		else
-			q->stats.burst_avg = ( ( q->stats.burst_avg * 7
-						 + q->burst_cur ) / 8 );
-		/* Start new burst */
-		q->burst_cur = qdisc_pkt_len(skb);
-		q->flow_sched_prev = flow_cur->flow_idx;
+			p = &parent->rb_left;
 	}
-#endif	/* SCRR_DEBUG_BURST_AVG */
-
-	/* Figure out the virtual time of the packet. */
-	/* STFQ : Get virtual time of the flow == start-time on this packet.
-	 * Get the later of the finish-time of previous packet (flow was
-	 * busy) and the current virtual time (flow was idle). Jean II */
-	/* For the No Packet Metadata version, we would need to compare to
-	 * virtual_dequeue as it was when the flow was enqueued. Instead,
-	 * we compare it to the virtual_advance of the previous cycle
-	 * through the queues. It means that the sub-queue had no packet
-	 * sent in the previous schedule, i.e. it was idle. Jean II */
-	if ( time_after_eq64(q->virtual_previous, flow_cur->virtual_finish) )
-		/* We don't have the exact time at enqueue.
-		 * Try to give this new flow a full "quanta" at this round.
-		 * The maximum advance is equal to the maximum packet size.
-		 * We want the maximum burst for this new flow to be less
-		 * than twice the max packet size, so we can only go back
-		 * one advance minus 1 byte (as we can send 1 packet beyond
-		 * the current advance). Deduct the current packet from the
-		 * "quanta" to minimise average burstiness. Jean II */
-		virtual_pkt = q->virtual_previous + qdisc_pkt_len(skb);
-	else
-		virtual_pkt = flow_cur->virtual_finish;
-
-	/* Compute virtual tag of next packet in the sub-queue (if any).
-	 * The finish time of the current packet is after virtual_dequeue. */
-	virtual_next = virtual_pkt + qdisc_pkt_len(skb);
-
-	/* Update flow virtual time.
-	 * STFQ : All flows have the same weight. Jean II */
-	flow_cur->virtual_finish = virtual_next;
-
-#ifdef SCRR_DEBUG_STFQ_DEQUEUE
-	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, sch->q.qlen);
-#endif	/* SCRR_DEBUG_STFQ_DEQUEUE */
 
-	/* Update virtual time - Check if queue is busy */
-	if (sch->q.qlen == 0) {
-		q->virtual_dequeue = virtual_next;
-		q->virtual_previous = q->virtual_advance;
-		q->virtual_advance = q->virtual_dequeue;
-	} else {
-		/* In SCRR, packets are dequeued out of order,
-		 * so the virtual time of STFQ can not be tracked
-		 * easily. We would need to find the smallest
-		 * rank amongst all packets in the queue.
-		 * Approximate by taking the time of this packet.
-		 * But, prevent time going backwards. Jean II */
-		if ( time_after64(virtual_pkt, q->virtual_dequeue) )
-			q->virtual_dequeue = virtual_pkt;
+	/* Not in new array, may still be in the old array */
+	if (unlikely(q->hash_root_old != NULL)) {
+		flow_cur = scrr_rehash_lookup(q, flow_idx, flow_key);
+		if (flow_cur != NULL)
+			return flow_cur;
 	}
 
-	/* SCRR: Self Clocked Round Robin Scheduling. Jean II */
-	/* If the sub-queue does not have a next packet,
-	 * or if the next packet of the sub-queue is after the
-	 * current virtual-time, we need to schedule another
-	 * sub-queue. Jean II */
-	if ( (scrr_peek_skb(flow_cur) == NULL)
-	     || ( time_after64(virtual_next, q->virtual_advance) ) ) {
-
-		/* Advance the global clock as needed */
-		scrr_try_virtual_advance(q);
-
-		/* We could make the flows without packets inactive here.
-		 * The problem is that it would increase the chance of
-		 * starvation for the old flows, though that flow coming
-		 * back to the new list. This would happen if a flow drips
-		 * packets without accumulating them in the sub-queue.
-		 * We could always place inactive flows at the back of the
-		 * old list, however light flows would loose their place
-		 * in the schedule, impacting fairness. Jean II */
-
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
-
-		/* Add current flow at end of list of active flows */
-		scrr_robin_add_tail(&q->old_flows, flow_cur);
+	/* Create a new flow */
+	flow_cur = scrr_create_flow(q, flow_idx, flow_key);
+	if (unlikely(flow_cur == NULL)) {
+		return NULL;
 	}
-	/* Else : if the next packet is older than the current virtual-time,
-	 * remain on the same sub-queue, so it will be scheduled.
-	 * next time. Jean II */
 
-	return skb;
-}
+	/* Insert new flow into classifer */
+	cold_cur = scrr_flow_cold(q, flow_cur);
+	rb_link_node(&cold_cur->hash_node, parent, p);
+	rb_insert_color(&cold_cur->hash_node, root);
 
-/* QDisc add a new packet to our queue - tail of queue.
- * Version No Packet Metadata + No Empty */
-static int scrr_qdisc_nmne_enqueue(struct sk_buff *	skb,
-				   struct Qdisc *	sch,
-				   struct sk_buff **	to_free)
-{
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow *	flow_cur;
+	/* Can't allocate memory here, defer to the work */
+	if (unlikely(scrr_hash_need_grow(q)))
+		schedule_work(&q->hash_work);
 
-	/* Tail-drop when queue is full - pfifo style limit */
-	if (unlikely(sch->q.qlen >= sch->limit)) {
-		qdisc_qstats_overlimit(sch);
-		return qdisc_drop(skb, sch, to_free);
-	}
+#ifdef SCRR_DEBUG_FLOW_NEW
+	{
+		struct iphdr *ih;
+		__be16 src_port;
+		__be16 dest_port; 
 
-	/* Find or create flow for this packet. */
+		if (skb->protocol == htons(ETH_P_IP)) {
+			ih = ip_hdr(skb);
+			switch (ih->protocol) {
+			case IPPROTO_TCP: {
+				struct tcphdr *th = tcp_hdr(skb);
+				src_port = th->source;
+				dest_port = th->dest;
+				break;
+			}
+			case IPPROTO_UDP: {
+				struct udphdr *uh = udp_hdr(skb);
+				src_port = uh->source;
+				dest_port = uh->dest;
+				break;
+			}
+			default:
+				src_port = 0;
+				dest_port = 0;
+			}
+			printk(KERN_DEBUG "SCRR: flow new: idx:%d, src_addr:%d, dst_addr:%d, src_port:%d, dst_port:%d\n", flow_idx, ntohl(ih->saddr), ntohl(ih->daddr), ntohs(src_port), ntohs(dest_port));
+		} else {
+			printk(KERN_DEBUG "SCRR: flow new: idx:%d\n", flow_idx);
+		}
+	}
+#endif	/* SCRR_DEBUG_FLOW_NEW */
+
+	return flow_cur;
+}
+
+/* Remember the flow of a socket. Take the flow out of its previous
+ * entry, so that scrr_sk_cache_forget() only has one to clear. */
+static void scrr_sk_cache_set(struct scrr_sched_data *	q,
+			      struct scrr_sk_cache *	entry,
+			      const struct sock *	sk,
+			      uint32_t			flow_idx,
+			      struct scrr_flow *	flow)
+{
+	struct scrr_flow_cold *cold = scrr_flow_cold(q, flow);
+
+	scrr_sk_cache_forget(q, flow);
+	entry->sk = sk;
+	entry->flow = flow;
+	entry->flow_idx = flow_idx;
+	cold->sk_slot = entry - q->sk_cache;
+}
+
+/* Socket cache.
+ * Locally generated traffic has the socket in skb->sk, and a long lived
+ * TCP socket sends millions of packets in the same flow. The cache maps
+ * the socket pointer to its flow, direct mapped, so the classification
+ * of those packets is one compare instead of a walk down the RB tree.
+ * The socket is never dereferenced, a socket freed and reused for
+ * another connection is caught by the hash, which TCP sets from the
+ * socket (sk_txhash) so it's already in the skb. A flow freed by gc is
+ * taken out of the cache, so the entry is always valid when both match.
+ * Forwarded traffic, and stale or colliding entries, go through the
+ * hash table as before.
+ *
+ * Exact flow identity.
+ * By default, flows are hash_mask buckets of the hash, so with many
+ * connections unrelated flows share a sub-queue, and a mouse may wait
+ * behind an elephant. With SCF_EXACT_FLOW, the full hash is used, and
+ * a second hash of the headers, with our own seed, tells apart flows
+ * that still collide. Those two are 64 bits of identity, and the
+ * collisions they resolved are counted as hash_collisions. The
+ * socket cache is checked first, a socket is already a single flow.
+ */
+static struct scrr_flow *scrr_classify(struct sk_buff *skb,
+				       struct scrr_sched_data *q)
+{
+	struct scrr_sk_cache *	entry = NULL;
+	struct scrr_flow *	flow_cur;
+	uint32_t		flow_idx;
+	uint32_t		flow_key = 0;
+
+	/* Get hash value for the packet */
+	if (unlikely(q->flags & SCF_EXACT_FLOW))
+		flow_idx = skb_get_hash(skb);
+	else
+		flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
+
+	/* Collect a few idle flows, if any */
+	scrr_gc(q);
+
+	if (q->sk_cache != NULL && skb->sk != NULL) {
+		entry = &q->sk_cache[hash_ptr(skb->sk, q->sk_cache_log)];
+		if ( likely(entry->sk == skb->sk)
+		     && likely(entry->flow_idx == flow_idx) ) {
+			q->stats.sk_cache_hit++;
+			return entry->flow;
+		}
+		q->stats.sk_cache_miss++;
+	}
+
+	if (unlikely(q->flags & SCF_EXACT_FLOW))
+		flow_key = skb_get_hash_perturb(skb, &q->flow_key_seed);
+
+	flow_cur = scrr_hash_classify(skb, q, flow_idx, flow_key);
+
+	if (entry != NULL && flow_cur != NULL)
+		scrr_sk_cache_set(q, entry, skb->sk, flow_idx, flow_cur);
+	return flow_cur;
+}
+
+/* Add a flow at the end of the list used by Round Robin. */
+static void scrr_robin_add_tail(struct scrr_flow_head *head,
+				struct scrr_flow *flow)
+{
+	if (head->first)
+		head->last->next = flow;
+	else
+		head->first = flow;
+	head->last = flow;
+	flow->next = NULL;
+}
+
+static inline struct sk_buff *scrr_peek_skb(struct scrr_flow *flow)
+{
+	struct sk_buff *head = flow->head;
+
+	return head;
+}
+
+/*
+ * Longest queue tracking, for SCF_FAT_DROP and flow_blimit.
+ * Flows with a backlog are kept in buckets by log2 of their backlog, and
+ * the bitmap of non empty buckets gives the fattest flows in O(1). A flow
+ * only moves when its backlog crosses a power of two. When tracking is off,
+ * all backlogs are zero and the buckets are empty.
+ */
+static inline void scrr_fat_update(struct scrr_sched_data *q,
+				   struct scrr_flow_cold *cold,
+				   u32 backlog)
+{
+	int bucket_old = fls(cold->backlog) - 1;
+	int bucket_new = fls(backlog) - 1;
+
+	cold->backlog = backlog;
+	if (bucket_old == bucket_new)
+		return;
+
+	if (bucket_old >= 0) {
+		list_del(&cold->fat_node);
+		if (list_empty(&q->fat_buckets[bucket_old]))
+			q->fat_bitmap &= ~(1U << bucket_old);
+	}
+	if (bucket_new >= 0) {
+		/* The flow which just grew is picked first */
+		list_add(&cold->fat_node, &q->fat_buckets[bucket_new]);
+		q->fat_bitmap |= 1U << bucket_new;
+	}
+}
+
+static void scrr_fat_buckets_init(struct scrr_sched_data *q)
+{
+	int i;
+
+	for (i = 0; i < SCRR_FAT_BUCKETS; i++)
+		INIT_LIST_HEAD(&q->fat_buckets[i]);
+	q->fat_bitmap = 0;
+}
+
+/* Switch tracking on or off, from the packets in the scheduled flows.
+ * Flows which are not scheduled have no packets. */
+static void scrr_backlog_track(struct scrr_sched_data *q, bool track)
+{
+	struct scrr_flow_head *heads[] = { &q->new_flows, &q->old_flows };
+	struct scrr_flow *flow;
+	struct sk_buff *skb;
+	u32 backlog;
+	int i;
+
+	scrr_fat_buckets_init(q);
+	for (i = 0; i < ARRAY_SIZE(heads); i++) {
+		for (flow = heads[i]->first; flow != NULL; flow = flow->next) {
+			backlog = 0;
+			if (track)
+				for (skb = flow->head; skb; skb = skb->next)
+					backlog += qdisc_pkt_len(skb);
+			/* Buckets were reset, don't unlink */
+			scrr_flow_cold(q, flow)->backlog = 0;
+			scrr_fat_update(q, scrr_flow_cold(q, flow), backlog);
+		}
+	}
+	q->backlog_track = track;
+}
+
+/* Add one skb to the flow queue. */
+static inline void scrr_enqueue_skb(struct Qdisc *	sch,
+				    struct scrr_flow *	flow,
+				    struct sk_buff *	skb)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct scrr_flow_cold *cold = scrr_flow_cold(q, flow);
+
+	if (flow->head == NULL)
+		flow->head = skb;
+	else
+		cold->tail->next = skb;
+	cold->tail = skb;
+	skb->next = NULL;
+
+	if (unlikely(q->backlog_track))
+		scrr_fat_update(q, cold, cold->backlog + qdisc_pkt_len(skb));
+
+	flow->qlen++;
+	qdisc_qstats_backlog_inc(sch, skb);
+	sch->q.qlen++;
+}
+
+/* Remove one skb from flow queue. */
+static inline struct sk_buff *scrr_dequeue_skb(struct Qdisc *	sch,
+					       struct scrr_flow *	flow)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *	skb;
+
+	/* Move a few more trees, if we are rehashing */
+	if (unlikely(q->hash_root_old != NULL))
+		scrr_rehash_step(q);
+
+	skb = flow->head;
+	if (skb == NULL)
+		return NULL;
+
+	flow->head = skb->next;
+	skb_mark_not_on_list(skb);
+
+	/* Only touch the cold half if we need it */
+	if (unlikely(q->backlog_track)) {
+		struct scrr_flow_cold *cold = scrr_flow_cold(q, flow);
+
+		scrr_fat_update(q, cold, cold->backlog - qdisc_pkt_len(skb));
+	}
+
+	flow->qlen--;
+	qdisc_qstats_backlog_dec(sch, skb);
+	sch->q.qlen--;
+
+	return skb;
+}
+
+/* Multi-queue : each TX queue has its own SCRR instance with its own
+ * lock, so the virtual clock can't be shared directly without adding
+ * back the contention we are trying to avoid.
+ * Each instance publishes its virtual advance at the end of its
+ * scheduling rounds, and an instance waking up from idle moves its
+ * clock up to the latest one. We only resync when idle, because a busy
+ * instance has flows and packets tagged with its own clock, and moving
+ * the clock under them would allow those flows to burst. */
+static inline void scrr_mq_clock_publish(struct scrr_sched_data *q)
+{
+	s64	virtual_global = atomic64_read(&q->mq_clock->virtual_advance);
+
+	/* Most of the time, another instance is ahead of us, so
+	 * avoid dirtying the shared cacheline. */
+	do {
+		if (!time_after64(q->virtual_advance, (u64) virtual_global))
+			return;
+	} while (!atomic64_try_cmpxchg(&q->mq_clock->virtual_advance,
+				       &virtual_global, q->virtual_advance));
+}
+
+static inline void scrr_mq_clock_sync(struct scrr_sched_data *q)
+{
+	u64	virtual_global = atomic64_read(&q->mq_clock->virtual_advance);
+	u64	virtual_delta;
+
+	if (!time_after64(virtual_global, q->virtual_advance))
+		return;
+
+	/* Shift the whole clock, to keep the gap between previous and
+	 * advance, which is used for the initial advance. Idle flows
+	 * are further behind, so they will still be seen as idle. */
+	virtual_delta = virtual_global - q->virtual_advance;
+	q->virtual_dequeue += virtual_delta;
+	q->virtual_advance += virtual_delta;
+	q->virtual_previous += virtual_delta;
+}
+
+static void scrr_mq_clock_put(struct scrr_mq_clock *clock)
+{
+	if (clock && refcount_dec_and_test(&clock->refcnt))
+		kfree(clock);
+}
+
+/* Variants of SCRR.
+ * All variants are generated from the same enqueue and dequeue code,
+ * specialised at compile time by those feature bits. The code is always
+ * inlined in each variant with constant features, so the compiler removes
+ * the tests and each variant has no runtime branch on its features.
+ */
+#define SCRR_F_METADATA		0x0001	/* Virtual start-time in skb */
+#define SCRR_F_NO_EMPTY		0x0002	/* Empty flows go inactive at once */
+#define SCRR_F_INIT_ADV		0x0004	/* Initial advance for idle flows */
+#define SCRR_F_ONE_LIST		0x0008	/* Only use the list of new flows */
+#ifdef SCRR_DEBUG_BURST_AVG
+#define SCRR_F_BURST_STATS	0x0010	/* Burst statistics */
+#else
+#define SCRR_F_BURST_STATS	0
+#endif	/* SCRR_DEBUG_BURST_AVG */
+#define SCRR_F_PI2		0x0020	/* PI2 AQM at dequeue */
+
+#define SCRR_V_SCRR	(SCRR_F_METADATA | SCRR_F_BURST_STATS)
+#define SCRR_V_NPM	(SCRR_F_BURST_STATS)
+#define SCRR_V_NMIA	(SCRR_F_INIT_ADV | SCRR_F_BURST_STATS)
+#define SCRR_V_NMNE	(SCRR_F_NO_EMPTY | SCRR_F_BURST_STATS)
+#define SCRR_V_NEIA	(SCRR_F_NO_EMPTY | SCRR_F_INIT_ADV | SCRR_F_BURST_STATS)
+#define SCRR_V_BASIC	(SCRR_F_METADATA | SCRR_F_NO_EMPTY | SCRR_F_ONE_LIST \
+			 | SCRR_F_BURST_STATS)
+#define SCRR_V_PI2	(SCRR_F_METADATA | SCRR_F_PI2 | SCRR_F_BURST_STATS)
+
+/* Only some combinations make sense. */
+#define SCRR_FEATURES_CHECK(features)					\
+	do {								\
+		/* Initial advance replaces the packet metadata */	\
+		BUILD_BUG_ON(((features) & SCRR_F_METADATA)		\
+			     && ((features) & SCRR_F_INIT_ADV));	\
+		/* Single list can't keep empty flows around */		\
+		BUILD_BUG_ON(((features) & SCRR_F_ONE_LIST)		\
+			     && !((features) & SCRR_F_NO_EMPTY));	\
+		/* Dropping at dequeue may empty the flow at the head	\
+		 * of the list, it must stay there until next visit */	\
+		BUILD_BUG_ON(((features) & SCRR_F_PI2)			\
+			     && ((features) & SCRR_F_NO_EMPTY));	\
+	} while (0)
+
+/* Weighted SCRR : virtual time used by a packet, its length divided by
+ * the weight of its class. Heavier classes get more bytes per round.
+ * Weights are at least one, so the virtual length of a packet is never
+ * more than its length, and the advance of each round is still bounded
+ * by the largest packet. The divide is done in scrr_qdisc_change().
+ */
+static inline u32 scrr_weighted_len(struct Qdisc *sch,
+				    const struct sk_buff *skb)
+{
+	const struct scrr_sched_data *q = qdisc_priv(sch);
+	u32	len = qdisc_pkt_len(skb);
+	u32	class;
+
+	switch (q->weight_src) {
+	case SCRR_WEIGHT_NONE:
+		return len;
+	case SCRR_WEIGHT_PRIORITY:
+		class = skb->priority;
+		break;
+	case SCRR_WEIGHT_MARK:
+		class = skb->mark;
+		break;
+	default:
+		/* Set by a tc filter, or SO_PRIORITY. Not ours, class 0 */
+		if (TC_H_MAJ(skb->priority) == sch->handle)
+			class = TC_H_MIN(skb->priority);
+		else
+			class = 0;
+		break;
+	}
+	class &= SCRR_WEIGHT_CLASSES - 1;
+
+	/* Round up, a packet always uses some virtual time */
+	return (u32) ( ( (u64) len * q->weight_inv[class]
+			 + (1U << SCRR_WEIGHT_SHIFT) - 1 )
+		       >> SCRR_WEIGHT_SHIFT );
+}
+
+/* Overload : drop from the head of the fattest flow, rather than the
+ * packet which arrives, so a mouse never pays for an elephant, and the
+ * sender sees the loss a queue earlier. The victim is in the highest
+ * bucket, within a factor two of the longest queue. We drop up to half
+ * its backlog, but leave one packet, so the flow is never emptied under
+ * the scheduler. Returns the number of packets dropped. */
+static __always_inline int scrr_fat_drop(struct Qdisc *		sch,
+					 struct sk_buff **	to_free,
+					 const u32		features)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct scrr_flow_cold *	cold;
+	struct scrr_flow *	flow;
+	struct sk_buff *	skb;
+	unsigned int		bytes = 0;
+	u64			virtual_drop = 0;
+	u32			target;
+	int			cnt = 0;
+
+	if (q->fat_bitmap == 0)
+		return 0;
+	cold = list_first_entry(&q->fat_buckets[__fls(q->fat_bitmap)],
+				struct scrr_flow_cold, fat_node);
+	flow = scrr_cold_flow(q, cold);
+
+	target = cold->backlog / 2;
+	while ( (flow->qlen > 1)
+		&& (cnt < SCRR_FAT_DROP_BATCH)
+		&& (cold->backlog > target) ) {
+		skb = scrr_dequeue_skb(sch, flow);
+		bytes += qdisc_pkt_len(skb);
+		if (features & SCRR_F_METADATA)
+			virtual_drop += scrr_weighted_len(sch, skb);
+		qdisc_drop(skb, sch, to_free);
+		cnt++;
+	}
+	if (cnt == 0)
+		return 0;
+
+	/* With metadata, the remaining packets were stamped behind the
+	 * ones we dropped. Move them back, otherwise the next one would
+	 * jump the clock by the whole drop, and all other flows would
+	 * burst to catch up. At most flow_limit packets, only on overload.
+	 * Without metadata, the flow is charged at dequeue, nothing to do. */
+	if (features & SCRR_F_METADATA) {
+		for (skb = flow->head; skb != NULL; skb = skb->next)
+			scrr_skb_cb(skb)->virtual_start -= virtual_drop;
+		flow->virtual_finish -= virtual_drop;
+	}
+
+	qdisc_tree_reduce_backlog(sch, cnt, bytes);
+	q->stats.fat_drop += cnt;
+	cold->drops += cnt;
+
+	return cnt;
+}
+
+/* QDisc add a new packet to our queue - tail of queue. */
+static __always_inline int scrr_enqueue_core(struct sk_buff *	skb,
+					     struct Qdisc *	sch,
+					     struct sk_buff **	to_free,
+					     const u32		features)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct scrr_flow *	flow_cur;
+	u64			virtual_pkt;
+
+	SCRR_FEATURES_CHECK(features);
+
+	/* Tail-drop when queue is full - pfifo style limit,
+	 * or make room in the fattest flow */
+	if (unlikely(sch->q.qlen >= sch->limit)) {
+		qdisc_qstats_overlimit(sch);
+		if ( !(q->flags & SCF_FAT_DROP)
+		     || scrr_fat_drop(sch, to_free, features) == 0 )
+			return qdisc_drop(skb, sch, to_free);
+	}
+
+	/* EDT : don't hold a packet for ever, like sch_fq */
+	if ( unlikely(q->flags & SCF_PACING)
+	     && (u64) skb->tstamp > ktime_get_ns() + q->horizon_ns ) {
+		q->stats.horizon_drops++;
+		return qdisc_drop(skb, sch, to_free);
+	}
+
+	/* scrr_mq : catch up with other instances when waking up. */
+	if (unlikely(sch->q.qlen == 0) && q->mq_clock)
+		scrr_mq_clock_sync(q);
+
+	/* Find or create flow for this packet. */
 	flow_cur = scrr_classify(skb, q);
 	if (unlikely(flow_cur == NULL)) {
-		/* Alt : enqueue packet on random flow, Jean II */
-		return qdisc_drop(skb, sch, to_free);
+		/* Out of flows, use the collision flow, if any */
+		flow_cur = q->flow_shared;
+		if (flow_cur == NULL || !(q->flags & SCF_FLOW_SHARE))
+			return qdisc_drop(skb, sch, to_free);
+		q->stats.flow_shared++;
 	}
 
 	/* Check sub-queue size. */
 	if (unlikely(flow_cur->qlen >= q->flow_plimit)) {
 		q->stats.drop_mark++;
+		scrr_flow_cold(q, flow_cur)->drops++;
 		return qdisc_drop(skb, sch, to_free);
 	}
+	/* Same in bytes, a packet larger than the limit still goes */
+	if (unlikely(q->flow_blimit != 0)) {
+		struct scrr_flow_cold *cold = scrr_flow_cold(q, flow_cur);
+
+		if ( (cold->backlog != 0)
+		     && (cold->backlog + qdisc_pkt_len(skb) > q->flow_blimit) ) {
+			q->stats.drop_mark++;
+			cold->drops++;
+			return qdisc_drop(skb, sch, to_free);
+		}
+	}
+
+	if (features & SCRR_F_PI2) {
+		/* UDP is tail-dropped, PI2 is done at dequeue */
+		if (udp_is_taildrop_config(q, skb)
+		    && udp_try_drop_pkt(q, flow_cur)) {
+			scrr_flow_cold(q, flow_cur)->drops++;
+			return qdisc_drop(skb, sch, to_free);
+		}
+
+		/* Set timestamp on packet to measure sojourn time */
+		scrr_skb_cb(skb)->ts = ktime_get_ns();
+	} else if (unlikely((q->flags & SCF_SOJOURN_HIST) || q->telem_chan))
+		scrr_skb_cb(skb)->ts = ktime_get_ns();
 	/* bstats->packets keep track of the number of actual Ethernet
 	 * packets. Unfortunately, all other stats are in number of
 	 * sbks. The packet count and skb count are different due
@@ -1119,9 +2115,10 @@ static int scrr_qdisc_nmne_enqueue(struct sk_buff *	skb,
 	if (scrr_flow_is_detached(flow_cur)) {
 		u32	flows_active = q->stats.flows - q->stats.flows_inactive;
 
+		scrr_flow_set_attached(flow_cur);
 		q->stats.flows_inactive--;
 
-		/* Check how long that flow was inactive.
+		/* No Empty : check how long that flow was inactive.
 		 * We assume that the flow could have been active in
 		 * the current scheduling round. So, the only way that
 		 * flow could fit in the round is if the new packet
@@ -1129,11 +2126,13 @@ static int scrr_qdisc_nmne_enqueue(struct sk_buff *	skb,
 		 * schedule it in this round via the new list.
 		 * If the scheduler was empty, the flow must go in
 		 * the current round (a new round). Jean II */
-		if ( ( time_after64(flow_cur->virtual_finish,
-				    q->virtual_advance) )
+		if ( (features & SCRR_F_NO_EMPTY)
+		     && !(features & SCRR_F_ONE_LIST)
+		     && ( time_after64(flow_cur->virtual_finish,
+				       q->virtual_advance) )
 		     && ( flows_active != 0 ) ) {
 #ifdef SCRR_DEBUG_NOEMPTY_ENQUEUE
-			printk(KERN_DEBUG "SCRR: flow add old: idx:%d; vfin:%lld; vadv:%lld (%d)\n", flow_cur->flow_idx, flow_cur->virtual_finish, q->virtual_advance, q->rounds_advance);
+			printk(KERN_DEBUG "SCRR: flow add old: idx:%d; vfin:%lld; vadv:%lld (%d)\n", scrr_flow_idx(q, flow_cur), flow_cur->virtual_finish, q->virtual_advance, q->rounds_advance);
 #endif	/* SCRR_DEBUG_NOEMPTY_ENQUEUE */
 
 			/* That inactive flow was recently used, in the
@@ -1147,11 +2146,12 @@ static int scrr_qdisc_nmne_enqueue(struct sk_buff *	skb,
 			 * this flow in part of the next cycle. Jean II */
 		} else {
 #ifdef SCRR_DEBUG_NOEMPTY_ENQUEUE
-			printk(KERN_DEBUG "SCRR: flow add new: idx:%d; vfin:%lld; vadv:%lld (%d)\n", flow_cur->flow_idx, flow_cur->virtual_finish, q->virtual_advance, q->rounds_advance);
+			if (features & SCRR_F_NO_EMPTY)
+				printk(KERN_DEBUG "SCRR: flow add new: idx:%d; vfin:%lld; vadv:%lld (%d)\n", scrr_flow_idx(q, flow_cur), flow_cur->virtual_finish, q->virtual_advance, q->rounds_advance);
 #endif	/* SCRR_DEBUG_NOEMPTY_ENQUEUE */
 
-			/* That inactive flow is old. Put it flow into list
-			 * of new flows for immediate scheduling. Jean II */
+			/* Put inactive flow into list of new flows for
+			 * immediate scheduling. */
 			scrr_robin_add_tail(&q->new_flows, flow_cur);
 
 			/* One more flow in the current round robin cycle */
@@ -1159,11 +2159,34 @@ static int scrr_qdisc_nmne_enqueue(struct sk_buff *	skb,
 		}
 	}
 
-	/* Note: this overwrites flow_cur->age */
+	if (features & SCRR_F_METADATA) {
+		/* STFQ : Get virtual time of the flow == start-time on
+		 * this packet. Get the later of the finish-time of previous
+		 * packet (flow was busy) and the current virtual time
+		 * (flow was idle). */
+		if ( time_after64(q->virtual_advance, flow_cur->virtual_finish) )
+			virtual_pkt = q->virtual_advance;
+		else
+			virtual_pkt = flow_cur->virtual_finish;
+
+		/* Save virtual time in packet to be used in dequeue */
+		scrr_skb_cb(skb)->virtual_start = virtual_pkt;
+
+		/* Update flow virtual time, weighted. */
+		flow_cur->virtual_finish = virtual_pkt
+					   + scrr_weighted_len(sch, skb);
+	}
+
 	scrr_enqueue_skb(sch, flow_cur, skb);
 
+	if (trace_scrr_enqueue_enabled())
+		trace_scrr_enqueue(sch, scrr_flow_idx(q, flow_cur),
+				   qdisc_pkt_len(skb), flow_cur->qlen,
+				   flow_cur->virtual_finish,
+				   q->virtual_advance);
+
 #ifdef SCRR_DEBUG_STFQ_ENQUEUE
-	printk(KERN_DEBUG "SCRR: enqueue: idx:%d; vadv:%lld; vpv:%lld; vfin:%lld\n", flow_cur->flow_idx, q->virtual_advance, q->virtual_previous, flow_cur->virtual_finish);
+	printk(KERN_DEBUG "SCRR: enqueue: idx:%d; vadv:%lld; vpv:%lld; vfin:%lld\n", scrr_flow_idx(q, flow_cur), q->virtual_advance, q->virtual_previous, flow_cur->virtual_finish);
 #endif	/* SCRR_DEBUG_STFQ_ENQUEUE */
 
 #ifdef SCRR_DEBUG_STATS_PEAK
@@ -1179,58 +2202,55 @@ static int scrr_qdisc_nmne_enqueue(struct sk_buff *	skb,
 	return NET_XMIT_SUCCESS;
 }
 
-/* QDisc remove a packet from our queue - head of queue.
- * Version No Packet Metadata + No Empty */
-static struct sk_buff *scrr_qdisc_nmne_dequeue(struct Qdisc *sch)
+/* Update virtual clock at the end of a scheduling round.
+ * Helper to remove code duplication. */
+static inline void scrr_try_virtual_advance(struct scrr_sched_data *q)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow_head *	head;
-	struct scrr_flow *	flow_cur;
-	struct sk_buff *	skb;
-	u64			virtual_pkt;
-	u64			virtual_next;
-
-	/* If all sub-queues are empty, nothing to schedule. */
-	if (unlikely(sch->q.qlen == 0))
-		return NULL;
-
-	/* If there are flows in the new list (rare), use that list. */
-	head = &q->new_flows;
-	if (likely(head->first == NULL)) {
-		/* Default case : use list of currently active flows. */
-		head = &q->old_flows;
-		if (unlikely(head->first == NULL)) {
-			printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
-			return NULL;
+	/* Check if it is time to update the virtual advance.
+	 * We update it only once for every complete schedule through
+	 * the active flows to minimise advance and guarantee the
+	 * smallest burst size. */
+	if (q->rounds_advance <= 0) {
+		/* Scheduling round is done, start a new round.
+		 * Make sure to not override previous if there is no advance
+		 * to not disable initial advance. */
+		if (q->virtual_dequeue != q->virtual_advance) {
+			q->virtual_previous = q->virtual_advance;
+			q->virtual_advance = q->virtual_dequeue;
 		}
-	}
-	/* Pick first flow of the list. The list is rotated as needed. */
-	flow_cur = head->first;
-
-	/* Always dequeue a packet. Or try. Jean II */
-	skb = scrr_dequeue_skb(sch, flow_cur);
-
-	if (unlikely(skb == NULL)) {
-		/* This is not supposed to happen, empty flows are supposed
-		 * to always go inactive below. Jean II */
-		printk_ratelimited(KERN_ERR "SCRR: flow with no SKB !\n");
-
-#ifdef SCRR_DEBUG_BURST_AVG
-		q->stats.sched_empty++;
-#endif	/* SCRR_DEBUG_BURST_AVG */
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue, and bail out... */
-		goto exit_empty;
+		/* The number of active flows may change.
+		 * The current number of active flows is exactly how
+		 * many there are in the round robin list. The next
+		 * cycle may take longer if new flows become active,
+		 * but it can't be shorter. */
+		q->rounds_advance = q->stats.flows - q->stats.flows_inactive
+				    - q->stats.flows_throttled;
+		trace_scrr_virtual_advance(q->sch, q->virtual_advance,
+					   q->virtual_previous,
+					   q->rounds_advance);
+
+		/* scrr_mq : let the other instances know. */
+		if (q->mq_clock)
+			scrr_mq_clock_publish(q);
 	}
 
-	/* Qdisc stats accounting */
-	qdisc_bstats_update(sch, skb);
+	/* We are only called upon schedule, so update remaining number of
+	 * schedules in this round.
+	 * This is initialised at zero, which is why we test before
+	 * decrement. */
+	q->rounds_advance--;
+}
 
+/* Keep track of burst size. */
+static inline void scrr_burst_update(struct scrr_sched_data *q,
+				     struct scrr_flow *flow_cur,
+				     struct sk_buff *skb)
+{
 #ifdef SCRR_DEBUG_BURST_AVG
 	/* Check if packet is part of the same burst.
 	 * If there is only one active flow, burstiness does not make sense */
-	if ( (flow_cur->flow_idx == q->flow_sched_prev)
+	if ( (scrr_flow_idx(q, flow_cur) == q->flow_sched_prev)
 	     && (q->stats.flows - q->stats.flows_inactive > 1) ) {
 		/* Part of same burst, just add */
 		q->burst_cur += qdisc_pkt_len(skb);
@@ -1245,117 +2265,337 @@ static struct sk_buff *scrr_qdisc_nmne_dequeue(struct Qdisc *sch)
 						 + q->burst_cur ) / 8 );
 		/* Start new burst */
 		q->burst_cur = qdisc_pkt_len(skb);
-		q->flow_sched_prev = flow_cur->flow_idx;
+		q->flow_sched_prev = scrr_flow_idx(q, flow_cur);
 	}
 #endif	/* SCRR_DEBUG_BURST_AVG */
+}
 
-	/* Figure out the virtual time of the packet. */
-	/* STFQ : Get virtual time of the flow == start-time on this packet.
-	 * Get the later of the finish-time of previous packet (flow was
-	 * busy) and the current virtual time (flow was idle). Jean II */
-	/* For the No Packet Metadata version, we would need to compare to
-	 * virtual_dequeue as it was when the flow was enqueued. Instead,
-	 * we compare it to the virtual_advance of the previous cycle
-	 * through the queues. It means that the sub-queue had no packet
-	 * sent in the previous schedule, i.e. it was idle. Jean II */
-	if ( time_after_eq64(q->virtual_previous, flow_cur->virtual_finish) )
-		/* We don't have the exact time at enqueue, good enough. Jean */
-		virtual_pkt = q->virtual_advance;
-	else
-		virtual_pkt = flow_cur->virtual_finish;
-
-	/* Compute virtual tag of next packet in the sub-queue (if any).
-	 * The finish time of the current packet is after virtual_dequeue. */
-	virtual_next = virtual_pkt + qdisc_pkt_len(skb);
+/* Keep track of sojourn time, SCF_SOJOURN_HIST.
+ * Bucket N has the packets that waited between 2^(N-1) and 2^N times
+ * 1024ns, bucket 0 those below 1us, the last one everything above.
+ * Light flows are those scheduled from the new list. */
+static inline void scrr_sojourn_update(struct scrr_sched_data *q,
+				       struct sk_buff *skb,
+				       u64 now,
+				       bool light)
+{
+	u64	ts = scrr_skb_cb(skb)->ts;
+	u32	bucket;
 
-	/* Update flow virtual time.
-	 * STFQ : All flows have the same weight. Jean II */
-	flow_cur->virtual_finish = virtual_next;
+	/* Skip packets enqueued before the histograms were enabled,
+	 * their timestamp is garbage. */
+	if (unlikely(ts < q->sojourn_start_ns || ts > now))
+		return;
 
-#ifdef SCRR_DEBUG_STFQ_DEQUEUE
-	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; vpv:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, q->virtual_previous, sch->q.qlen);
-#endif	/* SCRR_DEBUG_STFQ_DEQUEUE */
+	bucket = min_t(u32, fls64((now - ts) >> 10), SCRR_SOJOURN_BUCKETS - 1);
+	if (light)
+		q->stats.sojourn_light[bucket]++;
+	else
+		q->stats.sojourn_heavy[bucket]++;
+}
 
-	/* Update virtual time - Check if queue is busy */
-	if (unlikely(sch->q.qlen == 0)) {
-		q->virtual_dequeue = virtual_next;
-		q->virtual_previous = q->virtual_advance;
-		q->virtual_advance = q->virtual_dequeue;
-	} else {
-		/* In SCRR, packets are dequeued out of order,
-		 * so the virtual time of STFQ can not be tracked
-		 * easily. We would need to find the smallest
-		 * rank amongst all packets in the queue.
-		 * Approximate by taking the time of this packet.
-		 * But, prevent time going backwards. Jean II */
-		if ( time_after64(virtual_pkt, q->virtual_dequeue) )
-			q->virtual_dequeue = virtual_pkt;
+/* QDisc remove a packet from our queue - head of queue. */
+/* GSO packets.
+ * qdisc_pkt_len() of a GSO packet already counts the headers of every
+ * segment, so virtual time is in wire bytes. However, a 64kB TSO packet
+ * is sent as a single packet of more than 40 MTUs, and the burst of the
+ * flow is way above two max packet sizes, which hurts light flows.
+ * With gso_split, a GSO packet larger than that reaching the head of
+ * the schedule is segmented, and its segments are put back at the head
+ * of its flow. They are then scheduled one by one, and interleaved with
+ * other flows, like the MTU case. This is lazy : a flow alone in the
+ * schedule, or with small enough packets, keeps its GSO packets whole,
+ * which is much cheaper for the stack. */
+static struct sk_buff *scrr_gso_split(struct Qdisc *	sch,
+				      struct scrr_flow *flow,
+				      struct sk_buff *	skb,
+				      const u32		features)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	netdev_features_t	dev_features = netif_skb_features(skb);
+	struct sk_buff *	segs;
+	struct sk_buff *	seg;
+	struct sk_buff *	last = NULL;
+	u64			virtual_start = 0;
+	unsigned int		prev_len = qdisc_pkt_len(skb);
+	unsigned int		len = 0;
+	int			nb = 0;
+
+	segs = skb_gso_segment(skb, dev_features & ~NETIF_F_GSO_MASK);
+	if (IS_ERR_OR_NULL(segs))
+		/* Send it whole, the device can do it */
+		return skb;
+
+	/* With metadata, the flow was charged for the whole packet at
+	 * enqueue, spread that virtual time over the segments. */
+	if (features & SCRR_F_METADATA)
+		virtual_start = scrr_skb_cb(skb)->virtual_start;
+	for (seg = segs; seg != NULL; seg = seg->next) {
+		qdisc_skb_cb(seg)->pkt_len = seg->len;
+		if (features & SCRR_F_METADATA) {
+			scrr_skb_cb(seg)->virtual_start = virtual_start;
+			virtual_start += scrr_weighted_len(sch, seg);
+		}
+		len += seg->len;
+		last = seg;
+		nb++;
 	}
+	consume_skb(skb);
+
+	/* Put back all segments but the first at the head of the flow */
+	if (nb > 1) {
+		if (flow->head == NULL)
+			scrr_flow_cold(q, flow)->tail = last;
+		last->next = flow->head;
+		flow->head = segs->next;
+		flow->qlen += nb - 1;
+		sch->q.qlen += nb - 1;
+		sch->qstats.backlog += len - qdisc_pkt_len(segs);
+		if (q->backlog_track) {
+			struct scrr_flow_cold *cold = scrr_flow_cold(q, flow);
+
+			scrr_fat_update(q, cold, cold->backlog + len
+						 - qdisc_pkt_len(segs));
+		}
 
-	/* skb may be NULL after this point. Jean II */
+		/* Parents see more packets, we have some, so it's safe. */
+		qdisc_tree_reduce_backlog(sch, 1 - nb, prev_len - len);
+	}
+	skb_mark_not_on_list(segs);
+	q->stats.gso_split++;
 
-	/* SCRR: Self Clocked Round Robin Scheduling. Jean II */
-	/* If the sub-queue does not have a next packet,
-	 * or if the next packet of the sub-queue is after the
-	 * current virtual-time, we need to schedule another
-	 * sub-queue. Jean II */
-	if (unlikely(scrr_peek_skb(flow_cur) == NULL)) {
-		/* If the sub-queue is now empty, that flow becomes inactive.
-		 * It may be reactived in scrr_qdisc_enqueue().
-		 * In DRR and regular SCRR, we keep the queue in the
-		 * round robin list to prevent starvation for the old
-		 * flows, though that flow coming back to the new list.
-		 * This would happen if a flow drips packets without
-		 * accumulating them in the sub-queue.
-		 * We prevent that from happening by checking the
-		 * virtual clock of the flow before choosing to
-		 * put it in the list of new or old flows. Jean II */
+	return segs;
+}
 
-#ifdef SCRR_DEBUG_NOEMPTY_DEQUEUE
-		printk(KERN_DEBUG "SCRR: dequeue empty: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; vpv:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, q->virtual_previous, sch->q.qlen);
-#endif	/* SCRR_DEBUG_NOEMPTY_DEQUEUE */
+/*
+ * EDT pacing.
+ * With SCF_PACING, a packet is not sent before skb->tstamp, the
+ * Earliest Departure Time set by TCP pacing (BBR) or by BPF, like in
+ * sch_fq. The round robin lists only have flows that can send : when
+ * the head packet of a flow is not due, the flow leaves the lists and
+ * is parked in a timer wheel, in the slot of the tick of its head
+ * packet. The wheel is run at each dequeue, and a single watchdog wakes
+ * us up for the next non empty slot. Flows are woken at the start of
+ * their tick, so up to one tick early, like the timer slack of sch_fq.
+ * Flows further out than the wheel wait in their slot for another lap.
+ * A throttled flow keeps its packets and stays attached, its next
+ * pointer links it in its slot.
+ */
+static inline u64 scrr_pacing_tick(u64 time_ns)
+{
+	return time_ns >> SCRR_WHEEL_TICK_LOG;
+}
 
-exit_empty:
-		/* Flow goes inactive */
-		scrr_flow_set_detached(flow_cur);
-		q->stats.flows_inactive++;
+static void scrr_flow_throttle(struct scrr_sched_data *q,
+			       struct scrr_flow *flow,
+			       u64 tick)
+{
+	u32 slot = tick & (SCRR_WHEEL_SLOTS - 1);
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	flow->next = q->wheel[slot];
+	q->wheel[slot] = flow;
+	__set_bit(slot, q->wheel_map);
+}
 
-		/* Advance the global clock as needed, but after
-		 * updating the number of flows. Jean II */
-		goto exit_advance;
+/* Flow is due, it goes back in the round robin like a new flow. */
+static void scrr_flow_unthrottle(struct scrr_sched_data *q,
+				 struct scrr_flow *flow)
+{
+	scrr_robin_add_tail(&q->new_flows, flow);
+	q->rounds_advance++;
+	q->stats.flows_throttled--;
+}
 
-	} else if (likely( time_after64(virtual_next, q->virtual_advance) )) {
+static void scrr_wheel_slot_run(struct scrr_sched_data *q,
+				u32 slot,
+				u64 tick_now)
+{
+	struct scrr_flow *flow = q->wheel[slot];
+	struct scrr_flow *next;
+	u64 tick;
+
+	q->wheel[slot] = NULL;
+	__clear_bit(slot, q->wheel_map);
+	for ( ; flow != NULL; flow = next) {
+		next = flow->next;
+		tick = scrr_pacing_tick(flow->head->tstamp);
+		if (tick <= tick_now)
+			scrr_flow_unthrottle(q, flow);
+		else
+			/* Next lap, or the head was dropped */
+			scrr_flow_throttle(q, flow, tick);
+	}
+}
 
-		/* If the next packet of the sub-queue is after the
-		 * current virtual-time, it can't be sent in that 
-		 * scheduling round. Jean II */
+/* Run all the slots from the last run up to now, at most one lap. */
+static void scrr_wheel_run(struct scrr_sched_data *q, u64 tick_now)
+{
+	u32 first = q->wheel_tick & (SCRR_WHEEL_SLOTS - 1);
+	u32 end;
+	u32 slot;
+
+	end = first + min_t(u64, tick_now - q->wheel_tick + 1,
+			    SCRR_WHEEL_SLOTS);
+	q->wheel_tick = tick_now + 1;
+	if (q->stats.flows_throttled == 0)
+		return;
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	slot = first;
+	for_each_set_bit_from(slot, q->wheel_map,
+			      min_t(u32, end, SCRR_WHEEL_SLOTS))
+		scrr_wheel_slot_run(q, slot, tick_now);
+	if (end > SCRR_WHEEL_SLOTS) {
+		slot = 0;
+		for_each_set_bit_from(slot, q->wheel_map,
+				      end - SCRR_WHEEL_SLOTS)
+			scrr_wheel_slot_run(q, slot, tick_now);
+	}
+}
 
-		/* Add current flow at end of the list of active flows */
-		scrr_robin_add_tail(&q->old_flows, flow_cur);
+/* Pacing turned off, or reset : all flows are due. */
+static void scrr_wheel_flush(struct scrr_sched_data *q)
+{
+	u32 slot;
 
-exit_advance:
-		/* Advance the global clock as needed */
-		scrr_try_virtual_advance(q);
+	for_each_set_bit(slot, q->wheel_map, SCRR_WHEEL_SLOTS)
+		scrr_wheel_slot_run(q, slot, U64_MAX);
+}
+
+/* ------------------------- TELEMETRY ------------------------- */
+
+/*
+ * The decision stream of the scheduler, for tuning. This is what
+ * SCRR_DEBUG_STFQ_DEQUEUE prints, but printk can't keep up with the
+ * line rate. One packet in telem_sample is recorded at dequeue, in
+ * binary, to a relay channel. Relay has one lock-free ring per CPU,
+ * which userspace reads or mmaps from debugfs, in
+ * /sys/kernel/debug/scrr/<dev>-<major>:<minor>/cpuN, see scrr_telem.c.
+ * When the reader is too slow, new records are dropped and counted,
+ * the datapath never waits. When off, the cost is a test of telem_chan.
+ */
+static struct dentry *scrr_debugfs;	/* Top directory of all instances */
+
+static struct dentry *scrr_telem_create_file(const char *filename,
+					     struct dentry *parent,
+					     umode_t mode,
+					     struct rchan_buf *buf,
+					     int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int scrr_telem_remove_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+/* Ring full : don't overwrite what the reader has not seen yet. */
+static int scrr_telem_subbuf_start(struct rchan_buf *buf, void *subbuf,
+				   void *prev_subbuf, size_t prev_padding)
+{
+	struct scrr_sched_data *q = buf->chan->private_data;
 
+	if (relay_buf_full(buf)) {
+		q->stats.telem_lost++;
+		return 0;
 	}
-	/* Else : if the next packet is older than the current virtual-time,
-	 * remain on the same sub-queue, so it will be scheduled.
-	 * next time in this scheduling round. Jean II */
+	return 1;
+}
 
-	return skb;
+static const struct rchan_callbacks scrr_telem_callbacks = {
+	.subbuf_start		= scrr_telem_subbuf_start,
+	.create_buf_file	= scrr_telem_create_file,
+	.remove_buf_file	= scrr_telem_remove_file,
+};
+
+/* Create the channel, can sleep. The directory is kept in telem_dir. */
+static struct rchan *scrr_telem_open(struct Qdisc *sch,
+				     struct netlink_ext_ack *extack)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct rchan *chan;
+	char name[IFNAMSIZ + 16];
+
+	if (IS_ERR_OR_NULL(scrr_debugfs)) {
+		NL_SET_ERR_MSG(extack, "SCRR: telemetry needs debugfs");
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	snprintf(name, sizeof(name), "%s-%x:%x", qdisc_dev(sch)->name,
+		 TC_H_MAJ(sch->handle) >> 16, TC_H_MIN(sch->handle));
+	q->telem_dir = debugfs_create_dir(name, scrr_debugfs);
+	if (IS_ERR(q->telem_dir)) {
+		chan = ERR_CAST(q->telem_dir);
+		q->telem_dir = NULL;
+		return chan;
+	}
+
+	chan = relay_open("cpu", q->telem_dir, SCRR_TELEM_SUBBUF,
+			  SCRR_TELEM_SUBBUFS, &scrr_telem_callbacks, q);
+	if (chan == NULL) {
+		debugfs_remove(q->telem_dir);
+		q->telem_dir = NULL;
+		return ERR_PTR(-ENOMEM);
+	}
+	return chan;
 }
 
-/* QDisc remove a packet from our queue - head of queue.
- * Version No Packet Metadata + No Empty + Initial Advance */
-static struct sk_buff *scrr_qdisc_neia_dequeue(struct Qdisc *sch)
+/* The channel must no longer be reachable from the datapath. */
+static void scrr_telem_close(struct scrr_sched_data *q, struct rchan *chan)
+{
+	if (chan == NULL)
+		return;
+	relay_close(chan);
+	debugfs_remove(q->telem_dir);
+	q->telem_dir = NULL;
+}
+
+static void scrr_telem_record(struct scrr_sched_data *q,
+			      struct scrr_flow *flow,
+			      struct sk_buff *skb,
+			      u64 virtual_pkt,
+			      bool new_list)
+{
+	struct scrr_telem_rec rec;
+	u64 ts = scrr_skb_cb(skb)->ts;
+
+	q->telem_left = q->telem_sample;
+
+	rec.ts_ns = ktime_get_ns();
+	rec.virtual_pkt = virtual_pkt;
+	rec.virtual_advance = q->virtual_advance;
+	/* Packets enqueued before telemetry may have no timestamp */
+	if (ts >= q->telem_start_ns && ts <= rec.ts_ns)
+		rec.sojourn_ns = rec.ts_ns - ts;
+	else
+		rec.sojourn_ns = 0;
+	rec.flow_idx = scrr_flow_idx(q, flow);
+	rec.len = qdisc_pkt_len(skb);
+	rec.flow_qlen = flow->qlen;
+	rec.list = new_list ? SCRR_TELEM_LIST_NEW : SCRR_TELEM_LIST_OLD;
+
+	relay_write(q->telem_chan, &rec, sizeof(rec));
+	q->stats.telem_records++;
+}
+
+/* Nothing can send, wake up for the first non empty slot. */
+static void scrr_watchdog_schedule(struct scrr_sched_data *q)
+{
+	u32 first = q->wheel_tick & (SCRR_WHEEL_SLOTS - 1);
+	u32 slot;
+
+	slot = find_next_bit(q->wheel_map, SCRR_WHEEL_SLOTS, first);
+	if (slot >= SCRR_WHEEL_SLOTS)
+		slot = find_first_bit(q->wheel_map, SCRR_WHEEL_SLOTS);
+	qdisc_watchdog_schedule_ns(&q->watchdog,
+		( q->wheel_tick + ((slot - first) & (SCRR_WHEEL_SLOTS - 1)) )
+		<< SCRR_WHEEL_TICK_LOG);
+}
+
+static __always_inline struct sk_buff *scrr_dequeue_core(struct Qdisc *sch,
+							 const u32 features)
 {
 	struct scrr_sched_data *q = qdisc_priv(sch);
 	struct scrr_flow_head *	head;
@@ -1363,102 +2603,212 @@ static struct sk_buff *scrr_qdisc_neia_dequeue(struct Qdisc *sch)
 	struct sk_buff *	skb;
 	u64			virtual_pkt;
 	u64			virtual_next;
+	u32			virtual_len;
+	s64			now = 0;
+	u64			tick_now = 0;
+
+	SCRR_FEATURES_CHECK(features);
 
 	/* If all sub-queues are empty, nothing to schedule. */
 	if (unlikely(sch->q.qlen == 0))
 		return NULL;
 
-	/* If there are flows in the new list (rare), use that list. */
+	/* Fortunately, this is cheap on modern CPUs ;-) */
+	if ( (features & SCRR_F_PI2) || unlikely(q->flags & SCF_PACING) )
+		now = ktime_get_ns();
+
+	/* Put the flows which are now due back in the lists */
+	if (unlikely(q->flags & SCF_PACING)) {
+		tick_now = scrr_pacing_tick(now);
+		if (tick_now >= q->wheel_tick)
+			scrr_wheel_run(q, tick_now);
+	}
+
+retry_flow:
+	/* If there are flows in the new list (rare), use that list.
+	 * With a single list, that's the list of all active flows. */
 	head = &q->new_flows;
-	if (likely(head->first == NULL)) {
+	if ( (!(features & SCRR_F_ONE_LIST)) && likely(head->first == NULL) ) {
 		/* Default case : use list of currently active flows. */
 		head = &q->old_flows;
-		if (unlikely(head->first == NULL)) {
-			printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
+	}
+	if (unlikely(head->first == NULL)) {
+		/* All flows with packets wait for their departure time */
+		if (q->stats.flows_throttled != 0) {
+			scrr_watchdog_schedule(q);
 			return NULL;
 		}
+		printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
+		return NULL;
 	}
 	/* Pick first flow of the list. The list is rotated as needed. */
 	flow_cur = head->first;
 
+	/* EDT : head packet not due, park the flow until it is. */
+	if ( unlikely(q->flags & SCF_PACING) && flow_cur->head != NULL ) {
+		u64 tick = scrr_pacing_tick(flow_cur->head->tstamp);
+
+		if (tick > tick_now) {
+			/* Must be done first, next is reused in the wheel */
+			head->first = flow_cur->next;
+			scrr_flow_throttle(q, flow_cur, tick);
+			q->stats.flows_throttled++;
+			q->stats.throttled++;
+
+			/* That counts as the turn of the flow */
+			scrr_try_virtual_advance(q);
+			goto retry_flow;
+		}
+	}
+
 	/* Always dequeue a packet. Or try. Jean II */
 	skb = scrr_dequeue_skb(sch, flow_cur);
 
 	if (unlikely(skb == NULL)) {
-		/* This is not supposed to happen, empty flows are supposed
-		 * to always go inactive below. Jean II */
-		printk_ratelimited(KERN_ERR "SCRR: flow with no SKB !\n");
+		if (features & SCRR_F_BURST_STATS)
+			q->stats.sched_empty++;
 
-#ifdef SCRR_DEBUG_BURST_AVG
-		q->stats.sched_empty++;
-#endif	/* SCRR_DEBUG_BURST_AVG */
+		if (features & SCRR_F_NO_EMPTY) {
+			/* This is not supposed to happen, empty flows are
+			 * supposed to always go inactive below. */
+			printk_ratelimited(KERN_ERR "SCRR: flow with no SKB !\n");
+
+			/* Remove flow from head of current list,
+			 * advance to next sub-queue, and bail out... */
+			goto exit_empty;
+		}
+
+		/* If the sub-queue was empty, that flow becomes inactive.
+		 * It may be reactived in scrr_qdisc_enqueue(). */
 
 		/* Remove flow from head of current list,
-		 * advance to next sub-queue, and bail out... */
-		goto exit_empty;
+		 * advance to next sub-queue. */
+		head->first = flow_cur->next;
+
+		/* Flow goes inactive */
+		scrr_flow_set_detached(q, flow_cur);
+		q->stats.flows_inactive++;
+		if (trace_scrr_flow_detach_enabled())
+			trace_scrr_flow_detach(sch, scrr_flow_idx(q, flow_cur),
+					       flow_cur->virtual_finish);
+
+		/* Advance the global clock as needed, but after
+		 * updating the number of flows. */
+		scrr_try_virtual_advance(q);
+
+		/* Pick another flow.
+		 * This won't infinite loop because sch->q.qlen != 0
+		 * and the list of flows will become empty. */
+		goto retry_flow;
+	}
+
+	/* Splitting is only worth it if other flows wait behind us. */
+	if ( unlikely(q->gso_split != 0)
+	     && skb_is_gso(skb)
+	     && qdisc_pkt_len(skb) > q->gso_split
+	     && q->stats.flows - q->stats.flows_inactive > 1 )
+		skb = scrr_gso_split(sch, flow_cur, skb, features);
+
+	if ( (features & SCRR_F_PI2)
+	     && scrr_pi2_dequeue_drop(q, flow_cur, skb, now) ) {
+		/* Flow was charged for that packet at enqueue */
+		q->pi2_param.reduce_qlen++;
+		q->pi2_param.reduce_backlog += qdisc_pkt_len(skb);
+		qdisc_qstats_drop(sch);
+		scrr_flow_cold(q, flow_cur)->drops++;
+		kfree_skb(skb);
+
+		/* Flow stays at the head of the list, if it's now empty
+		 * it will go inactive on the next pass. */
+		if (sch->q.qlen == 0)
+			return NULL;
+		goto retry_flow;
 	}
 
 	/* Qdisc stats accounting */
 	qdisc_bstats_update(sch, skb);
+	q->packets_sched += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
 
-#ifdef SCRR_DEBUG_BURST_AVG
-	/* Check if packet is part of the same burst.
-	 * If there is only one active flow, burstiness does not make sense */
-	if ( (flow_cur->flow_idx == q->flow_sched_prev)
-	     && (q->stats.flows - q->stats.flows_inactive > 1) ) {
-		/* Part of same burst, just add */
-		q->burst_cur += qdisc_pkt_len(skb);
-	} else {
-		/* Add previous burst to average */
-		if (q->burst_cur > q->stats.burst_peak)
-			q->stats.burst_peak = q->burst_cur;
-		if (q->stats.burst_avg == 0)
-			q->stats.burst_avg = q->burst_cur;
-		else
-			q->stats.burst_avg = ( ( q->stats.burst_avg * 7
-						 + q->burst_cur ) / 8 );
-		/* Start new burst */
-		q->burst_cur = qdisc_pkt_len(skb);
-		q->flow_sched_prev = flow_cur->flow_idx;
-	}
-#endif	/* SCRR_DEBUG_BURST_AVG */
+	/* With a single list, we can't tell light flows apart. */
+	if (unlikely(q->flags & SCF_SOJOURN_HIST))
+		scrr_sojourn_update(q, skb,
+				    (features & SCRR_F_PI2) ? now : ktime_get_ns(),
+				    ( !(features & SCRR_F_ONE_LIST)
+				      && head == &q->new_flows ));
+
+	if (features & SCRR_F_BURST_STATS)
+		scrr_burst_update(q, flow_cur, skb);
+
+	/* The class of the packet is still in the skb, no need to save
+	 * its weighted length at enqueue. */
+	virtual_len = scrr_weighted_len(sch, skb);
 
 	/* Figure out the virtual time of the packet. */
-	/* STFQ : Get virtual time of the flow == start-time on this packet.
-	 * Get the later of the finish-time of previous packet (flow was
-	 * busy) and the current virtual time (flow was idle). Jean II */
-	/* For the No Packet Metadata version, we would need to compare to
-	 * virtual_dequeue as it was when the flow was enqueued. Instead,
-	 * we compare it to the virtual_advance of the previous cycle
-	 * through the queues. It means that the sub-queue had no packet
-	 * sent in the previous schedule, i.e. it was idle. Jean II */
-	if ( time_after_eq64(q->virtual_previous, flow_cur->virtual_finish) )
-		/* We don't have the exact time at enqueue.
-		 * Try to give this new flow a full "quanta" at this round.
-		 * The maximum advance is equal to the maximum packet size.
-		 * We want the maximum burst for this new flow to be less
-		 * than twice the max packet size, so we can only go back
-		 * one advance minus 1 byte (as we can send 1 packet beyond
-		 * the current advance). Deduct the current packet from the
-		 * "quanta" to minimise average burstiness. Jean II */
-		virtual_pkt = q->virtual_previous + qdisc_pkt_len(skb);
-	else
-		virtual_pkt = flow_cur->virtual_finish;
+	if (features & SCRR_F_METADATA) {
+		/* Get virtual tag of this packet. */
+		virtual_pkt = scrr_skb_cb(skb)->virtual_start;
+	} else {
+		/* STFQ : Get virtual time of the flow == start-time on this
+		 * packet. Get the later of the finish-time of previous packet
+		 * (flow was busy) and the current virtual time (flow was
+		 * idle). */
+		/* For the No Packet Metadata version, we would need to
+		 * compare to virtual_dequeue as it was when the flow was
+		 * enqueued. Instead, we compare it to the virtual_advance of
+		 * the previous cycle through the queues. It means that the
+		 * sub-queue had no packet sent in the previous schedule,
+		 * i.e. it was idle. */
+		if ( time_after_eq64(q->virtual_previous,
+				     flow_cur->virtual_finish) ) {
+			if (features & SCRR_F_INIT_ADV)
+				/* We don't have the exact time at enqueue.
+				 * Try to give this new flow a full "quanta"
+				 * at this round. The maximum advance is equal
+				 * to the maximum packet size. We want the
+				 * maximum burst for this new flow to be less
+				 * than twice the max packet size, so we can
+				 * only go back one advance minus 1 byte (as
+				 * we can send 1 packet beyond the current
+				 * advance). Deduct the current packet from
+				 * the "quanta" to minimise average burstiness.
+				 */
+				virtual_pkt = q->virtual_previous
+					      + virtual_len;
+			else
+				/* We don't have the exact time at enqueue,
+				 * good enough. Jean */
+				virtual_pkt = q->virtual_advance;
+		} else
+			virtual_pkt = flow_cur->virtual_finish;
+	}
 
 	/* Compute virtual tag of next packet in the sub-queue (if any).
 	 * The finish time of the current packet is after virtual_dequeue. */
-	virtual_next = virtual_pkt + qdisc_pkt_len(skb);
+	virtual_next = virtual_pkt + virtual_len;
+
+	if (!(features & SCRR_F_METADATA)) {
+		/* Update flow virtual time, the length is weighted. */
+		flow_cur->virtual_finish = virtual_next;
+	}
 
-	/* Update flow virtual time.
-	 * STFQ : All flows have the same weight. Jean II */
-	flow_cur->virtual_finish = virtual_next;
+	if (trace_scrr_dequeue_enabled())
+		trace_scrr_dequeue(sch, scrr_flow_idx(q, flow_cur),
+				   qdisc_pkt_len(skb), virtual_pkt,
+				   q->virtual_advance,
+				   ( !(features & SCRR_F_ONE_LIST)
+				     && head == &q->new_flows ));
+
+	if (unlikely(q->telem_chan != NULL) && --q->telem_left == 0)
+		scrr_telem_record(q, flow_cur, skb, virtual_pkt,
+				  ( !(features & SCRR_F_ONE_LIST)
+				    && head == &q->new_flows ));
 
 #ifdef SCRR_DEBUG_STFQ_DEQUEUE
-	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; vpv:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, q->virtual_previous, sch->q.qlen);
+	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; vpv:%lld; ql:%d\n", scrr_flow_idx(q, flow_cur), virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, q->virtual_previous, sch->q.qlen);
 #endif	/* SCRR_DEBUG_STFQ_DEQUEUE */
 
 	/* Update virtual time - Check if queue is busy */
-	if (unlikely(sch->q.qlen == 0)) {
+	if (sch->q.qlen == 0) {
 		q->virtual_dequeue = virtual_next;
 		q->virtual_previous = q->virtual_advance;
 		q->virtual_advance = q->virtual_dequeue;
@@ -1473,13 +2823,43 @@ static struct sk_buff *scrr_qdisc_neia_dequeue(struct Qdisc *sch)
 			q->virtual_dequeue = virtual_pkt;
 	}
 
-	/* skb may be NULL after this point. Jean II */
-
 	/* SCRR: Self Clocked Round Robin Scheduling. Jean II */
 	/* If the sub-queue does not have a next packet,
 	 * or if the next packet of the sub-queue is after the
 	 * current virtual-time, we need to schedule another
 	 * sub-queue. Jean II */
+	if (!(features & SCRR_F_NO_EMPTY)) {
+		if ( (scrr_peek_skb(flow_cur) == NULL)
+		     || ( time_after64(virtual_next, q->virtual_advance) ) ) {
+
+			/* Advance the global clock as needed */
+			scrr_try_virtual_advance(q);
+
+			/* We could make the flows without packets inactive
+			 * here. The problem is that it would increase the
+			 * chance of starvation for the old flows, though
+			 * that flow coming back to the new list. This would
+			 * happen if a flow drips packets without accumulating
+			 * them in the sub-queue. We could always place
+			 * inactive flows at the back of the old list, however
+			 * light flows would loose their place in the
+			 * schedule, impacting fairness. */
+
+			/* Remove flow from head of current list,
+			 * advance to next sub-queue. */
+			head->first = flow_cur->next;
+
+			/* Add current flow at end of list of active flows */
+			scrr_robin_add_tail(&q->old_flows, flow_cur);
+		}
+		/* Else : if the next packet is older than the current
+		 * virtual-time, remain on the same sub-queue, so it will be
+		 * scheduled next time. */
+		return skb;
+	}
+
+	/* skb may be NULL after this point. */
+
 	if (unlikely(scrr_peek_skb(flow_cur) == NULL)) {
 		/* If the sub-queue is now empty, that flow becomes inactive.
 		 * It may be reactived in scrr_qdisc_enqueue().
@@ -1493,18 +2873,22 @@ static struct sk_buff *scrr_qdisc_neia_dequeue(struct Qdisc *sch)
 		 * put it in the list of new or old flows. Jean II */
 
 #ifdef SCRR_DEBUG_NOEMPTY_DEQUEUE
-		printk(KERN_DEBUG "SCRR: dequeue empty: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; vpv:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, q->virtual_previous, sch->q.qlen);
+		printk(KERN_DEBUG "SCRR: dequeue empty: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; vpv:%lld; ql:%d\n", scrr_flow_idx(q, flow_cur), virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, q->virtual_previous, sch->q.qlen);
 #endif	/* SCRR_DEBUG_NOEMPTY_DEQUEUE */
 
 exit_empty:
-		/* Flow goes inactive */
-		scrr_flow_set_detached(flow_cur);
-		q->stats.flows_inactive++;
-
 		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
+		 * advance to next sub-queue.
+		 * Must be done first, next is reused when detached. */
 		head->first = flow_cur->next;
 
+		/* Flow goes inactive */
+		scrr_flow_set_detached(q, flow_cur);
+		q->stats.flows_inactive++;
+		if (trace_scrr_flow_detach_enabled())
+			trace_scrr_flow_detach(sch, scrr_flow_idx(q, flow_cur),
+					       flow_cur->virtual_finish);
+
 		/* Advance the global clock as needed, but after
 		 * updating the number of flows. Jean II */
 		goto exit_advance;
@@ -1512,7 +2896,7 @@ exit_empty:
 	} else if (likely( time_after64(virtual_next, q->virtual_advance) )) {
 
 		/* If the next packet of the sub-queue is after the
-		 * current virtual-time, it can't be sent in that 
+		 * current virtual-time, it can't be sent in that
 		 * scheduling round. Jean II */
 
 		/* Remove flow from head of current list,
@@ -1520,7 +2904,10 @@ exit_empty:
 		head->first = flow_cur->next;
 
 		/* Add current flow at end of the list of active flows */
-		scrr_robin_add_tail(&q->old_flows, flow_cur);
+		if (features & SCRR_F_ONE_LIST)
+			scrr_robin_add_tail(&q->new_flows, flow_cur);
+		else
+			scrr_robin_add_tail(&q->old_flows, flow_cur);
 
 exit_advance:
 		/* Advance the global clock as needed */
@@ -1534,549 +2921,2523 @@ exit_advance:
 	return skb;
 }
 
-/* QDisc remove a packet from our queue - head of queue.
- * Basic version of SCRR, no enhancements. */
-static struct sk_buff *scrr_qdisc_basic_dequeue(struct Qdisc *sch)
+/* Bypass.
+ * With TCQ_F_CAN_BYPASS, the stack sends packets straight to the driver
+ * when we are empty, and we never see them. That's only fair if going
+ * through us would change nothing, i.e. no flow is scheduled, so that
+ * the next packet of any flow starts at the current virtual clock,
+ * bypassed packet or not. The no-empty variants have no flow left when
+ * the queue drains, the others keep empty flows in the lists until the
+ * next visit, detach those now. Those flows would have been detached on
+ * their next visit anyway. Bypassed packets only show in bstats.
+ */
+static void scrr_bypass_idle(struct Qdisc *sch)
 {
 	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct scrr_flow_head *	head;
+	struct scrr_flow_head *	heads[2] = { &q->new_flows, &q->old_flows };
 	struct scrr_flow *	flow_cur;
+	struct scrr_flow *	flow_next;
+	int			i;
+
+	for (i = 0; i < 2; i++) {
+		flow_cur = heads[i]->first;
+		heads[i]->first = NULL;
+		while (flow_cur != NULL) {
+			/* next is reused when detached */
+			flow_next = flow_cur->next;
+			scrr_flow_set_detached(q, flow_cur);
+			q->stats.flows_inactive++;
+			if (trace_scrr_flow_detach_enabled())
+				trace_scrr_flow_detach(sch,
+						       scrr_flow_idx(q, flow_cur),
+						       flow_cur->virtual_finish);
+			flow_cur = flow_next;
+		}
+	}
+
+	/* Same as a fresh qdisc, the next flow starts a new round */
+	q->rounds_advance = -1;
+}
+
+static inline u32 scrr_bypass_count(struct Qdisc *sch)
+{
+	const struct scrr_sched_data *q = qdisc_priv(sch);
+
+	return (u32) (u64_stats_read(&sch->bstats.packets) - q->packets_sched);
+}
+
+/* Dequeue of a variant, then let the stack bypass us once the scheduler
+ * has drained. */
+static __always_inline struct sk_buff *scrr_dequeue_variant(struct Qdisc *sch,
+							    const u32 features)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
 	struct sk_buff *	skb;
-	u64			virtual_pkt;
-	u64			virtual_next;
 
-	/* If all sub-queues are empty, nothing to schedule. */
-	if (unlikely(sch->q.qlen == 0))
-		return NULL;
+	skb = scrr_dequeue_core(sch, features);
 
-	/* Default case : use list of currently active flows. */
-	head = &q->new_flows;
-	if (unlikely(head->first == NULL)) {
-		printk_ratelimited(KERN_ERR "SCRR: no flow to schedule !\n");
-		return NULL;
-	}
-	/* Pick first flow of the list. The list is rotated as needed. */
-	flow_cur = head->first;
+	if ( unlikely(q->flags & SCF_BYPASS)
+	     && sch->q.qlen == 0
+	     && (q->new_flows.first != NULL || q->old_flows.first != NULL) )
+		scrr_bypass_idle(sch);
+	return skb;
+}
 
-	/* Always dequeue a packet. Or try. Jean II */
-	skb = scrr_dequeue_skb(sch, flow_cur);
+/* Enqueue of each variant. The enqueue only depends on the metadata and
+ * the list selection, so variants differing only by their dequeue
+ * share the same enqueue. */
+static int scrr_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+			      struct sk_buff **to_free)
+{
+	return scrr_enqueue_core(skb, sch, to_free, SCRR_V_SCRR);
+}
 
-	if (unlikely(skb == NULL)) {
-		/* This is not supposed to happen, empty flows are supposed
-		 * to always go inactive below. Jean II */
-		printk_ratelimited(KERN_ERR "SCRR: flow with no SKB !\n");
+static int scrr_qdisc_npm_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+				  struct sk_buff **to_free)
+{
+	return scrr_enqueue_core(skb, sch, to_free, SCRR_V_NPM);
+}
 
-#ifdef SCRR_DEBUG_BURST_AVG
-		q->stats.sched_empty++;
-#endif	/* SCRR_DEBUG_BURST_AVG */
+static int scrr_qdisc_nmne_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+				   struct sk_buff **to_free)
+{
+	return scrr_enqueue_core(skb, sch, to_free, SCRR_V_NMNE);
+}
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue, and bail out... */
-		goto exit_empty;
-	}
+static int scrr_qdisc_pi2_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+				  struct sk_buff **to_free)
+{
+	int ret;
 
-	/* Qdisc stats accounting */
-	qdisc_bstats_update(sch, skb);
+	ret = scrr_enqueue_core(skb, sch, to_free, SCRR_V_PI2);
 
-#ifdef SCRR_DEBUG_BURST_AVG
-	/* Check if packet is part of the same burst.
-	 * If there is only one active flow, burstiness does not make sense */
-	if ( (flow_cur->flow_idx == q->flow_sched_prev)
-	     && (q->stats.flows - q->stats.flows_inactive > 1) ) {
-		/* Part of same burst, just add */
-		q->burst_cur += qdisc_pkt_len(skb);
-	} else {
-		/* Add previous burst to average */
-		if (q->burst_cur > q->stats.burst_peak)
-			q->stats.burst_peak = q->burst_cur;
-		if (q->stats.burst_avg == 0)
-			q->stats.burst_avg = q->burst_cur;
+	/* If packets are just dripping through one by one, dequeue never
+	 * sees a qlen > 0 to update our parents. */
+	scrr_pi2_reduce_backlog(sch);
+	return ret;
+}
+
+/* Dequeue of each variant. */
+static struct sk_buff *scrr_qdisc_dequeue(struct Qdisc *sch)
+{
+	return scrr_dequeue_variant(sch, SCRR_V_SCRR);
+}
+
+static struct sk_buff *scrr_qdisc_npm_dequeue(struct Qdisc *sch)
+{
+	return scrr_dequeue_variant(sch, SCRR_V_NPM);
+}
+
+static struct sk_buff *scrr_qdisc_nmia_dequeue(struct Qdisc *sch)
+{
+	return scrr_dequeue_variant(sch, SCRR_V_NMIA);
+}
+
+static struct sk_buff *scrr_qdisc_nmne_dequeue(struct Qdisc *sch)
+{
+	return scrr_dequeue_variant(sch, SCRR_V_NMNE);
+}
+
+static struct sk_buff *scrr_qdisc_neia_dequeue(struct Qdisc *sch)
+{
+	return scrr_dequeue_variant(sch, SCRR_V_NEIA);
+}
+
+static struct sk_buff *scrr_qdisc_basic_dequeue(struct Qdisc *sch)
+{
+	return scrr_dequeue_variant(sch, SCRR_V_BASIC);
+}
+
+static struct sk_buff *scrr_qdisc_pi2_dequeue(struct Qdisc *sch)
+{
+	struct sk_buff *skb = scrr_dequeue_variant(sch, SCRR_V_PI2);
+
+	scrr_pi2_reduce_backlog(sch);
+	return skb;
+}
+
+static void scrr_hash_free(void *addr)
+{
+	kvfree(addr);
+}
+
+/* Move flows from the open addressing table to the RB trees. */
+static void scrr_oa_to_rb(struct scrr_sched_data *q,
+			  struct scrr_oa_bucket *old_table, u32 old_buckets,
+			  struct rb_root *new_array, u32 new_log)
+{
+	struct rb_node **np, *parent;
+	struct rb_root *nroot;
+	struct scrr_flow_cold *oc, *nc;
+	struct scrr_flow *of;
+	u32 idx;
+	int slot;
+
+	for (idx = 0; idx < old_buckets; idx++) {
+		for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+			of = old_table[idx].flows[slot];
+			if (of == NULL)
+				continue;
+			if (scrr_gc_candidate(q, of)) {
+				scrr_flow_free_detached(q, of);
+				continue;
+			}
+			oc = scrr_flow_cold(q, of);
+			nroot = &new_array[oc->flow_idx & ((1U << new_log) - 1)];
+
+			np = &nroot->rb_node;
+			parent = NULL;
+			while (*np) {
+				parent = *np;
+
+				nc = rb_entry(parent, struct scrr_flow_cold, hash_node);
+				BUG_ON(scrr_flow_id_eq(nc, oc->flow_idx,
+						       oc->flow_key));
+
+				if (scrr_flow_id_gt(nc, oc->flow_idx,
+						    oc->flow_key))
+					np = &parent->rb_right;
+				else
+					np = &parent->rb_left;
+			}
+
+			rb_link_node(&oc->hash_node, parent, np);
+			rb_insert_color(&oc->hash_node, nroot);
+		}
+	}
+}
+
+/* Insert one flow of the old classifier in the new table. */
+static int scrr_oa_rehash_flow(struct scrr_sched_data *q,
+			       struct scrr_oa_bucket *new_table,
+			       u32 new_buckets,
+			       struct scrr_flow *of)
+{
+	/* Don't bother, will be freed on commit */
+	if (scrr_gc_candidate(q, of))
+		return 0;
+	if (scrr_oa_insert(new_table, new_buckets, of, scrr_flow_idx(q, of)))
+		return 0;
+	/* Inactive flows can be dropped, active flows are in the
+	 * round robin lists, can't make them disappear. */
+	if (scrr_flow_is_detached(of))
+		return 0;
+	return -ENOSPC;
+}
+
+/* Free one flow of the old classifier if it did not make it to
+ * the new table. */
+static void scrr_oa_rehash_commit(struct scrr_sched_data *q,
+				  struct scrr_flow *of)
+{
+	u32 probes;
+
+	if (scrr_oa_lookup(q, scrr_flow_idx(q, of), scrr_flow_key(q, of),
+			   &probes) == of)
+		return;
+	scrr_flow_free_detached(q, of);
+}
+
+/* Move flows from the current classifier to the open addressing table.
+ * The new table may be too small, so we insert everything before
+ * touching the old classifier, so that we can back out. */
+static int scrr_oa_rehash(struct scrr_sched_data *q,
+			  struct scrr_oa_bucket *new_table, u32 new_buckets)
+{
+	struct scrr_flow_cold *oc, *nc;
+	struct scrr_flow *of;
+	u32 idx;
+	int slot;
+	int err;
+
+	if (q->hash_root) {
+		for (idx = 0; idx < q->hash_buckets; idx++) {
+			rbtree_postorder_for_each_entry_safe(oc, nc,
+							     &q->hash_root[idx],
+							     hash_node) {
+				of = scrr_cold_flow(q, oc);
+				err = scrr_oa_rehash_flow(q, new_table,
+							  new_buckets, of);
+				if (err)
+					return err;
+			}
+		}
+	}
+	if (q->oa_table) {
+		for (idx = 0; idx < q->hash_buckets; idx++) {
+			for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+				of = q->oa_table[idx].flows[slot];
+				if (of == NULL)
+					continue;
+				err = scrr_oa_rehash_flow(q, new_table,
+							  new_buckets, of);
+				if (err)
+					return err;
+			}
+		}
+	}
+	return 0;
+}
+
+static int scrr_oa_resize(struct Qdisc *sch, u32 log)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct scrr_oa_bucket *table;
+	struct scrr_oa_bucket *old_table;
+	struct rb_root *old_hash_root;
+	struct rb_root *old_migrated;
+	struct rb_root *old_drained;
+	u32 old_buckets;
+	struct scrr_flow_cold *oc, *nc;
+	struct scrr_flow *of;
+	u32 idx;
+	int slot;
+	int err;
+
+	if (q->oa_table && log == q->hash_trees_log)
+		return 0;
+
+	/* If XPS was setup, we can allocate memory on right NUMA node */
+	table = kvzalloc_node(sizeof(struct scrr_oa_bucket) << log,
+			      GFP_KERNEL | __GFP_RETRY_MAYFAIL,
+			      netdev_queue_numa_node_read(sch->dev_queue));
+	if (!table)
+		return -ENOMEM;
+
+	sch_tree_lock(sch);
+
+	/* Complete pending incremental rehash, simpler */
+	old_migrated = scrr_rehash_finish(q);
+	old_drained = q->hash_root_drained;
+	q->hash_root_drained = NULL;
+
+	err = scrr_oa_rehash(q, table, 1U << log);
+	if (err) {
+		sch_tree_unlock(sch);
+		scrr_hash_free(table);
+		scrr_hash_free(old_migrated);
+		scrr_hash_free(old_drained);
+		return err;
+	}
+
+	old_hash_root = q->hash_root;
+	old_table = q->oa_table;
+	old_buckets = q->hash_buckets;
+
+	q->classifier = SCRR_CLASSIFIER_OA;
+	q->hash_root = NULL;
+	q->oa_table = table;
+	q->hash_trees_log = log;
+	q->hash_buckets = 1U << log;
+
+	/* Free flows left behind. The old RB trees are going away,
+	 * no need to erase anything. */
+	if (old_hash_root) {
+		for (idx = 0; idx < old_buckets; idx++) {
+			rbtree_postorder_for_each_entry_safe(oc, nc,
+							     &old_hash_root[idx],
+							     hash_node)
+				scrr_oa_rehash_commit(q, scrr_cold_flow(q, oc));
+		}
+	}
+	if (old_table) {
+		for (idx = 0; idx < old_buckets; idx++) {
+			for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+				of = old_table[idx].flows[slot];
+				if (of != NULL)
+					scrr_oa_rehash_commit(q, of);
+			}
+		}
+	}
+
+	sch_tree_unlock(sch);
+
+	scrr_hash_free(old_hash_root);
+	scrr_hash_free(old_table);
+	scrr_hash_free(old_migrated);
+	scrr_hash_free(old_drained);
+
+	return 0;
+}
+
+static struct rb_root *scrr_hash_alloc(struct Qdisc *sch, u32 log)
+{
+	struct rb_root *array;
+	u32 idx;
+
+	/* If XPS was setup, we can allocate memory on right NUMA node */
+	array = kvmalloc_node(sizeof(struct rb_root) << log, GFP_KERNEL | __GFP_RETRY_MAYFAIL,
+			      netdev_queue_numa_node_read(sch->dev_queue));
+	if (!array)
+		return NULL;
+
+	for (idx = 0; idx < (1U << log); idx++)
+		array[idx] = RB_ROOT;
+	return array;
+}
+
+static int scrr_hash_resize(struct Qdisc *sch, u32 log, u32 classifier)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct rb_root *array;
+	void *old_migrated;
+	void *old_drained;
+	void *old_oa_table;
+
+	if (classifier == SCRR_CLASSIFIER_OA)
+		return scrr_oa_resize(sch, log);
+
+	if (q->hash_root && log == q->hash_trees_log)
+		return 0;
+
+	array = scrr_hash_alloc(sch, log);
+	if (!array)
+		return -ENOMEM;
+
+	sch_tree_lock(sch);
+
+	/* Only one incremental rehash at a time, complete the previous */
+	old_migrated = scrr_rehash_finish(q);
+	old_drained = q->hash_root_drained;
+	q->hash_root_drained = NULL;
+
+	/* Open addressing to RB trees is done in one step */
+	old_oa_table = q->oa_table;
+	if (old_oa_table) {
+		scrr_oa_to_rb(q, old_oa_table, q->hash_buckets, array, log);
+		q->oa_table = NULL;
+	}
+
+	/* Current RB trees, if any, are migrated incrementally */
+	scrr_rehash_start(q, array, log);
+
+	sch_tree_unlock(sch);
+
+	scrr_hash_free(old_migrated);
+	scrr_hash_free(old_drained);
+	scrr_hash_free(old_oa_table);
+
+	return 0;
+}
+
+/* Free the array drained by scrr_rehash_step(), and auto-grow. */
+static void scrr_hash_work(struct work_struct *work)
+{
+	struct scrr_sched_data *q = container_of(work, struct scrr_sched_data,
+						 hash_work);
+	struct Qdisc *sch = q->sch;
+	struct rb_root *array = NULL;
+	void *old_drained;
+	u32 log;
+
+	sch_tree_lock(sch);
+	old_drained = q->hash_root_drained;
+	q->hash_root_drained = NULL;
+	log = q->hash_trees_log + 1;
+	if (!scrr_hash_need_grow(q))
+		log = 0;
+	sch_tree_unlock(sch);
+
+	scrr_hash_free(old_drained);
+
+	if (log == 0)
+		return;
+
+	array = scrr_hash_alloc(sch, log);
+	if (!array)
+		return;
+
+	/* Config may have changed while we were not looking */
+	sch_tree_lock(sch);
+	if (scrr_hash_need_grow(q) && log == q->hash_trees_log + 1) {
+		scrr_rehash_start(q, array, log);
+		array = NULL;
+	}
+	sch_tree_unlock(sch);
+
+	scrr_hash_free(array);
+}
+
+static const struct nla_policy scrr_policy[TCA_SCRR_MAX + 1] = {
+	[TCA_SCRR_PLIMIT]		= { .type = NLA_U32 },
+	[TCA_SCRR_BUCKETS_LOG]		= { .type = NLA_U32 },
+	[TCA_SCRR_HASH_MASK]		= { .type = NLA_U32 },
+	[TCA_SCRR_FLOW_PLIMIT]		= { .type = NLA_U32 },
+	[TCA_SCRR_FLAGS]		= { .type = NLA_U32 },
+	[TCA_SCRR_CLASSIFIER]		= { .type = NLA_U32 },
+	[TCA_SCRR_HASH_LOAD]		= { .type = NLA_U32 },
+	[TCA_SCRR_GC_AGE]		= { .type = NLA_U32 },
+	[TCA_SCRR_GSO_SPLIT]		= { .type = NLA_U32 },
+	[TCA_SCRR_SK_CACHE]		= { .type = NLA_U32 },
+	[TCA_SCRR_FLOW_BLIMIT]		= { .type = NLA_U32 },
+	[TCA_SCRR_HORIZON]		= { .type = NLA_U32 },
+	[TCA_SCRR_TELEMETRY]		= { .type = NLA_U32 },
+	[TCA_SCRR_TARGET]		= { .type = NLA_U32 },
+	[TCA_SCRR_TUPDATE]		= { .type = NLA_U32 },
+	[TCA_SCRR_ALPHA]		= { .type = NLA_U32 },
+	[TCA_SCRR_BETA]			= { .type = NLA_U32 },
+	[TCA_SCRR_COUPLING]		= { .type = NLA_U32 },
+	[TCA_SCRR_UDP_PLIMIT]		= { .type = NLA_U32 },
+	[TCA_SCRR_MAX_FLOWS]		= { .type = NLA_U32 },
+	[TCA_SCRR_WEIGHT_SRC]		= { .type = NLA_U32 },
+	[TCA_SCRR_WEIGHTS]		= { .type = NLA_BINARY,
+					    .len = SCRR_WEIGHT_CLASSES },
+};
+
+/* Precompute the reciprocal of the weights, see scrr_weighted_len() */
+static void scrr_weights_update(struct scrr_sched_data *q)
+{
+	int i;
+
+	for (i = 0; i < SCRR_WEIGHT_CLASSES; i++)
+		q->weight_inv[i] = (1U << SCRR_WEIGHT_SHIFT) / q->weights[i];
+}
+
+static int scrr_qdisc_change(struct Qdisc *sch,
+			     struct nlattr *opt,
+			     struct netlink_ext_ack *extack)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct nlattr *tb[TCA_SCRR_MAX + 1];
+	struct scrr_flow *flow_shared = NULL;
+	struct scrr_sk_cache *sk_cache = NULL;
+	struct scrr_sk_cache *sk_cache_old = NULL;
+	struct rchan	*telem_chan = NULL;
+	struct rchan	*telem_old = NULL;
+	u32		sk_cache_size = 0;
+	u32		plimit;
+	u32		hash_log_new;
+	u32		classifier_new;
+	int		err;
+	int		drop_count = 0;
+	unsigned	drop_len = 0;
+
+	if (!opt)
+		return -EINVAL;
+
+	err = nla_parse_nested_deprecated(tb, TCA_SCRR_MAX, opt, scrr_policy,
+					  NULL);
+	if (err < 0)
+		return err;
+
+	/* Check limit before locking */
+	if (tb[TCA_SCRR_PLIMIT]) {
+		plimit = nla_get_u32(tb[TCA_SCRR_PLIMIT]);
+		/* Can't be negative... */
+		if (plimit == 0)
+			return -EINVAL;
+	}
+	if (tb[TCA_SCRR_TARGET] && nla_get_u32(tb[TCA_SCRR_TARGET]) == 0)
+		return -EINVAL;
+	if (tb[TCA_SCRR_WEIGHT_SRC]
+	    && nla_get_u32(tb[TCA_SCRR_WEIGHT_SRC]) > SCRR_WEIGHT_CLASSID)
+		return -EINVAL;
+	if (tb[TCA_SCRR_WEIGHTS]) {
+		u8 *weights = nla_data(tb[TCA_SCRR_WEIGHTS]);
+		int i;
+
+		/* Weights below one would break the burst bound */
+		for (i = 0; i < nla_len(tb[TCA_SCRR_WEIGHTS]); i++)
+			if (weights[i] == 0)
+				return -EINVAL;
+	}
+
+	if (tb[TCA_SCRR_SK_CACHE]) {
+		u32 nval = nla_get_u32(tb[TCA_SCRR_SK_CACHE]);
+
+		if (nval > SCRR_SK_CACHE_MAX)
+			return -EINVAL;
+		if (nval != 0)
+			sk_cache_size = roundup_pow_of_two(max_t(u32, nval,
+							SCRR_SK_CACHE_MIN));
+	}
+
+	/* Allocations can sleep, do them before locking */
+	if (sk_cache_size != 0 && sk_cache_size != q->sk_cache_size) {
+		sk_cache = kvzalloc_node(sk_cache_size
+					 * sizeof(struct scrr_sk_cache),
+					 GFP_KERNEL,
+					 netdev_queue_numa_node_read(sch->dev_queue));
+		if (!sk_cache)
+			return -ENOMEM;
+	}
+	if (tb[TCA_SCRR_MAX_FLOWS]) {
+		err = scrr_pool_create(sch,
+				       nla_get_u32(tb[TCA_SCRR_MAX_FLOWS]));
+		if (err) {
+			kvfree(sk_cache);
+			return err;
+		}
+	}
+	if (tb[TCA_SCRR_FLAGS]
+	    && (nla_get_u32(tb[TCA_SCRR_FLAGS]) & SCF_FLOW_SHARE)
+	    && q->flow_shared == NULL) {
+		flow_shared = kmem_cache_alloc_node(q->flow_cachep, GFP_KERNEL,
+				netdev_queue_numa_node_read(sch->dev_queue));
+		if (!flow_shared) {
+			kvfree(sk_cache);
+			return -ENOMEM;
+		}
+	}
+	if (tb[TCA_SCRR_TELEMETRY]
+	    && nla_get_u32(tb[TCA_SCRR_TELEMETRY]) != 0
+	    && q->telem_chan == NULL) {
+		telem_chan = scrr_telem_open(sch, extack);
+		if (IS_ERR(telem_chan)) {
+			if (flow_shared)
+				kmem_cache_free(q->flow_cachep, flow_shared);
+			kvfree(sk_cache);
+			return PTR_ERR(telem_chan);
+		}
+	}
+
+	sch_tree_lock(sch);
+
+	if (tb[TCA_SCRR_SK_CACHE] && sk_cache_size != q->sk_cache_size) {
+		/* Flows in the old cache still have their sk_slot, a new
+		 * entry never has them, scrr_sk_cache_forget() is fine */
+		sk_cache_old = q->sk_cache;
+		q->sk_cache = sk_cache;
+		q->sk_cache_size = sk_cache_size;
+		q->sk_cache_log = sk_cache_size ? ilog2(sk_cache_size) : 0;
+	}
+
+	if (flow_shared) {
+		scrr_flow_shared_init(q, flow_shared);
+		q->flow_shared = flow_shared;
+	}
+
+	if (tb[TCA_SCRR_PLIMIT])
+		sch->limit = plimit;
+
+	hash_log_new = q->hash_trees_log;
+	if (tb[TCA_SCRR_BUCKETS_LOG]) {
+		u32 nval = nla_get_u32(tb[TCA_SCRR_BUCKETS_LOG]);
+
+		if (nval >= 1 && nval <= SCRR_HASH_LOG_MAX)
+			hash_log_new = nval;
 		else
-			q->stats.burst_avg = ( ( q->stats.burst_avg * 7
-						 + q->burst_cur ) / 8 );
-		/* Start new burst */
-		q->burst_cur = qdisc_pkt_len(skb);
-		q->flow_sched_prev = flow_cur->flow_idx;
+			err = -EINVAL;
 	}
-#endif	/* SCRR_DEBUG_BURST_AVG */
 
-	/* Get virtual tag of this packet. */
-	virtual_pkt = scrr_skb_cb(skb)->virtual_start;
-	/* Compute virtual tag of next packet in the sub-queue (if any).
-	 * The finish time of the current packet is after virtual_dequeue. */
-	virtual_next = virtual_pkt + qdisc_pkt_len(skb);
+	classifier_new = q->classifier;
+	if (tb[TCA_SCRR_CLASSIFIER]) {
+		u32 nval = nla_get_u32(tb[TCA_SCRR_CLASSIFIER]);
+
+		if (nval == SCRR_CLASSIFIER_RBTREE || nval == SCRR_CLASSIFIER_OA)
+			classifier_new = nval;
+		else
+			err = -EINVAL;
+	}
+
+	if (tb[TCA_SCRR_HASH_MASK])
+		q->hash_mask = nla_get_u32(tb[TCA_SCRR_HASH_MASK]);
+
+	if (tb[TCA_SCRR_HASH_LOAD])
+		q->hash_load = nla_get_u32(tb[TCA_SCRR_HASH_LOAD]);
+
+	if (tb[TCA_SCRR_FLOW_PLIMIT])
+		q->flow_plimit = nla_get_u32(tb[TCA_SCRR_FLOW_PLIMIT]);
+
+	if (tb[TCA_SCRR_FLOW_BLIMIT])
+		q->flow_blimit = nla_get_u32(tb[TCA_SCRR_FLOW_BLIMIT]);
+
+	if (tb[TCA_SCRR_HORIZON])
+		q->horizon_ns = (u64) nla_get_u32(tb[TCA_SCRR_HORIZON])
+				* NSEC_PER_USEC;
+
+	if (tb[TCA_SCRR_GC_AGE])
+		q->gc_age = usecs_to_jiffies(nla_get_u32(tb[TCA_SCRR_GC_AGE]));
+
+	if (tb[TCA_SCRR_TELEMETRY]) {
+		q->telem_sample = nla_get_u32(tb[TCA_SCRR_TELEMETRY]);
+		q->telem_left = q->telem_sample;
+		if (telem_chan) {
+			/* Packets already in the queue have no timestamp */
+			q->telem_start_ns = ktime_get_ns();
+			q->telem_chan = telem_chan;
+		} else if (q->telem_sample == 0) {
+			telem_old = q->telem_chan;
+			q->telem_chan = NULL;
+		}
+	}
+
+	if (tb[TCA_SCRR_GSO_SPLIT])
+		q->gso_split = nla_get_u32(tb[TCA_SCRR_GSO_SPLIT]);
+
+	if (tb[TCA_SCRR_WEIGHT_SRC])
+		q->weight_src = nla_get_u32(tb[TCA_SCRR_WEIGHT_SRC]);
+
+	if (tb[TCA_SCRR_WEIGHTS]) {
+		/* Classes not in the table have a weight of one.
+		 * Packets in the queue keep their weight. */
+		memset(q->weights, 1, sizeof(q->weights));
+		nla_memcpy(q->weights, tb[TCA_SCRR_WEIGHTS],
+			   nla_len(tb[TCA_SCRR_WEIGHTS]));
+		scrr_weights_update(q);
+	}
+
+	if (tb[TCA_SCRR_FLAGS]) {
+		u32 flags = nla_get_u32(tb[TCA_SCRR_FLAGS]);
+
+		/* Packets already in the queue have no timestamp */
+		if ( (flags & SCF_SOJOURN_HIST)
+		     && !(q->flags & SCF_SOJOURN_HIST) )
+			q->sojourn_start_ns = ktime_get_ns();
+		/* Flows keep the identity they were created with, after a
+		 * switch of SCF_EXACT_FLOW the new packets of a flow go to
+		 * a new flow, the old one drains and is collected. */
+		q->flags = flags;
+		/* Bypassed packets would not be paced */
+		if ( (flags & SCF_BYPASS) && !(flags & SCF_PACING) )
+			sch->flags |= TCQ_F_CAN_BYPASS;
+		else
+			sch->flags &= ~TCQ_F_CAN_BYPASS;
+		/* Throttled flows would wait for nothing */
+		if (!(flags & SCF_PACING))
+			scrr_wheel_flush(q);
+	}
+
+	/* PI2 attributes, only used by scrr_pi2 */
+	if (tb[TCA_SCRR_TARGET]) {
+		/* Checked above */
+		q->pi2_config.target_ns = ( (u64) nla_get_u32(tb[TCA_SCRR_TARGET])
+					    * NSEC_PER_USEC );
+		/* Unless specified, tupdate follows target, clamp at 1s */
+		if (!tb[TCA_SCRR_TUPDATE])
+			q->pi2_config.tupdate_ns = (u32) min_t(s64,
+						q->pi2_config.target_ns,
+						NSEC_PER_SEC);
+	}
+	if (tb[TCA_SCRR_TUPDATE]) {
+		u32 tupdate_us = nla_get_u32(tb[TCA_SCRR_TUPDATE]);
+
+		/* Clamp at 1s, to avoid overflowing 32 bits */
+		if (tupdate_us > USEC_PER_SEC)
+			tupdate_us = USEC_PER_SEC;
+		q->pi2_config.tupdate_ns = tupdate_us * NSEC_PER_USEC;
+	}
+	if (tb[TCA_SCRR_ALPHA])
+		q->pi2_config.alpha = nla_get_u32(tb[TCA_SCRR_ALPHA]);
+	if (tb[TCA_SCRR_BETA])
+		q->pi2_config.beta = nla_get_u32(tb[TCA_SCRR_BETA]);
+	if (tb[TCA_SCRR_COUPLING])
+		/* Prevent divide by zero. Also, make sure it's sensible */
+		q->pi2_config.coupling = clamp_t(u32,
+					 nla_get_u32(tb[TCA_SCRR_COUPLING]),
+					 ALPHA_BETA_SCALE / 4,
+					 16 * ALPHA_BETA_SCALE);
+	if (tb[TCA_SCRR_UDP_PLIMIT])
+		q->udp_plimit = nla_get_u32(tb[TCA_SCRR_UDP_PLIMIT]);
+	pi2_aqm_param_update(q);
+
+	if (!err) {
+
+		sch_tree_unlock(sch);
+		/* Only done if hash_log_new != q->hash_trees_log
+		 * or if the classifier changes */
+		err = scrr_hash_resize(sch, hash_log_new, classifier_new);
+		sch_tree_lock(sch);
+	}
+
+	/* Flows keep their backlog only if someone needs it */
+	if ( ((q->flags & SCF_FAT_DROP) || q->flow_blimit != 0)
+	     != q->backlog_track )
+		scrr_backlog_track(q, !q->backlog_track);
+
+	while (sch->q.qlen > sch->limit) {
+		struct sk_buff *skb = scrr_qdisc_dequeue(sch);
+
+		if (!skb)
+			break;
+		drop_len += qdisc_pkt_len(skb);
+		rtnl_kfree_skbs(skb, skb);
+		drop_count++;
+	}
+	qdisc_tree_reduce_backlog(sch, drop_count, drop_len);
+
+	/* Bypass just enabled, flows may be left from before */
+	if ((q->flags & SCF_BYPASS) && sch->q.qlen == 0)
+		scrr_bypass_idle(sch);
+
+	sch_tree_unlock(sch);
+
+	kvfree(sk_cache_old);
+	scrr_telem_close(q, telem_old);
+
+#ifdef SCRR_DEBUG_CONFIG
+	printk(KERN_DEBUG "SCRR: plimit %d; logs %d; mask 0x%X; flow_plimit %d; flags 0x%X; classifier %d; max_flows %d\n", sch->limit, q->hash_trees_log, q->hash_mask, q->flow_plimit, q->flags, q->classifier, q->pool.size);
+#endif	/* SCRR_DEBUG_CONFIG */
+
+	return err;
+}
+
+static int scrr_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts;
+
+	opts = nla_nest_start_noflag(skb, TCA_OPTIONS);
+	if (opts == NULL)
+		goto nla_put_failure;
+
+	/* Standard queue limit */
+	if (nla_put_u32(skb, TCA_SCRR_PLIMIT, sch->limit))
+		goto nla_put_failure;
+
+	/* Hashing attributes */
+	if (nla_put_u32(skb, TCA_SCRR_BUCKETS_LOG, q->hash_trees_log))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_HASH_MASK, q->hash_mask))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_CLASSIFIER, q->classifier))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_HASH_LOAD, q->hash_load))
+		goto nla_put_failure;
+
+	/* Other attributes */
+	if (nla_put_u32(skb, TCA_SCRR_FLOW_PLIMIT, q->flow_plimit))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_FLOW_BLIMIT, q->flow_blimit))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_HORIZON,
+			div_u64(q->horizon_ns, NSEC_PER_USEC)))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_TELEMETRY, q->telem_sample))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_FLAGS, q->flags))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_GC_AGE, jiffies_to_usecs(q->gc_age)))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_GSO_SPLIT, q->gso_split))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_SK_CACHE, q->sk_cache_size))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_MAX_FLOWS, q->pool.size))
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SCRR_WEIGHT_SRC, q->weight_src))
+		goto nla_put_failure;
+	if (nla_put(skb, TCA_SCRR_WEIGHTS, sizeof(q->weights), q->weights))
+		goto nla_put_failure;
+
+	/* PI2 attributes */
+	if (q->flow_cachep == scrr_pi2_flow_cachep) {
+		if (nla_put_u32(skb, TCA_SCRR_TARGET,
+				div_u64(q->pi2_config.target_ns,
+					NSEC_PER_USEC)) ||
+		    nla_put_u32(skb, TCA_SCRR_TUPDATE,
+				q->pi2_config.tupdate_ns / NSEC_PER_USEC) ||
+		    nla_put_u32(skb, TCA_SCRR_ALPHA, q->pi2_config.alpha) ||
+		    nla_put_u32(skb, TCA_SCRR_BETA, q->pi2_config.beta) ||
+		    nla_put_u32(skb, TCA_SCRR_COUPLING,
+				q->pi2_config.coupling) ||
+		    nla_put_u32(skb, TCA_SCRR_UDP_PLIMIT, q->udp_plimit))
+			goto nla_put_failure;
+	}
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	return -1;
+}
+
+/* Memory used by the flows and the flow table, for xstats. */
+static u64 scrr_mem_used(const struct scrr_sched_data *q)
+{
+	u64 mem = (u64) q->stats.flows * kmem_cache_size(q->flow_cachep);
+
+	/* The pool is allocated whole, whatever is in use */
+	if (q->pool.base)
+		mem += (u64) q->stats.pool_free * q->pool.obj_size;
+
+	if (q->oa_table)
+		mem += (u64) q->hash_buckets * sizeof(struct scrr_oa_bucket);
+	if (q->hash_root)
+		mem += (u64) q->hash_buckets * sizeof(struct rb_root);
+	if (q->hash_root_old)
+		mem += (u64) q->hash_buckets_old * sizeof(struct rb_root);
+	mem += (u64) q->sk_cache_size * sizeof(struct scrr_sk_cache);
+	return mem;
+}
+
+static int scrr_qdisc_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct tc_scrr_xstats st;
+
+	memcpy(&st, &q->stats, sizeof(st));
+	st.mem_used = scrr_mem_used(q);
+	st.bypass = scrr_bypass_count(sch);
+
+	/* Reset some of the statistics, unless disabled */
+	if ( ! (q->flags & SCF_PEAK_NORESET) ) {
+		q->stats.qlen_peak = 0;
+		q->stats.backlog_peak = 0;
+		q->stats.burst_peak = 0;
+		q->stats.probe_peak = 0;
+		q->stats.gc_lat_peak_ms = 0;
+	}
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
+
+static int scrr_qdisc_init_cache(struct Qdisc *sch,
+				 struct nlattr *opt,
+				 struct netlink_ext_ack *extack,
+				 struct kmem_cache *flow_cachep)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	int err;
+
+#ifdef SCRR_DEBUG_CONFIG
+	printk(KERN_DEBUG "SCRR: sizeof(scrr_flow) %lu\n", sizeof(struct scrr_flow));
+#endif	/* SCRR_DEBUG_CONFIG */
+
+	/* First, destroy cancels it whatever happens */
+	qdisc_watchdog_init(&q->watchdog, sch);
+
+	/* Configuration */
+	sch->limit		= SCRR_PLIMIT_DEFLT;
+	q->flow_plimit		= SCRR_FLOW_PLIMIT_DEFLT;
+	q->hash_mask		= SCRR_HASH_MASK_DEFLT;
+	q->hash_load		= SCRR_HASH_LOAD_DEFLT;
+	q->gc_age		= SCRR_GC_AGE_DEFLT;
+	q->gso_split		= 0;
+	q->flow_blimit		= 0;
+	q->backlog_track	= 0;
+	q->horizon_ns		= SCRR_HORIZON_DEFLT;
+	q->flow_cachep		= flow_cachep;
+	q->weight_src		= SCRR_WEIGHT_NONE;
+	get_random_bytes(&q->flow_key_seed, sizeof(q->flow_key_seed));
+	memset(q->weights, 1, sizeof(q->weights));
+	scrr_weights_update(q);
+
+	/* PI2 config */
+	q->pi2_config.target_ns	= PI2_TARGET_DEFLT;
+	q->pi2_config.tupdate_ns = PI2_TARGET_DEFLT;
+	q->pi2_config.alpha	= PI2_ALPHA_DEFLT;
+	q->pi2_config.beta	= PI2_BETA_DEFLT;
+	q->pi2_config.coupling	= PI2_COUPL_DEFLT;
+	q->pi2_param.reduce_qlen = 0;
+	q->pi2_param.reduce_backlog = 0;
+	q->udp_plimit		= SCRR_FLOW_PLIMIT_DEFLT;
+	pi2_aqm_param_update(q);
+
+	/* Parameters */
+	q->classifier		= SCRR_CLASSIFIER_RBTREE;
+	q->hash_root		= NULL;
+	q->oa_table		= NULL;
+	q->hash_root_old	= NULL;
+	q->hash_root_drained	= NULL;
+	q->hash_trees_log	= ilog2(SCRR_HASH_NUM_DEFLT);
+	q->sch			= sch;
+	q->packets_sched	= 0;
+	INIT_WORK(&q->hash_work, scrr_hash_work);
+	INIT_LIST_HEAD(&q->gc_list);
+	scrr_fat_buckets_init(q);
+	q->new_flows.first	= NULL;
+	q->old_flows.first	= NULL;
+	q->virtual_dequeue	= 0LL;
+	q->virtual_advance	= 0LL;
+	q->virtual_previous	= 0LL;
+	q->rounds_advance	= -1;
+	q->mq_clock		= NULL;
+	memset(&q->pool, 0, sizeof(q->pool));
+	q->flow_shared		= NULL;
+	q->sk_cache		= NULL;
+	q->sk_cache_size	= 0;
+	q->sk_cache_log		= 0;
+
+	if (opt)
+		err = scrr_qdisc_change(sch, opt, extack);
+	else
+		err = scrr_hash_resize(sch, q->hash_trees_log, q->classifier);
+
+	return err;
+}
+
+static int scrr_qdisc_init(struct Qdisc *sch,
+			   struct nlattr *opt,
+			   struct netlink_ext_ack *extack)
+{
+	return scrr_qdisc_init_cache(sch, opt, extack, scrr_flow_cachep);
+}
+
+static int scrr_pi2_qdisc_init(struct Qdisc *sch,
+			       struct nlattr *opt,
+			       struct netlink_ext_ack *extack)
+{
+	return scrr_qdisc_init_cache(sch, opt, extack, scrr_pi2_flow_cachep);
+}
+
+static void scrr_hash_purge(struct scrr_sched_data *q,
+			    struct rb_root *array, u32 buckets)
+{
+	struct rb_root *root;
+	struct rb_node *p;
+	struct scrr_flow *flow_cur;
+	unsigned int idx;
+
+	for (idx = 0; idx < buckets; idx++) {
+		root = &array[idx];
+		while ((p = rb_first(root)) != NULL) {
+			flow_cur = scrr_hash_flow(q, p);
+			rb_erase(p, root);
+
+			scrr_flow_purge(q, flow_cur);
+
+			scrr_flow_free(q, flow_cur);
+		}
+	}
+}
+
+static void scrr_qdisc_reset(struct Qdisc *sch)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct scrr_flow *flow_cur;
+	unsigned int idx;
+
+	sch->q.qlen = 0;
+	sch->qstats.backlog = 0;
+
+	q->stats.flows		= 0;
+	q->stats.flows_inactive	= 0;
+	q->stats.no_mark	= 0;
+	q->stats.drop_mark	= 0;
+	q->stats.burst_peak	= 0;
+	q->stats.burst_avg	= 0;
+	q->stats.sched_empty	= 0;
+	q->stats.ecn_mark	= 0;
+	q->stats.sce_mark	= 0;
+	memset(q->stats.sojourn_light, 0, sizeof(q->stats.sojourn_light));
+	memset(q->stats.sojourn_heavy, 0, sizeof(q->stats.sojourn_heavy));
+	q->stats.gso_split	= 0;
+	q->stats.sk_cache_hit	= 0;
+	q->stats.sk_cache_miss	= 0;
+	q->stats.hash_collisions = 0;
+	q->stats.fat_drop	= 0;
+	q->stats.throttled	= 0;
+	q->stats.horizon_drops	= 0;
+	q->stats.telem_records	= 0;
+	q->stats.telem_lost	= 0;
+	q->pi2_param.reduce_qlen = 0;
+	q->pi2_param.reduce_backlog = 0;
+
+#ifdef STFQ_DEBUG_BURST_AVG
+	q->flow_sched_prev	= 0;
+	q->burst_cur		= 0;
+#endif	/* STFQ_DEBUG_BURST_AVG */
+
+	q->new_flows.first	= NULL;
+	q->old_flows.first	= NULL;
+
+	/* All flows are freed below */
+	INIT_LIST_HEAD(&q->gc_list);
+	scrr_fat_buckets_init(q);
+	memset(q->wheel, 0, sizeof(q->wheel));
+	bitmap_zero(q->wheel_map, SCRR_WHEEL_SLOTS);
+	q->stats.flows_throttled = 0;
+	qdisc_watchdog_cancel(&q->watchdog);
+
+	/* Except the collision flow, which is just emptied */
+	if (q->flow_shared) {
+		scrr_flow_purge(q, q->flow_shared);
+		scrr_flow_shared_init(q, q->flow_shared);
+	}
+
+	if (q->oa_table) {
+		struct scrr_oa_bucket *bucket;
+		int slot;
+
+		for (idx = 0; idx < q->hash_buckets; idx++) {
+			bucket = &q->oa_table[idx];
+			for (slot = 0; slot < SCRR_OA_SLOTS; slot++) {
+				flow_cur = bucket->flows[slot];
+				if (flow_cur == NULL)
+					continue;
+				bucket->flows[slot] = NULL;
+
+				scrr_flow_purge(q, flow_cur);
+
+				scrr_flow_free(q, flow_cur);
+			}
+			bucket->overflow = 0;
+		}
+	}
+
+	/* Trees not yet migrated, the incremental rehash will
+	 * complete on empty trees. */
+	if (q->hash_root_old)
+		scrr_hash_purge(q, q->hash_root_old, q->hash_buckets_old);
+
+	if (!q->hash_root)
+		return;
+
+	scrr_hash_purge(q, q->hash_root, q->hash_buckets);
+}
+
+static void scrr_qdisc_destroy(struct Qdisc *sch)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+
+	/* Work may lock the qdisc, make sure it's done */
+	cancel_work_sync(&q->hash_work);
+
+	scrr_qdisc_reset(sch);
+	scrr_hash_free(q->hash_root);
+	scrr_hash_free(q->hash_root_old);
+	scrr_hash_free(q->hash_root_drained);
+	scrr_hash_free(q->oa_table);
+	scrr_mq_clock_put(q->mq_clock);
+	if (q->flow_shared)
+		kmem_cache_free(q->flow_cachep, q->flow_shared);
+	kvfree(q->pool.base);
+	kvfree(q->sk_cache);
+	kvfree(q->walk_snap);
+	scrr_telem_close(q, q->telem_chan);
+}
+
+/* ---------------------- PER FLOW CLASSES ---------------------- */
+
+/*
+ * Each active flow shows up as a class, like fq_codel, so that
+ * 'tc -s class show' gives the queue of each flow. The classes can't be
+ * changed, and there is no filter, find() never finds anything.
+ * With 100k flows, we can't hold the qdisc lock for the whole table.
+ * The tables are walked in chunks, each chunk is a snapshot of a few
+ * flows taken under the lock, handed out to netlink without the lock.
+ * When the netlink buffer is full, the cursor is kept, so that the next
+ * part of the dump resumes where we were instead of walking again all
+ * the flows already dumped. The dump is not atomic, a flow may move
+ * between chunks and be missed or seen twice, it's only statistics.
+ */
+
+/* Tables walked by scrr_walk(), in that order */
+enum {
+	SCRR_WALK_SHARED,	/* Collision flow, a single bucket */
+	SCRR_WALK_TABLE,	/* oa_table or hash_root[] */
+	SCRR_WALK_OLD,		/* hash_root_old[], during a rehash */
+	SCRR_WALK_DONE,
+};
+
+struct scrr_walk_snap {
+	struct tc_scrr_flow_xstats st;
+	u32		minor;		/* Class minor, position in the dump */
+};
+
+static void scrr_walk_snap_flow(struct scrr_sched_data *q,
+				struct scrr_flow *flow,
+				u64 now)
+{
+	struct scrr_walk_snap *snap = &q->walk_snap[q->walk_snap_cnt++];
+	struct scrr_flow_cold *cold = scrr_flow_cold(q, flow);
+	struct sk_buff *skb;
+	u64 ts;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->st.virtual_finish = flow->virtual_finish;
+	snap->st.flow_idx = cold->flow_idx;
+	snap->st.flow_key = cold->flow_key;
+	snap->st.qlen = flow->qlen;
+	snap->st.drops = cold->drops;
+
+	/* Without tracking, at most flow_plimit packets */
+	if (q->backlog_track)
+		snap->st.backlog = cold->backlog;
+	else
+		for (skb = flow->head; skb != NULL; skb = skb->next)
+			snap->st.backlog += qdisc_pkt_len(skb);
+
+	/* Packets are only timestamped for PI2 or the histograms */
+	skb = scrr_peek_skb(flow);
+	if ( skb == NULL
+	     || ( q->flow_cachep != scrr_pi2_flow_cachep
+		  && !(q->flags & SCF_SOJOURN_HIST) ) )
+		return;
+	ts = scrr_skb_cb(skb)->ts;
+	if ( (q->flow_cachep == scrr_pi2_flow_cachep || ts >= q->sojourn_start_ns)
+	     && ts <= now )
+		snap->st.sojourn_us = div_u64(now - ts, NSEC_PER_USEC);
+}
+
+/* Take one flow of the bucket, false if the chunk is full.
+ * seen counts the active flows of the bucket, the first walk_sub
+ * of them were taken by the previous chunk. */
+static bool scrr_walk_take(struct scrr_sched_data *q,
+			   struct scrr_flow *flow,
+			   u32 *seen,
+			   u64 now)
+{
+	/* Inactive flows have no head, and no stats worth a class */
+	if (flow == NULL || scrr_flow_is_detached(flow))
+		return true;
+	if ((*seen)++ < q->walk_sub)
+		return true;
+	if (q->walk_snap_cnt >= SCRR_WALK_CHUNK) {
+		q->walk_sub = *seen - 1;
+		return false;
+	}
+	scrr_walk_snap_flow(q, flow, now);
+	return true;
+}
+
+static u32 scrr_walk_buckets(const struct scrr_sched_data *q, u32 table)
+{
+	switch (table) {
+	case SCRR_WALK_SHARED:
+		return 1;
+	case SCRR_WALK_TABLE:
+		return (q->oa_table || q->hash_root) ? q->hash_buckets : 0;
+	case SCRR_WALK_OLD:
+		return q->hash_root_old ? q->hash_buckets_old : 0;
+	}
+	return 0;
+}
+
+/* Snapshot the active flows of one bucket, false if the chunk is full. */
+static bool scrr_walk_bucket(struct scrr_sched_data *q, u32 idx, u64 now)
+{
+	struct rb_root *root = NULL;
+	struct rb_node *p;
+	u32 seen = 0;
+	int slot;
+
+	switch (q->walk_table) {
+	case SCRR_WALK_SHARED:
+		if (!scrr_walk_take(q, q->flow_shared, &seen, now))
+			return false;
+		break;
+	case SCRR_WALK_TABLE:
+		if (q->oa_table) {
+			for (slot = 0; slot < SCRR_OA_SLOTS; slot++)
+				if (!scrr_walk_take(q,
+						    q->oa_table[idx].flows[slot],
+						    &seen, now))
+					return false;
+			break;
+		}
+		root = &q->hash_root[idx];
+		break;
+	case SCRR_WALK_OLD:
+		root = &q->hash_root_old[idx];
+		break;
+	}
+
+	if (root != NULL)
+		for (p = rb_first(root); p != NULL; p = rb_next(p))
+			if (!scrr_walk_take(q, scrr_hash_flow(q, p), &seen, now))
+				return false;
+
+	q->walk_sub = 0;
+	return true;
+}
+
+/* Fill the snapshot with the next chunk of flows, under the lock.
+ * Bounded both in flows and in buckets, the table may be mostly empty.
+ * The tables may have been resized since the last chunk, so the cursor
+ * is checked against the current size. */
+static void scrr_walk_chunk(struct Qdisc *sch)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	u32 budget = SCRR_WALK_BUCKETS;
+	u64 now;
+
+	sch_tree_lock(sch);
+	now = ktime_get_ns();
+	q->walk_snap_cnt = 0;
+	q->walk_snap_pos = 0;
+	while (q->walk_table != SCRR_WALK_DONE && budget > 0) {
+		if (q->walk_idx >= scrr_walk_buckets(q, q->walk_table)) {
+			q->walk_table++;
+			q->walk_idx = 0;
+			q->walk_sub = 0;
+			continue;
+		}
+		if (!scrr_walk_bucket(q, q->walk_idx, now))
+			break;
+		q->walk_idx++;
+		budget--;
+	}
+	sch_tree_unlock(sch);
+}
+
+static void scrr_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct scrr_walk_snap *snap;
+
+	if (arg->stop)
+		return;
+
+	/* Under RTNL, like all the class operations */
+	if (q->walk_snap == NULL) {
+		q->walk_snap = kvmalloc_array(SCRR_WALK_CHUNK,
+					      sizeof(struct scrr_walk_snap),
+					      GFP_KERNEL);
+		if (q->walk_snap == NULL) {
+			arg->stop = 1;
+			return;
+		}
+	}
+
+	/* Next part of a dump that stopped on a full buffer, resume at
+	 * the cursor. The cursor is shared by all walkers, so only if
+	 * this is the same kind of walker, and the last one to use the
+	 * cursor stopped exactly where this one did. Otherwise, walk
+	 * from the start and skip arg->skip classes, like other qdiscs. */
+	if ( arg->skip != 0 && arg->fn == q->walk_fn
+	     && arg->skip == q->walk_count ) {
+		arg->count = arg->skip;
+	} else {
+		q->walk_table = SCRR_WALK_SHARED;
+		q->walk_idx = 0;
+		q->walk_sub = 0;
+		q->walk_snap_cnt = 0;
+		q->walk_snap_pos = 0;
+		arg->count = 0;
+	}
+
+	for (;;) {
+		while (q->walk_snap_pos < q->walk_snap_cnt) {
+			snap = &q->walk_snap[q->walk_snap_pos];
+			if (arg->count >= arg->skip) {
+				snap->minor = (arg->count % TC_H_MIN_MASK) + 1;
+				if (arg->fn(sch, q->walk_snap_pos + 1, arg) < 0) {
+					arg->stop = 1;
+					break;
+				}
+			}
+			arg->count++;
+			q->walk_snap_pos++;
+		}
+		if (arg->stop || q->walk_table == SCRR_WALK_DONE)
+			break;
+		scrr_walk_chunk(sch);
+	}
+	/* Keep the cursor only if we stopped on a class, at the end of
+	 * the walk there is nothing to resume */
+	if (arg->stop && q->walk_snap_pos < q->walk_snap_cnt) {
+		q->walk_fn = arg->fn;
+		q->walk_count = arg->count;
+	} else {
+		q->walk_fn = NULL;
+		q->walk_count = 0;
+	}
+}
+
+static struct scrr_walk_snap *scrr_walk_class(struct Qdisc *sch,
+					      unsigned long cl)
+{
+	struct scrr_sched_data *q = qdisc_priv(sch);
+
+	if (cl == 0 || cl > q->walk_snap_cnt)
+		return NULL;
+	return &q->walk_snap[cl - 1];
+}
+
+static struct Qdisc *scrr_leaf(struct Qdisc *sch, unsigned long cl)
+{
+	return NULL;
+}
+
+static unsigned long scrr_find(struct Qdisc *sch, u32 classid)
+{
+	return 0;
+}
+
+static int scrr_dump_class(struct Qdisc *sch, unsigned long cl,
+			   struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct scrr_walk_snap *snap = scrr_walk_class(sch, cl);
+
+	if (snap == NULL)
+		return -EINVAL;
+	tcm->tcm_parent = TC_H_ROOT;
+	tcm->tcm_handle |= TC_H_MIN(snap->minor);
+	return 0;
+}
+
+static int scrr_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+				 struct gnet_dump *d)
+{
+	struct scrr_walk_snap *snap = scrr_walk_class(sch, cl);
+	struct gnet_stats_queue qs = { 0 };
+
+	if (snap == NULL)
+		return -1;
+	qs.qlen = snap->st.qlen;
+	qs.backlog = snap->st.backlog;
+	qs.drops = snap->st.drops;
+	if (gnet_stats_copy_queue(d, NULL, &qs, qs.qlen) < 0)
+		return -1;
+	return gnet_stats_copy_app(d, &snap->st, sizeof(snap->st));
+}
+
+static const struct Qdisc_class_ops scrr_class_ops = {
+	.leaf		=	scrr_leaf,
+	.find		=	scrr_find,
+	.walk		=	scrr_walk,
+	.dump		=	scrr_dump_class,
+	.dump_stats	=	scrr_dump_class_stats,
+};
+
+static struct Qdisc_ops scrr_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_enqueue,
+	.dequeue	=	scrr_qdisc_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static struct Qdisc_ops scrr_npm_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr_npm",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_npm_enqueue,
+	.dequeue	=	scrr_qdisc_npm_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static struct Qdisc_ops scrr_nmia_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr_nmia",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_npm_enqueue,
+	.dequeue	=	scrr_qdisc_nmia_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static struct Qdisc_ops scrr_nmne_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr_nmne",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_nmne_enqueue,
+	.dequeue	=	scrr_qdisc_nmne_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static struct Qdisc_ops scrr_neia_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr_neia",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_nmne_enqueue,
+	.dequeue	=	scrr_qdisc_neia_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static struct Qdisc_ops scrr_basic_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr_basic",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_enqueue,
+	.dequeue	=	scrr_qdisc_basic_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+static struct Qdisc_ops scrr_pi2_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_class_ops,
+	.id		=	"scrr_pi2",
+	.priv_size	=	sizeof(struct scrr_sched_data),
+
+	.enqueue	=	scrr_qdisc_pi2_enqueue,
+	.dequeue	=	scrr_qdisc_pi2_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	scrr_pi2_qdisc_init,
+	.reset		=	scrr_qdisc_reset,
+	.destroy	=	scrr_qdisc_destroy,
+	.change		=	scrr_qdisc_change,
+	.dump		=	scrr_qdisc_dump,
+	.dump_stats	=	scrr_qdisc_dump_stats,
+	.owner		=	THIS_MODULE,
+};
+
+/* ---------------------------------------------------------------- */
+/*
+ * Multi-queue SCRR.
+ *
+ * With a single root qdisc, all TX queues of the device serialise on the
+ * root qdisc lock, and on multi-queue NICs this lock becomes the bottleneck
+ * well before the link is saturated. Like sch_mq, scrr_mq is a root qdisc
+ * that creates one regular 'scrr' qdisc per TX queue, each with its own
+ * lock, its own flow lists and its own flow table allocated on the NUMA
+ * node of the TX queue. Flows are not shared between instances, a flow
+ * sticks to a TX queue unless the stack decides to move it.
+ * The instances share a loosely synchronised virtual clock, see
+ * scrr_mq_clock_sync().
+ */
+
+/*
+ * Private data for the root Qdisc
+ */
+struct scrr_mq_sched_data {
+	struct Qdisc **		qdiscs;		/* Child instances, until attach */
+	struct scrr_mq_clock *	clock;		/* Shared virtual clock */
+};
+
+/* Child instance of scrr_mq, as opposed to a qdisc grafted by the user */
+static struct scrr_sched_data *scrr_mq_child(struct scrr_mq_sched_data *priv,
+					     struct Qdisc *qdisc)
+{
+	struct scrr_sched_data *q;
+
+	if (qdisc->ops != &scrr_qdisc_ops)
+		return NULL;
+	q = qdisc_priv(qdisc);
+	if (q->mq_clock != priv->clock)
+		return NULL;
+	return q;
+}
+
+static void scrr_mq_destroy(struct Qdisc *sch)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct scrr_mq_sched_data *priv = qdisc_priv(sch);
+	unsigned int ntx;
+
+	if (priv->qdiscs) {
+		for (ntx = 0;
+		     ntx < dev->num_tx_queues && priv->qdiscs[ntx];
+		     ntx++)
+			qdisc_put(priv->qdiscs[ntx]);
+		kfree(priv->qdiscs);
+	}
+	scrr_mq_clock_put(priv->clock);
+}
+
+static int scrr_mq_init(struct Qdisc *sch,
+			struct nlattr *opt,
+			struct netlink_ext_ack *extack)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct scrr_mq_sched_data *priv = qdisc_priv(sch);
+	struct netdev_queue *dev_queue;
+	struct scrr_sched_data *q;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+	int err;
+
+	if (sch->parent != TC_H_ROOT)
+		return -EOPNOTSUPP;
+
+	if (!netif_is_multiqueue(dev))
+		return -EOPNOTSUPP;
+
+	priv->clock = kzalloc(sizeof(*priv->clock), GFP_KERNEL);
+	if (!priv->clock)
+		return -ENOMEM;
+	atomic64_set(&priv->clock->virtual_advance, 0);
+	refcount_set(&priv->clock->refcnt, 1);
+
+	/* pre-allocate qdiscs, attachment can't fail */
+	priv->qdiscs = kcalloc(dev->num_tx_queues, sizeof(priv->qdiscs[0]),
+			       GFP_KERNEL);
+	if (!priv->qdiscs)
+		return -ENOMEM;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		dev_queue = netdev_get_tx_queue(dev, ntx);
+		/* Flow table is allocated on NUMA node of dev_queue */
+		qdisc = qdisc_create_dflt(dev_queue, &scrr_qdisc_ops,
+					  TC_H_MAKE(TC_H_MAJ(sch->handle),
+						    TC_H_MIN(ntx + 1)),
+					  extack);
+		if (!qdisc)
+			return -ENOMEM;
+		priv->qdiscs[ntx] = qdisc;
+		qdisc->flags |= TCQ_F_ONETXQUEUE | TCQ_F_NOPARENT;
+
+		q = qdisc_priv(qdisc);
+		refcount_inc(&priv->clock->refcnt);
+		q->mq_clock = priv->clock;
+
+		/* All instances get the same configuration */
+		if (opt) {
+			err = scrr_qdisc_change(qdisc, opt, extack);
+			if (err)
+				return err;
+		}
+	}
+
+	sch->flags |= TCQ_F_MQROOT;
+
+	return 0;
+}
+
+static void scrr_mq_attach(struct Qdisc *sch)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct scrr_mq_sched_data *priv = qdisc_priv(sch);
+	struct Qdisc *qdisc, *old;
+	unsigned int ntx;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = priv->qdiscs[ntx];
+		old = dev_graft_qdisc(qdisc->dev_queue, qdisc);
+		if (old)
+			qdisc_put(old);
+#ifdef CONFIG_NET_SCHED
+		if (ntx < dev->real_num_tx_queues)
+			qdisc_hash_add(qdisc, false);
+#endif
+	}
+	kfree(priv->qdiscs);
+	priv->qdiscs = NULL;
+}
+
+static int scrr_mq_change(struct Qdisc *sch,
+			  struct nlattr *opt,
+			  struct netlink_ext_ack *extack)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct scrr_mq_sched_data *priv = qdisc_priv(sch);
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+	int err = 0;
+
+	if (!opt)
+		return -EINVAL;
+
+	/* Each instance locks itself, we never hold more than one lock */
+	for (ntx = 0; ntx < dev->num_tx_queues && !err; ntx++) {
+		qdisc = netdev_get_tx_queue(dev, ntx)->qdisc_sleeping;
+		if (scrr_mq_child(priv, qdisc))
+			err = scrr_qdisc_change(qdisc, opt, extack);
+	}
+	return err;
+}
+
+static int scrr_mq_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct scrr_mq_sched_data *priv = qdisc_priv(sch);
+	struct Qdisc *qdisc;
+	struct Qdisc *qdisc_conf = NULL;
+	unsigned int ntx;
+
+	sch->q.qlen = 0;
+	gnet_stats_basic_sync_init(&sch->bstats);
+	memset(&sch->qstats, 0, sizeof(sch->qstats));
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = netdev_get_tx_queue(dev, ntx)->qdisc_sleeping;
+		spin_lock_bh(qdisc_lock(qdisc));
 
-#ifdef SCRR_DEBUG_STFQ_DEQUEUE
-	printk(KERN_DEBUG "SCRR: dequeue: idx:%d; vpkt:%lld; vnxt:%lld; vadv:%lld (%d); vdq:%lld; ql:%d\n", flow_cur->flow_idx, virtual_pkt, virtual_next, q->virtual_advance, q->rounds_advance, q->virtual_dequeue, sch->q.qlen);
-#endif	/* SCRR_DEBUG_STFQ_DEQUEUE */
+		gnet_stats_add_basic(&sch->bstats, qdisc->cpu_bstats,
+				     &qdisc->bstats, false);
+		gnet_stats_add_queue(&sch->qstats, qdisc->cpu_qstats,
+				     &qdisc->qstats);
+		sch->q.qlen += qdisc_qlen(qdisc);
 
-	/* Update virtual time - Check if queue is busy */
-	if (sch->q.qlen == 0) {
-		q->virtual_dequeue = virtual_pkt + qdisc_pkt_len(skb);
-		q->virtual_previous = q->virtual_advance;
-		q->virtual_advance = q->virtual_dequeue;
-	} else {
-		/* In SCRR, packets are dequeued out of order,
-		 * so the virtual time of STFQ can not be tracked
-		 * easily. We would need to find the smallest
-		 * rank amongst all packets in the queue.
-		 * Approximate by taking the time of this packet.
-		 * But, prevent time going backwards. Jean II */
-		if ( time_after64(virtual_pkt, q->virtual_dequeue) )
-			q->virtual_dequeue = virtual_pkt;
+		spin_unlock_bh(qdisc_lock(qdisc));
+
+		if (!qdisc_conf && scrr_mq_child(priv, qdisc))
+			qdisc_conf = qdisc;
 	}
 
-	/* SCRR: Self Clocked Round Robin Scheduling. Jean II */
-	/* If the sub-queue does not have a next packet,
-	 * or if the next packet of the sub-queue is after the
-	 * current virtual-time, we need to schedule another
-	 * sub-queue. Jean II */
-	if (unlikely(scrr_peek_skb(flow_cur) == NULL)) {
-		/* If the sub-queue is now empty, that flow becomes inactive.
-		 * It may be reactived in scrr_qdisc_enqueue() and
-		 * put back at the back of the list. Jean II */
+	/* All instances have the same config, unless changed individually,
+	 * report the first one. */
+	if (qdisc_conf)
+		return scrr_qdisc_dump(qdisc_conf, skb);
+	return 0;
+}
 
-exit_empty:
-		/* Flow goes inactive */
-		scrr_flow_set_detached(flow_cur);
-		q->stats.flows_inactive++;
+static int scrr_mq_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct scrr_mq_sched_data *priv = qdisc_priv(sch);
+	struct scrr_sched_data *q;
+	struct Qdisc *qdisc;
+	struct tc_scrr_xstats st;
+	u64		burst_sum = 0;
+	u32		burst_cnt = 0;
+	u64		probe_sum = 0;
+	u32		probe_cnt = 0;
+	u64		gc_lat_sum = 0;
+	u32		gc_lat_cnt = 0;
+	unsigned int ntx;
+	unsigned int idx;
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+	memset(&st, 0, sizeof(st));
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = netdev_get_tx_queue(dev, ntx)->qdisc_sleeping;
+		q = scrr_mq_child(priv, qdisc);
+		if (!q)
+			continue;
+
+		spin_lock_bh(qdisc_lock(qdisc));
+
+		/* Counters add up, peaks are the max of all instances */
+		st.flows		+= q->stats.flows;
+		st.flows_inactive	+= q->stats.flows_inactive;
+		st.flows_gc		+= q->stats.flows_gc;
+		st.alloc_errors		+= q->stats.alloc_errors;
+		st.no_mark		+= q->stats.no_mark;
+		st.drop_mark		+= q->stats.drop_mark;
+		st.ecn_mark		+= q->stats.ecn_mark;
+		st.sce_mark		+= q->stats.sce_mark;
+		st.sched_empty		+= q->stats.sched_empty;
+		st.qlen_peak	= max(st.qlen_peak, q->stats.qlen_peak);
+		st.backlog_peak	= max(st.backlog_peak, q->stats.backlog_peak);
+		st.burst_peak	= max(st.burst_peak, q->stats.burst_peak);
+		st.probe_peak	= max(st.probe_peak, q->stats.probe_peak);
+		st.table_full		+= q->stats.table_full;
+		st.gc_lat_peak_ms = max(st.gc_lat_peak_ms, q->stats.gc_lat_peak_ms);
+		st.gc_deferred		+= q->stats.gc_deferred;
+		st.pool_free		+= q->stats.pool_free;
+		st.flow_shared		+= q->stats.flow_shared;
+		st.gso_split		+= q->stats.gso_split;
+		st.bypass		+= scrr_bypass_count(qdisc);
+		st.sk_cache_hit		+= q->stats.sk_cache_hit;
+		st.sk_cache_miss	+= q->stats.sk_cache_miss;
+		st.hash_collisions	+= q->stats.hash_collisions;
+		st.fat_drop		+= q->stats.fat_drop;
+		st.flows_throttled	+= q->stats.flows_throttled;
+		st.throttled		+= q->stats.throttled;
+		st.horizon_drops	+= q->stats.horizon_drops;
+		st.mem_used		+= scrr_mem_used(q);
+		for (idx = 0; idx < SCRR_SOJOURN_BUCKETS; idx++) {
+			st.sojourn_light[idx] += q->stats.sojourn_light[idx];
+			st.sojourn_heavy[idx] += q->stats.sojourn_heavy[idx];
+		}
+		if (q->stats.burst_avg) {
+			burst_sum += q->stats.burst_avg;
+			burst_cnt++;
+		}
+		if (q->stats.probe_avg_1k) {
+			probe_sum += q->stats.probe_avg_1k;
+			probe_cnt++;
+		}
+		if (q->stats.gc_lat_avg_ms) {
+			gc_lat_sum += q->stats.gc_lat_avg_ms;
+			gc_lat_cnt++;
+		}
 
-		/* Advance the global clock as needed, but after
-		 * updating the number of flows. Jean II */
-		goto exit_advance;
+		/* Reset some of the statistics, unless disabled */
+		if ( ! (q->flags & SCF_PEAK_NORESET) ) {
+			q->stats.qlen_peak = 0;
+			q->stats.backlog_peak = 0;
+			q->stats.burst_peak = 0;
+			q->stats.probe_peak = 0;
+			q->stats.gc_lat_peak_ms = 0;
+		}
 
-	} else if (likely( time_after64(virtual_next, q->virtual_advance) )) {
+		spin_unlock_bh(qdisc_lock(qdisc));
+	}
+	if (burst_cnt)
+		st.burst_avg = div_u64(burst_sum, burst_cnt);
+	if (probe_cnt)
+		st.probe_avg_1k = div_u64(probe_sum, probe_cnt);
+	if (gc_lat_cnt)
+		st.gc_lat_avg_ms = div_u64(gc_lat_sum, gc_lat_cnt);
 
-		/* If the next packet of the sub-queue is after the
-		 * current virtual-time, it can't be sent in that 
-		 * scheduling round. Jean II */
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
 
-		/* Remove flow from head of current list,
-		 * advance to next sub-queue. */
-		head->first = flow_cur->next;
+static struct netdev_queue *scrr_mq_queue_get(struct Qdisc *sch,
+					      unsigned long cl)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	unsigned long ntx = cl - 1;
 
-		/* Add current flow at end of list of active flows */
-		/* We only use the new list. Jean II */
-		scrr_robin_add_tail(&q->new_flows, flow_cur);
+	if (ntx >= dev->num_tx_queues)
+		return NULL;
+	return netdev_get_tx_queue(dev, ntx);
+}
 
-exit_advance:
-		/* Advance the global clock as needed */
-		scrr_try_virtual_advance(q);
+static struct netdev_queue *scrr_mq_select_queue(struct Qdisc *sch,
+						 struct tcmsg *tcm)
+{
+	return scrr_mq_queue_get(sch, TC_H_MIN(tcm->tcm_parent));
+}
 
-	}
-	/* Else : if the next packet is older than the current virtual-time,
-	 * remain on the same sub-queue, so it will be scheduled.
-	 * next time. Jean II */
+static int scrr_mq_graft(struct Qdisc *sch, unsigned long cl,
+			 struct Qdisc *new, struct Qdisc **old,
+			 struct netlink_ext_ack *extack)
+{
+	struct netdev_queue *dev_queue = scrr_mq_queue_get(sch, cl);
+	struct net_device *dev = qdisc_dev(sch);
 
-	return skb;
+	if (dev->flags & IFF_UP)
+		dev_deactivate(dev);
+
+	*old = dev_graft_qdisc(dev_queue, new);
+	if (new)
+		new->flags |= TCQ_F_ONETXQUEUE | TCQ_F_NOPARENT;
+
+	if (dev->flags & IFF_UP)
+		dev_activate(dev);
+
+	return 0;
 }
 
-static void scrr_rehash(struct scrr_sched_data *q,
-		      struct rb_root *old_array, u32 old_log,
-		      struct rb_root *new_array, u32 new_log)
+static struct Qdisc *scrr_mq_leaf(struct Qdisc *sch, unsigned long cl)
 {
-	struct rb_node *op, **np, *parent;
-	struct rb_root *oroot, *nroot;
-	struct scrr_flow *of, *nf;
-	int fcnt = 0;
-	u32 idx;
+	struct netdev_queue *dev_queue = scrr_mq_queue_get(sch, cl);
 
-	for (idx = 0; idx < (1U << old_log); idx++) {
-		oroot = &old_array[idx];
-		while ((op = rb_first(oroot)) != NULL) {
-			rb_erase(op, oroot);
-			of = rb_entry(op, struct scrr_flow, hash_node);
-			if (scrr_gc_candidate(of)) {
-				fcnt++;
-				kmem_cache_free(scrr_flow_cachep, of);
-				continue;
-			}
-			nroot = &new_array[hash_32(of->flow_idx, new_log)];
+	return dev_queue->qdisc_sleeping;
+}
 
-			np = &nroot->rb_node;
-			parent = NULL;
-			while (*np) {
-				parent = *np;
+static unsigned long scrr_mq_find(struct Qdisc *sch, u32 classid)
+{
+	unsigned int ntx = TC_H_MIN(classid);
 
-				nf = rb_entry(parent, struct scrr_flow, hash_node);
-				BUG_ON(nf->flow_idx == of->flow_idx);
+	if (!scrr_mq_queue_get(sch, ntx))
+		return 0;
+	return ntx;
+}
 
-				if (nf->flow_idx > of->flow_idx)
-					np = &parent->rb_right;
-				else
-					np = &parent->rb_left;
-			}
+static int scrr_mq_dump_class(struct Qdisc *sch, unsigned long cl,
+			      struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct netdev_queue *dev_queue = scrr_mq_queue_get(sch, cl);
 
-			rb_link_node(&of->hash_node, parent, np);
-			rb_insert_color(&of->hash_node, nroot);
-		}
-	}
-	q->stats.flows -= fcnt;
-	q->stats.flows_inactive -= fcnt;
-	q->stats.flows_gc += fcnt;
+	tcm->tcm_parent = TC_H_ROOT;
+	tcm->tcm_handle |= TC_H_MIN(cl);
+	tcm->tcm_info = dev_queue->qdisc_sleeping->handle;
+	return 0;
 }
 
-static void scrr_hash_free(void *addr)
+static int scrr_mq_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+				    struct gnet_dump *d)
 {
-	kvfree(addr);
+	struct netdev_queue *dev_queue = scrr_mq_queue_get(sch, cl);
+
+	sch = dev_queue->qdisc_sleeping;
+	if (gnet_stats_copy_basic(d, sch->cpu_bstats, &sch->bstats, true) < 0 ||
+	    qdisc_qstats_copy(d, sch) < 0)
+		return -1;
+	return 0;
 }
 
-static int scrr_hash_resize(struct Qdisc *sch, u32 log)
+static void scrr_mq_walk(struct Qdisc *sch, struct qdisc_walker *arg)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct rb_root *array;
-	void *old_hash_root;
-	u32 buckets;
-	u32 idx;
+	struct net_device *dev = qdisc_dev(sch);
+	unsigned int ntx;
 
-	if (q->hash_root && log == q->hash_trees_log)
-		return 0;
+	if (arg->stop)
+		return;
 
-	buckets = 1U << log;
+	arg->count = arg->skip;
+	for (ntx = arg->skip; ntx < dev->num_tx_queues; ntx++) {
+		if (arg->fn(sch, ntx + 1, arg) < 0) {
+			arg->stop = 1;
+			break;
+		}
+		arg->count++;
+	}
+}
 
-	/* If XPS was setup, we can allocate memory on right NUMA node */
-	array = kvmalloc_node(sizeof(struct rb_root) << log, GFP_KERNEL | __GFP_RETRY_MAYFAIL,
-			      netdev_queue_numa_node_read(sch->dev_queue));
-	if (!array)
-		return -ENOMEM;
+static const struct Qdisc_class_ops scrr_mq_class_ops = {
+	.select_queue	=	scrr_mq_select_queue,
+	.graft		=	scrr_mq_graft,
+	.leaf		=	scrr_mq_leaf,
+	.find		=	scrr_mq_find,
+	.walk		=	scrr_mq_walk,
+	.dump		=	scrr_mq_dump_class,
+	.dump_stats	=	scrr_mq_dump_class_stats,
+};
 
-	for (idx = 0; idx < buckets; idx++)
-		array[idx] = RB_ROOT;
+static struct Qdisc_ops scrr_mq_qdisc_ops __read_mostly = {
+	.cl_ops		=	&scrr_mq_class_ops,
+	.id		=	"scrr_mq",
+	.priv_size	=	sizeof(struct scrr_mq_sched_data),
+
+	.init		=	scrr_mq_init,
+	.destroy	=	scrr_mq_destroy,
+	.attach		=	scrr_mq_attach,
+	.change		=	scrr_mq_change,
+	.dump		=	scrr_mq_dump,
+	.dump_stats	=	scrr_mq_dump_stats,
+	.owner		=	THIS_MODULE,
+};
 
-	sch_tree_lock(sch);
+/* ---------------------------------------------------------------- */
+/*
+ * Hierarchical SCRR.
+ *
+ * A single SCRR shares the bandwidth between flows, so a tenant with
+ * many flows gets more than a tenant with a few. hscrr is a classful
+ * qdisc with two levels of self-clocked round robin : the first level
+ * serves classes (tenants, VLANs, DSCP groups...), the second level is
+ * a regular 'scrr' qdisc per class, which serves the flows of the class.
+ * Classes are created with 'tc class add' and packets are classified
+ * like DRR, by tc filters or by a skb->priority holding one of our
+ * classids. Unclassified packets go to the default class, if any.
+ *
+ * The first level uses the same virtual clock as SCRR, with the length
+ * of packets weighted by the class weight. The leaf qdisc owns the skb
+ * control block and we can't peek at its head without dequeuing it,
+ * so the first level is the scrr_nmne variant : no packet metadata, and
+ * classes go inactive as soon as their leaf is empty. We have our own
+ * lists of new and old classes, so both levels are O(1) per packet.
+ * Leaves run under our root lock, there is only one lock.
+ */
 
-	old_hash_root = q->hash_root;
-	if (old_hash_root)
-		scrr_rehash(q, old_hash_root, q->hash_trees_log, array, log);
+enum {
+	TCA_HSCRR_UNSPEC,
+	TCA_HSCRR_WEIGHT,	/* class weight, 1 to 255 */
+	TCA_HSCRR_DEFAULT,	/* minor of default class, 0 is none */
+	__TCA_HSCRR_MAX
+};
+#define TCA_HSCRR_MAX	(__TCA_HSCRR_MAX - 1)
 
-	q->hash_root = array;
-	q->hash_trees_log = log;
-	q->hash_buckets = buckets;
+#define HSCRR_WEIGHT_MAX	(255)
 
-	sch_tree_unlock(sch);
+struct hscrr_class {
+	struct Qdisc_class_common common;	/* classid + hash node */
+	struct list_head	alist;		/* new or old list, if active */
+	struct Qdisc *		qdisc;		/* Leaf, scrr by default */
+	u64			virtual_finish;	/* Virtual time of the class */
+	u32			weight;
+	u32			weight_inv;	/* 1/weight, fixed point */
+	unsigned int		filter_cnt;	/* Filters bound to us */
 
-	scrr_hash_free(old_hash_root);
+	struct gnet_stats_basic_sync bstats;
+};
 
-	return 0;
+struct hscrr_sched_data {
+	struct tcf_proto __rcu *filter_list;	/* Filters of the root */
+	struct tcf_block *	block;
+	struct Qdisc_class_hash	clhash;		/* All our classes */
+	struct list_head	new_classes;	/* Classes just activated */
+	struct list_head	old_classes;	/* Classes in the schedule */
+	u32			classes_active;	/* Classes in the lists */
+	u32			defcls;		/* Minor of default class */
+
+	u64			virtual_dequeue;
+	u64			virtual_advance;
+	u64			virtual_previous;
+	s32			rounds_advance;	/* Schedules left in round */
+};
+
+static struct hscrr_class *hscrr_find_class(struct Qdisc *sch, u32 classid)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct Qdisc_class_common *clc;
+
+	clc = qdisc_class_find(&q->clhash, classid);
+	if (clc == NULL)
+		return NULL;
+	return container_of(clc, struct hscrr_class, common);
 }
 
-static const struct nla_policy scrr_policy[TCA_SCRR_MAX + 1] = {
-	[TCA_SCRR_PLIMIT]		= { .type = NLA_U32 },
-	[TCA_SCRR_BUCKETS_LOG]		= { .type = NLA_U32 },
-	[TCA_SCRR_HASH_MASK]		= { .type = NLA_U32 },
-	[TCA_SCRR_FLOW_PLIMIT]		= { .type = NLA_U32 },
-	[TCA_SCRR_FLAGS]		= { .type = NLA_U32 },
-};
+static struct hscrr_class *hscrr_classify(struct sk_buff *skb,
+					  struct Qdisc *sch,
+					  int *qerr)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *	cl;
+	struct tcf_result	res;
+	struct tcf_proto *	fl;
+	int			result;
+
+	/* skb->priority already holds one of our classes */
+	if (TC_H_MAJ(skb->priority ^ sch->handle) == 0) {
+		cl = hscrr_find_class(sch, skb->priority);
+		if (cl != NULL)
+			return cl;
+	}
 
-static int scrr_qdisc_change(struct Qdisc *sch,
-			     struct nlattr *opt,
-			     struct netlink_ext_ack *extack)
+	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
+	fl = rcu_dereference_bh(q->filter_list);
+	result = tcf_classify(skb, NULL, fl, &res, false);
+	if (result >= 0) {
+#ifdef CONFIG_NET_CLS_ACT
+		switch (result) {
+		case TC_ACT_QUEUED:
+		case TC_ACT_STOLEN:
+		case TC_ACT_TRAP:
+			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
+			fallthrough;
+		case TC_ACT_SHOT:
+			return NULL;
+		}
+#endif
+		cl = (struct hscrr_class *) res.class;
+		if (cl == NULL)
+			cl = hscrr_find_class(sch, res.classid);
+		if (cl != NULL)
+			return cl;
+	}
+
+	/* No filter matched, use the default class, if any */
+	if (q->defcls == 0)
+		return NULL;
+	return hscrr_find_class(sch, TC_H_MAKE(sch->handle, q->defcls));
+}
+
+/* Length of the packet in virtual time, see scrr_weighted_len(). */
+static inline u32 hscrr_weighted_len(const struct hscrr_class *cl,
+				     const struct sk_buff *skb)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_SCRR_MAX + 1];
-	u32		plimit;
-	u32		hash_log_new;
-	int		err;
-	int		drop_count = 0;
-	unsigned	drop_len = 0;
+	return (u32) ( ( (u64) qdisc_pkt_len(skb) * cl->weight_inv
+			 + (1U << SCRR_WEIGHT_SHIFT) - 1 )
+		       >> SCRR_WEIGHT_SHIFT );
+}
 
-	if (!opt)
-		return -EINVAL;
+/* Same as scrr_try_virtual_advance(), for classes. */
+static inline void hscrr_try_virtual_advance(struct hscrr_sched_data *q)
+{
+	if (q->rounds_advance <= 0) {
+		if (q->virtual_dequeue != q->virtual_advance) {
+			q->virtual_previous = q->virtual_advance;
+			q->virtual_advance = q->virtual_dequeue;
+		}
+		q->rounds_advance = q->classes_active;
+	}
+	q->rounds_advance--;
+}
 
-	err = nla_parse_nested_deprecated(tb, TCA_SCRR_MAX, opt, scrr_policy,
-					  NULL);
-	if (err < 0)
+/* Class has packets again, like a flow of scrr_nmne. */
+static void hscrr_class_activate(struct hscrr_sched_data *q,
+				 struct hscrr_class *cl)
+{
+	/* The class was served in the current round and its next
+	 * packet can't fit in it, wait for the next round. Otherwise,
+	 * it's part of the current round. */
+	if ( time_after64(cl->virtual_finish, q->virtual_advance)
+	     && ( q->classes_active != 0 ) ) {
+		list_add_tail(&cl->alist, &q->old_classes);
+	} else {
+		list_add_tail(&cl->alist, &q->new_classes);
+		q->rounds_advance++;
+	}
+	q->classes_active++;
+}
+
+/* Class has no packets left. If this is not done in dequeue, the
+ * current round may last one schedule longer, which is harmless. */
+static void hscrr_class_deactivate(struct hscrr_sched_data *q,
+				   struct hscrr_class *cl)
+{
+	if (list_empty(&cl->alist))
+		return;
+	list_del_init(&cl->alist);
+	q->classes_active--;
+}
+
+static int hscrr_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+			       struct sk_buff **to_free)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	unsigned int		len = qdisc_pkt_len(skb);
+	struct hscrr_class *	cl;
+	int			err = 0;
+
+	cl = hscrr_classify(skb, sch, &err);
+	if (cl == NULL) {
+		if (err & __NET_XMIT_BYPASS)
+			qdisc_qstats_drop(sch);
+		__qdisc_drop(skb, to_free);
 		return err;
+	}
 
-	/* Check limit before locking */
-	if (tb[TCA_SCRR_PLIMIT]) {
-		plimit = nla_get_u32(tb[TCA_SCRR_PLIMIT]);
-		/* Can't be negative... */
-		if (plimit == 0)
-			return -EINVAL;
+	err = qdisc_enqueue(skb, cl->qdisc, to_free);
+	if (unlikely(err != NET_XMIT_SUCCESS)) {
+		/* The leaf has counted the drop in its own stats, which
+		 * are the stats of the class. */
+		if (net_xmit_drop_count(err))
+			qdisc_qstats_drop(sch);
+		return err;
 	}
 
-	sch_tree_lock(sch);
+	/* The leaf may have dropped at dequeue without telling us yet,
+	 * so check the lists rather than the qlen of the leaf. */
+	if (list_empty(&cl->alist))
+		hscrr_class_activate(q, cl);
 
-	if (tb[TCA_SCRR_PLIMIT])
-		sch->limit = plimit;
+	sch->qstats.backlog += len;
+	sch->q.qlen++;
+	return NET_XMIT_SUCCESS;
+}
 
-	hash_log_new = q->hash_trees_log;
-	if (tb[TCA_SCRR_BUCKETS_LOG]) {
-		u32 nval = nla_get_u32(tb[TCA_SCRR_BUCKETS_LOG]);
+static struct sk_buff *hscrr_qdisc_dequeue(struct Qdisc *sch)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct list_head *	head;
+	struct hscrr_class *	cl;
+	struct sk_buff *	skb;
+	u64			virtual_pkt;
+	u64			virtual_next;
+	u32			tries = q->classes_active;
 
-		if (nval >= 1 && nval <= ilog2(256*1024))
-			hash_log_new = nval;
-		else
-			err = -EINVAL;
+	if (unlikely(sch->q.qlen == 0))
+		return NULL;
+
+retry_class:
+	head = &q->new_classes;
+	if (likely(list_empty(head)))
+		head = &q->old_classes;
+	if (unlikely(list_empty(head)))
+		return NULL;
+	cl = list_first_entry(head, struct hscrr_class, alist);
+
+	skb = qdisc_dequeue_peeked(cl->qdisc);
+	if (unlikely(skb == NULL)) {
+		if (cl->qdisc->q.qlen == 0) {
+			/* The leaf dropped its last packets at dequeue,
+			 * like scrr_pi2. The list gets shorter. */
+			hscrr_class_deactivate(q, cl);
+			hscrr_try_virtual_advance(q);
+			goto retry_class;
+		}
+
+		/* The leaf is not work conserving, for example a shaper.
+		 * Don't let it block the other classes, but don't spin
+		 * if all classes are like that. */
+		qdisc_warn_nonwc(__func__, cl->qdisc);
+		list_move_tail(&cl->alist, &q->old_classes);
+		hscrr_try_virtual_advance(q);
+		if (tries-- <= 1)
+			return NULL;
+		goto retry_class;
 	}
 
-	if (tb[TCA_SCRR_HASH_MASK])
-		q->hash_mask = nla_get_u32(tb[TCA_SCRR_HASH_MASK]);
+	bstats_update(&cl->bstats, skb);
+	qdisc_bstats_update(sch, skb);
+	qdisc_qstats_backlog_dec(sch, skb);
+	sch->q.qlen--;
 
-	if (tb[TCA_SCRR_FLOW_PLIMIT])
-		q->flow_plimit = nla_get_u32(tb[TCA_SCRR_FLOW_PLIMIT]);
+	/* No metadata : the class was idle if it was not served in the
+	 * previous round, see scrr_dequeue_core(). */
+	if ( time_after_eq64(q->virtual_previous, cl->virtual_finish) )
+		virtual_pkt = q->virtual_advance;
+	else
+		virtual_pkt = cl->virtual_finish;
+	virtual_next = virtual_pkt + hscrr_weighted_len(cl, skb);
+	cl->virtual_finish = virtual_next;
 
-	if (tb[TCA_SCRR_FLAGS])
-                q->flags = nla_get_u32(tb[TCA_SCRR_FLAGS]);
+	if (sch->q.qlen == 0) {
+		q->virtual_dequeue = virtual_next;
+		q->virtual_previous = q->virtual_advance;
+		q->virtual_advance = q->virtual_dequeue;
+	} else if ( time_after64(virtual_pkt, q->virtual_dequeue) ) {
+		q->virtual_dequeue = virtual_pkt;
+	}
 
-	if (!err) {
+	if (cl->qdisc->q.qlen == 0) {
+		/* No empty : the class goes inactive at once */
+		hscrr_class_deactivate(q, cl);
+		hscrr_try_virtual_advance(q);
+	} else if ( time_after64(virtual_next, q->virtual_advance) ) {
+		/* The next packet of the class is for the next round */
+		list_move_tail(&cl->alist, &q->old_classes);
+		hscrr_try_virtual_advance(q);
+	}
+	/* Else : stay at the head, the next packet is in this round. */
 
-		sch_tree_unlock(sch);
-		/* Only done if hash_log_new != q->hash_trees_log */
-		err = scrr_hash_resize(sch, hash_log_new);
-		sch_tree_lock(sch);
+	return skb;
+}
+
+static const struct nla_policy hscrr_policy[TCA_HSCRR_MAX + 1] = {
+	[TCA_HSCRR_WEIGHT]	= { .type = NLA_U32 },
+	[TCA_HSCRR_DEFAULT]	= { .type = NLA_U32 },
+};
+
+static int hscrr_change_class(struct Qdisc *sch, u32 classid, u32 parentid,
+			      struct nlattr **tca, unsigned long *arg,
+			      struct netlink_ext_ack *extack)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *	cl = (struct hscrr_class *) *arg;
+	struct nlattr *		opt = tca[TCA_OPTIONS];
+	struct nlattr *		tb[TCA_HSCRR_MAX + 1];
+	u32			weight = 1;
+	int			err;
+
+	/* Only one level of classes, the flows are below. */
+	if (parentid && parentid != TC_H_ROOT && parentid != sch->handle) {
+		NL_SET_ERR_MSG(extack, "HSCRR classes must be children of the qdisc");
+		return -EINVAL;
 	}
-	while (sch->q.qlen > sch->limit) {
-		struct sk_buff *skb = scrr_qdisc_dequeue(sch);
 
-		if (!skb)
-			break;
-		drop_len += qdisc_pkt_len(skb);
-		rtnl_kfree_skbs(skb, skb);
-		drop_count++;
+	if (opt) {
+		err = nla_parse_nested_deprecated(tb, TCA_HSCRR_MAX, opt,
+						  hscrr_policy, extack);
+		if (err < 0)
+			return err;
+		if (tb[TCA_HSCRR_WEIGHT]) {
+			weight = nla_get_u32(tb[TCA_HSCRR_WEIGHT]);
+			if (weight == 0 || weight > HSCRR_WEIGHT_MAX) {
+				NL_SET_ERR_MSG(extack, "HSCRR weight must be between 1 and 255");
+				return -EINVAL;
+			}
+		}
+	}
+
+	if (cl != NULL) {
+		if (opt && tb[TCA_HSCRR_WEIGHT]) {
+			sch_tree_lock(sch);
+			cl->weight = weight;
+			cl->weight_inv = (1U << SCRR_WEIGHT_SHIFT) / weight;
+			sch_tree_unlock(sch);
+		}
+		return 0;
 	}
-	qdisc_tree_reduce_backlog(sch, drop_count, drop_len);
 
+	cl = kzalloc(sizeof(*cl), GFP_KERNEL);
+	if (cl == NULL)
+		return -ENOBUFS;
+
+	gnet_stats_basic_sync_init(&cl->bstats);
+	INIT_LIST_HEAD(&cl->alist);
+	cl->common.classid = classid;
+	cl->weight = weight;
+	cl->weight_inv = (1U << SCRR_WEIGHT_SHIFT) / weight;
+	cl->qdisc = qdisc_create_dflt(sch->dev_queue, &scrr_qdisc_ops,
+				      classid, NULL);
+	if (cl->qdisc == NULL)
+		cl->qdisc = &noop_qdisc;
+	else
+		qdisc_hash_add(cl->qdisc, true);
+
+	sch_tree_lock(sch);
+	qdisc_class_hash_insert(&q->clhash, &cl->common);
 	sch_tree_unlock(sch);
 
-#ifdef SCRR_DEBUG_CONFIG
-	printk(KERN_DEBUG "SCRR: plimit %d; logs %d; mask 0x%X; flow_plimit %d; flags 0x%X\n", sch->limit, q->hash_trees_log, q->hash_mask, q->flow_plimit, q->flags);
-#endif	/* SCRR_DEBUG_CONFIG */
+	qdisc_class_hash_grow(sch, &q->clhash);
 
-	return err;
+	*arg = (unsigned long) cl;
+	return 0;
 }
 
-static int scrr_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
+static void hscrr_destroy_class(struct Qdisc *sch, struct hscrr_class *cl)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct nlattr *opts;
+	qdisc_put(cl->qdisc);
+	kfree(cl);
+}
 
-	opts = nla_nest_start_noflag(skb, TCA_OPTIONS);
-	if (opts == NULL)
-		goto nla_put_failure;
+static int hscrr_delete_class(struct Qdisc *sch, unsigned long arg,
+			      struct netlink_ext_ack *extack)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *	cl = (struct hscrr_class *) arg;
 
-	/* Standard queue limit */
-	if (nla_put_u32(skb, TCA_SCRR_PLIMIT, sch->limit))
-		goto nla_put_failure;
+	if (cl->filter_cnt > 0)
+		return -EBUSY;
 
-	/* Hashing attributes */
-	if (nla_put_u32(skb, TCA_SCRR_BUCKETS_LOG, q->hash_trees_log))
-		goto nla_put_failure;
-	if (nla_put_u32(skb, TCA_SCRR_HASH_MASK, q->hash_mask))
-		goto nla_put_failure;
+	sch_tree_lock(sch);
 
-	/* Other attributes */
-	if (nla_put_u32(skb, TCA_SCRR_FLOW_PLIMIT, q->flow_plimit))
-		goto nla_put_failure;
-	if (nla_put_u32(skb, TCA_SCRR_FLAGS, q->flags))
-		goto nla_put_failure;
+	/* qlen_notify() takes the class out of the lists */
+	qdisc_purge_queue(cl->qdisc);
+	hscrr_class_deactivate(q, cl);
+	qdisc_class_hash_remove(&q->clhash, &cl->common);
 
-	return nla_nest_end(skb, opts);
+	sch_tree_unlock(sch);
 
-nla_put_failure:
-	return -1;
+	hscrr_destroy_class(sch, cl);
+	return 0;
 }
 
-static int scrr_qdisc_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+static unsigned long hscrr_search_class(struct Qdisc *sch, u32 classid)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct tc_scrr_xstats st;
+	return (unsigned long) hscrr_find_class(sch, classid);
+}
 
-	memcpy(&st, &q->stats, sizeof(st));
+static struct tcf_block *hscrr_tcf_block(struct Qdisc *sch, unsigned long cl,
+					 struct netlink_ext_ack *extack)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
 
-	/* Reset some of the statistics, unless disabled */
-	if ( ! (q->flags & SCF_PEAK_NORESET) ) {
-		q->stats.qlen_peak = 0;
-		q->stats.backlog_peak = 0;
-		q->stats.burst_peak = 0;
+	if (cl) {
+		NL_SET_ERR_MSG(extack, "HSCRR classid must be zero");
+		return NULL;
 	}
+	return q->block;
+}
 
-	return gnet_stats_copy_app(d, &st, sizeof(st));
+static unsigned long hscrr_bind_tcf(struct Qdisc *sch, unsigned long parent,
+				    u32 classid)
+{
+	struct hscrr_class *cl = hscrr_find_class(sch, classid);
+
+	if (cl != NULL)
+		cl->filter_cnt++;
+	return (unsigned long) cl;
 }
 
-static int scrr_qdisc_init(struct Qdisc *sch,
-			   struct nlattr *opt,
-			   struct netlink_ext_ack *extack)
+static void hscrr_unbind_tcf(struct Qdisc *sch, unsigned long arg)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	int err;
+	struct hscrr_class *cl = (struct hscrr_class *) arg;
 
-#ifdef SCRR_DEBUG_CONFIG
-	printk(KERN_DEBUG "SCRR: sizeof(scrr_flow) %lu\n", sizeof(struct scrr_flow));
-#endif	/* SCRR_DEBUG_CONFIG */
+	cl->filter_cnt--;
+}
 
-	/* Configuration */
-	sch->limit		= SCRR_PLIMIT_DEFLT;
-	q->flow_plimit		= SCRR_FLOW_PLIMIT_DEFLT;
-	q->hash_mask		= SCRR_HASH_MASK_DEFLT;
+static int hscrr_graft_class(struct Qdisc *sch, unsigned long arg,
+			     struct Qdisc *new, struct Qdisc **old,
+			     struct netlink_ext_ack *extack)
+{
+	struct hscrr_class *cl = (struct hscrr_class *) arg;
 
-	/* Parameters */
-	q->hash_root		= NULL;
-	q->hash_trees_log	= ilog2(SCRR_HASH_NUM_DEFLT);
-	q->new_flows.first	= NULL;
-	q->old_flows.first	= NULL;
-	q->virtual_dequeue	= 0LL;
-	q->virtual_advance	= 0LL;
-	q->virtual_previous	= 0LL;
-	q->rounds_advance	= -1;
+	if (new == NULL) {
+		new = qdisc_create_dflt(sch->dev_queue, &scrr_qdisc_ops,
+					cl->common.classid, NULL);
+		if (new == NULL)
+			new = &noop_qdisc;
+	}
 
-	if (opt)
-		err = scrr_qdisc_change(sch, opt, extack);
-	else
-		err = scrr_hash_resize(sch, q->hash_trees_log);
+	*old = qdisc_replace(sch, new, &cl->qdisc);
+	return 0;
+}
 
-	return err;
+static struct Qdisc *hscrr_class_leaf(struct Qdisc *sch, unsigned long arg)
+{
+	struct hscrr_class *cl = (struct hscrr_class *) arg;
+
+	return cl->qdisc;
 }
 
-static void scrr_qdisc_reset(struct Qdisc *sch)
+static void hscrr_qlen_notify(struct Qdisc *sch, unsigned long arg)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
-	struct rb_root *root;
-	struct rb_node *p;
-	struct scrr_flow *flow_cur;
-	unsigned int idx;
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *cl = (struct hscrr_class *) arg;
 
-	sch->q.qlen = 0;
-	sch->qstats.backlog = 0;
+	hscrr_class_deactivate(q, cl);
+}
 
-	q->stats.flows		= 0;
-	q->stats.flows_inactive	= 0;
-	q->stats.no_mark	= 0;
-	q->stats.drop_mark	= 0;
-	q->stats.burst_peak	= 0;
-	q->stats.burst_avg	= 0;
-	q->stats.sched_empty	= 0;
+static int hscrr_dump_class(struct Qdisc *sch, unsigned long arg,
+			    struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct hscrr_class *	cl = (struct hscrr_class *) arg;
+	struct nlattr *		nest;
 
-#ifdef STFQ_DEBUG_BURST_AVG
-	q->flow_sched_prev	= 0;
-	q->burst_cur		= 0;
-#endif	/* STFQ_DEBUG_BURST_AVG */
+	tcm->tcm_parent	= TC_H_ROOT;
+	tcm->tcm_handle	= cl->common.classid;
+	tcm->tcm_info	= cl->qdisc->handle;
 
-	q->new_flows.first	= NULL;
-	q->old_flows.first	= NULL;
+	nest = nla_nest_start_noflag(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_HSCRR_WEIGHT, cl->weight))
+		goto nla_put_failure;
+	return nla_nest_end(skb, nest);
 
-	if (!q->hash_root)
-		return;
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
 
-	for (idx = 0; idx < (1U << q->hash_trees_log); idx++) {
-		root = &q->hash_root[idx];
-		while ((p = rb_first(root)) != NULL) {
-			flow_cur = rb_entry(p, struct scrr_flow, hash_node);
-			rb_erase(p, root);
+static int hscrr_dump_class_stats(struct Qdisc *sch, unsigned long arg,
+				  struct gnet_dump *d)
+{
+	struct hscrr_class *	cl = (struct hscrr_class *) arg;
+	struct Qdisc *		cl_q = cl->qdisc;
+	__u32			qlen = qdisc_qlen_sum(cl_q);
+
+	/* Drops of the class are the drops of the leaf, the classifier
+	 * drops have no class and are only in the qdisc stats */
+	if (gnet_stats_copy_basic(d, NULL, &cl->bstats, true) < 0 ||
+	    gnet_stats_copy_queue(d, cl_q->cpu_qstats, &cl_q->qstats, qlen) < 0)
+		return -1;
+	return 0;
+}
+
+static void hscrr_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *	cl;
+	unsigned int		i;
 
-			scrr_flow_purge(flow_cur);
+	if (arg->stop)
+		return;
 
-			kmem_cache_free(scrr_flow_cachep, flow_cur);
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, &q->clhash.hash[i], common.hnode) {
+			if (arg->count < arg->skip) {
+				arg->count++;
+				continue;
+			}
+			if (arg->fn(sch, (unsigned long) cl, arg) < 0) {
+				arg->stop = 1;
+				return;
+			}
+			arg->count++;
 		}
 	}
 }
 
-static void scrr_qdisc_destroy(struct Qdisc *sch)
+static int hscrr_qdisc_change(struct Qdisc *sch,
+			      struct nlattr *opt,
+			      struct netlink_ext_ack *extack)
 {
-	struct scrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct nlattr *tb[TCA_HSCRR_MAX + 1];
+	int err;
 
-	scrr_qdisc_reset(sch);
-	scrr_hash_free(q->hash_root);
+	if (!opt)
+		return -EINVAL;
+
+	err = nla_parse_nested_deprecated(tb, TCA_HSCRR_MAX, opt,
+					  hscrr_policy, extack);
+	if (err < 0)
+		return err;
+
+	if (tb[TCA_HSCRR_DEFAULT]) {
+		u32 defcls = nla_get_u32(tb[TCA_HSCRR_DEFAULT]);
+
+		if (defcls > TC_H_MIN_MASK) {
+			NL_SET_ERR_MSG(extack, "HSCRR default must be a class minor");
+			return -EINVAL;
+		}
+		sch_tree_lock(sch);
+		q->defcls = defcls;
+		sch_tree_unlock(sch);
+	}
+	return 0;
 }
 
-static struct Qdisc_ops scrr_qdisc_ops __read_mostly = {
-	.id		=	"scrr",
-	.priv_size	=	sizeof(struct scrr_sched_data),
+static int hscrr_qdisc_init(struct Qdisc *sch,
+			    struct nlattr *opt,
+			    struct netlink_ext_ack *extack)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	int err;
 
-	.enqueue	=	scrr_qdisc_enqueue,
-	.dequeue	=	scrr_qdisc_dequeue,
-	.peek		=	qdisc_peek_dequeued,
-	.init		=	scrr_qdisc_init,
-	.reset		=	scrr_qdisc_reset,
-	.destroy	=	scrr_qdisc_destroy,
-	.change		=	scrr_qdisc_change,
-	.dump		=	scrr_qdisc_dump,
-	.dump_stats	=	scrr_qdisc_dump_stats,
-	.owner		=	THIS_MODULE,
-};
+	err = tcf_block_get(&q->block, &q->filter_list, sch, extack);
+	if (err)
+		return err;
+	err = qdisc_class_hash_init(&q->clhash);
+	if (err < 0)
+		return err;
+	INIT_LIST_HEAD(&q->new_classes);
+	INIT_LIST_HEAD(&q->old_classes);
 
-static struct Qdisc_ops scrr_npm_qdisc_ops __read_mostly = {
-	.id		=	"scrr_npm",
-	.priv_size	=	sizeof(struct scrr_sched_data),
+	if (opt)
+		return hscrr_qdisc_change(sch, opt, extack);
+	return 0;
+}
 
-	.enqueue	=	scrr_qdisc_npm_enqueue,
-	.dequeue	=	scrr_qdisc_npm_dequeue,
-	.peek		=	qdisc_peek_dequeued,
-	.init		=	scrr_qdisc_init,
-	.reset		=	scrr_qdisc_reset,
-	.destroy	=	scrr_qdisc_destroy,
-	.change		=	scrr_qdisc_change,
-	.dump		=	scrr_qdisc_dump,
-	.dump_stats	=	scrr_qdisc_dump_stats,
-	.owner		=	THIS_MODULE,
-};
+static int hscrr_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts;
 
-static struct Qdisc_ops scrr_nmia_qdisc_ops __read_mostly = {
-	.id		=	"scrr_nmia",
-	.priv_size	=	sizeof(struct scrr_sched_data),
+	opts = nla_nest_start_noflag(skb, TCA_OPTIONS);
+	if (opts == NULL)
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_HSCRR_DEFAULT, q->defcls))
+		goto nla_put_failure;
+	return nla_nest_end(skb, opts);
 
-	.enqueue	=	scrr_qdisc_npm_enqueue,
-	.dequeue	=	scrr_qdisc_nmia_dequeue,
-	.peek		=	qdisc_peek_dequeued,
-	.init		=	scrr_qdisc_init,
-	.reset		=	scrr_qdisc_reset,
-	.destroy	=	scrr_qdisc_destroy,
-	.change		=	scrr_qdisc_change,
-	.dump		=	scrr_qdisc_dump,
-	.dump_stats	=	scrr_qdisc_dump_stats,
-	.owner		=	THIS_MODULE,
-};
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -EMSGSIZE;
+}
 
-static struct Qdisc_ops scrr_nmne_qdisc_ops __read_mostly = {
-	.id		=	"scrr_nmne",
-	.priv_size	=	sizeof(struct scrr_sched_data),
+static void hscrr_qdisc_reset(struct Qdisc *sch)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *	cl;
+	unsigned int		i;
+
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, &q->clhash.hash[i], common.hnode) {
+			hscrr_class_deactivate(q, cl);
+			qdisc_reset(cl->qdisc);
+			cl->virtual_finish = 0;
+		}
+	}
+	q->virtual_dequeue = 0;
+	q->virtual_advance = 0;
+	q->virtual_previous = 0;
+	q->rounds_advance = 0;
+}
 
-	.enqueue	=	scrr_qdisc_nmne_enqueue,
-	.dequeue	=	scrr_qdisc_nmne_dequeue,
-	.peek		=	qdisc_peek_dequeued,
-	.init		=	scrr_qdisc_init,
-	.reset		=	scrr_qdisc_reset,
-	.destroy	=	scrr_qdisc_destroy,
-	.change		=	scrr_qdisc_change,
-	.dump		=	scrr_qdisc_dump,
-	.dump_stats	=	scrr_qdisc_dump_stats,
-	.owner		=	THIS_MODULE,
-};
+static void hscrr_qdisc_destroy(struct Qdisc *sch)
+{
+	struct hscrr_sched_data *q = qdisc_priv(sch);
+	struct hscrr_class *	cl;
+	struct hlist_node *	next;
+	unsigned int		i;
 
-static struct Qdisc_ops scrr_neia_qdisc_ops __read_mostly = {
-	.id		=	"scrr_neia",
-	.priv_size	=	sizeof(struct scrr_sched_data),
+	tcf_block_put(q->block);
 
-	.enqueue	=	scrr_qdisc_nmne_enqueue,
-	.dequeue	=	scrr_qdisc_neia_dequeue,
-	.peek		=	qdisc_peek_dequeued,
-	.init		=	scrr_qdisc_init,
-	.reset		=	scrr_qdisc_reset,
-	.destroy	=	scrr_qdisc_destroy,
-	.change		=	scrr_qdisc_change,
-	.dump		=	scrr_qdisc_dump,
-	.dump_stats	=	scrr_qdisc_dump_stats,
-	.owner		=	THIS_MODULE,
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry_safe(cl, next, &q->clhash.hash[i],
+					  common.hnode)
+			hscrr_destroy_class(sch, cl);
+	}
+	qdisc_class_hash_destroy(&q->clhash);
+}
+
+static const struct Qdisc_class_ops hscrr_class_ops = {
+	.change		=	hscrr_change_class,
+	.delete		=	hscrr_delete_class,
+	.find		=	hscrr_search_class,
+	.tcf_block	=	hscrr_tcf_block,
+	.bind_tcf	=	hscrr_bind_tcf,
+	.unbind_tcf	=	hscrr_unbind_tcf,
+	.graft		=	hscrr_graft_class,
+	.leaf		=	hscrr_class_leaf,
+	.qlen_notify	=	hscrr_qlen_notify,
+	.dump		=	hscrr_dump_class,
+	.dump_stats	=	hscrr_dump_class_stats,
+	.walk		=	hscrr_walk,
 };
 
-static struct Qdisc_ops scrr_basic_qdisc_ops __read_mostly = {
-	.id		=	"scrr_basic",
-	.priv_size	=	sizeof(struct scrr_sched_data),
+static struct Qdisc_ops hscrr_qdisc_ops __read_mostly = {
+	.cl_ops		=	&hscrr_class_ops,
+	.id		=	"hscrr",
+	.priv_size	=	sizeof(struct hscrr_sched_data),
 
-	.enqueue	=	scrr_qdisc_enqueue,
-	.dequeue	=	scrr_qdisc_basic_dequeue,
+	.enqueue	=	hscrr_qdisc_enqueue,
+	.dequeue	=	hscrr_qdisc_dequeue,
 	.peek		=	qdisc_peek_dequeued,
-	.init		=	scrr_qdisc_init,
-	.reset		=	scrr_qdisc_reset,
-	.destroy	=	scrr_qdisc_destroy,
-	.change		=	scrr_qdisc_change,
-	.dump		=	scrr_qdisc_dump,
-	.dump_stats	=	scrr_qdisc_dump_stats,
+	.init		=	hscrr_qdisc_init,
+	.reset		=	hscrr_qdisc_reset,
+	.destroy	=	hscrr_qdisc_destroy,
+	.change		=	hscrr_qdisc_change,
+	.dump		=	hscrr_qdisc_dump,
 	.owner		=	THIS_MODULE,
 };
 
@@ -2084,11 +5445,27 @@ static int __init scrr_module_init(void)
 {
 	int ret;
 
+	/* scrr_flow_cold() : cold half right after the hot half */
+	BUILD_BUG_ON(sizeof(struct scrr_flow) != 32);
+	BUILD_BUG_ON(offsetof(struct scrr_flow_obj, cold)
+		     != sizeof(struct scrr_flow));
+	BUILD_BUG_ON(offsetof(struct scrr_pi2_flow, cold)
+		     != sizeof(struct scrr_flow));
+
 	scrr_flow_cachep = kmem_cache_create("scrr_flow_cache",
-					     sizeof(struct scrr_flow),
-					     0, 0, NULL);
+					     sizeof(struct scrr_flow_obj),
+					     0, SLAB_HWCACHE_ALIGN, NULL);
 	if (!scrr_flow_cachep)
 		return -ENOMEM;
+	scrr_pi2_flow_cachep = kmem_cache_create("scrr_pi2_flow_cache",
+						 sizeof(struct scrr_pi2_flow),
+						 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!scrr_pi2_flow_cachep) {
+		kmem_cache_destroy(scrr_flow_cachep);
+		return -ENOMEM;
+	}
+	/* Only telemetry needs it, checked when it is turned on */
+	scrr_debugfs = debugfs_create_dir("scrr", NULL);
 
 	ret = register_qdisc(&scrr_qdisc_ops);
 	if (!ret) {
@@ -2101,6 +5478,21 @@ static int __init scrr_module_init(void)
 					ret = register_qdisc(&scrr_neia_qdisc_ops);
 					if (!ret) {
 						ret = register_qdisc(&scrr_basic_qdisc_ops);
+						if (!ret) {
+							ret = register_qdisc(&scrr_pi2_qdisc_ops);
+							if (!ret) {
+								ret = register_qdisc(&scrr_mq_qdisc_ops);
+								if (!ret) {
+									ret = register_qdisc(&hscrr_qdisc_ops);
+									if (ret)
+										unregister_qdisc(&scrr_mq_qdisc_ops);
+								}
+								if (ret)
+									unregister_qdisc(&scrr_pi2_qdisc_ops);
+							}
+							if (ret)
+								unregister_qdisc(&scrr_basic_qdisc_ops);
+						}
 						if (ret)
 							unregister_qdisc(&scrr_neia_qdisc_ops);
 					}
@@ -2116,8 +5508,11 @@ static int __init scrr_module_init(void)
 		if (ret)
 			unregister_qdisc(&scrr_qdisc_ops);
 	}
-	if (ret)
+	if (ret) {
+		debugfs_remove(scrr_debugfs);
+		kmem_cache_destroy(scrr_pi2_flow_cachep);
 		kmem_cache_destroy(scrr_flow_cachep);
+	}
 	return ret;
 }
 
@@ -2129,6 +5524,11 @@ static void __exit scrr_module_exit(void)
 	unregister_qdisc(&scrr_nmne_qdisc_ops);
 	unregister_qdisc(&scrr_neia_qdisc_ops);
 	unregister_qdisc(&scrr_basic_qdisc_ops);
+	unregister_qdisc(&scrr_pi2_qdisc_ops);
+	unregister_qdisc(&scrr_mq_qdisc_ops);
+	unregister_qdisc(&hscrr_qdisc_ops);
+	debugfs_remove(scrr_debugfs);
+	kmem_cache_destroy(scrr_pi2_flow_cachep);
 	kmem_cache_destroy(scrr_flow_cachep);
 }
 
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * net/sched/sch_scrr_trace.h Tracepoints of the SCRR Scheduler
+ *
+ * Static tracepoints on the scheduling decisions of SCRR, usable from
+ * perf and bpftrace, for example :
+ *	perf record -e 'scrr:*' -a
+ *	bpftrace -e 't:scrr:scrr_dequeue { @[args->light] = count(); }'
+ * When not enabled, each tracepoint is a patched out jump, and the
+ * enqueue and dequeue only fetch the flow index, in the cold half of
+ * the flow, behind trace_*_enabled().
+ * This replaces the SCRR_DEBUG_STFQ_* printk in production.
+ * Virtual times are in bytes, like in the scheduler.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scrr
+
+#if !defined(_SCH_SCRR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCH_SCRR_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <net/sch_generic.h>
+
+/* Flow life cycle : created, goes inactive, garbage collected */
+DECLARE_EVENT_CLASS(scrr_flow_class,
+
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_finish),
+
+	TP_ARGS(sch, flow_idx, virtual_finish),
+
+	TP_STRUCT__entry(
+		__field(	int,	ifindex		)
+		__field(	u32,	handle		)
+		__field(	u32,	flow_idx	)
+		__field(	u64,	virtual_finish	)
+	),
+
+	TP_fast_assign(
+		__entry->ifindex	= qdisc_dev(sch)->ifindex;
+		__entry->handle		= sch->handle;
+		__entry->flow_idx	= flow_idx;
+		__entry->virtual_finish	= virtual_finish;
+	),
+
+	TP_printk("ifindex=%d handle=0x%X idx=0x%X vfin=%llu",
+		  __entry->ifindex, __entry->handle, __entry->flow_idx,
+		  __entry->virtual_finish)
+);
+
+DEFINE_EVENT(scrr_flow_class, scrr_flow_create,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_finish),
+	TP_ARGS(sch, flow_idx, virtual_finish)
+);
+
+DEFINE_EVENT(scrr_flow_class, scrr_flow_detach,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_finish),
+	TP_ARGS(sch, flow_idx, virtual_finish)
+);
+
+DEFINE_EVENT(scrr_flow_class, scrr_flow_gc,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_finish),
+	TP_ARGS(sch, flow_idx, virtual_finish)
+);
+
+/* Packet added to a flow, vfin is the flow virtual time after that */
+TRACE_EVENT(scrr_enqueue,
+
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u32 len, u32 flow_qlen,
+		 u64 virtual_finish, u64 virtual_advance),
+
+	TP_ARGS(sch, flow_idx, len, flow_qlen, virtual_finish,
+		virtual_advance),
+
+	TP_STRUCT__entry(
+		__field(	int,	ifindex		)
+		__field(	u32,	handle		)
+		__field(	u32,	flow_idx	)
+		__field(	u32,	len		)
+		__field(	u32,	flow_qlen	)
+		__field(	u64,	virtual_finish	)
+		__field(	u64,	virtual_advance	)
+	),
+
+	TP_fast_assign(
+		__entry->ifindex	= qdisc_dev(sch)->ifindex;
+		__entry->handle		= sch->handle;
+		__entry->flow_idx	= flow_idx;
+		__entry->len		= len;
+		__entry->flow_qlen	= flow_qlen;
+		__entry->virtual_finish	= virtual_finish;
+		__entry->virtual_advance = virtual_advance;
+	),
+
+	TP_printk("ifindex=%d handle=0x%X idx=0x%X len=%u fl=%u vfin=%llu vadv=%llu",
+		  __entry->ifindex, __entry->handle, __entry->flow_idx,
+		  __entry->len, __entry->flow_qlen, __entry->virtual_finish,
+		  __entry->virtual_advance)
+);
+
+/* Packet scheduled, light is set if the flow came from the new list */
+TRACE_EVENT(scrr_dequeue,
+
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u32 len, u64 virtual_pkt,
+		 u64 virtual_advance, bool light),
+
+	TP_ARGS(sch, flow_idx, len, virtual_pkt, virtual_advance, light),
+
+	TP_STRUCT__entry(
+		__field(	int,	ifindex		)
+		__field(	u32,	handle		)
+		__field(	u32,	flow_idx	)
+		__field(	u32,	len		)
+		__field(	u64,	virtual_pkt	)
+		__field(	u64,	virtual_advance	)
+		__field(	bool,	light		)
+	),
+
+	TP_fast_assign(
+		__entry->ifindex	= qdisc_dev(sch)->ifindex;
+		__entry->handle		= sch->handle;
+		__entry->flow_idx	= flow_idx;
+		__entry->len		= len;
+		__entry->virtual_pkt	= virtual_pkt;
+		__entry->virtual_advance = virtual_advance;
+		__entry->light		= light;
+	),
+
+	TP_printk("ifindex=%d handle=0x%X idx=0x%X len=%u vpkt=%llu vadv=%llu light=%d",
+		  __entry->ifindex, __entry->handle, __entry->flow_idx,
+		  __entry->len, __entry->virtual_pkt,
+		  __entry->virtual_advance, __entry->light)
+);
+
+/* End of a scheduling round, the virtual clock moves forward */
+TRACE_EVENT(scrr_virtual_advance,
+
+	TP_PROTO(struct Qdisc *sch, u64 virtual_advance, u64 virtual_previous,
+		 s32 rounds),
+
+	TP_ARGS(sch, virtual_advance, virtual_previous, rounds),
+
+	TP_STRUCT__entry(
+		__field(	int,	ifindex		)
+		__field(	u32,	handle		)
+		__field(	u64,	virtual_advance	)
+		__field(	u64,	virtual_previous )
+		__field(	s32,	rounds		)
+	),
+
+	TP_fast_assign(
+		__entry->ifindex	= qdisc_dev(sch)->ifindex;
+		__entry->handle		= sch->handle;
+		__entry->virtual_advance = virtual_advance;
+		__entry->virtual_previous = virtual_previous;
+		__entry->rounds		= rounds;
+	),
+
+	TP_printk("ifindex=%d handle=0x%X vadv=%llu vpv=%llu rounds=%d",
+		  __entry->ifindex, __entry->handle,
+		  __entry->virtual_advance, __entry->virtual_previous,
+		  __entry->rounds)
+);
+
+#endif /* _SCH_SCRR_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sch_scrr_trace
+#include <trace/define_trace.h>
@@ -25,6 +25,12 @@
  *
  *  dequeue() : serves FIFO's in strict priority preference. Updates the global virtual time.
  * 		Higher indexed bands have higher priority.
+ *
+ * The number of bands is configurable, up to 32. Non-empty bands are
+ * tracked in a bitmap, so dequeue finds the highest one with a single
+ * fls(). On inversion, the bounds of all bands but the highest are
+ * pushed down by the same cost, this is done by accumulating the cost
+ * in qbound_shift instead of updating every bound.
  */
 
 #include <linux/module.h>
@@ -39,6 +45,8 @@
 #include <linux/slab.h>
 #include <linux/rbtree.h>
 #include <linux/hash.h>
+#include <linux/siphash.h>
+#include <linux/random.h>
 #include <linux/prefetch.h>
 #include <linux/vmalloc.h>
 #include <net/netlink.h>
@@ -58,6 +66,7 @@
 #define SPPIFO_BAND_PLIMIT_DEFLT	(1250)		/* packets */
 #define SPPIFO_HASH_NUM_DEFLT		(1024)		/* num tree roots */
 #define SPPIFO_HASH_MASK_DEFLT		(1024 - 1)	/* bitmask */
+#define SPPIFO_BANDS_DEFLT		(8)		/* FIFO queues */
 
 enum {
 	TCA_SPPIFO_UNSPEC,
@@ -66,13 +75,15 @@ enum {
 	TCA_SPPIFO_HASH_MASK,	/* mask applied to skb hashes */
 	TCA_SPPIFO_BAND_PLIMIT,	/* limit of packets per band */
 	TCA_SPPIFO_FLAGS,		/* Options */
+	TCA_SPPIFO_BANDS,	/* Number of bands */
 	__TCA_SPPIFO_MAX
 };
 #define TCA_SPPIFO_MAX	(__TCA_SPPIFO_MAX - 1)
 
 /* TCA_SPPIFO_FLAGS */
 #define SCF_PEAK_NORESET	0x0020	/* Don't reset peak statistics */
-#define SPPIFO_BANDS	8		/* Number of FIFO queues */
+#define SCF_EXACT_FLOW		0x0400	/* Full hash and key, no collisions */
+#define SPPIFO_BANDS_MAX	32		/* Max number of FIFO queues */
 
 /* statistics gathering */
 struct tc_sppifo_xstats {
@@ -87,8 +98,10 @@ struct tc_sppifo_xstats {
 	__u32	burst_avg;	/* Average burst size */
 	__u32	num_inversions;	/* Number of inversions on enqueue */
 	__u32	num_reordering;	/* Number of re-ordering on dequeue */
-	__u32	band_tx[SPPIFO_BANDS];	/* Number of SKBs sent from each band */
-	__u32	band_qlen[SPPIFO_BANDS];	/* Number of SKBs queued in each band */
+	__u32	band_tx[SPPIFO_BANDS_MAX];	/* Number of SKBs sent from each band */
+	__u32	band_qlen[SPPIFO_BANDS_MAX];	/* Number of SKBs queued in each band */
+	__u32	bands;		/* Number of bands */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
 };
 
 /*
@@ -101,6 +114,7 @@ struct sppifo_flow {
 	u64		virtual_tail;	/* Virtual of next incoming packet */
 	u64		virtual_head;	/* Current virtual time */
 	u32		flow_idx;	/* Hash value for this flow */
+	u32		flow_key;	/* Second hash, with SCF_EXACT_FLOW */
 	int		pcount;		/* number of packets in fifos */
 
 } ____cacheline_aligned_in_smp;
@@ -115,7 +129,10 @@ struct sppifo_sched_data {
 	u32		hash_mask;	/* mask for orphaned skb */
 	u8		hash_trees_log;	/* log(number buckets) */
 	u32		flags;		/* Bitmask of AIFF_XXX flags */
+	siphash_key_t	flow_key_seed;	/* For flow_key of SCF_EXACT_FLOW */
 	u32 	band_plimit;	/* Limit on number of packets in each band */
+	u32		bands;		/* Number of bands used for enqueue */
+	u32		bands_alloc;	/* Number of bands with a FIFO */
 
 	/* Classifier */
 	struct rb_root	*hash_root;	/* Hash of tree roots */
@@ -127,8 +144,10 @@ struct sppifo_sched_data {
 	struct tc_sppifo_xstats  stats;
 
 	/* Scheduler */
-	u64		sppifo_qbound[SPPIFO_BANDS];			/* SP-PIFO Queue bound */
-	struct	skb_array	fifo[SPPIFO_BANDS];		/* FIFO queues holding packets */
+	u32		band_active;	/* Bitmap of non-empty bands */
+	u64		qbound_shift;	/* Push-down of all but highest bound */
+	u64		sppifo_qbound[SPPIFO_BANDS_MAX];		/* SP-PIFO Queue bound */
+	struct	skb_array	fifo[SPPIFO_BANDS_MAX];		/* FIFO queues holding packets */
 	u64		virtual_dequeue;  /* Virtual of last dequeue */
 };
 
@@ -145,8 +164,24 @@ static inline struct sppifo_skb_cb *sppifo_skb_cb(struct sk_buff *skb)
 	return (struct sppifo_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+/* Identity of a flow in the classifier, flow_idx then flow_key.
+ * Without SCF_EXACT_FLOW, flow_key is always 0. */
+static inline bool sppifo_flow_id_eq(const struct sppifo_flow *f,
+				   u32 flow_idx, u32 flow_key)
+{
+	return f->flow_idx == flow_idx && f->flow_key == flow_key;
+}
+
+static inline bool sppifo_flow_id_gt(const struct sppifo_flow *f,
+				   u32 flow_idx, u32 flow_key)
+{
+	return ( f->flow_idx > flow_idx
+		 || (f->flow_idx == flow_idx && f->flow_key > flow_key) );
+}
+
 static inline struct sppifo_flow *sppifo_create_flow(struct sppifo_sched_data *q,
-						 uint32_t flow_idx)
+						 uint32_t flow_idx,
+						 uint32_t flow_key)
 {
 	struct sppifo_flow *flow_new;
 
@@ -157,6 +192,7 @@ static inline struct sppifo_flow *sppifo_create_flow(struct sppifo_sched_data *q
 	}
 
 	flow_new->flow_idx = flow_idx;
+	flow_new->flow_key = flow_key;
 
 	/* Initialize virtual time of the flow. */
 	flow_new->virtual_tail = q->virtual_dequeue;
@@ -183,7 +219,8 @@ static bool sppifo_gc_candidate(const struct sppifo_flow *f)
 
 static void sppifo_gc(struct sppifo_sched_data *q,
 		    struct rb_root *	root,
-		    uint32_t		flow_idx)
+		    uint32_t		flow_idx,
+		    uint32_t		flow_key)
 {
 	struct rb_node **p, *parent;
 	void *tofree[SPPIFO_GC_MAX];
@@ -196,7 +233,7 @@ static void sppifo_gc(struct sppifo_sched_data *q,
 		parent = *p;
 
 		f = rb_entry(parent, struct sppifo_flow, hash_node);
-		if (f->flow_idx == flow_idx)
+		if (sppifo_flow_id_eq(f, flow_idx, flow_key))
 			break;
 
 		if (sppifo_gc_candidate(f)) {
@@ -205,7 +242,7 @@ static void sppifo_gc(struct sppifo_sched_data *q,
 				break;
 		}
 
-		if (f->flow_idx > flow_idx)
+		if (sppifo_flow_id_gt(f, flow_idx, flow_key))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
@@ -231,12 +268,19 @@ static struct sppifo_flow *sppifo_classify(struct sk_buff *skb,
 	struct rb_node **	p;
 	struct rb_node *	parent;
 	uint32_t		flow_idx;
+	uint32_t		flow_key = 0;
 	struct rb_root *	root;
 	struct sppifo_flow *	flow_cur;
 	struct sppifo_sched_data *q = qdisc_priv(sch);
 
-	/* Get hash value for the packet */
-	flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
+	/* Get hash value for the packet. With SCF_EXACT_FLOW, the full
+	 * hash, and a second hash of the headers to tell apart the flows
+	 * which still collide. */
+	if (unlikely(q->flags & SCF_EXACT_FLOW)) {
+		flow_idx = skb_get_hash(skb);
+		flow_key = skb_get_hash_perturb(skb, &q->flow_key_seed);
+	} else
+		flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
 
 	/* Get the root of the tree from the hash */
 	root = &q->hash_root[ flow_idx & (q->hash_buckets - 1) ];
@@ -249,7 +293,7 @@ static struct sppifo_flow *sppifo_classify(struct sk_buff *skb,
 	if ( (q->stats.flows >= (q->hash_buckets * 2))
 	     && ( ( time_after(jiffies, q->age_next_gc) )
 		  || (sch->q.qlen == 0) ) )
-		sppifo_gc(q, root, flow_idx);
+		sppifo_gc(q, root, flow_idx, flow_key);
 
 	/* Find flow in that specific tree */
 	p = &root->rb_node;
@@ -259,17 +303,20 @@ static struct sppifo_flow *sppifo_classify(struct sk_buff *skb,
 
 		flow_cur = rb_entry(parent, struct sppifo_flow, hash_node);
 		if (flow_cur->flow_idx == flow_idx) {
-			/* Found ! */
-			return flow_cur;
+			if (likely(flow_cur->flow_key == flow_key)) {
+				/* Found ! */
+				return flow_cur;
+			}
+			q->stats.hash_collisions++;
 		}
-		if (flow_cur->flow_idx > flow_idx)
+		if (sppifo_flow_id_gt(flow_cur, flow_idx, flow_key))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
 	}
 
 	/* Create a new flow */
-	flow_cur = sppifo_create_flow(q, flow_idx);
+	flow_cur = sppifo_create_flow(q, flow_idx, flow_key);
 	if (unlikely(flow_cur == NULL)) {
 		return NULL;
 	}
@@ -314,26 +361,51 @@ static struct sppifo_flow *sppifo_classify(struct sk_buff *skb,
 }
 
 
+/* The bounds of all bands but the highest are stored with qbound_shift
+ * added, so comparing virtual_pkt + qbound_shift with them gives the
+ * pushed down bounds. */
 static inline u32 sppifo_select_band(struct sppifo_sched_data *q, struct sppifo_flow  *flow_cur, u64 virtual_pkt)
 {
-	int i;
+	u64 virtual_shift = virtual_pkt + q->qbound_shift;
+	u32 top = q->bands - 1;
+	u32 match = 0;
 	u64 cost;
+	u32 i;
 
-	for(i = 0; i < SPPIFO_BANDS - 1; i++)
-	{
-		if(time_after_eq64(virtual_pkt, q->sppifo_qbound[i]))
-			return i;
-	}
-	if(time_before64(virtual_pkt, q->sppifo_qbound[i]))
+	/* Find all bands that can take the packet, without branches,
+	 * the lowest one is the one we want. */
+	for(i = 0; i < top; i++)
+		match |= (u32) time_after_eq64(virtual_shift, q->sppifo_qbound[i]) << i;
+	if (match)
+		return __ffs(match);
+
+	if(time_before64(virtual_pkt, q->sppifo_qbound[top]))
 	{
 		// inversion detected
-		cost = q->sppifo_qbound[i] - virtual_pkt;
-		for(i = 0; i < SPPIFO_BANDS - 1; i++)
-			q->sppifo_qbound[i] -= cost;
+		cost = q->sppifo_qbound[top] - virtual_pkt;
+		q->qbound_shift += cost;
 		q->stats.num_inversions++;
 	}
-	// i is always the highest priority queue at this point
-	return i;
+	// top is always the highest priority queue at this point
+	return top;
+}
+
+static inline void sppifo_set_bound(struct sppifo_sched_data *q, u32 band, u64 virtual_pkt)
+{
+	if (band == q->bands - 1)
+		q->sppifo_qbound[band] = virtual_pkt;
+	else
+		q->sppifo_qbound[band] = virtual_pkt + q->qbound_shift;
+}
+
+/* Reset bounds, all bands are empty of recent packets. */
+static void sppifo_reset_bounds(struct sppifo_sched_data *q)
+{
+	u32 b;
+
+	q->qbound_shift = 0;
+	for(b = 0; b < SPPIFO_BANDS_MAX; b++)
+		q->sppifo_qbound[b] = q->virtual_dequeue;
 }
 
 
@@ -391,10 +463,12 @@ static int sppifo_qdisc_enqueue(struct sk_buff *	skb,
 		q->stats.drop_mark++;
 		return qdisc_drop(skb, sch, to_free);
 	}
-	q->sppifo_qbound[selected_band] = virtual_pkt;
+	sppifo_set_bound(q, selected_band, virtual_pkt);
 
+	/* Bands are only used under the qdisc lock, no need for the
+	 * locked version of skb_array. */
 	list = sppifo_band2list(q, selected_band);
-	err = skb_array_produce(list, skb);
+	err = __ptr_ring_produce(&list->ring, skb);
 
 	if (unlikely(err)) {
 		return qdisc_drop(skb, sch, to_free);
@@ -408,6 +482,7 @@ static int sppifo_qdisc_enqueue(struct sk_buff *	skb,
 	q->stats.no_mark++;
 	
 	q->stats.band_qlen[selected_band]++;
+	q->band_active |= 1U << selected_band;
 	sch->q.qlen++;
 	flow_cur->age = jiffies;
 	qdisc_qstats_backlog_inc(sch, skb);
@@ -443,38 +518,27 @@ static struct sk_buff *sppifo_qdisc_dequeue(struct Qdisc *sch)
 	if (unlikely(sch->q.qlen == 0))
 		return NULL;
 
-	for (b = SPPIFO_BANDS - 1; b >= 0; b--)
-	{
-		if (q->stats.band_qlen[b] > 0)
-		{
-			list = sppifo_band2list(q, b);
-
-			if(list == NULL)
-			{
-				printk("SP_PIFO: BUG -> band cannot be null!\n");
-				return NULL;
-			}
-
-			if (unlikely(skb_array_empty(list))) {
-				printk("SP_PIFO: BUG -> Could not find a packet in non-empty band!\n");
-				return NULL;
-			}
+	/* Highest non-empty band. This may be above the current number
+	 * of bands, if it was decreased, until those bands drain. */
+	if (unlikely(q->band_active == 0)) {
+		printk("SP_PIFO: BUG -> Could not find a packet in bands!\n");
+		return NULL;
+	}
+	b = fls(q->band_active) - 1;
+	list = sppifo_band2list(q, b);
 
 #ifdef SPPIFO_DEBUG_SPPIFO_DEQUEUE
-			printk(KERN_DEBUG "SP-PIFO: consuming band %d of length %u\n", b, q->stats.band_qlen[b] );
+	printk(KERN_DEBUG "SP-PIFO: consuming band %d of length %u\n", b, q->stats.band_qlen[b] );
 #endif	/* SPPIFO_DEBUG_SPPIFO_DEQUEUE */
-			skb = skb_array_consume(list);
-			q->stats.band_qlen[b]--;
-			sch->q.qlen--;
-			break;
-		}
-	}
-
-	if(unlikely(skb == NULL))
-	{
-		printk("SP_PIFO: BUG -> Could not find a packet in bands!\n");
+	skb = __skb_array_consume(list);
+	if (unlikely(skb == NULL)) {
+		printk("SP_PIFO: BUG -> Could not find a packet in non-empty band!\n");
 		return NULL;
 	}
+	q->stats.band_qlen[b]--;
+	if (q->stats.band_qlen[b] == 0)
+		q->band_active &= ~(1U << b);
+	sch->q.qlen--;
 
 	/* Get virtual tag of this packet. */
 	virtual_pkt = sppifo_skb_cb(skb)->virtual_start;
@@ -528,9 +592,9 @@ static void sppifo_rehash(struct sppifo_sched_data *q,
 				parent = *np;
 
 				nf = rb_entry(parent, struct sppifo_flow, hash_node);
-				BUG_ON(nf->flow_idx == of->flow_idx);
+				BUG_ON(sppifo_flow_id_eq(nf, of->flow_idx, of->flow_key));
 
-				if (nf->flow_idx > of->flow_idx)
+				if (sppifo_flow_id_gt(nf, of->flow_idx, of->flow_key))
 					np = &parent->rb_right;
 				else
 					np = &parent->rb_left;
@@ -594,8 +658,26 @@ static const struct nla_policy sppifo_policy[TCA_SPPIFO_MAX + 1] = {
 	[TCA_SPPIFO_HASH_MASK]		= { .type = NLA_U32 },
 	[TCA_SPPIFO_BAND_PLIMIT]		= { .type = NLA_U32 },
 	[TCA_SPPIFO_FLAGS]		= { .type = NLA_U32 },
+	[TCA_SPPIFO_BANDS]		= { .type = NLA_U32 },
 };
 
+/* Create the FIFOs of new bands. Bands above q->bands are not used by
+ * enqueue and are empty, so this can be done without the lock. */
+static int sppifo_bands_alloc(struct sppifo_sched_data *q, u32 bands)
+{
+	int err;
+
+	while (q->bands_alloc < bands) {
+		struct skb_array *list = sppifo_band2list(q, q->bands_alloc);
+
+		err = skb_array_init(list, SPPIFO_PLIMIT_DEFLT, GFP_KERNEL);
+		if (err)
+			return -ENOMEM;
+		q->bands_alloc++;
+	}
+	return 0;
+}
+
 static int sppifo_qdisc_change(struct Qdisc *sch,
 			     struct nlattr *opt,
 			     struct netlink_ext_ack *extack)
@@ -603,6 +685,7 @@ static int sppifo_qdisc_change(struct Qdisc *sch,
 	struct sppifo_sched_data *q = qdisc_priv(sch);
 	struct nlattr *tb[TCA_SPPIFO_MAX + 1];
 	u32		plimit;
+	u32		bands;
 	u32		hash_log_new;
 	int		err;
 	int		drop_count = 0;
@@ -624,11 +707,27 @@ static int sppifo_qdisc_change(struct Qdisc *sch,
 			return -EINVAL;
 	}
 
+	/* Check and create bands before locking */
+	if (tb[TCA_SPPIFO_BANDS]) {
+		bands = nla_get_u32(tb[TCA_SPPIFO_BANDS]);
+		if (bands == 0 || bands > SPPIFO_BANDS_MAX)
+			return -EINVAL;
+		err = sppifo_bands_alloc(q, bands);
+		if (err)
+			return err;
+	}
+
 	sch_tree_lock(sch);
 
 	if (tb[TCA_SPPIFO_PLIMIT])
 		sch->limit = plimit;
 
+	if (tb[TCA_SPPIFO_BANDS] && bands != q->bands) {
+		/* Bounds of the top band are not pushed down */
+		q->bands = bands;
+		sppifo_reset_bounds(q);
+	}
+
 	hash_log_new = q->hash_trees_log;
 	if (tb[TCA_SPPIFO_BUCKETS_LOG]) {
 		u32 nval = nla_get_u32(tb[TCA_SPPIFO_BUCKETS_LOG]);
@@ -671,7 +770,7 @@ static int sppifo_qdisc_change(struct Qdisc *sch,
 	sch_tree_unlock(sch);
 
 #ifdef SPPIFO_DEBUG_CONFIG
-	printk(KERN_DEBUG "SPPIFO: plimit %d; logs %d; mask 0x%X; band_plimit %d; flags 0x%X\n", sch->limit, q->hash_trees_log, q->hash_mask, q->band_plimit, q->flags);
+	printk(KERN_DEBUG "SPPIFO: plimit %d; logs %d; mask 0x%X; band_plimit %d; bands %d; flags 0x%X\n", sch->limit, q->hash_trees_log, q->hash_mask, q->band_plimit, q->bands, q->flags);
 #endif	/* SPPIFO_DEBUG_CONFIG */
 
 	return err;
@@ -701,6 +800,8 @@ static int sppifo_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 		goto nla_put_failure;
 	if (nla_put_u32(skb, TCA_SPPIFO_FLAGS, q->flags))
 		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_SPPIFO_BANDS, q->bands))
+		goto nla_put_failure;
 
 	return nla_nest_end(skb, opts);
 
@@ -714,6 +815,7 @@ static int sppifo_qdisc_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 	struct tc_sppifo_xstats st;
 
 	memcpy(&st, &q->stats, sizeof(st));
+	st.bands = q->bands;
 
 	/* Reset some of the statistics, unless disabled */
 	if ( ! (q->flags & SCF_PEAK_NORESET) ) {
@@ -736,6 +838,7 @@ static int sppifo_qdisc_init(struct Qdisc *sch,
 	sch->limit		= SPPIFO_PLIMIT_DEFLT;
 	q->band_plimit		= 0;
 	q->hash_mask		= SPPIFO_HASH_MASK_DEFLT;
+	get_random_bytes(&q->flow_key_seed, sizeof(q->flow_key_seed));
 
 	/* Parameters */
 	q->hash_root		= NULL;
@@ -744,18 +847,16 @@ static int sppifo_qdisc_init(struct Qdisc *sch,
 	q->age_next_gc		= jiffies + SPPIFO_GC_AGE / 2;
 
 	/* Schedule */
-	for(b = 0;b < SPPIFO_BANDS; b++){
-		struct skb_array *list = sppifo_band2list(q, b);
-		int err;
-
-		err = skb_array_init(list, SPPIFO_PLIMIT_DEFLT, GFP_KERNEL);
-		if (err)
-			return -ENOMEM;
-
+	q->bands		= SPPIFO_BANDS_DEFLT;
+	q->bands_alloc		= 0;
+	q->band_active		= 0;
+	for(b = 0;b < SPPIFO_BANDS_MAX; b++)
 		q->stats.band_qlen[b] = 0;
-		q->sppifo_qbound[b] = 0;
-	}
-		
+	sppifo_reset_bounds(q);
+
+	err = sppifo_bands_alloc(q, q->bands);
+	if (err)
+		return err;
 
 	if (opt)
 		err = sppifo_qdisc_change(sch, opt, extack);
@@ -786,6 +887,7 @@ static void sppifo_qdisc_reset(struct Qdisc *sch)
 	q->stats.burst_avg	= 0;
 	q->stats.num_inversions	= 0;
 	q->stats.num_reordering	= 0;
+	q->stats.hash_collisions = 0;
 
 
 	if (!q->hash_root)
@@ -802,7 +904,7 @@ static void sppifo_qdisc_reset(struct Qdisc *sch)
 		}
 	}
 
-	for(b = 0;b < SPPIFO_BANDS; b++)
+	for(b = 0;b < SPPIFO_BANDS_MAX; b++)
 	{
 		
 		list = sppifo_band2list(q, b);
@@ -813,8 +915,9 @@ static void sppifo_qdisc_reset(struct Qdisc *sch)
 		while ((skb = __skb_array_consume(list)) != NULL)
 			kfree_skb(skb);
 		q->stats.band_qlen[b] = 0;
-		q->sppifo_qbound[b] = 0;
 	}
+	q->band_active = 0;
+	sppifo_reset_bounds(q);
 
 
 }
@@ -827,7 +930,7 @@ static void sppifo_qdisc_destroy(struct Qdisc *sch)
 	sppifo_qdisc_reset(sch);
 
 
-	for (b = 0; b < SPPIFO_BANDS; b++) {
+	for (b = 0; b < SPPIFO_BANDS_MAX; b++) {
 		struct skb_array *list = sppifo_band2list(q, b);
 
 		if (!list->ring.queue)
@@ -14,6 +14,14 @@
  * which is more scalable than a linked list. This is totally separate
  * from the RB-trees in the classifier.
  *
+ * Alternatively, with the 'calendar' flag, STFQ uses a calendar queue
+ * to store the scheduled flows. The virtual time of all scheduled flows
+ * is within one packet of virtual_dequeue, so a window of 4096 buckets
+ * of virtual time covers all of them, and a two level bitmap finds
+ * the first non-empty bucket in constant time. Flows within a bucket
+ * are served in FIFO order, so the order is only approximated to the
+ * bucket granularity.
+ *
  * ---------------------------------------------------------------- *
  *
  * Flow management (classification, lists, gc...) based on sch_fq.c :
@@ -41,6 +49,8 @@
 #include <linux/slab.h>
 #include <linux/rbtree.h>
 #include <linux/hash.h>
+#include <linux/siphash.h>
+#include <linux/random.h>
 #include <linux/prefetch.h>
 #include <linux/vmalloc.h>
 #include <net/netlink.h>
@@ -49,17 +59,24 @@
 #include <net/tcp_states.h>
 #include <net/tcp.h>
 
+#define CREATE_TRACE_POINTS
+#include "sch_stfq_trace.h"
+
 //#define STFQ_DEBUG_CONFIG
 //#define STFQ_DEBUG_FLOW_NEW
 //#define STFQ_DEBUG_STFQ_ENQUEUE
 //#define STFQ_DEBUG_STFQ_DEQUEUE
 //#define STFQ_DEBUG_STATS_PEAK
+//#define STFQ_DEBUG_CALENDAR
 #define STFQ_DEBUG_BURST_AVG
 
 #define STFQ_PLIMIT_DEFLT		(10000)		/* packets */
 #define STFQ_FLOW_PLIMIT_DEFLT		(100)		/* packets */
 #define STFQ_HASH_NUM_DEFLT		(1024)		/* num tree roots */
 #define STFQ_HASH_MASK_DEFLT		(1024 - 1)	/* bitmask */
+#define STFQ_CAL_GRAN_LOG_DEFLT		(5)		/* 32 bytes */
+#define STFQ_WALK_CHUNK			(64)		/* flows per class dump lock */
+#define STFQ_WALK_BUCKETS		(1024)		/* buckets per class dump lock */
 
 enum {
 	TCA_STFQ_UNSPEC,
@@ -68,12 +85,16 @@ enum {
 	TCA_STFQ_HASH_MASK,	/* mask applied to skb hashes */
 	TCA_STFQ_FLOW_PLIMIT,	/* limit of packets per flow */
 	TCA_STFQ_FLAGS,		/* Options */
+	TCA_STFQ_CAL_GRAN_LOG,	/* log2(calendar bucket granularity) */
 	__TCA_STFQ_MAX
 };
 #define TCA_STFQ_MAX	(__TCA_STFQ_MAX - 1)
 
 /* TCA_STFQ_FLAGS */
 #define SCF_PEAK_NORESET	0x0020	/* Don't reset peak statistics */
+#define SCF_CALENDAR		0x0040	/* Schedule with calendar queue */
+#define SCF_BYPASS		0x0200	/* Stack may skip us when empty */
+#define SCF_EXACT_FLOW		0x0400	/* Full hash and key, no collisions */
 
 /* statistics gathering */
 struct tc_stfq_xstats {
@@ -88,6 +109,18 @@ struct tc_stfq_xstats {
 	__u32	burst_peak;	/* Maximum burst size */
 	__u32	burst_avg;	/* Average burst size */
 	__u32	sched_empty;	/* Schedule with no packet */
+	__u32	cal_clamp;	/* Flows beyond the calendar window */
+	__u32	bypass;		/* Packets sent by the stack, skipping us */
+	__u32	hash_collisions; /* Lookups that met another flow's hash */
+};
+
+/* Statistics of one flow, as a class, see stfq_walk() */
+struct tc_stfq_flow_xstats {
+	__u64	virtual_tail;	/* Virtual of next incoming packet */
+	__u32	flow_idx;	/* Hash value for this flow */
+	__u32	qlen;		/* Packets queued */
+	__u32	backlog;	/* Bytes queued */
+	__u32	drops;		/* Packets dropped from this flow */
 };
 
 /*
@@ -100,16 +133,38 @@ struct stfq_flow {
 		unsigned long  age;	/* (jiffies | 1UL) when flow was emptied, for gc */
 	};
 	struct rb_node	hash_node;	/* anchor in hash_root[] trees */
-	struct rb_node	stfq_node;	/* flow pointer in the sorted flow tree */
+	union {
+		struct rb_node	stfq_node;	/* pointer in the sorted flow tree */
+		struct list_head cal_node;	/* pointer in the calendar bucket */
+	};
 	u64		virtual_tail;	/* Virtual of next incoming packet */
 	u64		virtual_head;	/* Virtual where inserted in RB tree */
 	u32		flow_idx;	/* Hash value for this flow */
+	u32		flow_key;	/* Second hash, with SCF_EXACT_FLOW */
 	int		qlen;		/* number of packets in flow queue */
+	u32		cal_idx;	/* Calendar bucket of the flow */
+	u32		drops;		/* Packets dropped, for the class stats */
 
 } ____cacheline_aligned_in_smp;
 
 static struct kmem_cache *stfq_flow_cachep __read_mostly;
 
+/*
+ * Calendar queue of scheduled flows.
+ * The first level bitmap tells which words of the second level are
+ * non-empty, the second level tells which buckets are non-empty.
+ * 64 * 64 = 4096 buckets, two __ffs() to find the first one.
+ */
+#define STFQ_CAL_BUCKETS_LOG	12
+#define STFQ_CAL_BUCKETS	(1 << STFQ_CAL_BUCKETS_LOG)
+#define STFQ_CAL_MASK		(STFQ_CAL_BUCKETS - 1)
+
+struct stfq_calendar {
+	u64			bitmap_l1;
+	u64			bitmap_l2[STFQ_CAL_BUCKETS / 64];
+	struct list_head	bucket[STFQ_CAL_BUCKETS];
+};
+
 /*
  * Private data for the Qdisc
  */
@@ -119,6 +174,7 @@ struct stfq_sched_data {
 	u8		hash_trees_log;	/* log(number buckets) */
 	u32		flow_plimit;	/* max packets per flow */
 	u32		flags;		/* Bitmask of AIFF_XXX flags */
+	siphash_key_t	flow_key_seed;	/* For flow_key of SCF_EXACT_FLOW */
 
 	/* Classifier */
 	struct rb_root	*hash_root;	/* Hash of tree roots */
@@ -126,6 +182,8 @@ struct stfq_sched_data {
 
 	/* Stats and instrumentation */
 	struct tc_stfq_xstats  stats;
+	struct Qdisc	*sch;		/* Back pointer for tracepoints */
+	u64		packets_sched;	/* Part of bstats.packets we sent */
 #ifdef STFQ_DEBUG_BURST_AVG
 	u32		flow_sched_prev;	/* Previously active flow */
 	u32		burst_cur;	/* Current burst size */
@@ -134,6 +192,22 @@ struct stfq_sched_data {
 	/* Scheduler */
 	struct rb_root_cached	scheduled_flows;	/* Sorted flow list */
 	u64		virtual_dequeue;  /* Virtual of last dequeue */
+
+	/* Calendar scheduler */
+	struct stfq_calendar *calendar;	/* Buckets, if allocated */
+	u64		cal_base;	/* Absolute index of first bucket */
+	u8		cal_gran_log;	/* log(virtual time per bucket) */
+
+	/* Per flow classes, see stfq_walk() */
+	struct stfq_walk_snap *walk_snap; /* Flows of the current chunk */
+	u32		walk_snap_cnt;	/* Entries in walk_snap */
+	u32		walk_snap_pos;	/* Next entry to hand out */
+	u32		walk_idx;	/* Next bucket of hash_root[] */
+	u32		walk_sub;	/* Flows of that bucket already taken */
+	int		walk_count;	/* Classes dumped when we stopped */
+	/* Walker that stopped at walk_count, NULL if none */
+	int		(*walk_fn)(struct Qdisc *, unsigned long,
+				   struct qdisc_walker *);
 };
 
 /*
@@ -149,6 +223,198 @@ static inline struct stfq_skb_cb *stfq_skb_cb(struct sk_buff *skb)
 	return (struct stfq_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+/* Inserting flows into the sorted RB tree based on the virtual time */
+static void stfq_rb_insert_flow(struct stfq_sched_data *	q,
+				struct stfq_flow *		flow)
+{
+	struct rb_root_cached *root = &(q->scheduled_flows);
+	struct rb_node **new = &root->rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	u64 virtual_head = flow->virtual_head;
+	bool leftmost = true;
+
+	/* Find location in RB tree */
+	while (*new) {
+		struct stfq_flow* this = rb_entry(*new, struct stfq_flow, stfq_node);
+		parent = *new;
+		if time_before64(virtual_head, this->virtual_head)
+			new = &(parent->rb_left);
+		else {
+			new = &(parent->rb_right);
+			leftmost = false;
+		}
+	}
+
+	/* Insert in RB tree, rebalance */
+	rb_link_node(&flow->stfq_node, parent, new);
+	rb_insert_color_cached(&flow->stfq_node, root, leftmost);
+}
+
+/* Remove the flow with the lowest virtual time from the RB tree */
+static struct stfq_flow *stfq_rb_pop_flow(struct stfq_sched_data *q)
+{
+	struct rb_node *node_cur;
+
+	/* Flows are always sorted by the virtual time of the head packet,
+	 * so the leftmost flow should be scheduled first. */
+	node_cur = rb_first_cached(&(q->scheduled_flows));
+	if (node_cur == NULL)
+		return NULL;
+
+	rb_erase_cached(node_cur, &(q->scheduled_flows));
+	return rb_entry(node_cur, struct stfq_flow, stfq_node);
+}
+
+static void stfq_cal_init(struct stfq_calendar *cal)
+{
+	int i;
+
+	cal->bitmap_l1 = 0;
+	memset(cal->bitmap_l2, 0, sizeof(cal->bitmap_l2));
+	for (i = 0; i < STFQ_CAL_BUCKETS; i++)
+		INIT_LIST_HEAD(&cal->bucket[i]);
+}
+
+/* Inserting flows into the calendar bucket of their virtual time.
+ * All buckets are relative to cal_base, which is at or below the bucket
+ * of the lowest virtual time in the calendar. */
+static void stfq_cal_insert_flow(struct stfq_sched_data *	q,
+				 struct stfq_flow *		flow)
+{
+	struct stfq_calendar *cal = q->calendar;
+	u64 slot = flow->virtual_head >> q->cal_gran_log;
+	u32 idx;
+
+	/* Calendar is empty, restart the window at virtual_dequeue, which
+	 * is below the virtual time of any flow inserted later. */
+	if (cal->bitmap_l1 == 0)
+		q->cal_base = q->virtual_dequeue >> q->cal_gran_log;
+
+	if ((s64) (slot - q->cal_base) < 0) {
+		/* Only possible because of FIFO order within buckets. */
+		slot = q->cal_base;
+	} else if (slot - q->cal_base >= STFQ_CAL_BUCKETS) {
+		/* Beyond the window, the granularity is too small for
+		 * the packet sizes. Keep it in the last bucket. */
+#ifdef STFQ_DEBUG_CALENDAR
+		printk_ratelimited(KERN_DEBUG "STFQ: calendar clamp: idx:%d; vhead:%lld; base:%lld\n", flow->flow_idx, flow->virtual_head, q->cal_base);
+#endif	/* STFQ_DEBUG_CALENDAR */
+		slot = q->cal_base + STFQ_CAL_BUCKETS - 1;
+		q->stats.cal_clamp++;
+	}
+
+	idx = slot & STFQ_CAL_MASK;
+	flow->cal_idx = idx;
+	list_add_tail(&flow->cal_node, &cal->bucket[idx]);
+	cal->bitmap_l2[idx / 64] |= 1ULL << (idx % 64);
+	cal->bitmap_l1 |= 1ULL << (idx / 64);
+}
+
+static void stfq_cal_remove_flow(struct stfq_calendar *	cal,
+				 struct stfq_flow *	flow)
+{
+	u32 idx = flow->cal_idx;
+
+	list_del(&flow->cal_node);
+	if (list_empty(&cal->bucket[idx])) {
+		cal->bitmap_l2[idx / 64] &= ~(1ULL << (idx % 64));
+		if (cal->bitmap_l2[idx / 64] == 0)
+			cal->bitmap_l1 &= ~(1ULL << (idx / 64));
+	}
+}
+
+/* Find first non-empty bucket at or after start, wrapping around.
+ * The calendar must not be empty. */
+static u32 stfq_cal_find_first(const struct stfq_calendar *cal, u32 start)
+{
+	u32 word = start / 64;
+	u64 bits;
+
+	/* Rest of the word of the start bucket */
+	bits = cal->bitmap_l2[word] & (~0ULL << (start % 64));
+	if (bits)
+		return word * 64 + __ffs64(bits);
+
+	/* Next non-empty word, or wrap around to the first one */
+	bits = (word < 63) ? cal->bitmap_l1 & (~0ULL << (word + 1)) : 0;
+	if (bits == 0)
+		bits = cal->bitmap_l1;
+	word = __ffs64(bits);
+	return word * 64 + __ffs64(cal->bitmap_l2[word]);
+}
+
+/* Remove the flow with the lowest virtual time from the calendar */
+static struct stfq_flow *stfq_cal_pop_flow(struct stfq_sched_data *q)
+{
+	struct stfq_calendar *cal = q->calendar;
+	struct stfq_flow *flow;
+	u32 base_idx;
+	u32 idx;
+
+	if (cal->bitmap_l1 == 0)
+		return NULL;
+
+	/* Advance the window to the first non-empty bucket */
+	base_idx = q->cal_base & STFQ_CAL_MASK;
+	idx = stfq_cal_find_first(cal, base_idx);
+	q->cal_base += (idx - base_idx) & STFQ_CAL_MASK;
+
+	flow = list_first_entry(&cal->bucket[idx], struct stfq_flow, cal_node);
+	stfq_cal_remove_flow(cal, flow);
+	return flow;
+}
+
+/* Insert flow in the scheduler based on the virtual time */
+static inline void stfq_schedule_insert_flow(struct stfq_sched_data *	q,
+					     struct stfq_flow *		flow,
+					     u64			virtual_head)
+{
+	/* Update virtual head */
+	flow->virtual_head = virtual_head;
+
+	if (q->flags & SCF_CALENDAR)
+		stfq_cal_insert_flow(q, flow);
+	else
+		stfq_rb_insert_flow(q, flow);
+}
+
+/* Remove the flow to schedule next from the scheduler */
+static inline struct stfq_flow *stfq_schedule_pop_flow(struct stfq_sched_data *q)
+{
+	if (q->flags & SCF_CALENDAR)
+		return stfq_cal_pop_flow(q);
+	else
+		return stfq_rb_pop_flow(q);
+}
+
+static inline void stfq_schedule_remove_flow(struct stfq_sched_data *	q,
+					     struct stfq_flow *		flow)
+{
+	if (q->flags & SCF_CALENDAR)
+		stfq_cal_remove_flow(q->calendar, flow);
+	else
+		rb_erase_cached(&(flow->stfq_node), &(q->scheduled_flows));
+}
+
+/* Move all scheduled flows to the other scheduler, if it changes.
+ * The order of flows is preserved, the calendar is already allocated. */
+static void stfq_schedule_switch(struct stfq_sched_data *	q,
+				 u32				flags_new)
+{
+	struct stfq_flow *flow;
+
+	if ( ! ((q->flags ^ flags_new) & SCF_CALENDAR) )
+		return;
+
+	if (flags_new & SCF_CALENDAR) {
+		while ((flow = stfq_rb_pop_flow(q)) != NULL)
+			stfq_cal_insert_flow(q, flow);
+	} else {
+		while ((flow = stfq_cal_pop_flow(q)) != NULL)
+			stfq_rb_insert_flow(q, flow);
+	}
+}
+
 /*
  * flow->tail and flow->age share the same location.
  * We can use the low order bit to differentiate if this location points
@@ -166,8 +432,24 @@ static bool stfq_flow_is_detached(const struct stfq_flow *flow)
 	return !!(flow->age & 1UL);
 }
 
+/* Identity of a flow in the classifier, flow_idx then flow_key.
+ * Without SCF_EXACT_FLOW, flow_key is always 0. */
+static inline bool stfq_flow_id_eq(const struct stfq_flow *f,
+				   u32 flow_idx, u32 flow_key)
+{
+	return f->flow_idx == flow_idx && f->flow_key == flow_key;
+}
+
+static inline bool stfq_flow_id_gt(const struct stfq_flow *f,
+				   u32 flow_idx, u32 flow_key)
+{
+	return ( f->flow_idx > flow_idx
+		 || (f->flow_idx == flow_idx && f->flow_key > flow_key) );
+}
+
 static inline struct stfq_flow *stfq_create_flow(struct stfq_sched_data *q,
-						 uint32_t flow_idx)
+						 uint32_t flow_idx,
+						 uint32_t flow_key)
 {
 	struct stfq_flow *flow_new;
 
@@ -179,9 +461,11 @@ static inline struct stfq_flow *stfq_create_flow(struct stfq_sched_data *q,
 
 	stfq_flow_set_detached(flow_new);
 	flow_new->flow_idx = flow_idx;
+	flow_new->flow_key = flow_key;
 
 	/* Initialise virtual time of the flow. */
 	flow_new->virtual_tail = q->virtual_dequeue;
+	trace_stfq_flow_create(q->sch, flow_idx, flow_new->virtual_tail);
 
 	q->stats.flows++;
 	q->stats.flows_inactive++;
@@ -195,7 +479,7 @@ static inline void stfq_flow_purge(struct stfq_flow *flow,
 
 	/* If flow is actively scheduled, remove from scheduler */
 	if ( ! stfq_flow_is_detached(flow) ) {
-		rb_erase_cached(&(flow->stfq_node), &(q->scheduled_flows));
+		stfq_schedule_remove_flow(q, flow);
 	}
 
 	/* Remove all SKBs attached to this flow */
@@ -216,7 +500,8 @@ static bool stfq_gc_candidate(const struct stfq_flow *f)
 
 static void stfq_gc(struct stfq_sched_data *q,
 		    struct rb_root *	root,
-		    uint32_t		flow_idx)
+		    uint32_t		flow_idx,
+		    uint32_t		flow_key)
 {
 	struct rb_node **p, *parent;
 	void *tofree[STFQ_GC_MAX];
@@ -229,7 +514,7 @@ static void stfq_gc(struct stfq_sched_data *q,
 		parent = *p;
 
 		f = rb_entry(parent, struct stfq_flow, hash_node);
-		if (f->flow_idx == flow_idx)
+		if (stfq_flow_id_eq(f, flow_idx, flow_key))
 			break;
 
 		if (stfq_gc_candidate(f)) {
@@ -238,7 +523,7 @@ static void stfq_gc(struct stfq_sched_data *q,
 				break;
 		}
 
-		if (f->flow_idx > flow_idx)
+		if (stfq_flow_id_gt(f, flow_idx, flow_key))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
@@ -251,6 +536,7 @@ static void stfq_gc(struct stfq_sched_data *q,
 		f = tofree[--i];
 		rb_erase(&f->hash_node, root);
 		/* No need to call stfq_flow_purge(), flow was idle */
+		trace_stfq_flow_gc(q->sch, f->flow_idx, f->virtual_tail);
 	}
 	q->stats.flows -= fcnt;
 	q->stats.flows_inactive -= fcnt;
@@ -265,11 +551,18 @@ static struct stfq_flow *stfq_classify(struct sk_buff *skb,
 	struct rb_node **	p;
 	struct rb_node *	parent;
 	uint32_t		flow_idx;
+	uint32_t		flow_key = 0;
 	struct rb_root *	root;
 	struct stfq_flow *	flow_cur;
 
-	/* Get hash value for the packet */
-	flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
+	/* Get hash value for the packet. With SCF_EXACT_FLOW, the full
+	 * hash, and a second hash of the headers to tell apart the flows
+	 * which still collide. */
+	if (unlikely(q->flags & SCF_EXACT_FLOW)) {
+		flow_idx = skb_get_hash(skb);
+		flow_key = skb_get_hash_perturb(skb, &q->flow_key_seed);
+	} else
+		flow_idx = (uint32_t) ( skb_get_hash(skb) & q->hash_mask );
 
 	/* Get the root of the tree from the hash */
 	root = &q->hash_root[ flow_idx & (q->hash_buckets - 1) ];
@@ -281,7 +574,7 @@ static struct stfq_flow *stfq_classify(struct sk_buff *skb,
 	 * inclination to play with it. Jean II */
 	if (q->stats.flows >= (q->hash_buckets * 2) &&
 	    q->stats.flows_inactive > q->stats.flows/2)
-		stfq_gc(q, root, flow_idx);
+		stfq_gc(q, root, flow_idx, flow_key);
 
 	/* Find flow in that specific tree */
 	p = &root->rb_node;
@@ -291,17 +584,20 @@ static struct stfq_flow *stfq_classify(struct sk_buff *skb,
 
 		flow_cur = rb_entry(parent, struct stfq_flow, hash_node);
 		if (flow_cur->flow_idx == flow_idx) {
-			/* Found ! */
-			return flow_cur;
+			if (likely(flow_cur->flow_key == flow_key)) {
+				/* Found ! */
+				return flow_cur;
+			}
+			q->stats.hash_collisions++;
 		}
-		if (flow_cur->flow_idx > flow_idx)
+		if (stfq_flow_id_gt(flow_cur, flow_idx, flow_key))
 			p = &parent->rb_right;
 		else
 			p = &parent->rb_left;
 	}
 
 	/* Create a new flow */
-	flow_cur = stfq_create_flow(q, flow_idx);
+	flow_cur = stfq_create_flow(q, flow_idx, flow_key);
 	if (unlikely(flow_cur == NULL)) {
 		return NULL;
 	}
@@ -345,36 +641,6 @@ static struct stfq_flow *stfq_classify(struct sk_buff *skb,
 	return flow_cur;
 }
 
-/* Inserting flows into the sorted RB tree based on the virtual time */
-static void stfq_schedule_insert_flow(struct stfq_sched_data *	q,
-				      struct stfq_flow *	flow,
-				      u64			virtual_head)
-{
-	struct rb_root_cached *root = &(q->scheduled_flows);
-	struct rb_node **new = &root->rb_root.rb_node;
-	struct rb_node *parent = NULL;
-	bool leftmost = true;
-
-	/* Update virtual head */
-	flow->virtual_head = virtual_head;
-	
-	/* Find location in RB tree */
-	while (*new) {
-		struct stfq_flow* this = rb_entry(*new, struct stfq_flow, stfq_node);
-		parent = *new;
-		if time_before64(virtual_head, this->virtual_head)
-			new = &(parent->rb_left);
-		else {
-			new = &(parent->rb_right);
-			leftmost = false;
-		}
-	}
-
-	/* Insert in RB tree, rebalance */
-	rb_link_node(&flow->stfq_node, parent, new);
-	rb_insert_color_cached(&flow->stfq_node, root, leftmost);
-}
-
 static inline struct sk_buff *stfq_peek_skb(struct stfq_flow *flow)
 {
 	struct sk_buff *head = flow->head;
@@ -444,6 +710,7 @@ static int stfq_qdisc_enqueue(struct sk_buff *	skb,
 	/* Check sub-queue size. */
 	if (unlikely(flow_cur->qlen >= q->flow_plimit)) {
 		q->stats.drop_mark++;
+		flow_cur->drops++;
 		return qdisc_drop(skb, sch, to_free);
 	}
 	/* bstats->packets keep track of the number of actual Ethernet
@@ -471,7 +738,7 @@ static int stfq_qdisc_enqueue(struct sk_buff *	skb,
 
 		q->stats.flows_inactive--;
 
-		/* STFQ: Add flow to rb tree. The flow was empty, so it
+		/* STFQ: Add flow to scheduler. The flow was empty, so it
 		 * now has one packet, which is at the head. */
 		stfq_schedule_insert_flow(q, flow_cur, virtual_pkt);
 	}
@@ -479,6 +746,9 @@ static int stfq_qdisc_enqueue(struct sk_buff *	skb,
 	/* Note: this overwrites flow_cur->age */
 	stfq_enqueue_skb(sch, flow_cur, skb);
 
+	trace_stfq_enqueue(sch, flow_cur->flow_idx, qdisc_pkt_len(skb),
+			   flow_cur->qlen, virtual_pkt, q->virtual_dequeue);
+
 #ifdef STFQ_DEBUG_STFQ_ENQUEUE
 	printk(KERN_DEBUG "STFQ: enqueue:  idx:%d; vdq:%lld; vpkt:%lld; vtail:%lld; fl:%d; ql:%d\n", flow_cur->flow_idx, q->virtual_dequeue, virtual_pkt, flow_cur->virtual_tail, flow_cur->qlen, sch->q.qlen);
 #endif	/* STFQ_DEBUG_STFQ_ENQUEUE */
@@ -501,7 +771,6 @@ static struct sk_buff *stfq_qdisc_dequeue(struct Qdisc *sch)
 {
 	struct stfq_sched_data *q = qdisc_priv(sch);
 	struct stfq_flow *flow_cur;
-	struct rb_node *node_cur;
 	struct sk_buff *	skb;
 	u64			virtual_pkt;
 
@@ -511,20 +780,14 @@ static struct sk_buff *stfq_qdisc_dequeue(struct Qdisc *sch)
 
 retry_flow:
 
-	/* Flows are always sorted by the virtual time of the head packet,
-	 * so the leftmost flow should be scheduled first. */
-	node_cur = rb_first_cached(&(q->scheduled_flows));
+	/* Remove flow with lowest virtual time, advance to next flow. */
+	flow_cur = stfq_schedule_pop_flow(q);
 
-	if (unlikely(node_cur == NULL)) {
+	if (unlikely(flow_cur == NULL)) {
 		printk_ratelimited(KERN_ERR "STFQ: no flow to schedule !\n");
 		return NULL;
 	}
 
-	flow_cur = rb_entry(node_cur, struct stfq_flow, stfq_node);
-
-	/* Remove flow from current list, advance to next flow. */
-	rb_erase_cached(node_cur, &(q->scheduled_flows));
-
 	/* Always dequeue a packet. Or try. Jean II */
 	skb = stfq_dequeue_skb(sch, flow_cur);
 
@@ -592,20 +855,26 @@ retry_flow:
 		 * This time is the new head of this flow. */
 		virtual_next = virtual_pkt + qdisc_pkt_len(skb);
 
-		/* STFQ: Add the flow back to the rb tree at new position
+		/* STFQ: Add the flow back to the scheduler at new position
 		 * the virtual time of the new head packet. */
 		stfq_schedule_insert_flow(q, flow_cur, virtual_next);
 	} else {
 		/* Flow goes inactive */
 		stfq_flow_set_detached(flow_cur);
 		q->stats.flows_inactive++;
+		trace_stfq_flow_detach(sch, flow_cur->flow_idx,
+				       flow_cur->virtual_tail);
 	}
 
+	trace_stfq_dequeue(sch, flow_cur->flow_idx, qdisc_pkt_len(skb),
+			   flow_cur->qlen, virtual_pkt, q->virtual_dequeue);
+
 #ifdef STFQ_DEBUG_STFQ_DEQUEUE
 	printk(KERN_DEBUG "STFQ: dequeue: idx:%d; vdq:%lld; vpkt:%lld; vnxt:%lld; fl:%d; ql:%d\n", flow_cur->flow_idx, q->virtual_dequeue, virtual_pkt, virtual_pkt + qdisc_pkt_len(skb), flow_cur->qlen, sch->q.qlen);
 #endif	/* STFQ_DEBUG_STFQ_DEQUEUE */
 
 	qdisc_bstats_update(sch, skb);
+	q->packets_sched += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
 	return skb;
 }
 
@@ -626,6 +895,8 @@ static void stfq_rehash(struct stfq_sched_data *q,
 			of = rb_entry(op, struct stfq_flow, hash_node);
 			if (stfq_gc_candidate(of)) {
 				fcnt++;
+				trace_stfq_flow_gc(q->sch, of->flow_idx,
+						   of->virtual_tail);
 				kmem_cache_free(stfq_flow_cachep, of);
 				continue;
 			}
@@ -637,9 +908,9 @@ static void stfq_rehash(struct stfq_sched_data *q,
 				parent = *np;
 
 				nf = rb_entry(parent, struct stfq_flow, hash_node);
-				BUG_ON(nf->flow_idx == of->flow_idx);
+				BUG_ON(stfq_flow_id_eq(nf, of->flow_idx, of->flow_key));
 
-				if (nf->flow_idx > of->flow_idx)
+				if (stfq_flow_id_gt(nf, of->flow_idx, of->flow_key))
 					np = &parent->rb_right;
 				else
 					np = &parent->rb_left;
@@ -704,6 +975,7 @@ static const struct nla_policy stfq_policy[TCA_STFQ_MAX + 1] = {
 	[TCA_STFQ_HASH_MASK]		= { .type = NLA_U32 },
 	[TCA_STFQ_FLOW_PLIMIT]		= { .type = NLA_U32 },
 	[TCA_STFQ_FLAGS]		= { .type = NLA_U32 },
+	[TCA_STFQ_CAL_GRAN_LOG]		= { .type = NLA_U32 },
 };
 
 static int stfq_qdisc_change(struct Qdisc *sch,
@@ -714,6 +986,8 @@ static int stfq_qdisc_change(struct Qdisc *sch,
 	struct nlattr *tb[TCA_STFQ_MAX + 1];
 	u32		plimit;
 	u32		hash_log_new;
+	u32		flags_new;
+	struct stfq_calendar *calendar = NULL;
 	int		err;
 	int		drop_count = 0;
 	unsigned	drop_len = 0;
@@ -734,8 +1008,24 @@ static int stfq_qdisc_change(struct Qdisc *sch,
 			return -EINVAL;
 	}
 
+	/* Allocate calendar before locking, it is kept until destroy */
+	flags_new = q->flags;
+	if (tb[TCA_STFQ_FLAGS])
+		flags_new = nla_get_u32(tb[TCA_STFQ_FLAGS]);
+	if ((flags_new & SCF_CALENDAR) && q->calendar == NULL) {
+		calendar = kvmalloc_node(sizeof(struct stfq_calendar),
+					 GFP_KERNEL | __GFP_RETRY_MAYFAIL,
+					 netdev_queue_numa_node_read(sch->dev_queue));
+		if (!calendar)
+			return -ENOMEM;
+		stfq_cal_init(calendar);
+	}
+
 	sch_tree_lock(sch);
 
+	if (calendar)
+		q->calendar = calendar;
+
 	if (tb[TCA_STFQ_PLIMIT])
 		sch->limit = plimit;
 
@@ -755,8 +1045,32 @@ static int stfq_qdisc_change(struct Qdisc *sch,
 	if (tb[TCA_STFQ_FLOW_PLIMIT])
 		q->flow_plimit = nla_get_u32(tb[TCA_STFQ_FLOW_PLIMIT]);
 
-	if (tb[TCA_STFQ_FLAGS])
-                q->flags = nla_get_u32(tb[TCA_STFQ_FLAGS]);
+	if (tb[TCA_STFQ_CAL_GRAN_LOG]) {
+		u32 nval = nla_get_u32(tb[TCA_STFQ_CAL_GRAN_LOG]);
+
+		if (nval > 20) {
+			err = -EINVAL;
+		} else if (nval != q->cal_gran_log) {
+			/* Buckets change meaning, go through the RB tree */
+			stfq_schedule_switch(q, q->flags & ~SCF_CALENDAR);
+			q->flags &= ~SCF_CALENDAR;
+			q->cal_gran_log = nval;
+		}
+	}
+
+	/* Move scheduled flows if the scheduler changes */
+	stfq_schedule_switch(q, flags_new);
+	q->flags = flags_new;
+
+	/* Flows go inactive as soon as they are empty, so when the queue
+	 * is empty, no flow is scheduled, and the next packet of any flow
+	 * starts at virtual_dequeue. Going through us changes nothing that
+	 * matters for later packets, the stack can send it directly.
+	 * Bypassed packets only show in bstats. */
+	if (q->flags & SCF_BYPASS)
+		sch->flags |= TCQ_F_CAN_BYPASS;
+	else
+		sch->flags &= ~TCQ_F_CAN_BYPASS;
 
 	if (!err) {
 
@@ -779,7 +1093,7 @@ static int stfq_qdisc_change(struct Qdisc *sch,
 	sch_tree_unlock(sch);
 
 #ifdef STFQ_DEBUG_CONFIG
-	printk(KERN_DEBUG "STFQ: plimit %d; logs %d; mask 0x%X; flow_plimit %d; flags 0x%X\n", sch->limit, q->hash_trees_log, q->hash_mask, q->flow_plimit, q->flags);
+	printk(KERN_DEBUG "STFQ: plimit %d; logs %d; mask 0x%X; flow_plimit %d; flags 0x%X; cal_gran_log %d\n", sch->limit, q->hash_trees_log, q->hash_mask, q->flow_plimit, q->flags, q->cal_gran_log);
 #endif	/* STFQ_DEBUG_CONFIG */
 
 	return err;
@@ -809,6 +1123,8 @@ static int stfq_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 		goto nla_put_failure;
 	if (nla_put_u32(skb, TCA_STFQ_FLAGS, q->flags))
 		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_STFQ_CAL_GRAN_LOG, q->cal_gran_log))
+		goto nla_put_failure;
 
 	return nla_nest_end(skb, opts);
 
@@ -822,6 +1138,8 @@ static int stfq_qdisc_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 	struct tc_stfq_xstats st;
 
 	memcpy(&st, &q->stats, sizeof(st));
+	st.bypass = (u32) (u64_stats_read(&sch->bstats.packets)
+			   - q->packets_sched);
 
 	/* Reset some of the statistics, unless disabled */
 	if ( ! (q->flags & SCF_PEAK_NORESET) ) {
@@ -844,16 +1162,23 @@ static int stfq_qdisc_init(struct Qdisc *sch,
 	printk(KERN_DEBUG "STFQ: sizeof(stfq_flow) %lu\n", sizeof(struct stfq_flow));
 #endif	/* STFQ_DEBUG_CONFIG */
 
+	q->sch			= sch;
+	q->packets_sched	= 0;
+
 	/* Configuration */
 	sch->limit		= STFQ_PLIMIT_DEFLT;
 	q->flow_plimit		= STFQ_FLOW_PLIMIT_DEFLT;
 	q->hash_mask		= STFQ_HASH_MASK_DEFLT;
+	get_random_bytes(&q->flow_key_seed, sizeof(q->flow_key_seed));
 
 	/* Parameters */
 	q->hash_root		= NULL;
 	q->hash_trees_log	= ilog2(STFQ_HASH_NUM_DEFLT);
 	q->scheduled_flows	= RB_ROOT_CACHED;
 	q->virtual_dequeue	= 0LL;
+	q->calendar		= NULL;
+	q->cal_base		= 0LL;
+	q->cal_gran_log		= STFQ_CAL_GRAN_LOG_DEFLT;
 
 	if (opt)
 		err = stfq_qdisc_change(sch, opt, extack);
@@ -881,14 +1206,14 @@ static void stfq_qdisc_reset(struct Qdisc *sch)
 	q->stats.burst_peak	= 0;
 	q->stats.burst_avg	= 0;
 	q->stats.sched_empty	= 0;
+	q->stats.cal_clamp	= 0;
+	q->stats.hash_collisions = 0;
 
 #ifdef STFQ_DEBUG_BURST_AVG
 	q->flow_sched_prev	= 0;
 	q->burst_cur		= 0;
 #endif	/* STFQ_DEBUG_BURST_AVG */
 
-	q->scheduled_flows	= RB_ROOT_CACHED;
-
 	if (!q->hash_root)
 		return;
 
@@ -905,6 +1230,12 @@ static void stfq_qdisc_reset(struct Qdisc *sch)
 			kmem_cache_free(stfq_flow_cachep, flow_cur);
 		}
 	}
+
+	/* Flows were removed from the scheduler by stfq_flow_purge() */
+	q->scheduled_flows	= RB_ROOT_CACHED;
+	if (q->calendar)
+		stfq_cal_init(q->calendar);
+	q->cal_base		= 0LL;
 }
 
 static void stfq_qdisc_destroy(struct Qdisc *sch)
@@ -913,9 +1244,204 @@ static void stfq_qdisc_destroy(struct Qdisc *sch)
 
 	stfq_qdisc_reset(sch);
 	stfq_hash_free(q->hash_root);
+	kvfree(q->calendar);
+	kvfree(q->walk_snap);
+}
+
+/* ---------------------- PER FLOW CLASSES ---------------------- */
+
+/*
+ * Each active flow shows up as a class, like fq_codel. Same as
+ * sch_scrr.c, the hash table is walked in chunks, each chunk is a
+ * snapshot taken under the lock, and the next part of a dump resumes
+ * at the cursor. Packets are not timestamped, so no sojourn time.
+ */
+
+struct stfq_walk_snap {
+	struct tc_stfq_flow_xstats st;
+	u32		minor;		/* Class minor, position in the dump */
+};
+
+static void stfq_walk_snap_flow(struct stfq_sched_data *q,
+				struct stfq_flow *flow)
+{
+	struct stfq_walk_snap *snap = &q->walk_snap[q->walk_snap_cnt++];
+	struct sk_buff *skb;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->st.virtual_tail = flow->virtual_tail;
+	snap->st.flow_idx = flow->flow_idx;
+	snap->st.qlen = flow->qlen;
+	snap->st.drops = flow->drops;
+	/* At most flow_plimit packets */
+	for (skb = flow->head; skb != NULL; skb = skb->next)
+		snap->st.backlog += qdisc_pkt_len(skb);
+}
+
+/* Snapshot the active flows of one bucket, false if the chunk is full.
+ * The first walk_sub active flows were taken by the previous chunk. */
+static bool stfq_walk_bucket(struct stfq_sched_data *q, u32 idx)
+{
+	struct stfq_flow *flow;
+	struct rb_node *p;
+	u32 seen = 0;
+
+	for (p = rb_first(&q->hash_root[idx]); p != NULL; p = rb_next(p)) {
+		flow = rb_entry(p, struct stfq_flow, hash_node);
+		/* Inactive flows have no head, and no stats worth a class */
+		if (stfq_flow_is_detached(flow))
+			continue;
+		if (seen++ < q->walk_sub)
+			continue;
+		if (q->walk_snap_cnt >= STFQ_WALK_CHUNK) {
+			q->walk_sub = seen - 1;
+			return false;
+		}
+		stfq_walk_snap_flow(q, flow);
+	}
+	q->walk_sub = 0;
+	return true;
+}
+
+/* Fill the snapshot with the next chunk of flows, under the lock.
+ * The hash may have been resized since the last chunk. */
+static void stfq_walk_chunk(struct Qdisc *sch)
+{
+	struct stfq_sched_data *q = qdisc_priv(sch);
+	u32 budget = STFQ_WALK_BUCKETS;
+
+	sch_tree_lock(sch);
+	q->walk_snap_cnt = 0;
+	q->walk_snap_pos = 0;
+	while (q->walk_idx < q->hash_buckets && budget > 0) {
+		if (!stfq_walk_bucket(q, q->walk_idx))
+			break;
+		q->walk_idx++;
+		budget--;
+	}
+	sch_tree_unlock(sch);
+}
+
+static void stfq_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct stfq_sched_data *q = qdisc_priv(sch);
+
+	if (arg->stop)
+		return;
+
+	/* Under RTNL, like all the class operations */
+	if (q->walk_snap == NULL) {
+		q->walk_snap = kvmalloc_array(STFQ_WALK_CHUNK,
+					      sizeof(struct stfq_walk_snap),
+					      GFP_KERNEL);
+		if (q->walk_snap == NULL) {
+			arg->stop = 1;
+			return;
+		}
+	}
+
+	/* Next part of a dump that stopped on a full buffer, resume at
+	 * the cursor. The cursor is shared by all walkers, so only if
+	 * this is the same kind of walker, and the last one to use the
+	 * cursor stopped exactly where this one did. Otherwise, walk
+	 * from the start and skip arg->skip classes, like other qdiscs. */
+	if ( arg->skip != 0 && arg->fn == q->walk_fn
+	     && arg->skip == q->walk_count ) {
+		arg->count = arg->skip;
+	} else {
+		q->walk_idx = 0;
+		q->walk_sub = 0;
+		q->walk_snap_cnt = 0;
+		q->walk_snap_pos = 0;
+		arg->count = 0;
+	}
+
+	for (;;) {
+		while (q->walk_snap_pos < q->walk_snap_cnt) {
+			if (arg->count >= arg->skip) {
+				q->walk_snap[q->walk_snap_pos].minor =
+					(arg->count % TC_H_MIN_MASK) + 1;
+				if (arg->fn(sch, q->walk_snap_pos + 1, arg) < 0) {
+					arg->stop = 1;
+					break;
+				}
+			}
+			arg->count++;
+			q->walk_snap_pos++;
+		}
+		if (arg->stop || q->walk_idx >= q->hash_buckets)
+			break;
+		stfq_walk_chunk(sch);
+	}
+	/* Keep the cursor only if we stopped on a class, at the end of
+	 * the walk there is nothing to resume */
+	if (arg->stop && q->walk_snap_pos < q->walk_snap_cnt) {
+		q->walk_fn = arg->fn;
+		q->walk_count = arg->count;
+	} else {
+		q->walk_fn = NULL;
+		q->walk_count = 0;
+	}
+}
+
+static struct stfq_walk_snap *stfq_walk_class(struct Qdisc *sch,
+					      unsigned long cl)
+{
+	struct stfq_sched_data *q = qdisc_priv(sch);
+
+	if (cl == 0 || cl > q->walk_snap_cnt)
+		return NULL;
+	return &q->walk_snap[cl - 1];
+}
+
+static struct Qdisc *stfq_leaf(struct Qdisc *sch, unsigned long cl)
+{
+	return NULL;
+}
+
+static unsigned long stfq_find(struct Qdisc *sch, u32 classid)
+{
+	return 0;
+}
+
+static int stfq_dump_class(struct Qdisc *sch, unsigned long cl,
+			   struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct stfq_walk_snap *snap = stfq_walk_class(sch, cl);
+
+	if (snap == NULL)
+		return -EINVAL;
+	tcm->tcm_parent = TC_H_ROOT;
+	tcm->tcm_handle |= TC_H_MIN(snap->minor);
+	return 0;
 }
 
+static int stfq_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+				 struct gnet_dump *d)
+{
+	struct stfq_walk_snap *snap = stfq_walk_class(sch, cl);
+	struct gnet_stats_queue qs = { 0 };
+
+	if (snap == NULL)
+		return -1;
+	qs.qlen = snap->st.qlen;
+	qs.backlog = snap->st.backlog;
+	qs.drops = snap->st.drops;
+	if (gnet_stats_copy_queue(d, NULL, &qs, qs.qlen) < 0)
+		return -1;
+	return gnet_stats_copy_app(d, &snap->st, sizeof(snap->st));
+}
+
+static const struct Qdisc_class_ops stfq_class_ops = {
+	.leaf		=	stfq_leaf,
+	.find		=	stfq_find,
+	.walk		=	stfq_walk,
+	.dump		=	stfq_dump_class,
+	.dump_stats	=	stfq_dump_class_stats,
+};
+
 static struct Qdisc_ops stfq_qdisc_ops __read_mostly = {
+	.cl_ops		=	&stfq_class_ops,
 	.id		=	"stfq",
 	.priv_size	=	sizeof(struct stfq_sched_data),
 
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * net/sched/sch_stfq_trace.h Tracepoints of the STFQ Scheduler
+ *
+ * Static tracepoints on the scheduling decisions of STFQ, usable from
+ * perf and bpftrace, for example :
+ *	perf record -e 'stfq:*' -a
+ *	bpftrace -e 't:stfq:stfq_dequeue { @[args->flow_idx] = sum(args->len); }'
+ * When not enabled, each tracepoint is a patched out jump.
+ * This replaces the STFQ_DEBUG_STFQ_* printk in production.
+ * Virtual times are in bytes, like in the scheduler.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stfq
+
+#if !defined(_SCH_STFQ_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCH_STFQ_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <net/sch_generic.h>
+
+/* Flow life cycle : created, goes inactive, garbage collected */
+DECLARE_EVENT_CLASS(stfq_flow_class,
+
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_tail),
+
+	TP_ARGS(sch, flow_idx, virtual_tail),
+
+	TP_STRUCT__entry(
+		__field(	int,	ifindex		)
+		__field(	u32,	handle		)
+		__field(	u32,	flow_idx	)
+		__field(	u64,	virtual_tail	)
+	),
+
+	TP_fast_assign(
+		__entry->ifindex	= qdisc_dev(sch)->ifindex;
+		__entry->handle		= sch->handle;
+		__entry->flow_idx	= flow_idx;
+		__entry->virtual_tail	= virtual_tail;
+	),
+
+	TP_printk("ifindex=%d handle=0x%X idx=0x%X vtail=%llu",
+		  __entry->ifindex, __entry->handle, __entry->flow_idx,
+		  __entry->virtual_tail)
+);
+
+DEFINE_EVENT(stfq_flow_class, stfq_flow_create,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_tail),
+	TP_ARGS(sch, flow_idx, virtual_tail)
+);
+
+DEFINE_EVENT(stfq_flow_class, stfq_flow_detach,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_tail),
+	TP_ARGS(sch, flow_idx, virtual_tail)
+);
+
+DEFINE_EVENT(stfq_flow_class, stfq_flow_gc,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u64 virtual_tail),
+	TP_ARGS(sch, flow_idx, virtual_tail)
+);
+
+/* Packets in and out, with the start-time of the packet and the
+ * virtual clock of the scheduler, after the update on dequeue */
+DECLARE_EVENT_CLASS(stfq_pkt_class,
+
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u32 len, u32 flow_qlen,
+		 u64 virtual_pkt, u64 virtual_dequeue),
+
+	TP_ARGS(sch, flow_idx, len, flow_qlen, virtual_pkt, virtual_dequeue),
+
+	TP_STRUCT__entry(
+		__field(	int,	ifindex		)
+		__field(	u32,	handle		)
+		__field(	u32,	flow_idx	)
+		__field(	u32,	len		)
+		__field(	u32,	flow_qlen	)
+		__field(	u64,	virtual_pkt	)
+		__field(	u64,	virtual_dequeue	)
+	),
+
+	TP_fast_assign(
+		__entry->ifindex	= qdisc_dev(sch)->ifindex;
+		__entry->handle		= sch->handle;
+		__entry->flow_idx	= flow_idx;
+		__entry->len		= len;
+		__entry->flow_qlen	= flow_qlen;
+		__entry->virtual_pkt	= virtual_pkt;
+		__entry->virtual_dequeue = virtual_dequeue;
+	),
+
+	TP_printk("ifindex=%d handle=0x%X idx=0x%X len=%u fl=%u vpkt=%llu vdq=%llu",
+		  __entry->ifindex, __entry->handle, __entry->flow_idx,
+		  __entry->len, __entry->flow_qlen, __entry->virtual_pkt,
+		  __entry->virtual_dequeue)
+);
+
+DEFINE_EVENT(stfq_pkt_class, stfq_enqueue,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u32 len, u32 flow_qlen,
+		 u64 virtual_pkt, u64 virtual_dequeue),
+	TP_ARGS(sch, flow_idx, len, flow_qlen, virtual_pkt, virtual_dequeue)
+);
+
+DEFINE_EVENT(stfq_pkt_class, stfq_dequeue,
+	TP_PROTO(struct Qdisc *sch, u32 flow_idx, u32 len, u32 flow_qlen,
+		 u64 virtual_pkt, u64 virtual_dequeue),
+	TP_ARGS(sch, flow_idx, len, flow_qlen, virtual_pkt, virtual_dequeue)
+);
+
+#endif /* _SCH_STFQ_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sch_stfq_trace
+#include <trace/define_trace.h>
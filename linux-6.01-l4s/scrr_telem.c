@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * scrr_telem.c		Stream the SCRR telemetry to a file.
+ *
+ * Companion of q_scrr.c. With "telemetry N", the qdisc records one
+ * packet in N at dequeue to a relay channel, one ring per CPU, in
+ * /sys/kernel/debug/scrr/<dev>-<major>:<minor>/cpuN. This reads all
+ * the rings and writes the records to a file, either in binary
+ * (struct scrr_telem_rec, native endian) or as text, one line per
+ * record. Records of different CPUs are not merged, sort on ts_ns.
+ * The rings are small, if this is not reading, records are lost,
+ * see "telemetry ... (lost N)" in "tc -s qdisc".
+ *
+ * Build :
+ *	gcc -O2 -Wall -o scrr_telem scrr_telem.c
+ * Usage :
+ *	tc qdisc replace dev eth0 root handle 1: scrr telemetry 100
+ *	scrr_telem -t -d 10 eth0-1:0 /tmp/telem.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <linux/types.h>
+
+#define SCRR_TELEM_ROOT		"/sys/kernel/debug/scrr"
+#define SCRR_TELEM_MAX_CPUS	1024
+#define SCRR_TELEM_PATH		4096
+#define SCRR_TELEM_READ_RECS	1024	/* Records per read() */
+
+/* Same as sch_scrr.c */
+#define SCRR_TELEM_LIST_OLD	0	/* Flow was in the old list */
+#define SCRR_TELEM_LIST_NEW	1	/* Flow was in the new list */
+
+struct scrr_telem_rec {
+	__u64	ts_ns;		/* Dequeue time, ktime */
+	__u64	virtual_pkt;	/* Virtual start of the packet */
+	__u64	virtual_advance; /* Virtual clock of the round */
+	__u64	sojourn_ns;	/* Time in the qdisc */
+	__u32	flow_idx;	/* Hash value of the flow */
+	__u32	len;		/* Packet length */
+	__u32	flow_qlen;	/* Packets left in the flow */
+	__u32	list;		/* SCRR_TELEM_LIST_XXX */
+};
+
+/* One relay file, one per CPU */
+struct telem_cpu {
+	int		fd;
+	int		cpu;
+	size_t		partial;	/* Bytes of an incomplete record */
+	char		buf[SCRR_TELEM_READ_RECS
+			    * sizeof(struct scrr_telem_rec)];
+};
+
+static volatile sig_atomic_t telem_stop;
+
+static void telem_sigint(int sig)
+{
+	(void) sig;
+	telem_stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: scrr_telem [ -t ] [ -d SECONDS ] DIR FILE\n"
+		"  DIR : directory of the qdisc, full path or name in "
+		SCRR_TELEM_ROOT "\n"
+		"  FILE : output, - for stdout\n"
+		"  -t : write text instead of binary records\n"
+		"  -d : stop after SECONDS, default on SIGINT\n");
+	exit(1);
+}
+
+static int telem_open_cpus(const char *dir, struct telem_cpu **cpus)
+{
+	struct dirent *de;
+	DIR *d;
+	int n = 0;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL && n < SCRR_TELEM_MAX_CPUS) {
+		struct telem_cpu *tc;
+		char path[SCRR_TELEM_PATH + 256 + 2];
+		int cpu;
+
+		if (sscanf(de->d_name, "cpu%d", &cpu) != 1)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		tc = malloc(sizeof(*tc));
+		if (tc == NULL)
+			break;
+		tc->fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (tc->fd < 0) {
+			fprintf(stderr, "Can't open %s: %s\n",
+				path, strerror(errno));
+			free(tc);
+			continue;
+		}
+		tc->cpu = cpu;
+		tc->partial = 0;
+		cpus[n++] = tc;
+	}
+	closedir(d);
+	if (n == 0)
+		fprintf(stderr, "No relay file in %s\n", dir);
+	return n;
+}
+
+static void telem_write_text(FILE *out, int cpu,
+			     const struct scrr_telem_rec *rec)
+{
+	fprintf(out, "%llu,%d,%08x,%u,%llu,%llu,%llu,%u,%s\n",
+		(unsigned long long) rec->ts_ns, cpu, rec->flow_idx,
+		rec->len, (unsigned long long) rec->virtual_pkt,
+		(unsigned long long) rec->virtual_advance,
+		(unsigned long long) rec->sojourn_ns, rec->flow_qlen,
+		rec->list == SCRR_TELEM_LIST_NEW ? "new" : "old");
+}
+
+/* Drain one ring. Relay skips the padding at the end of sub-buffers,
+ * but a short read may still cut a record. Returns records read. */
+static long telem_drain(struct telem_cpu *tc, FILE *out, int text)
+{
+	const size_t rec_size = sizeof(struct scrr_telem_rec);
+	long total = 0;
+	ssize_t len;
+
+	while ((len = read(tc->fd, tc->buf + tc->partial,
+			   sizeof(tc->buf) - tc->partial)) > 0) {
+		size_t avail = tc->partial + len;
+		size_t nrec = avail / rec_size;
+		size_t i;
+
+		if (text) {
+			for (i = 0; i < nrec; i++) {
+				struct scrr_telem_rec rec;
+
+				memcpy(&rec, tc->buf + i * rec_size, rec_size);
+				telem_write_text(out, tc->cpu, &rec);
+			}
+		} else
+			fwrite(tc->buf, rec_size, nrec, out);
+
+		tc->partial = avail - nrec * rec_size;
+		memmove(tc->buf, tc->buf + nrec * rec_size, tc->partial);
+		total += nrec;
+	}
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	struct telem_cpu *cpus[SCRR_TELEM_MAX_CPUS];
+	struct pollfd pfd[SCRR_TELEM_MAX_CPUS];
+	struct timespec start, now;
+	char dir[SCRR_TELEM_PATH];
+	double duration = 0;
+	long records = 0;
+	int text = 0;
+	FILE *out;
+	int ncpus;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "td:h")) != -1) {
+		switch (opt) {
+		case 't':
+			text = 1;
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+
+	if (strchr(argv[optind], '/') != NULL)
+		snprintf(dir, sizeof(dir), "%s", argv[optind]);
+	else
+		snprintf(dir, sizeof(dir), SCRR_TELEM_ROOT "/%s", argv[optind]);
+	ncpus = telem_open_cpus(dir, cpus);
+	if (ncpus <= 0)
+		return 1;
+
+	if (strcmp(argv[optind + 1], "-") == 0)
+		out = stdout;
+	else
+		out = fopen(argv[optind + 1], text ? "w" : "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n",
+			argv[optind + 1], strerror(errno));
+		return 1;
+	}
+	if (text)
+		fprintf(out, "ts_ns,cpu,flow_idx,len,virtual_pkt,"
+			"virtual_advance,sojourn_ns,flow_qlen,list\n");
+
+	signal(SIGINT, telem_sigint);
+	signal(SIGTERM, telem_sigint);
+	for (i = 0; i < ncpus; i++) {
+		pfd[i].fd = cpus[i]->fd;
+		pfd[i].events = POLLIN;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!telem_stop) {
+		/* Relay only wakes up readers on full sub-buffers,
+		 * the timeout picks up the rest. */
+		if (poll(pfd, ncpus, 100) < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < ncpus; i++)
+			records += telem_drain(cpus[i], out, text);
+
+		if (duration > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - start.tv_sec)
+			    + (now.tv_nsec - start.tv_nsec) / 1e9 >= duration)
+				break;
+		}
+	}
+	for (i = 0; i < ncpus; i++) {
+		records += telem_drain(cpus[i], out, text);
+		close(cpus[i]->fd);
+		free(cpus[i]);
+	}
+	if (out != stdout)
+		fclose(out);
+	fprintf(stderr, "%ld records from %d CPUs\n", records, ncpus);
+	return 0;
+}
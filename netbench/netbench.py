@@ -0,0 +1,595 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# netbench.py : Performance regression suite for the qdiscs of this tree.
+#
+# Load each qdisc on a veth pair between two network namespaces (or on a
+# physical interface facing a peer), run a fixed set of traffic mixes
+# and write one JSON record per qdisc, mix and run, so that results of
+# two commits can be compared with --compare.
+#
+# Mixes :
+#	elephants	TCP bulk flows only, throughput and Jain fairness
+#	mice		elephants + short TCP connections (netperf TCP_CRR)
+#	rpc		elephants + request/response (netperf TCP_RR)
+#	udp		elephants + one unresponsive UDP flow
+#	saturation	64 byte UDP flood from many flows, no bottleneck,
+#			Mpps and cycles per packet of the qdisc
+# Each mix but saturation runs through a tbf bottleneck with the qdisc
+# under test as its child, with a 100 Hz ping as the light flow.
+#
+# Needs root, iproute2 with the tc modules of this tree, iperf3, and
+# optionally netperf (mice, rpc), perf (cycles) and pktgen (saturation).
+
+import argparse
+import json
+import math
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import time
+
+# qdisc -> module providing it
+QDISC_MODULES = {
+	"scrr":			"sch_scrr",
+	"scrr_npm":		"sch_scrr",
+	"scrr_nmia":		"sch_scrr",
+	"scrr_nmne":		"sch_scrr",
+	"scrr_neia":		"sch_scrr",
+	"scrr_basic":		"sch_scrr",
+	"scrr_pi2":		"sch_scrr",
+	"fq_drr":		"sch_fq_drr",
+	"stfq":			"sch_stfq",
+	"aifo_stfq":		"sch_aifo_stfq",
+	"sppifo_stfq":		"sch_sppifo_stfq",
+	"fq_pi2":		"sch_fq_pi2",
+	"pi2":			"sch_pi2",
+	"bfifo_head_drop":	"sch_bfifo_head",
+}
+DEFAULT_QDISCS = [ "scrr", "scrr_npm", "scrr_nmia", "scrr_nmne",
+		   "scrr_neia", "scrr_basic", "fq_drr", "stfq", "aifo_stfq",
+		   "sppifo_stfq", "fq_pi2", "pi2", "bfifo_head_drop" ]
+MIXES = [ "elephants", "mice", "rpc", "udp", "saturation" ]
+
+# Metrics and their direction, for --compare
+METRICS = {
+	"mbps":			+1,
+	"jain":			+1,
+	"light_p99_us":		-1,
+	"rr_p99_us":		-1,
+	"mpps":			+1,
+	"cycles_per_pkt":	-1,
+}
+
+IPERF_PORT = 5201
+NETPERF_PORT = 12865
+SND_ADDR = "10.201.0.1"
+RCV_ADDR = "10.201.0.2"
+
+
+def log(msg):
+	print("netbench: " + msg, file=sys.stderr, flush=True)
+
+
+class Bench:
+	def __init__(self, args):
+		self.args = args
+		self.procs = []
+		if args.dev:
+			# Physical pair, servers run on the peer
+			self.dev = args.dev
+			self.peer = args.peer
+			self.snd_ns = None
+			self.rcv_ns = None
+		else:
+			self.dev = args.prefix + "0"
+			self.peer = RCV_ADDR
+			self.snd_ns = args.prefix + "-snd"
+			self.rcv_ns = args.prefix + "-rcv"
+
+	# ---------------- COMMANDS ----------------
+
+	def wrap(self, cmd, ns):
+		if ns is None:
+			return cmd
+		return [ "ip", "netns", "exec", ns ] + cmd
+
+	def run(self, cmd, ns=None, check=True, timeout=None):
+		if self.args.verbose:
+			log(" ".join(self.wrap(cmd, ns)))
+		try:
+			res = subprocess.run(self.wrap(cmd, ns),
+					     capture_output=True, text=True,
+					     timeout=timeout)
+		except OSError as e:
+			raise RuntimeError("%s: %s" % (cmd[0], e.strerror))
+		if check and res.returncode != 0:
+			raise RuntimeError("%s: %s" % (" ".join(cmd),
+						       res.stderr.strip()))
+		return res.stdout
+
+	def spawn(self, cmd, ns=None):
+		if self.args.verbose:
+			log(" ".join(self.wrap(cmd, ns)))
+		try:
+			proc = subprocess.Popen(self.wrap(cmd, ns),
+						stdout=subprocess.PIPE,
+						stderr=subprocess.DEVNULL,
+						text=True)
+		except OSError as e:
+			raise RuntimeError("%s: %s" % (cmd[0], e.strerror))
+		self.procs.append(proc)
+		return proc
+
+	def collect(self, proc, timeout):
+		try:
+			out, _ = proc.communicate(timeout=timeout)
+		except subprocess.TimeoutExpired:
+			proc.kill()
+			out, _ = proc.communicate()
+		if proc in self.procs:
+			self.procs.remove(proc)
+		return out
+
+	def tc(self, args, check=True):
+		return self.run([ self.args.tc ] + args, self.snd_ns, check)
+
+	# ---------------- SETUP ----------------
+
+	def setup(self):
+		if self.snd_ns is None:
+			return
+		self.teardown()
+		p = self.args.prefix
+		self.run([ "ip", "netns", "add", self.snd_ns ])
+		self.run([ "ip", "netns", "add", self.rcv_ns ])
+		self.run([ "ip", "link", "add", p + "0", "netns", self.snd_ns,
+			   "type", "veth", "peer", "name", p + "1",
+			   "netns", self.rcv_ns ])
+		for ns, dev, addr in ((self.snd_ns, p + "0", SND_ADDR),
+				      (self.rcv_ns, p + "1", RCV_ADDR)):
+			self.run([ "ip", "link", "set", "lo", "up" ], ns)
+			self.run([ "ip", "addr", "add", addr + "/24",
+				   "dev", dev ], ns)
+			self.run([ "ip", "link", "set", dev, "up" ], ns)
+			if self.args.no_offload and shutil.which("ethtool"):
+				self.run([ "ethtool", "-K", dev, "tso", "off",
+					   "gso", "off", "gro", "off" ], ns,
+					 check=False)
+		for i in range(self.args.streams + 1):
+			self.run([ "iperf3", "-s", "-D",
+				   "-p", str(IPERF_PORT + i) ], self.rcv_ns)
+		if shutil.which("netserver"):
+			self.run([ "netserver", "-p", str(NETPERF_PORT) ],
+				 self.rcv_ns, check=False)
+		# Let the servers and the neighbours settle
+		self.run([ "ping", "-c", "3", "-i", "0.2", "-q", self.peer ],
+			 self.snd_ns, check=False)
+
+	def teardown(self):
+		for proc in self.procs:
+			proc.kill()
+		self.procs = []
+		if self.snd_ns is None:
+			return
+		# Deleting the namespace kills the veth, the servers go with
+		# their namespace only when killed
+		for ns in (self.rcv_ns, self.snd_ns):
+			pids = self.run([ "ip", "netns", "pids", ns ],
+					check=False).split()
+			for pid in pids:
+				try:
+					os.kill(int(pid), signal.SIGKILL)
+				except (ProcessLookupError, ValueError):
+					pass
+			self.run([ "ip", "netns", "del", ns ], check=False)
+
+	def load_module(self, qdisc):
+		mod = QDISC_MODULES.get(qdisc)
+		if mod is None:
+			return None
+		if not os.path.isdir("/sys/module/" + mod):
+			if self.args.modules:
+				self.run([ "insmod", os.path.join(self.args.modules,
+								 mod + ".ko") ])
+			else:
+				self.run([ "modprobe", mod ])
+		try:
+			with open("/sys/module/%s/srcversion" % mod) as f:
+				return f.read().strip()
+		except OSError:
+			return None
+
+	def set_qdisc(self, qdisc, opts, bottleneck):
+		self.tc([ "qdisc", "del", "dev", self.dev, "root" ], check=False)
+		if bottleneck:
+			self.tc([ "qdisc", "add", "dev", self.dev, "root",
+				  "handle", "1:", "tbf", "rate", self.args.rate,
+				  "burst", self.args.burst, "limit", "1000000" ])
+			parent = [ "parent", "1:1" ]
+		else:
+			parent = [ "root" ]
+		self.tc([ "qdisc", "add", "dev", self.dev ] + parent
+			+ [ "handle", "10:", qdisc ] + opts)
+
+	def qdisc_stats(self):
+		out = self.tc([ "-s", "-j", "qdisc", "show", "dev", self.dev ])
+		for q in json.loads(out):
+			if q.get("handle") == "10:":
+				return q.get("packets", 0), q.get("drops", 0)
+		return 0, 0
+
+	# ---------------- TOOLS ----------------
+
+	def iperf(self, port, udp=False, streams=1, length=None, rate=None):
+		cmd = [ "iperf3", "-J", "-c", self.peer, "-p", str(port),
+			"-t", str(self.args.duration), "-P", str(streams) ]
+		if udp:
+			cmd += [ "-u", "-b", rate or "0" ]
+		elif self.args.cc:
+			cmd += [ "-C", self.args.cc ]
+		if length:
+			cmd += [ "-l", str(length) ]
+		return self.spawn(cmd, self.snd_ns)
+
+	@staticmethod
+	def iperf_flows(out):
+		""" Throughput of each flow in Mb/s, at the receiver """
+		try:
+			res = json.loads(out)
+		except ValueError:
+			return []
+		end = res.get("end", {})
+		if "sum_received" in end and end["sum_received"].get("packets"):
+			# UDP, what went through, not what was sent
+			return [ end["sum_received"]["bits_per_second"] / 1e6 ]
+		flows = []
+		for st in end.get("streams", []):
+			rcv = st.get("receiver") or st.get("udp") or {}
+			flows.append(rcv.get("bits_per_second", 0) / 1e6)
+		return flows
+
+	def ping(self):
+		# One packet every 10 ms is a light flow at any rate
+		count = int(self.args.duration * 100)
+		return self.spawn([ "ping", "-i", "0.01", "-c", str(count),
+				    "-W", "1", self.peer ], self.snd_ns)
+
+	@staticmethod
+	def ping_rtts(out):
+		return [ float(m) * 1000.0
+			 for m in re.findall(r"time=([0-9.]+) ms", out) ]
+
+	def netperf(self, test):
+		if not shutil.which("netperf"):
+			return None
+		return self.spawn([ "netperf", "-H", self.peer,
+				    "-p", str(NETPERF_PORT), "-t", test,
+				    "-l", str(self.args.duration), "--",
+				    "-o", "P50_LATENCY,P99_LATENCY,"
+				    "TRANSACTION_RATE" ], self.snd_ns)
+
+	@staticmethod
+	def netperf_p99(out):
+		# Omni output : header line, then the values
+		lines = [ l for l in out.splitlines() if l.strip() ]
+		if len(lines) < 2:
+			return None
+		try:
+			return float(lines[-1].split(",")[1])
+		except (IndexError, ValueError):
+			return None
+
+	def perf_start(self):
+		""" Sample cycles on all CPUs, the qdisc's share is read back
+		    by module, like the .kperf files of the experiment data """
+		if self.args.no_perf or not shutil.which("perf"):
+			return None
+		self.perf_data = "/tmp/%s-%d.perf" % (self.args.prefix,
+						      os.getpid())
+		return self.spawn([ "perf", "record", "-a", "-q",
+				    "-e", "cycles", "-o", self.perf_data,
+				    "--", "sleep", str(self.args.duration) ])
+
+	def perf_cycles(self, proc, qdisc):
+		""" Cycles spent in the module of the qdisc """
+		if proc is None:
+			return None
+		self.collect(proc, self.args.duration + 30)
+		mod = QDISC_MODULES.get(qdisc)
+		try:
+			out = self.run([ "perf", "report", "-i", self.perf_data,
+					 "--stdio", "-q", "--sort", "dso",
+					 "-F", "period,dso" ])
+		except RuntimeError:
+			return None
+		finally:
+			try:
+				os.unlink(self.perf_data)
+			except OSError:
+				pass
+		for line in out.splitlines():
+			fields = line.split()
+			if len(fields) == 2 and fields[1] == "[%s]" % mod:
+				return int(fields[0])
+		return 0
+
+	def pktgen(self):
+		""" Flood through the qdisc, pktgen in queue_xmit mode goes
+		    through dev_queue_xmit() like the stack """
+		if self.snd_ns is None:
+			return None
+		try:
+			self.run([ "modprobe", "pktgen" ], check=False)
+		except RuntimeError:
+			pass
+		if not os.path.isdir("/sys/module/pktgen"):
+			return None
+		mac = json.loads(self.run([ "ip", "-j", "link", "show",
+					    self.args.prefix + "1" ],
+					  self.rcv_ns))[0]["address"]
+		sh = " && ".join([
+			"echo rem_device_all > /proc/net/pktgen/kpktgend_0",
+			"echo add_device %s > /proc/net/pktgen/kpktgend_0"
+			% self.dev ] + [
+			"echo '%s' > /proc/net/pktgen/%s" % (c, self.dev)
+			for c in ( "count 0", "pkt_size 64", "delay 0",
+				   "xmit_mode queue_xmit",
+				   "dst " + RCV_ADDR, "dst_mac " + mac,
+				   "udp_dst_min 9", "udp_dst_max 9",
+				   "udp_src_min 1024",
+				   "udp_src_max %d" % (1023 + self.args.flows),
+				   "flag UDPSRC_RND" ) ] + [
+			"exec timeout -s INT %d sh -c "
+			"'echo start > /proc/net/pktgen/pgctrl'"
+			% self.args.duration ])
+		return self.spawn([ "sh", "-c", sh ], self.snd_ns)
+
+	# ---------------- MIXES ----------------
+
+	def run_mix(self, qdisc, opts, mix):
+		rec = {}
+		bottleneck = mix != "saturation"
+		self.set_qdisc(qdisc, opts, bottleneck)
+		pkts0, drops0 = self.qdisc_stats()
+		start = time.monotonic()
+		perf = self.perf_start()
+		wait = self.args.duration + 30
+
+		if mix == "saturation":
+			flood = self.pktgen()
+			if flood is None:
+				# No pktgen, a poor man's flood
+				flood = self.iperf(IPERF_PORT, udp=True,
+						   streams=self.args.streams,
+						   length=18)
+			self.collect(flood, wait)
+		else:
+			elephants = self.iperf(IPERF_PORT,
+					       streams=self.args.streams)
+			light = self.ping()
+			extra = None
+			if mix == "mice":
+				extra = self.netperf("TCP_CRR")
+			elif mix == "rpc":
+				extra = self.netperf("TCP_RR")
+			elif mix == "udp":
+				extra = self.iperf(IPERF_PORT + 1, udp=True,
+						   rate=self.args.udp_rate)
+			flows = self.iperf_flows(self.collect(elephants, wait))
+			rtts = self.ping_rtts(self.collect(light, wait))
+			if mix == "udp" and extra is not None:
+				flows += self.iperf_flows(self.collect(extra,
+								       wait))
+			elif extra is not None:
+				rec["rr_p99_us"] = self.netperf_p99(
+					self.collect(extra, wait))
+			rec["mbps"] = round(sum(flows), 1)
+			rec["jain"] = jain(flows)
+			rec["light_p50_us"] = percentile(rtts, 50)
+			rec["light_p99_us"] = percentile(rtts, 99)
+
+		elapsed = time.monotonic() - start
+		cycles = self.perf_cycles(perf, qdisc)
+		pkts1, drops1 = self.qdisc_stats()
+		rec["packets"] = pkts1 - pkts0
+		rec["drops"] = drops1 - drops0
+		if mix == "saturation":
+			rec["mpps"] = round(rec["packets"] / elapsed / 1e6, 3)
+		if cycles is not None and rec["packets"] > 0:
+			rec["cycles_per_pkt"] = round(cycles / rec["packets"], 1)
+		self.tc([ "qdisc", "del", "dev", self.dev, "root" ], check=False)
+		return rec
+
+
+# ---------------- STATISTICS ----------------
+
+def percentile(values, pct):
+	if not values:
+		return None
+	values = sorted(values)
+	idx = min(len(values) - 1, int(math.ceil(pct / 100.0 * len(values))) - 1)
+	return round(values[max(idx, 0)], 1)
+
+def jain(flows):
+	""" Jain fairness index, 1 when all flows get the same rate """
+	if not flows or sum(flows) == 0:
+		return None
+	return round(sum(flows) ** 2 / (len(flows) * sum(f * f for f in flows)),
+		     4)
+
+def median(values):
+	values = sorted(v for v in values if v is not None)
+	if not values:
+		return None
+	mid = len(values) // 2
+	if len(values) % 2:
+		return values[mid]
+	return (values[mid - 1] + values[mid]) / 2
+
+
+# ---------------- COMPARE ----------------
+
+def load_results(path):
+	res = {}
+	with open(path) as f:
+		for line in f:
+			if not line.strip():
+				continue
+			rec = json.loads(line)
+			key = (rec["qdisc"], rec["opts"], rec["mix"])
+			res.setdefault(key, []).append(rec)
+	return res
+
+def compare(old_path, new_path, threshold):
+	""" Median of the runs of each qdisc and mix, flag the metrics
+	    which got worse by more than threshold percent """
+	old = load_results(old_path)
+	new = load_results(new_path)
+	regressions = 0
+	print("%-24s %-10s %-15s %12s %12s %8s" %
+	      ("qdisc", "mix", "metric", "old", "new", "change"))
+	for key in sorted(set(old) & set(new)):
+		qdisc, opts, mix = key
+		name = qdisc + (" " + opts if opts else "")
+		for metric, sign in METRICS.items():
+			a = median([ r.get(metric) for r in old[key] ])
+			b = median([ r.get(metric) for r in new[key] ])
+			if a is None or b is None or a == 0:
+				continue
+			change = (b - a) * 100.0 / a
+			flag = ""
+			if change * sign < -threshold:
+				flag = " <-"
+				regressions += 1
+			print("%-24s %-10s %-15s %12g %12g %+7.1f%%%s" %
+			      (name[:24], mix, metric, a, b, change, flag))
+	for key in sorted(set(old) ^ set(new)):
+		print("%s %s : only in %s" % (key[0], key[2],
+					      old_path if key in old else new_path))
+	return 1 if regressions else 0
+
+
+# ---------------- MAIN ----------------
+
+def git_commit():
+	try:
+		return subprocess.run([ "git", "-C",
+					os.path.dirname(os.path.abspath(__file__)),
+					"describe", "--always", "--dirty" ],
+				      capture_output=True, text=True,
+				      check=True).stdout.strip()
+	except (OSError, subprocess.CalledProcessError):
+		return None
+
+def parse_qdisc(spec):
+	""" "scrr:sk_cache 256 fat_drop" -> ("scrr", [ "sk_cache", ... ]) """
+	name, _, opts = spec.partition(":")
+	return name, opts.split()
+
+def main():
+	ap = argparse.ArgumentParser(
+		description="Performance regression suite of the qdiscs",
+		epilog="qdiscs: " + " ".join(QDISC_MODULES))
+	ap.add_argument("-q", "--qdisc", action="append",
+			help="qdisc to test, with tc options after ':', "
+			"repeat for more (default all)")
+	ap.add_argument("-m", "--mix", action="append", choices=MIXES,
+			help="traffic mix, repeat for more (default all)")
+	ap.add_argument("-o", "--output", default="-",
+			help="JSON lines output (default stdout)")
+	ap.add_argument("-d", "--duration", type=int, default=20,
+			help="seconds per mix (default 20)")
+	ap.add_argument("-r", "--runs", type=int, default=1,
+			help="runs of each mix (default 1)")
+	ap.add_argument("-R", "--rate", default="1gbit",
+			help="bottleneck rate (default 1gbit)")
+	ap.add_argument("--burst", default="64kb",
+			help="bottleneck burst (default 64kb)")
+	ap.add_argument("-P", "--streams", type=int, default=8,
+			help="TCP elephants (default 8)")
+	ap.add_argument("--udp-rate", default="500M",
+			help="rate of the UDP flow of the udp mix (default 500M)")
+	ap.add_argument("--flows", type=int, default=1024,
+			help="flows of the saturation flood (default 1024)")
+	ap.add_argument("--cc", help="TCP congestion control of elephants")
+	ap.add_argument("--no-offload", action="store_true",
+			help="disable TSO, GSO and GRO on the veth")
+	ap.add_argument("--no-perf", action="store_true",
+			help="don't measure cycles per packet")
+	ap.add_argument("--modules",
+			help="directory of the .ko files, default modprobe")
+	ap.add_argument("--tc", default="tc",
+			help="tc built with the modules of this tree")
+	ap.add_argument("--dev", help="physical interface, instead of veth")
+	ap.add_argument("--peer", help="address of the peer of DEV, "
+			"running iperf3 -s on ports 5201+ and netserver")
+	ap.add_argument("--prefix", default="nb",
+			help="prefix of namespaces and veth (default nb)")
+	ap.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"),
+			help="compare two outputs, exit 1 on regression")
+	ap.add_argument("--threshold", type=float, default=5.0,
+			help="regression threshold in percent (default 5)")
+	ap.add_argument("-v", "--verbose", action="store_true")
+	args = ap.parse_args()
+
+	if args.compare:
+		return compare(args.compare[0], args.compare[1], args.threshold)
+	if args.dev and not args.peer:
+		ap.error("--dev needs --peer")
+	if os.geteuid() != 0:
+		ap.error("must run as root")
+
+	qdiscs = [ parse_qdisc(s) for s in (args.qdisc or DEFAULT_QDISCS) ]
+	mixes = args.mix or MIXES
+	out = sys.stdout if args.output == "-" else open(args.output, "a")
+	base = {
+		"commit":	git_commit(),
+		"kernel":	os.uname().release,
+		"rate":		args.rate,
+		"duration":	args.duration,
+		"streams":	args.streams,
+	}
+
+	bench = Bench(args)
+	try:
+		bench.setup()
+		for qdisc, opts in qdiscs:
+			srcversion = bench.load_module(qdisc)
+			for mix in mixes:
+				for run in range(args.runs):
+					log("%s %s %s run %d" % (qdisc,
+						" ".join(opts), mix, run))
+					rec = dict(base)
+					rec.update({
+						"qdisc":	qdisc,
+						"opts":		" ".join(opts),
+						"srcversion":	srcversion,
+						"mix":		mix,
+						"run":		run,
+					})
+					try:
+						rec.update(bench.run_mix(qdisc,
+								opts, mix))
+					except (RuntimeError,
+						subprocess.TimeoutExpired) as e:
+						rec["error"] = str(e)
+						log("failed: " + str(e))
+					out.write(json.dumps(rec) + "\n")
+					out.flush()
+	except KeyboardInterrupt:
+		pass
+	except RuntimeError as e:
+		log(str(e))
+		return 1
+	finally:
+		bench.teardown()
+		if out is not sys.stdout:
+			out.close()
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,1137 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * bench.c : trace driven benchmark of the packet schedulers.
+ *
+ * The scheduler is driven by a discrete event simulation : packets
+ * arrive from a source, and a link of fixed rate dequeues them. Time
+ * in the scheduler is virtual, so results don't depend on how fast the
+ * benchmark runs, only the cost of enqueue and dequeue is measured with
+ * the real clock.
+ *
+ * Sources :
+ *	o Synthetic : N elephants, window limited, so they keep their
+ *	  window of packets in the scheduler, plus Poisson arrivals of
+ *	  short mice flows. Elephants may use GSO, mice use random sizes.
+ *	o Trace : replay of a pcap file, at the capture timestamps
+ *	  scaled by the speedup.
+ *
+ * Reported :
+ *	o Cost of enqueue and dequeue, ns per call (mean and p99).
+ *	o Cache misses per call, if hardware counters are available.
+ *	o Jain fairness index of the elephants throughput.
+ *	o Sojourn time of mice and elephant packets (p50, p99, p999).
+ *	o Flow completion time of mice.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+
+#define BENCH_SCHED_MAX		32
+#define BENCH_START_NS		(10 * NSEC_PER_SEC)
+#define BENCH_HDR_LEN		66	/* Ethernet + IPv4 + TCP with options */
+
+/* ----------------------- HISTOGRAMS ----------------------- */
+
+/*
+ * Log-linear histogram, 16 sub-buckets per power of two, so about 6%
+ * of resolution over the whole u64 range.
+ */
+#define HIST_SUB_LOG	4
+#define HIST_SUB	(1 << HIST_SUB_LOG)
+#define HIST_BUCKETS	((64 - HIST_SUB_LOG + 1) * HIST_SUB)
+
+struct hist {
+	u64	count;
+	u64	sum;
+	u64	max;
+	u64	bucket[HIST_BUCKETS];
+};
+
+static inline int hist_idx(u64 v)
+{
+	int exp;
+
+	if (v < HIST_SUB)
+		return (int) v;
+	exp = fls64(v) - 1 - HIST_SUB_LOG;
+	return (exp + 1) * HIST_SUB + (int) ((v >> exp) & (HIST_SUB - 1));
+}
+
+static inline u64 hist_val(int idx)
+{
+	int exp = idx / HIST_SUB - 1;
+
+	if (exp < 0)
+		return idx;
+	/* Middle of the bucket */
+	return ((u64) (HIST_SUB + idx % HIST_SUB) << exp) + ((1ULL << exp) >> 1);
+}
+
+static inline void hist_add(struct hist *h, u64 v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->bucket[hist_idx(v)]++;
+}
+
+static u64 hist_pct(const struct hist *h, double pct)
+{
+	u64 target, acc = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+	target = (u64) ceil(h->count * pct / 100.0);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		acc += h->bucket[i];
+		if (acc >= target)
+			return min(hist_val(i), h->max);
+	}
+	return h->max;
+}
+
+static double hist_mean(const struct hist *h)
+{
+	return h->count ? (double) h->sum / h->count : 0.0;
+}
+
+/* ----------------------- HARDWARE COUNTERS ----------------------- */
+
+enum {
+	PMU_LLC_MISS,
+	PMU_L1D_MISS,
+	PMU_NUM
+};
+
+/* One group for enqueue, one for dequeue */
+struct pmu {
+	int	fd[PMU_NUM];
+	u64	val[PMU_NUM];
+};
+
+static int pmu_open_one(int group, u32 type, u64 config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = 0;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static int pmu_open(struct pmu *p)
+{
+	p->fd[PMU_LLC_MISS] = pmu_open_one(-1, PERF_TYPE_HARDWARE,
+					   PERF_COUNT_HW_CACHE_MISSES);
+	/* ENOENT without a PMU, as in most VMs, EACCES with
+	 * perf_event_paranoid */
+	if (p->fd[PMU_LLC_MISS] < 0)
+		return -errno;
+	p->fd[PMU_L1D_MISS] = pmu_open_one(p->fd[PMU_LLC_MISS],
+					   PERF_TYPE_HW_CACHE,
+					   PERF_COUNT_HW_CACHE_L1D |
+					   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+					   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	return 0;
+}
+
+static void pmu_close(struct pmu *p)
+{
+	int i;
+
+	for (i = 0; i < PMU_NUM; i++) {
+		if (p->fd[i] >= 0) {
+			u64 v;
+
+			if (read(p->fd[i], &v, sizeof(v)) == sizeof(v))
+				p->val[i] = v;
+			close(p->fd[i]);
+		}
+		p->fd[i] = -1;
+	}
+}
+
+static inline void pmu_enable(struct pmu *p)
+{
+	ioctl(p->fd[PMU_LLC_MISS], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static inline void pmu_disable(struct pmu *p)
+{
+	ioctl(p->fd[PMU_LLC_MISS], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* ----------------------- CONFIG & STATE ----------------------- */
+
+struct bench_cfg {
+	const char	*sched[BENCH_SCHED_MAX];
+	const char	*sched_opts[BENCH_SCHED_MAX];
+	int		sched_num;
+	const char	*trace_path;
+	double		speedup;	/* Trace replay time scale */
+	u64		packets;	/* Packets to dequeue per run */
+	u64		link_bps;
+	u32		mtu;
+	u32		elephants;
+	u32		window;		/* Base elephant window, packets */
+	u32		gso_segs;	/* Max segments of elephant packets */
+	u64		rtt_ns;
+	double		mice_rate;	/* Mice flows per second */
+	u32		mice_pkts;	/* Max packets per mouse */
+	int		ect;		/* Elephants are ECT(1) */
+	u64		pacing_bps;	/* EDT pacing of elephants, 0 = none */
+	u32		classes;	/* Classes of classful schedulers */
+	int		pmu;		/* Use hardware counters */
+	u32		seed;
+};
+
+/* Per flow state of the synthetic source */
+struct bench_flow {
+	u32		hash;
+	u32		window;		/* Elephant window */
+	u32		inflight;	/* Mouse packets not yet delivered */
+	u32		lost;		/* Mouse packets dropped */
+	u64		start_ns;	/* Mouse arrival */
+	u64		bytes;		/* Bytes delivered after warmup */
+	u64		edt_ns;		/* Departure time of the next packet */
+};
+
+/* Pending arrival, heap ordered by time */
+struct bench_event {
+	u64		time_ns;
+	u32		flow;
+};
+
+struct bench_run {
+	const struct bench_cfg	*cfg;
+	struct sl_qdisc		*q;
+	u32			classes;	/* 0 if not classful */
+
+	/* Virtual time */
+	u64			now_ns;
+	u64			link_free_ns;
+
+	/* Pending elephant sends */
+	struct bench_event	*heap;
+	u32			heap_len;
+	u32			heap_size;
+
+	/* Flows, elephants first, then mice */
+	struct bench_flow	*flows;
+	u32			flows_num;
+	u32			flows_size;
+	u64			mice_next_ns;
+	u32			rnd;
+
+	/* Sockets of the elephants, the mice are forwarded traffic */
+	struct sock		*socks;
+
+	/* Trace replay */
+	struct trace		trace;
+	struct trace_pkt	trace_pkt;
+	int			trace_more;
+
+	/* Packet pool */
+	struct sk_buff		*skb_free;
+
+	/* Results */
+	u64			enqueued;
+	u64			dequeued;
+	u64			drops;
+	u64			warmup;
+	u64			stalls;
+	u64			bypassed;
+	u64			meas_start_ns;
+	u64			meas_bytes;
+	u64			mice_done;
+	u64			mice_lossy;
+	u64			timer_overhead;
+	struct hist		enq_ns;
+	struct hist		deq_ns;
+	struct hist		sojourn_mice;
+	struct hist		sojourn_eleph;
+	struct hist		fct_mice;
+	struct pmu		pmu_enq;
+	struct pmu		pmu_deq;
+	int			pmu_ok;
+};
+
+/* The free hook has no context */
+static struct bench_run *bench_cur;
+
+static inline u32 bench_rand(struct bench_run *br)
+{
+	br->rnd ^= br->rnd << 13;
+	br->rnd ^= br->rnd >> 17;
+	br->rnd ^= br->rnd << 5;
+	return br->rnd;
+}
+
+/* Uniform in [0, 1) */
+static inline double bench_urand(struct bench_run *br)
+{
+	return (bench_rand(br) >> 8) / (double) (1 << 24);
+}
+
+static inline u64 now_real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Cost of reading the clock, to be removed from each sample */
+static u64 timer_overhead_calibrate(void)
+{
+	u64 best = ~0ULL;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		u64 t0 = now_real_ns();
+		u64 t1 = now_real_ns();
+
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return best;
+}
+
+/* ----------------------- EVENT HEAP ----------------------- */
+
+static int heap_push(struct bench_run *br, u64 time_ns, u32 flow)
+{
+	struct bench_event *h;
+	u32 i;
+
+	if (br->heap_len == br->heap_size) {
+		u32 size = br->heap_size ? br->heap_size * 2 : 1024;
+
+		h = realloc(br->heap, size * sizeof(*h));
+		if (!h)
+			return -ENOMEM;
+		br->heap = h;
+		br->heap_size = size;
+	}
+	h = br->heap;
+	for (i = br->heap_len++; i > 0; ) {
+		u32 parent = (i - 1) / 2;
+
+		if (h[parent].time_ns <= time_ns)
+			break;
+		h[i] = h[parent];
+		i = parent;
+	}
+	h[i].time_ns = time_ns;
+	h[i].flow = flow;
+	return 0;
+}
+
+static struct bench_event heap_pop(struct bench_run *br)
+{
+	struct bench_event *h = br->heap;
+	struct bench_event top = h[0];
+	struct bench_event last = h[--br->heap_len];
+	u32 i = 0;
+
+	for (;;) {
+		u32 child = 2 * i + 1;
+
+		if (child >= br->heap_len)
+			break;
+		if (child + 1 < br->heap_len &&
+		    h[child + 1].time_ns < h[child].time_ns)
+			child++;
+		if (last.time_ns <= h[child].time_ns)
+			break;
+		h[i] = h[child];
+		i = child;
+	}
+	h[i] = last;
+	return top;
+}
+
+/* ----------------------- PACKETS ----------------------- */
+
+static struct sk_buff *bench_skb_alloc(struct bench_run *br)
+{
+	struct sk_buff *skb = br->skb_free;
+
+	if (skb)
+		br->skb_free = skb->next;
+	else {
+		skb = aligned_alloc(SMP_CACHE_BYTES,
+				    (sizeof(*skb) + SMP_CACHE_BYTES - 1) &
+				    ~(SMP_CACHE_BYTES - 1));
+		if (!skb)
+			return NULL;
+	}
+	memset(skb, 0, sizeof(*skb));
+	return skb;
+}
+
+static inline void bench_skb_put(struct bench_run *br, struct sk_buff *skb)
+{
+	skb->next = br->skb_free;
+	br->skb_free = skb;
+}
+
+static void bench_skb_pool_free(struct bench_run *br)
+{
+	while (br->skb_free) {
+		struct sk_buff *next = br->skb_free->next;
+
+		free(br->skb_free);
+		br->skb_free = next;
+	}
+}
+
+static void bench_skb_setup(struct sk_buff *skb, u32 flow, u32 hash, u32 len,
+			    u16 protocol, u8 l4proto, u8 dsfield)
+{
+	skb->len = len;
+	skb->hash = hash;
+	skb->protocol = htons(protocol);
+	skb->l4proto = l4proto;
+	if (protocol == ETH_P_IPV6) {
+		skb->ip6h.dsfield = dsfield;
+		skb->ip6h.nexthdr = l4proto;
+	} else {
+		skb->iph.tos = dsfield;
+		skb->iph.protocol = l4proto;
+		skb->iph.saddr = hash;
+		skb->iph.daddr = ~hash;
+	}
+	skb->th.source = (u16) hash;
+	skb->th.dest = (u16) (hash >> 16);
+	skb->sl_flow = flow;
+}
+
+static struct bench_flow *bench_flow_new(struct bench_run *br)
+{
+	struct bench_flow *f;
+
+	if (br->flows_num == br->flows_size) {
+		u32 size = br->flows_size ? br->flows_size * 2 : 4096;
+
+		f = realloc(br->flows, size * sizeof(*f));
+		if (!f)
+			return NULL;
+		br->flows = f;
+		br->flows_size = size;
+	}
+	f = &br->flows[br->flows_num++];
+	memset(f, 0, sizeof(*f));
+	do {
+		f->hash = bench_rand(br);
+	} while (!f->hash);
+	return f;
+}
+
+static inline bool bench_is_mouse(const struct bench_run *br, u32 flow)
+{
+	return flow >= br->cfg->elephants;
+}
+
+/* Packet dropped by the scheduler */
+static void bench_skb_dropped(struct sk_buff *skb)
+{
+	struct bench_run *br = bench_cur;
+	u32 flow = skb->sl_flow;
+
+	br->drops++;
+	if (!br->cfg->trace_path) {
+		if (bench_is_mouse(br, flow)) {
+			struct bench_flow *f = &br->flows[flow];
+
+			f->lost++;
+			f->inflight--;
+			if (!f->inflight)
+				br->mice_lossy++;
+		} else if (!skb->sl_segs_left) {
+			/* The window slot comes back after one RTT */
+			heap_push(br, br->now_ns + br->cfg->rtt_ns, flow);
+		}
+	}
+	bench_skb_put(br, skb);
+}
+
+/* ----------------------- SCHEDULER CALLS ----------------------- */
+
+static inline bool bench_measuring(const struct bench_run *br)
+{
+	return br->dequeued >= br->warmup;
+}
+
+static void bench_deliver(struct bench_run *br, struct sk_buff *skb);
+
+static int bench_enqueue(struct bench_run *br, struct sk_buff *skb)
+{
+	bool meas = bench_measuring(br);
+	bool bypass = false;
+	u64 t0, t1;
+	int ret;
+
+	skb->sl_tstamp = br->now_ns;
+	/* Flows are spread over the classes by hash, like a filter */
+	if (br->classes)
+		skb->priority = TC_H_MAKE(br->q->sch->handle,
+					  1 + skb->hash % br->classes);
+	sl_clock_set(br->now_ns);
+	if (meas && br->pmu_ok)
+		pmu_enable(&br->pmu_enq);
+	t0 = now_real_ns();
+	/* The qdisc is not running when the link is free */
+	if (br->link_free_ns <= br->now_ns && sl_qdisc_bypass(br->q, skb)) {
+		bypass = true;
+		ret = NET_XMIT_SUCCESS;
+	} else
+		ret = sl_qdisc_enqueue(br->q, skb);
+	t1 = now_real_ns();
+	if (meas && br->pmu_ok)
+		pmu_disable(&br->pmu_enq);
+	sl_qdisc_run_work();
+
+	br->enqueued++;
+	if (meas)
+		hist_add(&br->enq_ns, t1 - t0 > br->timer_overhead ?
+			 t1 - t0 - br->timer_overhead : 0);
+	if (bypass) {
+		br->bypassed++;
+		bench_deliver(br, skb);
+	}
+	return ret;
+}
+
+static struct sk_buff *bench_dequeue(struct bench_run *br)
+{
+	bool meas = bench_measuring(br);
+	struct sk_buff *skb;
+	u64 t0, t1;
+
+	sl_clock_set(br->now_ns);
+	if (meas && br->pmu_ok)
+		pmu_enable(&br->pmu_deq);
+	t0 = now_real_ns();
+	skb = sl_qdisc_dequeue(br->q);
+	t1 = now_real_ns();
+	if (meas && br->pmu_ok)
+		pmu_disable(&br->pmu_deq);
+	sl_qdisc_run_work();
+
+	if (meas && skb)
+		hist_add(&br->deq_ns, t1 - t0 > br->timer_overhead ?
+			 t1 - t0 - br->timer_overhead : 0);
+	return skb;
+}
+
+/* ----------------------- SOURCES ----------------------- */
+
+static u32 bench_eleph_len(struct bench_run *br, u32 *segs)
+{
+	const struct bench_cfg *cfg = br->cfg;
+	u32 mss = cfg->mtu - (BENCH_HDR_LEN - 14);
+
+	*segs = 1;
+	if (cfg->gso_segs > 1)
+		*segs = 1 + bench_rand(br) % cfg->gso_segs;
+	/* Like qdisc_pkt_len_init(), headers are counted on each segment */
+	return *segs * (mss + BENCH_HDR_LEN);
+}
+
+static int bench_eleph_send(struct bench_run *br, u32 flow)
+{
+	struct bench_flow *f = &br->flows[flow];
+	struct sk_buff *skb;
+	u32 segs, len;
+
+	skb = bench_skb_alloc(br);
+	if (!skb)
+		return -ENOMEM;
+	len = bench_eleph_len(br, &segs);
+	bench_skb_setup(skb, flow, f->hash, len, ETH_P_IP, IPPROTO_TCP,
+			br->cfg->ect ? INET_ECN_ECT_1 : INET_ECN_NOT_ECT);
+	skb->sk = &br->socks[flow];
+	/* Like TCP pacing, each packet leaves len / rate after the previous */
+	if (br->cfg->pacing_bps) {
+		skb->tstamp = max(br->now_ns, f->edt_ns);
+		f->edt_ns = skb->tstamp + (u64) len * 8 * NSEC_PER_SEC
+					  / br->cfg->pacing_bps;
+	}
+	if (segs > 1) {
+		skb->shinfo.gso_size = br->cfg->mtu - (BENCH_HDR_LEN - 14);
+		skb->shinfo.gso_segs = segs;
+	}
+	bench_enqueue(br, skb);
+	return 0;
+}
+
+static int bench_mouse_arrive(struct bench_run *br)
+{
+	const struct bench_cfg *cfg = br->cfg;
+	struct bench_flow *f;
+	u32 flow, pkts, i;
+
+	f = bench_flow_new(br);
+	if (!f)
+		return -ENOMEM;
+	flow = br->flows_num - 1;
+	pkts = 1 + bench_rand(br) % cfg->mice_pkts;
+	f->start_ns = br->now_ns;
+	f->inflight = pkts;
+
+	/* The whole mouse arrives as a burst, like an initial window */
+	for (i = 0; i < pkts; i++) {
+		struct sk_buff *skb = bench_skb_alloc(br);
+		u32 len;
+
+		if (!skb)
+			return -ENOMEM;
+		len = 64 + bench_rand(br) % (cfg->mtu + 14 - 64 + 1);
+		bench_skb_setup(skb, flow, f->hash, len, ETH_P_IP,
+				IPPROTO_TCP, INET_ECN_NOT_ECT);
+		bench_enqueue(br, skb);
+	}
+
+	/* Exponential inter-arrival */
+	br->mice_next_ns = br->now_ns + 1 +
+		(u64) (-log(1.0 - bench_urand(br)) * NSEC_PER_SEC /
+		       cfg->mice_rate);
+	return 0;
+}
+
+static int bench_trace_arrive(struct bench_run *br)
+{
+	struct trace_pkt *tp = &br->trace_pkt;
+	struct sk_buff *skb;
+	int ret;
+
+	skb = bench_skb_alloc(br);
+	if (!skb)
+		return -ENOMEM;
+	bench_skb_setup(skb, 0, tp->hash, tp->len, tp->protocol,
+			tp->l4proto, tp->dsfield);
+	bench_enqueue(br, skb);
+
+	ret = trace_next(&br->trace, tp);
+	if (ret < 0)
+		return ret;
+	br->trace_more = ret;
+	return 0;
+}
+
+/* Time of the next arrival, ~0 if there is none */
+static u64 bench_next_arrival(struct bench_run *br)
+{
+	const struct bench_cfg *cfg = br->cfg;
+	u64 next = ~0ULL;
+
+	if (cfg->trace_path) {
+		if (br->trace_more)
+			next = max(BENCH_START_NS + (u64)
+				   (br->trace_pkt.tstamp_ns / cfg->speedup),
+				   br->now_ns);
+		return next;
+	}
+	if (br->heap_len)
+		next = br->heap[0].time_ns;
+	if (cfg->mice_rate > 0 && br->mice_next_ns < next)
+		next = br->mice_next_ns;
+	return next;
+}
+
+static int bench_arrive(struct bench_run *br)
+{
+	const struct bench_cfg *cfg = br->cfg;
+
+	if (cfg->trace_path)
+		return bench_trace_arrive(br);
+	if (br->heap_len && br->heap[0].time_ns <= br->now_ns) {
+		struct bench_event ev = heap_pop(br);
+
+		return bench_eleph_send(br, ev.flow);
+	}
+	return bench_mouse_arrive(br);
+}
+
+/* ----------------------- LINK ----------------------- */
+
+static void bench_deliver(struct bench_run *br, struct sk_buff *skb)
+{
+	const struct bench_cfg *cfg = br->cfg;
+	u32 flow = skb->sl_flow;
+	u64 sojourn = br->now_ns - skb->sl_tstamp;
+	bool meas = bench_measuring(br);
+
+	br->dequeued++;
+	br->link_free_ns = br->now_ns +
+		(u64) skb->len * 8 * NSEC_PER_SEC / cfg->link_bps;
+	if (br->dequeued == br->warmup)
+		br->meas_start_ns = br->now_ns;
+
+	if (cfg->trace_path) {
+		if (meas) {
+			hist_add(&br->sojourn_eleph, sojourn);
+			br->meas_bytes += skb->len;
+		}
+	} else if (bench_is_mouse(br, flow)) {
+		struct bench_flow *f = &br->flows[flow];
+
+		if (meas)
+			hist_add(&br->sojourn_mice, sojourn);
+		if (--f->inflight == 0) {
+			if (f->lost)
+				br->mice_lossy++;
+			else if (meas) {
+				hist_add(&br->fct_mice,
+					 br->link_free_ns - f->start_ns);
+				br->mice_done++;
+			}
+		}
+	} else {
+		if (meas) {
+			hist_add(&br->sojourn_eleph, sojourn);
+			br->flows[flow].bytes += skb->len;
+			br->meas_bytes += skb->len;
+		}
+		/* Ack clocking, the next packet comes one RTT later.
+		 * A split GSO packet is acked by its last segment. */
+		if (!skb->sl_segs_left)
+			heap_push(br, br->link_free_ns + cfg->rtt_ns, flow);
+	}
+	bench_skb_put(br, skb);
+}
+
+/* ----------------------- RUN ----------------------- */
+
+static int bench_setup(struct bench_run *br)
+{
+	const struct bench_cfg *cfg = br->cfg;
+	u32 i;
+	int err;
+
+	br->rnd = cfg->seed ? cfg->seed : 0x9E3779B9;
+	br->now_ns = BENCH_START_NS;
+	br->link_free_ns = BENCH_START_NS;
+	br->warmup = cfg->packets / 10;
+	br->timer_overhead = timer_overhead_calibrate();
+
+	if (cfg->trace_path) {
+		err = trace_open(&br->trace, cfg->trace_path);
+		if (err)
+			return err;
+		err = trace_next(&br->trace, &br->trace_pkt);
+		if (err < 0)
+			return err;
+		br->trace_more = err;
+		return 0;
+	}
+
+	br->socks = calloc(max(cfg->elephants, 1U), sizeof(*br->socks));
+	if (!br->socks)
+		return -ENOMEM;
+	for (i = 0; i < cfg->elephants; i++) {
+		struct bench_flow *f = bench_flow_new(br);
+		u32 k;
+
+		if (!f)
+			return -ENOMEM;
+		/* Unequal windows, FIFO would share in proportion */
+		f->window = cfg->window << (i % 3);
+		for (k = 0; k < f->window; k++) {
+			/* Stagger the start over one RTT */
+			err = heap_push(br, BENCH_START_NS +
+					cfg->rtt_ns * k / f->window, i);
+			if (err)
+				return err;
+		}
+	}
+	br->mice_next_ns = BENCH_START_NS;
+	return 0;
+}
+
+static int bench_loop(struct bench_run *br)
+{
+	const struct bench_cfg *cfg = br->cfg;
+
+	while (br->dequeued < cfg->packets) {
+		u64 next = bench_next_arrival(br);
+		u64 wd;
+		int err;
+
+		/* Link is free before the next arrival, transmit */
+		if (sl_qdisc_qlen(br->q) && br->link_free_ns <= next) {
+			struct sk_buff *skb;
+
+			br->now_ns = max(br->now_ns, br->link_free_ns);
+			skb = bench_dequeue(br);
+			if (skb) {
+				bench_deliver(br, skb);
+				continue;
+			}
+			/* Throttled, wait for the watchdog or the next
+			 * arrival, whichever comes first */
+			br->stalls++;
+			wd = sl_watchdog_next();
+			if (wd < next && wd > br->now_ns) {
+				br->now_ns = wd;
+				sl_watchdog_expire(wd);
+				continue;
+			}
+		}
+		if (next == ~0ULL)
+			break;
+		br->now_ns = max(br->now_ns, next);
+		err = bench_arrive(br);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* Flush of the scheduler at the end, and GSO packets split by the
+ * scheduler, those are not drops */
+static void bench_skb_flushed(struct sk_buff *skb)
+{
+	bench_skb_put(bench_cur, skb);
+}
+
+/* Segments of GSO packets split by the scheduler */
+static struct sk_buff *bench_skb_seg_alloc(void)
+{
+	return bench_skb_alloc(bench_cur);
+}
+
+static void bench_cleanup(struct bench_run *br)
+{
+	sl_skb_free_hook = bench_skb_flushed;
+	sl_qdisc_reset(br->q);
+	if (br->cfg->trace_path)
+		trace_close(&br->trace);
+	free(br->heap);
+	free(br->flows);
+	free(br->socks);
+	bench_skb_pool_free(br);
+}
+
+static double bench_jain(const struct bench_run *br)
+{
+	double sum = 0.0, sq = 0.0;
+	u32 i, n = br->cfg->elephants;
+
+	if (!n || br->cfg->trace_path)
+		return NAN;
+	for (i = 0; i < n; i++) {
+		double x = br->flows[i].bytes;
+
+		sum += x;
+		sq += x * x;
+	}
+	return sq > 0.0 ? sum * sum / (n * sq) : NAN;
+}
+
+static void bench_print_header(void)
+{
+	printf("%-14s %7s %7s %7s %7s %8s %8s %7s %6s %7s %7s %7s %7s %7s %7s %8s\n",
+	       "sched", "enq_ns", "enq_p99", "deq_ns", "deq_p99",
+	       "enq_miss", "deq_miss", "drop%", "jain", "gbps",
+	       "m_p50", "m_p99", "m_p999", "e_p50", "e_p99", "fct_p99");
+}
+
+static void bench_print(const struct bench_run *br, const char *name)
+{
+	u64 meas_pkts = br->dequeued - br->warmup;
+	u64 dur = br->now_ns - br->meas_start_ns;
+	char enq_miss[16] = "n/a", deq_miss[16] = "n/a";
+	double jain = bench_jain(br);
+
+	if (br->pmu_ok && br->enq_ns.count && br->deq_ns.count) {
+		snprintf(enq_miss, sizeof(enq_miss), "%.2f",
+			 (double) br->pmu_enq.val[PMU_L1D_MISS] /
+			 br->enq_ns.count);
+		snprintf(deq_miss, sizeof(deq_miss), "%.2f",
+			 (double) br->pmu_deq.val[PMU_L1D_MISS] /
+			 br->deq_ns.count);
+	}
+
+	printf("%-14s %7.1f %7llu %7.1f %7llu %8s %8s %7.3f ",
+	       name, hist_mean(&br->enq_ns),
+	       (unsigned long long) hist_pct(&br->enq_ns, 99.0),
+	       hist_mean(&br->deq_ns),
+	       (unsigned long long) hist_pct(&br->deq_ns, 99.0),
+	       enq_miss, deq_miss,
+	       br->enqueued ? 100.0 * br->drops / br->enqueued : 0.0);
+	if (isnan(jain))
+		printf("%6s ", "n/a");
+	else
+		printf("%6.4f ", jain);
+	printf("%7.2f %7.1f %7.1f %7.1f %7.1f %7.1f %8.1f\n",
+	       dur ? br->meas_bytes * 8.0 / dur : 0.0,
+	       hist_pct(&br->sojourn_mice, 50.0) / 1000.0,
+	       hist_pct(&br->sojourn_mice, 99.0) / 1000.0,
+	       hist_pct(&br->sojourn_mice, 99.9) / 1000.0,
+	       hist_pct(&br->sojourn_eleph, 50.0) / 1000.0,
+	       hist_pct(&br->sojourn_eleph, 99.0) / 1000.0,
+	       hist_pct(&br->fct_mice, 99.0) / 1000.0);
+	if (meas_pkts < br->cfg->packets - br->warmup)
+		printf("%-14s   source ended after %llu packets\n", "",
+		       (unsigned long long) br->dequeued);
+	if (br->bypassed)
+		printf("%-14s   %.1f%% of packets bypassed the qdisc\n", "",
+		       100.0 * br->bypassed / br->enqueued);
+	if (br->pmu_ok)
+		printf("%-14s   llc misses/pkt enq %.2f deq %.2f\n", "",
+		       br->enq_ns.count ? (double)
+		       br->pmu_enq.val[PMU_LLC_MISS] / br->enq_ns.count : 0.0,
+		       br->deq_ns.count ? (double)
+		       br->pmu_deq.val[PMU_LLC_MISS] / br->deq_ns.count : 0.0);
+}
+
+static int bench_one(const struct bench_cfg *cfg, const char *sched,
+		     const char *opts)
+{
+	struct bench_run *br;
+	const char *msg = NULL;
+	int err;
+
+	br = calloc(1, sizeof(*br));
+	if (!br)
+		return -ENOMEM;
+	br->cfg = cfg;
+	bench_cur = br;
+	sl_skb_free_hook = bench_skb_dropped;
+	sl_skb_consume_hook = bench_skb_flushed;
+	sl_skb_alloc_hook = bench_skb_seg_alloc;
+
+	err = sl_qdisc_create(sched, opts, &br->q, &msg);
+	if (err) {
+		fprintf(stderr, "%s: create failed: %s (%d)\n", sched,
+			msg ? msg : strerror(-err), err);
+		free(br);
+		return err;
+	}
+
+	/* Classful schedulers get at least one class */
+	if (br->q->sch->ops->cl_ops && br->q->sch->ops->cl_ops->change) {
+		u32 minor;
+
+		br->classes = max(cfg->classes, 1U);
+		for (minor = 1; minor <= br->classes && !err; minor++)
+			err = sl_class_change(br->q, minor, NULL, &msg);
+		if (err) {
+			fprintf(stderr, "%s: class create failed: %s (%d)\n",
+				sched, msg ? msg : strerror(-err), err);
+			sl_qdisc_destroy(br->q);
+			free(br);
+			return err;
+		}
+	}
+
+	if (cfg->pmu) {
+		int perr = pmu_open(&br->pmu_enq);
+
+		if (!perr) {
+			perr = pmu_open(&br->pmu_deq);
+			if (perr)
+				pmu_close(&br->pmu_enq);
+		}
+		br->pmu_ok = !perr;
+		if (!br->pmu_ok)
+			fprintf(stderr, "%s: hardware counters not available: %s\n",
+				sched, strerror(-perr));
+	}
+
+	err = bench_setup(br);
+	if (!err)
+		err = bench_loop(br);
+	if (br->pmu_ok) {
+		pmu_close(&br->pmu_enq);
+		pmu_close(&br->pmu_deq);
+	}
+	if (err)
+		fprintf(stderr, "%s: run failed (%d)\n", sched, err);
+	else
+		bench_print(br, sched);
+
+	bench_cleanup(br);
+	sl_qdisc_destroy(br->q);
+	sl_skb_free_hook = NULL;
+	sl_skb_consume_hook = NULL;
+	sl_skb_alloc_hook = NULL;
+	bench_cur = NULL;
+	free(br);
+	return err;
+}
+
+/* ----------------------- MAIN ----------------------- */
+
+static void usage(const char *prog)
+{
+	const struct Qdisc_ops *ops = NULL;
+
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -q SCHED[:OPTS]  Scheduler, repeat to compare (default all)\n"
+		"                   OPTS are name=value,..., e.g. scrr:plimit=2000\n"
+		"  -n PACKETS       Packets to dequeue per run (default 1000000)\n"
+		"  -r GBPS          Link rate (default 10)\n"
+		"  -s MTU           MTU (default 1500)\n"
+		"  -E N             Elephants (default 16)\n"
+		"  -w PKTS          Base elephant window, 1x 2x 4x (default 16)\n"
+		"  -g SEGS          Max GSO segments of elephants (default 1)\n"
+		"  -R USEC          Elephant RTT (default 100)\n"
+		"  -M RATE          Mice flows per second (default 20000)\n"
+		"  -m PKTS          Max packets per mouse (default 16)\n"
+		"  -e               Elephants are ECT(1)\n"
+		"  -P GBPS          Pace each elephant with skb->tstamp (EDT)\n"
+		"  -C N             Classes of classful schedulers (default 1)\n"
+		"  -p FILE          Replay a pcap trace instead\n"
+		"  -S SPEEDUP       Trace time scale (default 1)\n"
+		"  -c               Count cache misses (hardware counters)\n"
+		"  -x SEED          Random seed\n"
+		"Schedulers :", prog);
+	while ((ops = sl_sched_next(ops)))
+		fprintf(stderr, " %s", ops->id);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const sched_dflt[] = {
+		"scrr", "stfq", "fq_drr", "aifo_stfq", "sppifo_stfq",
+	};
+	struct bench_cfg cfg = {
+		.speedup	= 1.0,
+		.packets	= 1000000,
+		.link_bps	= 10000000000ULL,
+		.mtu		= 1500,
+		.elephants	= 16,
+		.window		= 16,
+		.gso_segs	= 1,
+		.rtt_ns		= 100 * NSEC_PER_USEC,
+		.mice_rate	= 20000,
+		.mice_pkts	= 16,
+	};
+	int opt, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "q:n:r:s:E:w:g:R:M:m:eP:C:p:S:cx:h")) != -1) {
+		switch (opt) {
+		case 'q': {
+			char *colon;
+
+			if (cfg.sched_num >= BENCH_SCHED_MAX) {
+				fprintf(stderr, "Too many schedulers\n");
+				return 1;
+			}
+			colon = strchr(optarg, ':');
+			if (colon)
+				*colon++ = '\0';
+			cfg.sched[cfg.sched_num] = optarg;
+			cfg.sched_opts[cfg.sched_num++] = colon;
+			break;
+		}
+		case 'n':
+			cfg.packets = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.link_bps = (u64) (strtod(optarg, NULL) * 1e9);
+			break;
+		case 's':
+			cfg.mtu = strtoul(optarg, NULL, 0);
+			break;
+		case 'E':
+			cfg.elephants = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.window = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			cfg.gso_segs = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			cfg.rtt_ns = strtoull(optarg, NULL, 0) * NSEC_PER_USEC;
+			break;
+		case 'M':
+			cfg.mice_rate = strtod(optarg, NULL);
+			break;
+		case 'm':
+			cfg.mice_pkts = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			cfg.ect = 1;
+			break;
+		case 'P':
+			cfg.pacing_bps = (u64) (strtod(optarg, NULL) * 1e9);
+			break;
+		case 'C':
+			cfg.classes = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.trace_path = optarg;
+			break;
+		case 'S':
+			cfg.speedup = strtod(optarg, NULL);
+			break;
+		case 'c':
+			cfg.pmu = 1;
+			break;
+		case 'x':
+			cfg.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (cfg.mtu < 128 || cfg.link_bps == 0 || cfg.mice_pkts == 0 ||
+	    cfg.window == 0 || cfg.speedup <= 0.0) {
+		fprintf(stderr, "Invalid parameters\n");
+		return 1;
+	}
+	if (!cfg.sched_num) {
+		for (i = 0; i < ARRAY_SIZE(sched_dflt); i++)
+			cfg.sched[cfg.sched_num++] = sched_dflt[i];
+	}
+
+	if (cfg.trace_path)
+		printf("# trace %s, speedup %g, link %.1f Gb/s, %llu packets\n",
+		       cfg.trace_path, cfg.speedup, cfg.link_bps / 1e9,
+		       (unsigned long long) cfg.packets);
+	else
+		printf("# %u elephants (window %u, gso %u, rtt %llu us), "
+		       "mice %g/s (max %u pkts), link %.1f Gb/s, %llu packets\n",
+		       cfg.elephants, cfg.window, cfg.gso_segs,
+		       (unsigned long long) (cfg.rtt_ns / NSEC_PER_USEC),
+		       cfg.mice_rate, cfg.mice_pkts, cfg.link_bps / 1e9,
+		       (unsigned long long) cfg.packets);
+	if (!cfg.trace_path && cfg.pacing_bps)
+		printf("# elephants paced at %.2f Gb/s\n", cfg.pacing_bps / 1e9);
+	printf("# sojourn and fct in us, miss = L1D read misses per call\n");
+	if (cfg.trace_path)
+		printf("# trace has no mice, e_* is all packets\n");
+	else
+		printf("# gbps is elephant throughput\n");
+	bench_print_header();
+
+	for (i = 0; i < cfg.sched_num; i++)
+		if (bench_one(&cfg, cfg.sched[i], cfg.sched_opts[i]))
+			ret = 1;
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * bench.h : shared definitions of the scheduler benchmark.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+#include "schedlib.h"
+
+/* One packet read from a trace */
+struct trace_pkt {
+	u64		tstamp_ns;	/* Relative to the first packet */
+	u32		len;		/* Wire length */
+	u32		hash;		/* Flow hash, never zero */
+	u16		protocol;	/* ETH_P_IP or ETH_P_IPV6 */
+	u8		l4proto;	/* IPPROTO_TCP, IPPROTO_UDP... */
+	u8		dsfield;
+};
+
+struct trace {
+	FILE		*f;
+	int		swapped;	/* File in the other endianness */
+	int		nsec;		/* Timestamps in ns instead of us */
+	u32		linktype;
+	u64		first_ns;
+	u64		skipped;	/* Packets we could not parse */
+	unsigned char	*buf;
+	u32		buflen;
+};
+
+int trace_open(struct trace *tr, const char *path);
+/* Return 1 if a packet was read, 0 at the end, negative on error */
+int trace_next(struct trace *tr, struct trace_pkt *pkt);
+void trace_close(struct trace *tr);
+
+#endif /* BENCH_H */
@@ -0,0 +1,1572 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * kshim.h : just enough of the Linux 6.1 kernel API to build the qdisc
+ * modules (sch_*.c) as userspace code.
+ *
+ * The modules are compiled unmodified. Everything here is single
+ * threaded, the qdisc lock is a no-op, and time is a virtual clock
+ * driven by the caller, see sl_clock_set(). There is no real netlink,
+ * attributes are laid out like netlink so that the module change()
+ * and dump() functions run as in the kernel.
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* ----------------------- TYPES & COMPILER ----------------------- */
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef unsigned long long u64;
+typedef int8_t		s8;
+typedef int16_t		s16;
+typedef int32_t		s32;
+typedef long long	s64;
+typedef u8		__u8;
+typedef u16		__u16;
+typedef u32		__u32;
+typedef u64		__u64;
+typedef s32		__s32;
+typedef s64		__s64;
+typedef u16		__be16;
+typedef u32		__be32;
+typedef unsigned int	gfp_t;
+typedef s64		ktime_t;
+typedef u64		cycles_t;
+
+#define U32_MAX			((u32) ~0U)
+#define U64_MAX			((u64) ~0ULL)
+
+#define SMP_CACHE_BYTES			64
+#define ____cacheline_aligned		__attribute__((aligned(SMP_CACHE_BYTES)))
+#define ____cacheline_aligned_in_smp	____cacheline_aligned
+#ifndef __aligned
+#define __aligned(x)			__attribute__((aligned(x)))
+#endif
+#define __packed			__attribute__((packed))
+#define __read_mostly
+#define __percpu
+#define __init
+#define __exit
+#define __always_unused			__attribute__((unused))
+#define __maybe_unused			__attribute__((unused))
+#undef __always_inline
+#define __always_inline			inline __attribute__((always_inline))
+#define noinline			__attribute__((noinline))
+#define fallthrough			__attribute__((fallthrough))
+
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define READ_ONCE(x)		(*(volatile typeof(x) *) &(x))
+#define WRITE_ONCE(x, v)	(*(volatile typeof(x) *) &(x) = (v))
+#define barrier()		__asm__ __volatile__("" ::: "memory")
+#define smp_mb()		__sync_synchronize()
+#define smp_wmb()		barrier()
+#define smp_rmb()		barrier()
+#define cpu_relax()		barrier()
+
+void sl_bug(const char *file, int line);
+#define BUG()			sl_bug(__FILE__, __LINE__)
+#define BUG_ON(c)		do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c)		({ bool __w = !!(c); __w; })
+#define WARN_ON_ONCE(c)		WARN_ON(c)
+#define BUILD_BUG_ON(c)		((void) sizeof(char[1 - 2 * !!(c)]))
+
+#define typecheck(t, x)		({ t __d1; typeof(x) __d2; (void)(&__d1 == &__d2); 1; })
+#define container_of(p, t, m)	((t *)((char *)(p) - offsetof(t, m)))
+#define offsetofend(t, m)	(offsetof(t, m) + sizeof(((t *)0)->m))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define __stringify_1(x)	#x
+#define __stringify(x)		__stringify_1(x)
+
+#define min(a, b)		({ typeof(a) __a = (a); typeof(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b)		({ typeof(a) __a = (a); typeof(b) __b = (b); __a > __b ? __a : __b; })
+#define min_t(t, a, b)		({ t __a = (a); t __b = (b); __a < __b ? __a : __b; })
+#define max_t(t, a, b)		({ t __a = (a); t __b = (b); __a > __b ? __a : __b; })
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi)	min_t(t, max_t(t, v, lo), hi)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+#define IS_ERR_VALUE(x)		((unsigned long)(x) >= (unsigned long)-4095)
+#define IS_ERR(p)		IS_ERR_VALUE(p)
+#define IS_ERR_OR_NULL(p)	(!(p) || IS_ERR_VALUE(p))
+#define PTR_ERR(p)		((long)(p))
+#define ERR_PTR(e)		((void *)(long)(e))
+#define ERR_CAST(p)		((void *)(p))
+
+#define EPERM		1
+#define ENOENT		2
+#define E2BIG		7
+#define ENOMEM		12
+#define EBUSY		16
+#define EEXIST		17
+#define EINVAL		22
+#define ENOSPC		28
+#define ERANGE		34
+#define EMSGSIZE	90
+#define EOPNOTSUPP	95
+#define ENOBUFS		105
+
+/* ----------------------- PRINTK ----------------------- */
+
+#define KERN_ERR	"<3>"
+#define KERN_WARNING	"<4>"
+#define KERN_INFO	"<6>"
+#define KERN_DEBUG	"<7>"
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define printk_ratelimited	printk
+#define pr_err(...)		printk(KERN_ERR __VA_ARGS__)
+#define pr_warn(...)		printk(KERN_WARNING __VA_ARGS__)
+#define pr_info(...)		printk(KERN_INFO __VA_ARGS__)
+#define pr_debug(...)		printk(KERN_DEBUG __VA_ARGS__)
+/* From libc */
+int snprintf(char *str, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* ----------------------- MATH & BITS ----------------------- */
+
+#define BITS_PER_LONG		64
+#define BIT(n)			(1UL << (n))
+#define BITS_TO_LONGS(n)	DIV_ROUND_UP(n, BITS_PER_LONG)
+#define DECLARE_BITMAP(n, b)	unsigned long n[BITS_TO_LONGS(b)]
+
+static inline int fls(unsigned int x)		{ return x ? 32 - __builtin_clz(x) : 0; }
+static inline int fls64(u64 x)			{ return x ? 64 - __builtin_clzll(x) : 0; }
+#define ffs(x)				__builtin_ffs(x)
+static inline unsigned long __ffs(unsigned long x) { return __builtin_ctzl(x); }
+static inline unsigned long __ffs64(u64 x)	{ return __builtin_ctzll(x); }
+static inline unsigned long __fls(unsigned long x) { return 63 - __builtin_clzl(x); }
+static inline unsigned int hweight32(u32 x)	{ return __builtin_popcount(x); }
+static inline unsigned int hweight64(u64 x)	{ return __builtin_popcountll(x); }
+
+#define ilog2(n)		((n) ? (int) __fls((unsigned long) (n)) : -1)
+#define is_power_of_2(n)	((n) != 0 && (((n) & ((n) - 1)) == 0))
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return n <= 1 ? 1 : 1UL << (__fls(n - 1) + 1);
+}
+
+static inline void __set_bit(long nr, unsigned long *a)
+{
+	a[nr / BITS_PER_LONG] |= BIT(nr % BITS_PER_LONG);
+}
+static inline void __clear_bit(long nr, unsigned long *a)
+{
+	a[nr / BITS_PER_LONG] &= ~BIT(nr % BITS_PER_LONG);
+}
+#define set_bit		__set_bit
+#define clear_bit	__clear_bit
+static inline bool test_bit(long nr, const unsigned long *a)
+{
+	return (a[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+static inline void bitmap_zero(unsigned long *d, unsigned int nbits)
+{
+	memset(d, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+unsigned long find_next_bit(const unsigned long *a, unsigned long size,
+			    unsigned long offset);
+#define find_first_bit(a, size)	find_next_bit(a, size, 0)
+#define for_each_set_bit(bit, addr, size)				\
+	for ((bit) = find_first_bit((addr), (size)); (bit) < (size);	\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+#define for_each_set_bit_from(bit, addr, size)				\
+	for ((bit) = find_next_bit((addr), (size), (bit)); (bit) < (size); \
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * 0x61C88647U) >> (32 - bits);
+}
+static inline u32 hash_64(u64 val, unsigned int bits)
+{
+	return (u32) ((val * 0x61C8864680B583EBULL) >> (64 - bits));
+}
+#define hash_ptr(ptr, bits)	hash_64((unsigned long) (ptr), bits)
+
+typedef struct {
+	u64	key[2];
+} siphash_key_t;
+static inline u32 reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32) (((u64) val * ep_ro) >> 32);
+}
+static inline u32 lower_32_bits(u64 x)		{ return (u32) x; }
+static inline u32 upper_32_bits(u64 x)		{ return (u32) (x >> 32); }
+static inline u64 div_u64(u64 a, u32 b)		{ return a / b; }
+static inline s64 div_s64(s64 a, s32 b)		{ return a / b; }
+static inline u64 div64_u64(u64 a, u64 b)	{ return a / b; }
+static inline s64 div64_s64(s64 a, s64 b)	{ return a / b; }
+static inline u64 mul_u32_u32(u32 a, u32 b)	{ return (u64) a * b; }
+#define do_div(n, base)	({ u32 __rem = (n) % (base); (n) /= (base); __rem; })
+
+static inline u16 htons(u16 x)		{ return __builtin_bswap16(x); }
+static inline u16 ntohs(u16 x)		{ return __builtin_bswap16(x); }
+static inline u32 htonl(u32 x)		{ return __builtin_bswap32(x); }
+static inline u32 ntohl(u32 x)		{ return __builtin_bswap32(x); }
+#define cpu_to_be16(x)	((__be16) ((((x) >> 8) & 0xFF) | (((x) & 0xFF) << 8)))
+
+u32 get_random_u32(void);
+void get_random_bytes(void *buf, int len);
+#define prandom_u32()		get_random_u32()
+static inline u32 prandom_u32_max(u32 ceil)
+{
+	return reciprocal_scale(get_random_u32(), ceil);
+}
+
+/* ----------------------- TIME ----------------------- */
+
+#define HZ		1000
+#define NSEC_PER_USEC	1000L
+#define NSEC_PER_MSEC	1000000L
+#define NSEC_PER_SEC	1000000000L
+#define USEC_PER_MSEC	1000L
+#define USEC_PER_SEC	1000000L
+#define MSEC_PER_SEC	1000L
+
+extern volatile unsigned long jiffies;
+extern u64 sl_clock_ns;
+
+#define time_after(a, b)	(typecheck(unsigned long, a) && \
+				 typecheck(unsigned long, b) && \
+				 ((long)((b) - (a)) < 0))
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)	time_after_eq(b, a)
+#define time_after32(a, b)	((s32)((u32)(b) - (u32)(a)) < 0)
+#define time_before32(b, a)	time_after32(a, b)
+#define time_after64(a, b)	(typecheck(__u64, a) && \
+				 typecheck(__u64, b) && \
+				 ((__s64)((b) - (a)) < 0))
+#define time_before64(a, b)	time_after64(b, a)
+#define time_after_eq64(a, b)	(typecheck(__u64, a) && \
+				 typecheck(__u64, b) && \
+				 ((__s64)((a) - (b)) >= 0))
+#define time_before_eq64(a, b)	time_after_eq64(b, a)
+
+static inline unsigned int jiffies_to_msecs(unsigned long j)
+{
+	return (unsigned int) (j * (MSEC_PER_SEC / HZ));
+}
+static inline unsigned int jiffies_to_usecs(unsigned long j)
+{
+	return (unsigned int) (j * (USEC_PER_SEC / HZ));
+}
+static inline unsigned long msecs_to_jiffies(unsigned int m)
+{
+	return DIV_ROUND_UP((unsigned long) m, MSEC_PER_SEC / HZ);
+}
+static inline unsigned long usecs_to_jiffies(unsigned int u)
+{
+	return DIV_ROUND_UP((unsigned long) u, USEC_PER_SEC / HZ);
+}
+
+static inline u64 ktime_get_ns(void)		{ return sl_clock_ns; }
+static inline ktime_t ktime_get(void)		{ return (ktime_t) sl_clock_ns; }
+static inline s64 ktime_to_ns(ktime_t kt)	{ return kt; }
+static inline u64 local_clock(void)		{ return sl_clock_ns; }
+/* Real cycles, used only for instrumentation */
+cycles_t get_cycles(void);
+
+/* ----------------------- MEMORY ----------------------- */
+
+#define GFP_KERNEL		0x01U
+#define GFP_ATOMIC		0x02U
+#define __GFP_NOWARN		0x04U
+#define __GFP_RETRY_MAYFAIL	0x08U
+#define __GFP_ZERO		0x10U
+#define NUMA_NO_NODE		(-1)
+#define SLAB_HWCACHE_ALIGN	0x00002000UL
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void *kcalloc(size_t n, size_t size, gfp_t flags);
+void kfree(const void *p);
+#define kmalloc_node(s, f, n)		kmalloc(s, f)
+#define kzalloc_node(s, f, n)		kzalloc(s, f)
+#define kcalloc_node(n, s, f, nid)	kcalloc(n, s, f)
+void *kvmalloc_node(size_t size, gfp_t flags, int node);
+#define kvzalloc_node(s, f, n)		kvmalloc_node(s, (f) | __GFP_ZERO, n)
+#define kvmalloc(s, f)			kvmalloc_node(s, f, NUMA_NO_NODE)
+#define kvzalloc(s, f)			kvzalloc_node(s, f, NUMA_NO_NODE)
+#define kvcalloc(n, s, f)		kvzalloc((n) * (s), f)
+#define kvmalloc_array(n, s, f)		kvmalloc((n) * (s), f)
+void kvfree(const void *p);
+
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+				     unsigned int align, unsigned long flags,
+				     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *c);
+unsigned int kmem_cache_size(struct kmem_cache *c);
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags);
+#define kmem_cache_zalloc(c, f)		kmem_cache_alloc(c, (f) | __GFP_ZERO)
+#define kmem_cache_alloc_node(c, f, n)	kmem_cache_alloc(c, f)
+void kmem_cache_free(struct kmem_cache *c, void *p);
+void kmem_cache_free_bulk(struct kmem_cache *c, size_t nr, void **p);
+
+static inline void prefetch(const void *p)	{ __builtin_prefetch(p); }
+static inline void prefetchw(const void *p)	{ __builtin_prefetch(p, 1); }
+
+/* ----------------------- ATOMICS & LOCKS ----------------------- */
+
+typedef struct { int counter; } atomic_t;
+typedef struct { s64 counter; } atomic64_t;
+typedef struct { atomic_t refs; } refcount_t;
+typedef struct { int unused; } spinlock_t;
+
+#define atomic_read(v)		READ_ONCE((v)->counter)
+#define atomic_set(v, i)	WRITE_ONCE((v)->counter, (i))
+#define atomic_inc(v)		((void) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(v)		((void) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_inc_return(v)	__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic64_read(v)	READ_ONCE((v)->counter)
+#define atomic64_set(v, i)	WRITE_ONCE((v)->counter, (i))
+#define atomic64_add(i, v)	((void) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic64_add_return(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+static inline bool atomic64_try_cmpxchg(atomic64_t *v, s64 *old, s64 new)
+{
+	return __atomic_compare_exchange_n(&v->counter, old, new, false,
+					   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+static inline s64 atomic64_cmpxchg(atomic64_t *v, s64 old, s64 new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+#define refcount_set(r, n)	atomic_set(&(r)->refs, n)
+#define refcount_inc(r)		atomic_inc(&(r)->refs)
+#define refcount_dec_and_test(r) (__atomic_sub_fetch(&(r)->refs.counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+#define spin_lock_init(l)	((void) (l))
+#define spin_lock(l)		((void) (l))
+#define spin_unlock(l)		((void) (l))
+#define spin_lock_bh(l)		((void) (l))
+#define spin_unlock_bh(l)	((void) (l))
+#define local_bh_disable()	do { } while (0)
+#define local_bh_enable()	do { } while (0)
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define rcu_dereference(p)	(p)
+#define rcu_dereference_bh(p)	(p)
+#define __rcu
+#define rcu_assign_pointer(p, v) ((p) = (v))
+
+#define smp_processor_id()	0
+#define numa_node_id()		0
+#define cpu_to_node(c)		0
+#define this_cpu_ptr(p)		(p)
+#define per_cpu_ptr(p, c)	(p)
+#define for_each_possible_cpu(c) for ((c) = 0; (c) < 1; (c)++)
+#define alloc_percpu(t)		((t *) kzalloc(sizeof(t), GFP_KERNEL))
+#define free_percpu(p)		kfree(p)
+
+/* Work items are deferred until the qdisc call returns, see sl_run_work() */
+struct work_struct {
+	void			(*func)(struct work_struct *work);
+	struct work_struct	*sl_next;
+	bool			sl_pending;
+};
+#define INIT_WORK(w, f)		((w)->func = (f), (w)->sl_pending = false)
+bool schedule_work(struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+extern struct work_struct *sl_work_list;
+void sl_run_work(void);
+
+/* ----------------------- LISTS ----------------------- */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *l)
+{
+	l->next = l;
+	l->prev = l;
+}
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = n;
+	n->next = next;
+	n->prev = prev;
+	prev->next = n;
+}
+static inline void list_add(struct list_head *n, struct list_head *head)
+{
+	__list_add(n, head, head->next);
+}
+static inline void list_add_tail(struct list_head *n, struct list_head *head)
+{
+	__list_add(n, head->prev, head);
+}
+static inline void __list_del_entry(struct list_head *e)
+{
+	e->next->prev = e->prev;
+	e->prev->next = e->next;
+}
+static inline void list_del(struct list_head *e)
+{
+	__list_del_entry(e);
+	e->next = NULL;
+	e->prev = NULL;
+}
+static inline void list_del_init(struct list_head *e)
+{
+	__list_del_entry(e);
+	INIT_LIST_HEAD(e);
+}
+static inline void list_move_tail(struct list_head *e, struct list_head *head)
+{
+	__list_del_entry(e);
+	list_add_tail(e, head);
+}
+static inline int list_empty(const struct list_head *head)
+{
+	return READ_ONCE(head->next) == head;
+}
+
+#define list_entry(p, t, m)		container_of(p, t, m)
+#define list_first_entry(p, t, m)	list_entry((p)->next, t, m)
+#define list_last_entry(p, t, m)	list_entry((p)->prev, t, m)
+#define list_first_entry_or_null(p, t, m) \
+	(list_empty(p) ? NULL : list_first_entry(p, t, m))
+#define list_next_entry(pos, m)	list_entry((pos)->m.next, typeof(*(pos)), m)
+#define list_for_each_entry(pos, head, m)				\
+	for (pos = list_first_entry(head, typeof(*pos), m);		\
+	     &pos->m != (head); pos = list_next_entry(pos, m))
+#define list_for_each_entry_safe(pos, n, head, m)			\
+	for (pos = list_first_entry(head, typeof(*pos), m),		\
+	     n = list_next_entry(pos, m);				\
+	     &pos->m != (head); pos = n, n = list_next_entry(n, m))
+
+#define INIT_HLIST_HEAD(h)	((h)->first = NULL)
+#define INIT_HLIST_NODE(n)	((n)->next = NULL, (n)->pprev = NULL)
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+static inline void hlist_del(struct hlist_node *n)
+{
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->next = NULL;
+	n->pprev = NULL;
+}
+#define hlist_entry_safe(p, t, m) \
+	({ typeof(p) __p = (p); __p ? container_of(__p, t, m) : NULL; })
+#define hlist_for_each_entry(pos, head, m)				\
+	for (pos = hlist_entry_safe((head)->first, typeof(*(pos)), m);	\
+	     pos; pos = hlist_entry_safe((pos)->m.next, typeof(*(pos)), m))
+#define hlist_for_each_entry_safe(pos, n, head, m)			\
+	for (pos = hlist_entry_safe((head)->first, typeof(*pos), m);	\
+	     pos && ({ n = pos->m.next; 1; });				\
+	     pos = hlist_entry_safe(n, typeof(*pos), m))
+
+/* ----------------------- RB TREES ----------------------- */
+
+struct rb_node {
+	unsigned long	__rb_parent_color;
+	struct rb_node	*rb_right;
+	struct rb_node	*rb_left;
+} __aligned(sizeof(long));
+
+struct rb_root {
+	struct rb_node	*rb_node;
+};
+
+struct rb_root_cached {
+	struct rb_root	rb_root;
+	struct rb_node	*rb_leftmost;
+};
+
+#define RB_ROOT			(struct rb_root) { NULL, }
+#define RB_ROOT_CACHED		(struct rb_root_cached) { { NULL, }, NULL }
+#define rb_parent(r)		((struct rb_node *) ((r)->__rb_parent_color & ~3UL))
+#define rb_entry(p, t, m)	container_of(p, t, m)
+#define rb_entry_safe(ptr, type, member)				\
+	({ typeof(ptr) ____ptr = (ptr);					\
+	   ____ptr ? rb_entry(____ptr, type, member) : NULL; })
+#define RB_EMPTY_ROOT(root)	(READ_ONCE((root)->rb_node) == NULL)
+#define RB_EMPTY_NODE(node)	((node)->__rb_parent_color == (unsigned long) (node))
+#define RB_CLEAR_NODE(node)	((node)->__rb_parent_color = (unsigned long) (node))
+#define rb_first_cached(root)	(root)->rb_leftmost
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **rb_link)
+{
+	node->__rb_parent_color = (unsigned long) parent;
+	node->rb_left = node->rb_right = NULL;
+	*rb_link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_first_postorder(const struct rb_root *root);
+struct rb_node *rb_next_postorder(const struct rb_node *node);
+
+static inline void rb_insert_color_cached(struct rb_node *node,
+					  struct rb_root_cached *root,
+					  bool leftmost)
+{
+	if (leftmost)
+		root->rb_leftmost = node;
+	rb_insert_color(node, &root->rb_root);
+}
+static inline void rb_erase_cached(struct rb_node *node,
+				   struct rb_root_cached *root)
+{
+	if (root->rb_leftmost == node)
+		root->rb_leftmost = rb_next(node);
+	rb_erase(node, &root->rb_root);
+}
+
+#define rbtree_postorder_for_each_entry_safe(pos, n, root, field)	\
+	for (pos = rb_entry_safe(rb_first_postorder(root), typeof(*pos), field); \
+	     pos && ({ n = rb_entry_safe(rb_next_postorder(&pos->field), \
+			typeof(*pos), field); 1; });			\
+	     pos = n)
+
+/* ----------------------- PACKETS ----------------------- */
+
+#define ETH_P_IP	0x0800
+#define ETH_P_IPV6	0x86DD
+#define IPPROTO_TCP	6
+#define IPPROTO_UDP	17
+
+#define INET_ECN_NOT_ECT	0
+#define INET_ECN_ECT_1		1
+#define INET_ECN_ECT_0		2
+#define INET_ECN_CE		3
+#define INET_ECN_MASK		3
+
+struct iphdr {
+	u8	tos;
+	u8	protocol;
+	__be32	saddr;
+	__be32	daddr;
+};
+struct ipv6hdr {
+	u8	dsfield;
+	u8	nexthdr;
+};
+struct tcphdr {
+	__be16	source;
+	__be16	dest;
+};
+struct udphdr {
+	__be16	source;
+	__be16	dest;
+};
+
+struct sock {
+	u32		sk_hash;
+	u32		sk_txhash;
+	u32		sk_priority;
+	u32		sk_mark;
+	unsigned char	sk_state;
+	int		sk_pacing_status;
+	unsigned long	sk_pacing_rate;
+	unsigned long	sk_max_pacing_rate;
+};
+#define TCP_TIME_WAIT		6
+#define TCP_NEW_SYN_RECV	12
+#define SK_PACING_FQ		2
+static inline bool sk_fullsock(const struct sock *sk)
+{
+	return sk->sk_state != TCP_TIME_WAIT && sk->sk_state != TCP_NEW_SYN_RECV;
+}
+
+struct skb_shared_info {
+	unsigned short	gso_size;
+	unsigned short	gso_segs;
+	unsigned int	gso_type;
+};
+
+struct net_device;
+
+/*
+ * The packet. Instead of packet data, we carry a parsed IPv4 or IPv6
+ * header, enough for ECN marking and UDP detection. sl_flow and
+ * sl_tstamp belong to the caller, the modules never look at them.
+ */
+struct sk_buff {
+	union {
+		struct {
+			struct sk_buff		*next;
+			struct sk_buff		*prev;
+			struct net_device	*dev;
+		};
+		struct rb_node		rbnode;
+		struct list_head	list;
+	};
+	struct sock		*sk;
+	ktime_t			tstamp;
+	u8			mono_delivery_time;	/* tstamp is EDT */
+	char			cb[48] __aligned(8);
+	unsigned int		len;
+	unsigned int		data_len;
+	u32			priority;
+	u32			mark;
+	u32			hash;
+	__be16			protocol;
+	u16			queue_mapping;
+	struct skb_shared_info	shinfo;
+	union {
+		struct iphdr	iph;
+		struct ipv6hdr	ip6h;
+	};
+	union {
+		struct tcphdr	th;
+		struct udphdr	uh;
+	};
+	u8			l4proto;
+	/* Owned by the caller */
+	u32			sl_flow;
+	u64			sl_tstamp;
+	/* Set by skb_gso_segment(), segments after this one */
+	u16			sl_segs_left;
+};
+
+static inline struct skb_shared_info *skb_shinfo(const struct sk_buff *skb)
+{
+	return (struct skb_shared_info *) &skb->shinfo;
+}
+static inline bool skb_is_gso(const struct sk_buff *skb)
+{
+	return skb->shinfo.gso_size != 0;
+}
+static inline u32 skb_get_hash(struct sk_buff *skb)
+{
+	return skb->hash;
+}
+/* Not siphash, but like the kernel, independent of skb->hash and
+ * computed from the headers only. */
+static inline u32 skb_get_hash_perturb(const struct sk_buff *skb,
+				       const siphash_key_t *perturb)
+{
+	u64 v = perturb->key[0];
+
+	if (skb->protocol == htons(ETH_P_IP))
+		v ^= ((u64) skb->iph.saddr << 32) | skb->iph.daddr;
+	v = (v ^ (v >> 31)) * 0x7FB5D329728EA185ULL;
+	v ^= perturb->key[1] ^ ((u64) skb->th.source << 24)
+		^ ((u64) skb->th.dest << 8) ^ skb->l4proto;
+	v = (v ^ (v >> 27)) * 0x81DADEF4BC2DD44DULL;
+	return (u32) (v ^ (v >> 33));
+}
+static inline void skb_mark_not_on_list(struct sk_buff *skb)
+{
+	skb->next = NULL;
+}
+static inline u16 skb_get_queue_mapping(const struct sk_buff *skb)
+{
+	return skb->queue_mapping;
+}
+static inline __be16 skb_protocol(const struct sk_buff *skb, bool skip_vlan)
+{
+	(void) skip_vlan;
+	return skb->protocol;
+}
+static inline unsigned char *skb_network_header(const struct sk_buff *skb)
+{
+	return (unsigned char *) &skb->iph;
+}
+/* The network header is followed by the transport header */
+static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb)
+{
+	return (unsigned char *) &skb->th + sizeof(skb->th) + 64;
+}
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb)
+{
+	return (struct iphdr *) &skb->iph;
+}
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb)
+{
+	return (struct ipv6hdr *) &skb->ip6h;
+}
+static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb)
+{
+	return (struct tcphdr *) &skb->th;
+}
+static inline struct udphdr *udp_hdr(const struct sk_buff *skb)
+{
+	return (struct udphdr *) &skb->uh;
+}
+static inline u8 ipv4_get_dsfield(const struct iphdr *iph)
+{
+	return iph->tos;
+}
+static inline u8 ipv6_get_dsfield(const struct ipv6hdr *ip6h)
+{
+	return ip6h->dsfield;
+}
+static inline int skb_try_make_writable(struct sk_buff *skb,
+					unsigned int len)
+{
+	(void) skb;
+	(void) len;
+	return 0;
+}
+static inline u8 *sl_skb_dsfield(struct sk_buff *skb)
+{
+	return skb->protocol == cpu_to_be16(ETH_P_IPV6) ?
+		&skb->ip6h.dsfield : &skb->iph.tos;
+}
+static inline int INET_ECN_is_ce(u8 dsfield)
+{
+	return (dsfield & INET_ECN_MASK) == INET_ECN_CE;
+}
+static inline int INET_ECN_set_ce(struct sk_buff *skb)
+{
+	u8 *ds = sl_skb_dsfield(skb);
+
+	if ((*ds & INET_ECN_MASK) == INET_ECN_NOT_ECT)
+		return 0;
+	*ds |= INET_ECN_CE;
+	return 1;
+}
+static inline int INET_ECN_set_ect1(struct sk_buff *skb)
+{
+	u8 *ds = sl_skb_dsfield(skb);
+
+	if ((*ds & INET_ECN_MASK) != INET_ECN_ECT_0)
+		return 0;
+	*ds = (*ds & ~INET_ECN_MASK) | INET_ECN_ECT_1;
+	return 1;
+}
+
+/* Freeing skbs goes through the caller, see sl_skb_free_hook */
+void kfree_skb(struct sk_buff *skb);
+void consume_skb(struct sk_buff *skb);
+void kfree_skb_list(struct sk_buff *skb);
+
+/* Segmentation, in the library the length of a GSO skb is its wire
+ * length, so every segment carries its share of the headers. */
+typedef u64 netdev_features_t;
+#define NETIF_F_GSO_MASK	0x00000000FFFF0000ULL
+static inline netdev_features_t netif_skb_features(struct sk_buff *skb)
+{
+	(void) skb;
+	return 0;
+}
+struct sk_buff *skb_gso_segment(struct sk_buff *skb,
+				netdev_features_t features);
+#define skb_list_walk_safe(first, skb, next_skb)			\
+	for ((skb) = (first), (next_skb) = (skb) ? (skb)->next : NULL;	\
+	     (skb);							\
+	     (skb) = (next_skb), (next_skb) = (skb) ? (skb)->next : NULL)
+
+/* ----------------------- PTR RING ----------------------- */
+
+/* Single threaded, no producer/consumer cache lines split */
+struct ptr_ring {
+	int		producer;
+	int		consumer_head;
+	int		size;
+	void		**queue;
+};
+
+struct skb_array {
+	struct ptr_ring	ring;
+};
+
+int ptr_ring_init(struct ptr_ring *r, int size, gfp_t gfp);
+void ptr_ring_cleanup(struct ptr_ring *r, void (*destroy)(void *));
+static inline int __ptr_ring_produce(struct ptr_ring *r, void *ptr)
+{
+	if (unlikely(!r->size) || r->queue[r->producer])
+		return -ENOSPC;
+	r->queue[r->producer++] = ptr;
+	if (unlikely(r->producer >= r->size))
+		r->producer = 0;
+	return 0;
+}
+static inline void *__ptr_ring_peek(struct ptr_ring *r)
+{
+	return likely(r->size) ? r->queue[r->consumer_head] : NULL;
+}
+static inline bool __ptr_ring_empty(struct ptr_ring *r)
+{
+	return __ptr_ring_peek(r) == NULL;
+}
+static inline void *__ptr_ring_consume(struct ptr_ring *r)
+{
+	void *ptr = __ptr_ring_peek(r);
+
+	if (ptr) {
+		r->queue[r->consumer_head++] = NULL;
+		if (unlikely(r->consumer_head >= r->size))
+			r->consumer_head = 0;
+	}
+	return ptr;
+}
+#define ptr_ring_produce(r, p)	__ptr_ring_produce(r, p)
+#define ptr_ring_consume(r)	__ptr_ring_consume(r)
+#define ptr_ring_peek(r)	__ptr_ring_peek(r)
+#define ptr_ring_empty(r)	__ptr_ring_empty(r)
+
+static inline int skb_array_init(struct skb_array *a, int size, gfp_t gfp)
+{
+	return ptr_ring_init(&a->ring, size, gfp);
+}
+void skb_array_cleanup(struct skb_array *a);
+#define skb_array_produce(a, skb)	__ptr_ring_produce(&(a)->ring, skb)
+#define __skb_array_consume(a)		((struct sk_buff *) __ptr_ring_consume(&(a)->ring))
+#define skb_array_consume(a)		__skb_array_consume(a)
+#define __skb_array_peek(a)		((struct sk_buff *) __ptr_ring_peek(&(a)->ring))
+#define skb_array_peek(a)		__skb_array_peek(a)
+#define __skb_array_empty(a)		__ptr_ring_empty(&(a)->ring)
+#define skb_array_empty(a)		__skb_array_empty(a)
+
+/* ----------------------- NETLINK ----------------------- */
+
+/* Same layout as the real netlink attributes */
+struct nlattr {
+	u16	nla_len;
+	u16	nla_type;
+};
+#define NLA_ALIGNTO		4
+#define NLA_ALIGN(len)		(((len) + NLA_ALIGNTO - 1) & ~(NLA_ALIGNTO - 1))
+#define NLA_HDRLEN		((int) NLA_ALIGN(sizeof(struct nlattr)))
+
+enum {
+	NLA_UNSPEC, NLA_U8, NLA_U16, NLA_U32, NLA_U64, NLA_STRING, NLA_FLAG,
+	NLA_MSECS, NLA_NESTED, NLA_NESTED_ARRAY, NLA_NUL_STRING, NLA_BINARY,
+	NLA_S8, NLA_S16, NLA_S32, NLA_S64, NLA_BITFIELD32, NLA_REJECT,
+};
+
+struct nla_policy {
+	u8	type;
+	u8	validation_type;
+	u16	len;
+	u16	strict_start_type;
+	s64	min, max;
+};
+#define NLA_POLICY_MIN(tp, v)		{ .type = tp, .min = v }
+#define NLA_POLICY_MAX(tp, v)		{ .type = tp, .max = v }
+#define NLA_POLICY_RANGE(tp, a, b)	{ .type = tp, .min = a, .max = b }
+
+struct netlink_ext_ack {
+	const char	*_msg;
+};
+#define NL_SET_ERR_MSG(e, m)		do { if (e) (e)->_msg = (m); } while (0)
+#define NL_SET_ERR_MSG_MOD(e, m)	NL_SET_ERR_MSG(e, m)
+#define NL_SET_ERR_MSG_ATTR(e, a, m)	NL_SET_ERR_MSG(e, m)
+
+static inline void *nla_data(const struct nlattr *nla)
+{
+	return (char *) nla + NLA_HDRLEN;
+}
+static inline int nla_len(const struct nlattr *nla)
+{
+	return nla->nla_len - NLA_HDRLEN;
+}
+static inline int nla_type(const struct nlattr *nla)
+{
+	return nla->nla_type & 0x3FFF;
+}
+static inline u32 nla_get_u32(const struct nlattr *nla)
+{
+	return *(u32 *) nla_data(nla);
+}
+static inline s32 nla_get_s32(const struct nlattr *nla)
+{
+	return *(s32 *) nla_data(nla);
+}
+static inline u16 nla_get_u16(const struct nlattr *nla)
+{
+	return *(u16 *) nla_data(nla);
+}
+static inline u8 nla_get_u8(const struct nlattr *nla)
+{
+	return *(u8 *) nla_data(nla);
+}
+static inline u64 nla_get_u64(const struct nlattr *nla)
+{
+	u64 val;
+
+	memcpy(&val, nla_data(nla), sizeof(val));
+	return val;
+}
+static inline int nla_memcpy(void *dest, const struct nlattr *src, int count)
+{
+	int minlen = min_t(int, count, nla_len(src));
+
+	memcpy(dest, nla_data(src), minlen);
+	if (count > minlen)
+		memset((char *) dest + minlen, 0, count - minlen);
+	return minlen;
+}
+
+int nla_parse_nested_deprecated(struct nlattr **tb, int maxtype,
+				const struct nlattr *nla,
+				const struct nla_policy *policy,
+				struct netlink_ext_ack *extack);
+#define nla_parse_nested(tb, m, nla, p, e) \
+	nla_parse_nested_deprecated(tb, m, nla, p, e)
+
+/* Dump goes into the sk_buff given to dump(), see sl_qdisc_dump() */
+int nla_put(struct sk_buff *skb, int type, int len, const void *data);
+static inline int nla_put_u32(struct sk_buff *skb, int type, u32 val)
+{
+	return nla_put(skb, type, sizeof(val), &val);
+}
+static inline int nla_put_s32(struct sk_buff *skb, int type, s32 val)
+{
+	return nla_put(skb, type, sizeof(val), &val);
+}
+static inline int nla_put_u16(struct sk_buff *skb, int type, u16 val)
+{
+	return nla_put(skb, type, sizeof(val), &val);
+}
+static inline int nla_put_u8(struct sk_buff *skb, int type, u8 val)
+{
+	return nla_put(skb, type, sizeof(val), &val);
+}
+static inline int nla_put_u64_64bit(struct sk_buff *skb, int type, u64 val,
+				    int pad)
+{
+	(void) pad;
+	return nla_put(skb, type, sizeof(val), &val);
+}
+struct nlattr *nla_nest_start_noflag(struct sk_buff *skb, int type);
+#define nla_nest_start(skb, type)	nla_nest_start_noflag(skb, type)
+int nla_nest_end(struct sk_buff *skb, struct nlattr *start);
+void nla_nest_cancel(struct sk_buff *skb, struct nlattr *start);
+
+/* ----------------------- QDISC ----------------------- */
+
+#define TCA_OPTIONS		2
+#define TC_H_ROOT		0xFFFFFFFFU
+#define TC_H_INGRESS		0xFFFFFFF1U
+#define TC_H_UNSPEC		0U
+#define TC_H_MAJ_MASK		0xFFFF0000U
+#define TC_H_MIN_MASK		0x0000FFFFU
+#define TC_H_MAJ(h)		((h) & TC_H_MAJ_MASK)
+#define TC_H_MIN(h)		((h) & TC_H_MIN_MASK)
+#define TC_H_MAKE(maj, min)	(((maj) & TC_H_MAJ_MASK) | ((min) & TC_H_MIN_MASK))
+
+#define NET_XMIT_SUCCESS	0x00
+#define NET_XMIT_DROP		0x01
+#define NET_XMIT_CN		0x02
+#define NET_XMIT_MASK		0x0F
+#define net_xmit_drop_count(e)	((e) & __NET_XMIT_STOLEN ? 0 : 1)
+#define __NET_XMIT_STOLEN	0x00010000
+#define __NET_XMIT_BYPASS	0x00020000
+
+#define TCQ_F_BUILTIN		1
+#define TCQ_F_INGRESS		2
+#define TCQ_F_CAN_BYPASS	4
+#define TCQ_F_MQROOT		8
+#define TCQ_F_ONETXQUEUE	0x10
+#define TCQ_F_WARN_NONWC	(1 << 16)
+#define TCQ_F_CPUSTATS		0x20
+#define TCQ_F_NOPARENT		0x40
+#define TCQ_F_INVISIBLE		0x80
+#define TCQ_F_NOLOCK		0x100
+#define TCQ_F_OFFLOADED		0x200
+
+#define IFF_UP			0x1
+
+struct tcmsg {
+	unsigned char	tcm_family;
+	int		tcm_ifindex;
+	u32		tcm_handle;
+	u32		tcm_parent;
+	u32		tcm_info;
+};
+
+struct gnet_stats_basic_sync {
+	u64	bytes;
+	u64	packets;
+};
+/* No u64_stats_t, the counters are plain u64 */
+static inline u64 u64_stats_read(const u64 *p)
+{
+	return *p;
+}
+struct gnet_stats_queue {
+	u32	qlen;
+	u32	backlog;
+	u32	drops;
+	u32	requeues;
+	u32	overlimits;
+};
+
+/* Where dump_stats() copies its xstats, see sl_qdisc_xstats() */
+struct gnet_dump {
+	void	*xstats;
+	int	xstats_len;
+	int	xstats_copied;
+};
+
+struct qdisc_skb_head {
+	struct sk_buff	*head;
+	struct sk_buff	*tail;
+	u32		qlen;
+	spinlock_t	lock;
+};
+
+struct netdev_queue;
+struct Qdisc_ops;
+struct Qdisc_class_ops;
+struct qdisc_walker;
+struct tcf_block;
+struct module;
+
+struct Qdisc {
+	int			(*enqueue)(struct sk_buff *skb,
+					   struct Qdisc *sch,
+					   struct sk_buff **to_free);
+	struct sk_buff *	(*dequeue)(struct Qdisc *sch);
+	unsigned int		flags;
+	u32			limit;
+	const struct Qdisc_ops	*ops;
+	u32			handle;
+	u32			parent;
+	struct netdev_queue	*dev_queue;
+	struct gnet_stats_basic_sync bstats;
+	struct gnet_stats_basic_sync __percpu *cpu_bstats;
+	struct gnet_stats_queue	qstats;
+	struct gnet_stats_queue	__percpu *cpu_qstats;
+	struct qdisc_skb_head	q;
+	struct sk_buff		*gso_skb;	/* Peeked packet, one at most */
+	refcount_t		refcnt;
+	struct list_head	sl_list;	/* For qdisc_lookup() */
+	long			privdata[] ____cacheline_aligned;
+};
+
+struct qdisc_walker {
+	int	stop;
+	int	skip;
+	int	count;
+	int	(*fn)(struct Qdisc *, unsigned long cl, struct qdisc_walker *);
+};
+
+struct Qdisc_class_ops {
+	unsigned int		flags;
+	struct netdev_queue *	(*select_queue)(struct Qdisc *, struct tcmsg *);
+	int			(*graft)(struct Qdisc *, unsigned long cl,
+					 struct Qdisc *, struct Qdisc **,
+					 struct netlink_ext_ack *extack);
+	struct Qdisc *		(*leaf)(struct Qdisc *, unsigned long cl);
+	void			(*qlen_notify)(struct Qdisc *, unsigned long);
+	unsigned long		(*find)(struct Qdisc *, u32 classid);
+	int			(*change)(struct Qdisc *, u32, u32,
+					  struct nlattr **, unsigned long *,
+					  struct netlink_ext_ack *);
+	int			(*delete)(struct Qdisc *, unsigned long,
+					  struct netlink_ext_ack *);
+	void			(*walk)(struct Qdisc *, struct qdisc_walker *arg);
+	struct tcf_block *	(*tcf_block)(struct Qdisc *sch, unsigned long arg,
+					     struct netlink_ext_ack *extack);
+	unsigned long		(*bind_tcf)(struct Qdisc *, unsigned long,
+					    u32 classid);
+	void			(*unbind_tcf)(struct Qdisc *, unsigned long);
+	int			(*dump)(struct Qdisc *, unsigned long,
+					struct sk_buff *skb, struct tcmsg *);
+	int			(*dump_stats)(struct Qdisc *, unsigned long,
+					      struct gnet_dump *);
+};
+
+struct Qdisc_ops {
+	struct Qdisc_ops	*next;
+	const struct Qdisc_class_ops *cl_ops;
+	char			id[16];
+	int			priv_size;
+	unsigned int		static_flags;
+	int			(*enqueue)(struct sk_buff *skb,
+					   struct Qdisc *sch,
+					   struct sk_buff **to_free);
+	struct sk_buff *	(*dequeue)(struct Qdisc *);
+	struct sk_buff *	(*peek)(struct Qdisc *);
+	int			(*init)(struct Qdisc *sch, struct nlattr *arg,
+					struct netlink_ext_ack *extack);
+	void			(*reset)(struct Qdisc *);
+	void			(*destroy)(struct Qdisc *);
+	int			(*change)(struct Qdisc *sch,
+					  struct nlattr *arg,
+					  struct netlink_ext_ack *extack);
+	void			(*attach)(struct Qdisc *sch);
+	int			(*change_tx_queue_len)(struct Qdisc *, unsigned int);
+	void			(*change_real_num_tx)(struct Qdisc *sch,
+						      unsigned int new_real_tx);
+	int			(*dump)(struct Qdisc *, struct sk_buff *);
+	int			(*dump_stats)(struct Qdisc *, struct gnet_dump *);
+	struct module		*owner;
+};
+
+struct qdisc_skb_cb {
+	struct {
+		unsigned int	pkt_len;
+		u16		slave_dev_queue_mapping;
+		u16		tc_classid;
+	};
+#define QDISC_CB_PRIV_LEN 20
+	unsigned char		data[QDISC_CB_PRIV_LEN];
+};
+
+static inline struct qdisc_skb_cb *qdisc_skb_cb(const struct sk_buff *skb)
+{
+	return (struct qdisc_skb_cb *) skb->cb;
+}
+#define qdisc_cb_private_validate(skb, sz) \
+	BUILD_BUG_ON((sz) > QDISC_CB_PRIV_LEN)
+static inline void *qdisc_priv(struct Qdisc *q)
+{
+	return &q->privdata;
+}
+static inline unsigned int qdisc_pkt_len(const struct sk_buff *skb)
+{
+	return qdisc_skb_cb(skb)->pkt_len;
+}
+static inline u32 qdisc_qlen(const struct Qdisc *q)
+{
+	return q->q.qlen;
+}
+static inline u32 qdisc_qlen_sum(const struct Qdisc *q)
+{
+	return q->q.qlen;
+}
+static inline void qdisc_qstats_backlog_inc(struct Qdisc *sch,
+					    const struct sk_buff *skb)
+{
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+}
+static inline void qdisc_qstats_backlog_dec(struct Qdisc *sch,
+					    const struct sk_buff *skb)
+{
+	sch->qstats.backlog -= qdisc_pkt_len(skb);
+}
+static inline void qdisc_qstats_drop(struct Qdisc *sch)
+{
+	sch->qstats.drops++;
+}
+static inline void qdisc_qstats_overlimit(struct Qdisc *sch)
+{
+	sch->qstats.overlimits++;
+}
+static inline void bstats_update(struct gnet_stats_basic_sync *bstats,
+				 const struct sk_buff *skb)
+{
+	bstats->bytes += qdisc_pkt_len(skb);
+	bstats->packets += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+}
+static inline void qdisc_bstats_update(struct Qdisc *sch,
+				       const struct sk_buff *skb)
+{
+	sch->bstats.bytes += qdisc_pkt_len(skb);
+	sch->bstats.packets += skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+}
+static inline void __qdisc_drop(struct sk_buff *skb, struct sk_buff **to_free)
+{
+	skb->next = *to_free;
+	*to_free = skb;
+}
+static inline int qdisc_drop(struct sk_buff *skb, struct Qdisc *sch,
+			     struct sk_buff **to_free)
+{
+	__qdisc_drop(skb, to_free);
+	qdisc_qstats_drop(sch);
+	return NET_XMIT_DROP;
+}
+/* Tail may be stale when head is NULL, like the kernel */
+static inline void rtnl_kfree_skbs(struct sk_buff *head, struct sk_buff *tail)
+{
+	if (head && tail) {
+		tail->next = NULL;
+		kfree_skb_list(head);
+	}
+}
+static inline void rtnl_qdisc_drop(struct sk_buff *skb, struct Qdisc *sch)
+{
+	rtnl_kfree_skbs(skb, skb);
+	qdisc_qstats_drop(sch);
+}
+
+/* Single queue FIFO helpers, used by the fallback of some modules */
+int qdisc_enqueue_tail(struct sk_buff *skb, struct Qdisc *sch);
+struct sk_buff *__qdisc_dequeue_head(struct qdisc_skb_head *qh);
+struct sk_buff *qdisc_dequeue_head(struct Qdisc *sch);
+struct sk_buff *qdisc_peek_head(struct Qdisc *sch);
+struct sk_buff *qdisc_peek_dequeued(struct Qdisc *sch);
+struct sk_buff *qdisc_dequeue_peeked(struct Qdisc *sch);
+void qdisc_reset_queue(struct Qdisc *sch);
+
+/* Leaves of classful qdiscs */
+static inline int qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+				struct sk_buff **to_free)
+{
+	return sch->enqueue(skb, sch, to_free);
+}
+void qdisc_reset(struct Qdisc *sch);
+void qdisc_purge_queue(struct Qdisc *sch);
+struct Qdisc *qdisc_replace(struct Qdisc *sch, struct Qdisc *new,
+			    struct Qdisc **pold);
+void qdisc_warn_nonwc(const char *txt, struct Qdisc *qdisc);
+extern struct Qdisc noop_qdisc;
+
+/* Watchdogs only remember when they are due, there is no timer. The
+ * caller waits for sl_watchdog_next() and calls sl_watchdog_expire(),
+ * then dequeues again, like the qdisc being rescheduled. */
+struct qdisc_watchdog {
+	u64			last_expires;
+	struct Qdisc		*qdisc;
+	struct qdisc_watchdog	*sl_next;
+	bool			sl_armed;
+};
+void qdisc_watchdog_init(struct qdisc_watchdog *wd, struct Qdisc *qdisc);
+void qdisc_watchdog_schedule_range_ns(struct qdisc_watchdog *wd, u64 expires,
+				      u64 delta_ns);
+static inline void qdisc_watchdog_schedule_ns(struct qdisc_watchdog *wd,
+					      u64 expires)
+{
+	qdisc_watchdog_schedule_range_ns(wd, expires, 0ULL);
+}
+void qdisc_watchdog_cancel(struct qdisc_watchdog *wd);
+u64 sl_watchdog_next(void);
+void sl_watchdog_expire(u64 now_ns);
+
+/* Parents are found by handle, like the kernel */
+struct Qdisc *qdisc_lookup(struct net_device *dev, u32 handle);
+void qdisc_tree_reduce_backlog(struct Qdisc *sch, int n, int len);
+static inline void sch_tree_lock(struct Qdisc *sch)	{ (void) sch; }
+static inline void sch_tree_unlock(struct Qdisc *sch)	{ (void) sch; }
+spinlock_t *qdisc_lock(struct Qdisc *sch);
+#define qdisc_root_sleeping_lock(sch)	qdisc_lock((struct Qdisc *) (sch))
+
+/* One device with a single TX queue */
+#define IFNAMSIZ		16
+struct net_device {
+	char		name[IFNAMSIZ];
+	int		ifindex;
+	unsigned int	num_tx_queues;
+	unsigned int	real_num_tx_queues;
+	unsigned int	flags;
+	unsigned int	mtu;
+	unsigned int	tx_queue_len;
+};
+struct netdev_queue {
+	struct Qdisc		*qdisc_sleeping;
+	struct net_device	*dev;
+};
+struct net_device *qdisc_dev(const struct Qdisc *sch);
+static inline int netdev_queue_numa_node_read(const struct netdev_queue *q)
+{
+	(void) q;
+	return NUMA_NO_NODE;
+}
+struct netdev_queue *netdev_get_tx_queue(const struct net_device *dev,
+					 unsigned int index);
+static inline bool netif_is_multiqueue(const struct net_device *dev)
+{
+	return dev->num_tx_queues > 1;
+}
+static inline u32 psched_mtu(const struct net_device *dev)
+{
+	return dev->mtu + 14;
+}
+struct Qdisc *sl_qdisc_alloc(const struct Qdisc_ops *ops,
+			     struct netdev_queue *dev_queue, u32 parentid,
+			     struct nlattr *opt, struct netlink_ext_ack *extack,
+			     int *errp);
+struct Qdisc *qdisc_create_dflt(struct netdev_queue *dev_queue,
+				const struct Qdisc_ops *ops, u32 parentid,
+				struct netlink_ext_ack *extack);
+void qdisc_put(struct Qdisc *sch);
+struct Qdisc *dev_graft_qdisc(struct netdev_queue *dev_queue,
+			      struct Qdisc *qdisc);
+static inline void qdisc_hash_add(struct Qdisc *q, bool invisible)
+{
+	(void) q;
+	(void) invisible;
+}
+static inline void dev_activate(struct net_device *dev)	{ (void) dev; }
+static inline void dev_deactivate(struct net_device *dev)	{ (void) dev; }
+
+static inline void gnet_stats_basic_sync_init(struct gnet_stats_basic_sync *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+void gnet_stats_add_basic(struct gnet_stats_basic_sync *bstats,
+			  struct gnet_stats_basic_sync __percpu *cpu,
+			  struct gnet_stats_basic_sync *b, bool running);
+void gnet_stats_add_queue(struct gnet_stats_queue *qstats,
+			  const struct gnet_stats_queue __percpu *cpu_q,
+			  const struct gnet_stats_queue *q);
+static inline int gnet_stats_copy_basic(struct gnet_dump *d,
+					struct gnet_stats_basic_sync __percpu *cpu,
+					struct gnet_stats_basic_sync *b,
+					bool running)
+{
+	(void) d; (void) cpu; (void) b; (void) running;
+	return 0;
+}
+static inline int gnet_stats_copy_queue(struct gnet_dump *d,
+					struct gnet_stats_queue __percpu *cpu_q,
+					struct gnet_stats_queue *q, u32 qlen)
+{
+	(void) d; (void) cpu_q; (void) q; (void) qlen;
+	return 0;
+}
+static inline int qdisc_qstats_copy(struct gnet_dump *d, struct Qdisc *sch)
+{
+	(void) d; (void) sch;
+	return 0;
+}
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len);
+
+int register_qdisc(struct Qdisc_ops *qops);
+void unregister_qdisc(struct Qdisc_ops *qops);
+
+/* Class hash of classful qdiscs, include/net/sch_generic.h */
+struct Qdisc_class_common {
+	u32			classid;
+	struct hlist_node	hnode;
+};
+struct Qdisc_class_hash {
+	struct hlist_head	*hash;
+	unsigned int		hashsize;
+	unsigned int		hashmask;
+	unsigned int		hashelems;
+};
+static inline struct Qdisc_class_common *
+qdisc_class_find(const struct Qdisc_class_hash *hash, u32 id)
+{
+	struct Qdisc_class_common *cl;
+
+	if (!hash->hashsize)
+		return NULL;
+	hlist_for_each_entry(cl, &hash->hash[id & hash->hashmask], hnode)
+		if (cl->classid == id)
+			return cl;
+	return NULL;
+}
+int qdisc_class_hash_init(struct Qdisc_class_hash *clhash);
+void qdisc_class_hash_insert(struct Qdisc_class_hash *clhash,
+			     struct Qdisc_class_common *cl);
+void qdisc_class_hash_remove(struct Qdisc_class_hash *clhash,
+			     struct Qdisc_class_common *cl);
+void qdisc_class_hash_grow(struct Qdisc *sch, struct Qdisc_class_hash *clhash);
+void qdisc_class_hash_destroy(struct Qdisc_class_hash *clhash);
+
+/* There are no tc filters, classification is by skb->priority. */
+#define TC_ACT_UNSPEC		(-1)
+#define TC_ACT_OK		0
+#define TC_ACT_SHOT		2
+#define TC_ACT_STOLEN		4
+#define TC_ACT_QUEUED		5
+#define TC_ACT_TRAP		8
+
+struct tcf_proto;
+struct tcf_result {
+	unsigned long	class;
+	u32		classid;
+};
+static inline int tcf_block_get(struct tcf_block **p_block,
+				struct tcf_proto **p_filter_chain,
+				struct Qdisc *q, struct netlink_ext_ack *extack)
+{
+	(void) q; (void) extack;
+	*p_block = NULL;
+	*p_filter_chain = NULL;
+	return 0;
+}
+static inline void tcf_block_put(struct tcf_block *block)	{ (void) block; }
+static inline int tcf_classify(struct sk_buff *skb,
+			       const struct tcf_block *block,
+			       const struct tcf_proto *tp,
+			       struct tcf_result *res, bool compat_mode)
+{
+	(void) skb; (void) block; (void) tp; (void) res; (void) compat_mode;
+	return TC_ACT_UNSPEC;
+}
+
+/* ----------------------- RELAY & DEBUGFS ----------------------- */
+
+/* There is no debugfs, directories and files are only tokens. Relay
+ * keeps a single buffer, not one per CPU, with the kernel sub-buffer
+ * switching, so that lost records are accounted the same way. Nobody
+ * consumes, use sl_relay_consume() to play the reader. */
+typedef unsigned short umode_t;
+struct dentry {
+	struct dentry	*parent;
+	void		*data;
+};
+struct file_operations {
+	int		sl_unused;
+};
+extern const struct file_operations relay_file_operations;
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, umode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops);
+void debugfs_remove(struct dentry *dentry);
+#define debugfs_remove_recursive(d)	debugfs_remove(d)
+
+struct rchan;
+struct rchan_buf {
+	struct rchan	*chan;
+	void		*start;			/* All sub-buffers */
+	void		*data;			/* Current sub-buffer */
+	size_t		offset;			/* In the current sub-buffer */
+	size_t		subbufs_produced;
+	size_t		subbufs_consumed;
+	struct dentry	*dentry;
+};
+struct rchan_callbacks {
+	int (*subbuf_start)(struct rchan_buf *buf, void *subbuf,
+			    void *prev_subbuf, size_t prev_padding);
+	struct dentry *(*create_buf_file)(const char *filename,
+					  struct dentry *parent, umode_t mode,
+					  struct rchan_buf *buf, int *is_global);
+	int (*remove_buf_file)(struct dentry *dentry);
+};
+struct rchan {
+	size_t				subbuf_size;
+	size_t				n_subbufs;
+	const struct rchan_callbacks	*cb;
+	void				*private_data;
+	struct rchan_buf		*buf;
+};
+
+struct rchan *relay_open(const char *base_filename, struct dentry *parent,
+			 size_t subbuf_size, size_t n_subbufs,
+			 const struct rchan_callbacks *cb, void *private_data);
+void relay_close(struct rchan *chan);
+size_t relay_switch_subbuf(struct rchan_buf *buf, size_t length);
+static inline int relay_buf_full(struct rchan_buf *buf)
+{
+	return (buf->subbufs_produced - buf->subbufs_consumed)
+		== buf->chan->n_subbufs;
+}
+static inline void relay_write(struct rchan *chan, const void *data,
+			       size_t length)
+{
+	struct rchan_buf *buf = chan->buf;
+
+	if (buf->offset + length > chan->subbuf_size) {
+		length = relay_switch_subbuf(buf, length);
+		if (!length)
+			return;
+	}
+	memcpy((char *) buf->data + buf->offset, data, length);
+	buf->offset += length;
+}
+/* Mark all full sub-buffers as read */
+void sl_relay_consume(struct rchan *chan);
+
+/* ----------------------- UAPI ----------------------- */
+
+/* include/uapi/linux/pkt_sched.h, used by sch_bfifo_head.c */
+struct tc_fifo_qopt {
+	__u32	limit;	/* Queue length: bytes for bfifo, packets for pfifo */
+};
+
+/* include/uapi/linux/pkt_sched.h, used by sch_fq_drr.c */
+enum {
+	TCA_FQ_UNSPEC,
+	TCA_FQ_PLIMIT,
+	TCA_FQ_FLOW_PLIMIT,
+	TCA_FQ_QUANTUM,
+	TCA_FQ_INITIAL_QUANTUM,
+	TCA_FQ_RATE_ENABLE,
+	TCA_FQ_FLOW_DEFAULT_RATE,
+	TCA_FQ_FLOW_MAX_RATE,
+	TCA_FQ_BUCKETS_LOG,
+	TCA_FQ_FLOW_REFILL_DELAY,
+	TCA_FQ_ORPHAN_MASK,
+	TCA_FQ_LOW_RATE_THRESHOLD,
+	TCA_FQ_CE_THRESHOLD,
+	TCA_FQ_TIMER_SLACK,
+	TCA_FQ_HORIZON,
+	TCA_FQ_HORIZON_DROP,
+	__TCA_FQ_MAX
+};
+#define TCA_FQ_MAX	(__TCA_FQ_MAX - 1)
+
+struct tc_fq_qd_stats {
+	__u64	gc_flows;
+	__u64	highprio_packets;
+	__u64	tcp_retrans;
+	__u64	throttled;
+	__u64	flows_plimit;
+	__u64	pkts_too_long;
+	__u64	allocation_errors;
+	__s64	time_next_delayed_flow;
+	__u32	flows;
+	__u32	inactive_flows;
+	__u32	throttled_flows;
+	__u32	unthrottle_latency_ns;
+	__u64	ce_mark;
+	__u64	horizon_drops;
+	__u64	horizon_caps;
+};
+
+/* ----------------------- TRACEPOINTS ----------------------- */
+
+/* Tracepoints are always off, they compile to empty functions.
+ * trace/define_trace.h is empty, so trace headers are read once. */
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)		\
+	DEFINE_EVENT(none, name, PARAMS(proto), PARAMS(args))
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args)			\
+	static inline void trace_##name(proto) { }			\
+	static inline bool trace_##name##_enabled(void) { return false; }
+#ifndef PARAMS
+#define PARAMS(args...)		args
+#endif
+
+/* ----------------------- MODULE ----------------------- */
+
+extern struct module __this_module;
+#define THIS_MODULE		(&__this_module)
+#define EXPORT_SYMBOL(x)
+#define EXPORT_SYMBOL_GPL(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_ALIAS_NET_SCH(x)
+
+/* Module init runs when the library is loaded, exit never runs */
+#define module_init(fn)							\
+	static void __attribute__((constructor)) __sl_init_##fn(void)	\
+	{								\
+		if (fn())						\
+			printk(KERN_ERR "kshim: %s failed\n", #fn);	\
+	}
+#define module_exit(fn)							\
+	static void __attribute__((unused)) (*__sl_exit_##fn)(void) = fn
+
+#endif /* KSHIM_H */
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * schedlib.h : the qdisc modules as a userspace scheduling library.
+ *
+ * The library links the unmodified sch_*.c files over the kernel shim
+ * (kshim.h). A scheduler is created by id, the same id as the tc
+ * qdisc name ("scrr", "stfq", "fq_drr"...). Options are given as a
+ * string "name=value,name=value", where name is the netlink attribute
+ * name in lowercase without prefix, for example "plimit=10000" for
+ * TCA_SCRR_PLIMIT, and value is a number (C syntax, so flags can be
+ * given in hex).
+ *
+ * Time is virtual, the caller sets the clock before each call, so that
+ * trace replay and simulations are deterministic. Packets belong to the
+ * caller, packets dropped by the scheduler are returned through the
+ * free hook.
+ */
+
+#ifndef SCHEDLIB_H
+#define SCHEDLIB_H
+
+#include "kshim.h"
+
+/* Option names of a scheduler, indexed by netlink attribute type.
+ * With flat, like fifo, TCA_OPTIONS is a struct of u32 instead, names
+ * are its fields in order from 1, and there is no policy. Without any
+ * option, the scheduler gets no TCA_OPTIONS. */
+struct sl_sched_opts {
+	const struct Qdisc_ops		*ops;
+	const struct nla_policy		*policy;
+	const char * const		*names;
+	int				maxtype;
+	bool				flat;
+	struct sl_sched_opts		*next;
+};
+
+struct sl_qdisc {
+	struct Qdisc			*sch;
+	const struct sl_sched_opts	*opts;
+};
+
+/* Scheduler registry, filled by module_init() and the sched_*.c units */
+void sl_register_opts(struct sl_sched_opts *opts);
+const struct Qdisc_ops *sl_sched_next(const struct Qdisc_ops *prev);
+
+int sl_qdisc_create(const char *id, const char *opts_str,
+		    struct sl_qdisc **qp, const char **errmsg);
+int sl_qdisc_change(struct sl_qdisc *q, const char *opts_str,
+		    const char **errmsg);
+/* Classful schedulers, classes use the option names of the scheduler */
+int sl_class_change(struct sl_qdisc *q, u32 minor, const char *opts_str,
+		    const char **errmsg);
+void sl_qdisc_reset(struct sl_qdisc *q);
+void sl_qdisc_destroy(struct sl_qdisc *q);
+/* Copy the scheduler xstats, return their size or a negative error */
+int sl_qdisc_xstats(struct sl_qdisc *q, void *buf, int len);
+
+/* Virtual time, also drives jiffies */
+void sl_clock_set(u64 now_ns);
+/* Restart the random numbers of the schedulers, 0 for the default */
+void sl_random_seed(u32 seed);
+
+/* Called by the library for every packet the scheduler frees */
+extern void (*sl_skb_free_hook)(struct sk_buff *skb);
+/* Packets freed after use, for example once segmented, default free */
+extern void (*sl_skb_consume_hook)(struct sk_buff *skb);
+/* Allocate the segments of GSO packets, default malloc */
+extern struct sk_buff *(*sl_skb_alloc_hook)(void);
+
+/*
+ * Datapath. Like __dev_xmit_skb(), the library computes pkt_len and
+ * frees the packets dropped during enqueue. Deferred work (hash table
+ * resize) never runs from those, the caller runs it with
+ * sl_qdisc_run_work(), usually outside of the measured section.
+ */
+static inline int sl_qdisc_enqueue(struct sl_qdisc *q, struct sk_buff *skb)
+{
+	struct sk_buff *to_free = NULL;
+	int ret;
+
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+	ret = q->sch->enqueue(skb, q->sch, &to_free);
+	if (unlikely(to_free))
+		kfree_skb_list(to_free);
+	return ret & NET_XMIT_MASK;
+}
+
+/* Like __dev_xmit_skb(), an empty qdisc with TCQ_F_CAN_BYPASS is
+ * skipped, only bstats see the packet. Return true if the caller must
+ * transmit the packet itself, which it should only do when the link
+ * is free, like a qdisc that is not running. */
+static inline bool sl_qdisc_bypass(struct sl_qdisc *q, struct sk_buff *skb)
+{
+	if (!(q->sch->flags & TCQ_F_CAN_BYPASS) || q->sch->q.qlen != 0)
+		return false;
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+	qdisc_bstats_update(q->sch, skb);
+	return true;
+}
+
+static inline struct sk_buff *sl_qdisc_dequeue(struct sl_qdisc *q)
+{
+	return q->sch->dequeue(q->sch);
+}
+
+static inline u32 sl_qdisc_qlen(const struct sl_qdisc *q)
+{
+	return q->sch->q.qlen;
+}
+
+static inline u32 sl_qdisc_backlog(const struct sl_qdisc *q)
+{
+	return q->sch->qstats.backlog;
+}
+
+static inline void sl_qdisc_run_work(void)
+{
+	if (unlikely(sl_work_list))
+		sl_run_work();
+}
+
+#endif /* SCHEDLIB_H */
@@ -0,0 +1,1093 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * kshim.c : runtime of the kernel shim, see kshim.h.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kshim.h"
+#include "schedlib.h"
+
+/* Same as the kernel, so that jiffies wrap early. */
+#define INITIAL_JIFFIES	((unsigned long) (unsigned int) (-300 * HZ))
+
+volatile unsigned long jiffies = INITIAL_JIFFIES;
+u64 sl_clock_ns;
+struct module { int unused; } __this_module;
+struct work_struct *sl_work_list;
+void (*sl_skb_free_hook)(struct sk_buff *skb);
+void (*sl_skb_consume_hook)(struct sk_buff *skb);
+struct sk_buff *(*sl_skb_alloc_hook)(void);
+
+/* ----------------------- MISC ----------------------- */
+
+void sl_bug(const char *file, int line)
+{
+	fprintf(stderr, "kshim: BUG at %s:%d\n", file, line);
+	abort();
+}
+
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	/* Skip the KERN_* level */
+	if (fmt[0] == '<' && fmt[1] && fmt[2] == '>')
+		fmt += 3;
+	va_start(ap, fmt);
+	ret = vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+/* xorshift, deterministic so that runs can be reproduced */
+static u32 sl_random_state = 0x2545F491;
+
+void sl_random_seed(u32 seed)
+{
+	sl_random_state = seed ? seed : 0x2545F491;
+}
+
+u32 get_random_u32(void)
+{
+	u32 state = sl_random_state;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	sl_random_state = state;
+	return state;
+}
+
+void get_random_bytes(void *buf, int len)
+{
+	u8 *p = buf;
+	u32 rnd = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((i & 3) == 0)
+			rnd = get_random_u32();
+		p[i] = (u8) rnd;
+		rnd >>= 8;
+	}
+}
+
+unsigned long find_next_bit(const unsigned long *a, unsigned long size,
+			    unsigned long offset)
+{
+	unsigned long idx;
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+	idx = offset / BITS_PER_LONG;
+	word = a[idx] & (~0UL << (offset % BITS_PER_LONG));
+	while (!word) {
+		if (++idx * BITS_PER_LONG >= size)
+			return size;
+		word = a[idx];
+	}
+	return min(idx * BITS_PER_LONG + __ffs(word), size);
+}
+
+/* ----------------------- TIME ----------------------- */
+
+void sl_clock_set(u64 now_ns)
+{
+	sl_clock_ns = now_ns;
+	jiffies = INITIAL_JIFFIES + now_ns / (NSEC_PER_SEC / HZ);
+}
+
+cycles_t get_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (cycles_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+/* ----------------------- MEMORY ----------------------- */
+
+struct kmem_cache {
+	const char	*name;
+	unsigned int	size;
+	unsigned int	align;
+};
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (p && (flags & __GFP_ZERO))
+		memset(p, 0, size);
+	return p;
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+	return kmalloc(size, flags | __GFP_ZERO);
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	if (size && n > SIZE_MAX / size)
+		return NULL;
+	return kzalloc(n * size, flags);
+}
+
+void kfree(const void *p)
+{
+	free((void *) p);
+}
+
+void *kvmalloc_node(size_t size, gfp_t flags, int node)
+{
+	(void) node;
+	return kmalloc(size, flags);
+}
+
+void kvfree(const void *p)
+{
+	free((void *) p);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+				     unsigned int align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *c;
+
+	(void) ctor;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->name = name;
+	c->align = align ? align : sizeof(long);
+	if (flags & SLAB_HWCACHE_ALIGN)
+		c->align = max_t(unsigned int, c->align, SMP_CACHE_BYTES);
+	/* Same object rounding as SLUB */
+	c->size = (size + c->align - 1) & ~(c->align - 1);
+	/* SLUB packs objects from a page boundary, so they are also
+	 * aligned on the largest power of two dividing their size.
+	 * Some modules rely on it for ____cacheline_aligned objects. */
+	c->align = max_t(unsigned int, c->align,
+			 min_t(unsigned int, c->size & -c->size, 4096));
+	return c;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	free(c);
+}
+
+unsigned int kmem_cache_size(struct kmem_cache *c)
+{
+	return c->size;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags)
+{
+	void *p;
+
+	if (posix_memalign(&p, c->align, c->size))
+		return NULL;
+	if (flags & __GFP_ZERO)
+		memset(p, 0, c->size);
+	return p;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	(void) c;
+	free(p);
+}
+
+void kmem_cache_free_bulk(struct kmem_cache *c, size_t nr, void **p)
+{
+	while (nr--)
+		kmem_cache_free(c, p[nr]);
+}
+
+/* ----------------------- WORK ----------------------- */
+
+bool schedule_work(struct work_struct *work)
+{
+	struct work_struct **pw;
+
+	if (work->sl_pending)
+		return false;
+	work->sl_pending = true;
+	work->sl_next = NULL;
+	/* Keep FIFO order, there is rarely more than one */
+	for (pw = &sl_work_list; *pw; pw = &(*pw)->sl_next)
+		;
+	*pw = work;
+	return true;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	struct work_struct **pw;
+
+	for (pw = &sl_work_list; *pw; pw = &(*pw)->sl_next) {
+		if (*pw == work) {
+			*pw = work->sl_next;
+			work->sl_pending = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+void sl_run_work(void)
+{
+	struct work_struct *work;
+
+	while ((work = sl_work_list) != NULL) {
+		sl_work_list = work->sl_next;
+		work->sl_pending = false;
+		work->func(work);
+	}
+}
+
+/* ----------------------- WATCHDOGS ----------------------- */
+
+static struct qdisc_watchdog *sl_watchdog_list;
+
+void qdisc_watchdog_init(struct qdisc_watchdog *wd, struct Qdisc *qdisc)
+{
+	wd->qdisc = qdisc;
+	wd->last_expires = 0;
+	wd->sl_next = NULL;
+	wd->sl_armed = false;
+}
+
+void qdisc_watchdog_schedule_range_ns(struct qdisc_watchdog *wd, u64 expires,
+				      u64 delta_ns)
+{
+	/* Like the hrtimer, a timer already due in the range is kept */
+	if (wd->sl_armed && wd->last_expires - expires <= delta_ns)
+		return;
+	wd->last_expires = expires;
+	if (!wd->sl_armed) {
+		wd->sl_armed = true;
+		wd->sl_next = sl_watchdog_list;
+		sl_watchdog_list = wd;
+	}
+}
+
+void qdisc_watchdog_cancel(struct qdisc_watchdog *wd)
+{
+	struct qdisc_watchdog **pw;
+
+	for (pw = &sl_watchdog_list; *pw; pw = &(*pw)->sl_next) {
+		if (*pw == wd) {
+			*pw = wd->sl_next;
+			wd->sl_armed = false;
+			return;
+		}
+	}
+}
+
+u64 sl_watchdog_next(void)
+{
+	struct qdisc_watchdog *wd;
+	u64 next = U64_MAX;
+
+	for (wd = sl_watchdog_list; wd; wd = wd->sl_next)
+		next = min(next, wd->last_expires);
+	return next;
+}
+
+void sl_watchdog_expire(u64 now_ns)
+{
+	struct qdisc_watchdog **pw = &sl_watchdog_list;
+	struct qdisc_watchdog *wd;
+
+	while ((wd = *pw) != NULL) {
+		if (wd->last_expires <= now_ns) {
+			*pw = wd->sl_next;
+			wd->sl_armed = false;
+		} else
+			pw = &wd->sl_next;
+	}
+}
+
+/* ----------------------- PACKETS ----------------------- */
+
+void kfree_skb(struct sk_buff *skb)
+{
+	if (!skb)
+		return;
+	if (sl_skb_free_hook)
+		sl_skb_free_hook(skb);
+	else
+		free(skb);
+}
+
+void consume_skb(struct sk_buff *skb)
+{
+	if (!skb)
+		return;
+	if (sl_skb_consume_hook)
+		sl_skb_consume_hook(skb);
+	else
+		free(skb);
+}
+
+/* Segments of gso_size payload plus the headers, the last one gets the
+ * rest. They are copies of the packet, like skb_segment(). */
+struct sk_buff *skb_gso_segment(struct sk_buff *skb,
+				netdev_features_t features)
+{
+	u32 segs = skb_shinfo(skb)->gso_segs;
+	u32 mss = skb_shinfo(skb)->gso_size;
+	struct sk_buff *first = NULL, *last = NULL, *seg;
+	u32 hdr = 0, left = skb->len, i;
+
+	(void) features;
+	if (!skb_is_gso(skb) || segs < 2)
+		return NULL;
+	if (skb->len > segs * mss)
+		hdr = (skb->len - segs * mss) / segs;
+
+	for (i = 0; i < segs; i++) {
+		seg = sl_skb_alloc_hook ? sl_skb_alloc_hook() :
+					  malloc(sizeof(*seg));
+		if (!seg) {
+			kfree_skb_list(first);
+			return ERR_PTR(-ENOMEM);
+		}
+		memcpy(seg, skb, sizeof(*seg));
+		seg->len = i == segs - 1 ? left : mss + hdr;
+		left -= seg->len;
+		seg->shinfo.gso_size = 0;
+		seg->shinfo.gso_segs = 1;
+		seg->sl_segs_left = segs - 1 - i;
+		seg->next = NULL;
+		if (last)
+			last->next = seg;
+		else
+			first = seg;
+		last = seg;
+	}
+	return first;
+}
+
+void kfree_skb_list(struct sk_buff *skb)
+{
+	while (skb) {
+		struct sk_buff *next = skb->next;
+
+		kfree_skb(skb);
+		skb = next;
+	}
+}
+
+int ptr_ring_init(struct ptr_ring *r, int size, gfp_t gfp)
+{
+	r->queue = kcalloc(size, sizeof(void *), gfp);
+	if (!r->queue)
+		return -ENOMEM;
+	r->size = size;
+	r->producer = 0;
+	r->consumer_head = 0;
+	return 0;
+}
+
+void ptr_ring_cleanup(struct ptr_ring *r, void (*destroy)(void *))
+{
+	void *ptr;
+
+	if (destroy)
+		while ((ptr = __ptr_ring_consume(r)))
+			destroy(ptr);
+	kfree(r->queue);
+	r->queue = NULL;
+	r->size = 0;
+}
+
+static void __skb_array_destroy_skb(void *ptr)
+{
+	kfree_skb(ptr);
+}
+
+void skb_array_cleanup(struct skb_array *a)
+{
+	ptr_ring_cleanup(&a->ring, __skb_array_destroy_skb);
+}
+
+/* ----------------------- NETLINK ----------------------- */
+
+static int nla_validate_one(const struct nlattr *nla,
+			    const struct nla_policy *pt)
+{
+	static const u8 minlen[] = {
+		[NLA_U8] = sizeof(u8),	[NLA_U16] = sizeof(u16),
+		[NLA_U32] = sizeof(u32), [NLA_U64] = sizeof(u64),
+		[NLA_MSECS] = sizeof(u64), [NLA_S8] = sizeof(s8),
+		[NLA_S16] = sizeof(s16), [NLA_S32] = sizeof(s32),
+		[NLA_S64] = sizeof(s64),
+	};
+
+	if (pt->type == NLA_REJECT)
+		return -EINVAL;
+	if (pt->type < ARRAY_SIZE(minlen) && nla_len(nla) < minlen[pt->type])
+		return -ERANGE;
+	/* Like the kernel, len is a maximum for binaries, else a minimum */
+	if (pt->type == NLA_BINARY) {
+		if (pt->len && nla_len(nla) > pt->len)
+			return -ERANGE;
+	} else if (pt->len && nla_len(nla) < pt->len)
+		return -ERANGE;
+	return 0;
+}
+
+int nla_parse_nested_deprecated(struct nlattr **tb, int maxtype,
+				const struct nlattr *nla,
+				const struct nla_policy *policy,
+				struct netlink_ext_ack *extack)
+{
+	const struct nlattr *pos;
+	int rem;
+
+	memset(tb, 0, sizeof(struct nlattr *) * (maxtype + 1));
+
+	pos = nla_data(nla);
+	rem = nla_len(nla);
+	while (rem >= NLA_HDRLEN && pos->nla_len >= NLA_HDRLEN &&
+	       pos->nla_len <= rem) {
+		u16 type = nla_type(pos);
+
+		/* Unknown attributes are ignored, like deprecated parsing */
+		if (type > 0 && type <= maxtype) {
+			if (policy) {
+				int err = nla_validate_one(pos, &policy[type]);
+
+				if (err) {
+					NL_SET_ERR_MSG(extack,
+						       "Attribute failed policy validation");
+					return err;
+				}
+			}
+			tb[type] = (struct nlattr *) pos;
+		}
+		rem -= NLA_ALIGN(pos->nla_len);
+		pos = (const struct nlattr *) ((const char *) pos +
+					       NLA_ALIGN(pos->nla_len));
+	}
+	return 0;
+}
+
+/* No netlink socket to dump to, dump() is not supported. */
+int nla_put(struct sk_buff *skb, int type, int len, const void *data)
+{
+	(void) skb;
+	(void) type;
+	(void) len;
+	(void) data;
+	return -EOPNOTSUPP;
+}
+
+struct nlattr *nla_nest_start_noflag(struct sk_buff *skb, int type)
+{
+	(void) skb;
+	(void) type;
+	return NULL;
+}
+
+int nla_nest_end(struct sk_buff *skb, struct nlattr *start)
+{
+	(void) skb;
+	(void) start;
+	return -EOPNOTSUPP;
+}
+
+void nla_nest_cancel(struct sk_buff *skb, struct nlattr *start)
+{
+	(void) skb;
+	(void) start;
+}
+
+/* ----------------------- RELAY & DEBUGFS ----------------------- */
+
+const struct file_operations relay_file_operations;
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	struct dentry *dentry = kzalloc(sizeof(*dentry), GFP_KERNEL);
+
+	(void) name;
+	if (!dentry)
+		return ERR_PTR(-ENOMEM);
+	dentry->parent = parent;
+	return dentry;
+}
+
+struct dentry *debugfs_create_file(const char *name, umode_t mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	struct dentry *dentry = debugfs_create_dir(name, parent);
+
+	(void) mode;
+	(void) fops;
+	if (!IS_ERR(dentry))
+		dentry->data = data;
+	return dentry;
+}
+
+void debugfs_remove(struct dentry *dentry)
+{
+	if (!IS_ERR_OR_NULL(dentry))
+		kfree(dentry);
+}
+
+/* Same as the default callback of the kernel */
+static int sl_relay_subbuf_start(struct rchan_buf *buf, void *subbuf,
+				 void *prev_subbuf, size_t prev_padding)
+{
+	(void) subbuf;
+	(void) prev_subbuf;
+	(void) prev_padding;
+	return !relay_buf_full(buf);
+}
+
+struct rchan *relay_open(const char *base_filename, struct dentry *parent,
+			 size_t subbuf_size, size_t n_subbufs,
+			 const struct rchan_callbacks *cb, void *private_data)
+{
+	struct rchan *chan;
+	struct rchan_buf *buf;
+	int is_global = 0;
+	char name[32];
+
+	if (!subbuf_size || !n_subbufs || !cb || !cb->create_buf_file)
+		return NULL;
+	chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf)
+		buf->start = kvzalloc(subbuf_size * n_subbufs, GFP_KERNEL);
+	if (!chan || !buf || !buf->start)
+		goto fail;
+
+	chan->subbuf_size = subbuf_size;
+	chan->n_subbufs = n_subbufs;
+	chan->cb = cb;
+	chan->private_data = private_data;
+	chan->buf = buf;
+	buf->chan = chan;
+	buf->data = buf->start;
+
+	snprintf(name, sizeof(name), "%s0", base_filename);
+	buf->dentry = cb->create_buf_file(name, parent, 0400, buf, &is_global);
+	if (IS_ERR_OR_NULL(buf->dentry))
+		goto fail;
+	return chan;
+
+fail:
+	if (buf)
+		kvfree(buf->start);
+	kfree(buf);
+	kfree(chan);
+	return NULL;
+}
+
+void relay_close(struct rchan *chan)
+{
+	if (!chan)
+		return;
+	if (chan->cb->remove_buf_file)
+		chan->cb->remove_buf_file(chan->buf->dentry);
+	kvfree(chan->buf->start);
+	kfree(chan->buf);
+	kfree(chan);
+}
+
+/* Like the kernel : finish the current sub-buffer and move to the next
+ * one, unless the callback refuses. Returns what can be written. */
+size_t relay_switch_subbuf(struct rchan_buf *buf, size_t length)
+{
+	struct rchan *chan = buf->chan;
+	int (*subbuf_start)(struct rchan_buf *, void *, void *, size_t);
+	void *old, *new;
+	size_t padding = 0;
+	size_t new_subbuf;
+
+	if (length > chan->subbuf_size)
+		return 0;
+
+	subbuf_start = chan->cb->subbuf_start ? chan->cb->subbuf_start
+					      : sl_relay_subbuf_start;
+	old = buf->data;
+	if (buf->offset != chan->subbuf_size + 1) {
+		padding = chan->subbuf_size - buf->offset;
+		buf->subbufs_produced++;
+	}
+
+	new_subbuf = buf->subbufs_produced % chan->n_subbufs;
+	new = (char *) buf->start + new_subbuf * chan->subbuf_size;
+	buf->offset = 0;
+	if (!subbuf_start(buf, new, old, padding)) {
+		/* Stay full, the next write switches again */
+		buf->offset = chan->subbuf_size + 1;
+		return 0;
+	}
+	buf->data = new;
+	return length;
+}
+
+void sl_relay_consume(struct rchan *chan)
+{
+	chan->buf->subbufs_consumed = chan->buf->subbufs_produced;
+}
+
+/* ----------------------- QDISC ----------------------- */
+
+static struct net_device sl_dev = {
+	.name			= "sl0",
+	.num_tx_queues		= 1,
+	.real_num_tx_queues	= 1,
+	.flags			= IFF_UP,
+	.mtu			= 1500,
+	.tx_queue_len		= 1000,
+};
+static struct netdev_queue sl_txq = {
+	.dev	= &sl_dev,
+};
+static spinlock_t sl_qdisc_lock;
+static struct Qdisc_ops *sl_qdisc_base;
+static LIST_HEAD(sl_qdisc_all);
+
+struct net_device *qdisc_dev(const struct Qdisc *sch)
+{
+	return sch->dev_queue->dev;
+}
+
+struct netdev_queue *netdev_get_tx_queue(const struct net_device *dev,
+					 unsigned int index)
+{
+	(void) dev;
+	(void) index;
+	return &sl_txq;
+}
+
+spinlock_t *qdisc_lock(struct Qdisc *sch)
+{
+	(void) sch;
+	return &sl_qdisc_lock;
+}
+
+int register_qdisc(struct Qdisc_ops *qops)
+{
+	struct Qdisc_ops **qp;
+
+	for (qp = &sl_qdisc_base; *qp; qp = &(*qp)->next)
+		if (!strcmp(qops->id, (*qp)->id))
+			return -EEXIST;
+	qops->next = NULL;
+	*qp = qops;
+	return 0;
+}
+
+void unregister_qdisc(struct Qdisc_ops *qops)
+{
+	struct Qdisc_ops **qp;
+
+	for (qp = &sl_qdisc_base; *qp; qp = &(*qp)->next) {
+		if (*qp == qops) {
+			*qp = qops->next;
+			return;
+		}
+	}
+}
+
+const struct Qdisc_ops *sl_sched_next(const struct Qdisc_ops *prev)
+{
+	return prev ? prev->next : sl_qdisc_base;
+}
+
+/* Allocate and init, like qdisc_alloc() + qdisc_create() */
+struct Qdisc *sl_qdisc_alloc(const struct Qdisc_ops *ops,
+			     struct netdev_queue *dev_queue, u32 parentid,
+			     struct nlattr *opt, struct netlink_ext_ack *extack,
+			     int *errp)
+{
+	struct Qdisc *sch;
+	int err;
+
+	if (!dev_queue)
+		dev_queue = &sl_txq;
+	sch = kvzalloc(sizeof(*sch) + ops->priv_size, GFP_KERNEL);
+	if (!sch) {
+		*errp = -ENOMEM;
+		return NULL;
+	}
+	sch->ops = ops;
+	sch->enqueue = ops->enqueue;
+	sch->dequeue = ops->dequeue;
+	sch->flags = ops->static_flags;
+	sch->dev_queue = dev_queue;
+	sch->parent = parentid;
+	refcount_set(&sch->refcnt, 1);
+	list_add_tail(&sch->sl_list, &sl_qdisc_all);
+
+	err = ops->init ? ops->init(sch, opt, extack) : 0;
+	if (err) {
+		/* Like qdisc_create(), destroy cleans up a failed init */
+		if (ops->destroy)
+			ops->destroy(sch);
+		list_del(&sch->sl_list);
+		kvfree(sch);
+		*errp = err;
+		return NULL;
+	}
+	if (ops->attach)
+		ops->attach(sch);
+	*errp = 0;
+	return sch;
+}
+
+struct Qdisc *qdisc_create_dflt(struct netdev_queue *dev_queue,
+				const struct Qdisc_ops *ops, u32 parentid,
+				struct netlink_ext_ack *extack)
+{
+	int err;
+
+	return sl_qdisc_alloc(ops, dev_queue, parentid, NULL, extack, &err);
+}
+
+void qdisc_put(struct Qdisc *sch)
+{
+	if (!sch || (sch->flags & TCQ_F_BUILTIN) ||
+	    !refcount_dec_and_test(&sch->refcnt))
+		return;
+	qdisc_reset(sch);
+	if (sch->ops->destroy)
+		sch->ops->destroy(sch);
+	list_del(&sch->sl_list);
+	kvfree(sch);
+}
+
+/* Library qdiscs are not hashed by device, look at all of them */
+struct Qdisc *qdisc_lookup(struct net_device *dev, u32 handle)
+{
+	struct Qdisc *sch;
+
+	(void) dev;
+	list_for_each_entry(sch, &sl_qdisc_all, sl_list)
+		if (sch->handle == handle)
+			return sch;
+	return NULL;
+}
+
+/* Same as the kernel, the library root has no parent */
+void qdisc_tree_reduce_backlog(struct Qdisc *sch, int n, int len)
+{
+	const struct Qdisc_class_ops *cops;
+	unsigned long cl;
+	u32 parentid;
+	bool notify;
+	int drops;
+
+	if (n == 0 && len == 0)
+		return;
+	drops = max_t(int, n, 0);
+	while ((parentid = sch->parent)) {
+		if (TC_H_MAJ(parentid) == TC_H_MAJ(TC_H_INGRESS))
+			break;
+		if (sch->flags & TCQ_F_NOPARENT)
+			break;
+		notify = !sch->q.qlen && !WARN_ON_ONCE(!n);
+		sch = qdisc_lookup(qdisc_dev(sch), TC_H_MAJ(parentid));
+		if (sch == NULL)
+			break;
+		cops = sch->ops->cl_ops;
+		if (notify && cops && cops->qlen_notify) {
+			cl = cops->find(sch, parentid);
+			cops->qlen_notify(sch, cl);
+		}
+		sch->q.qlen -= n;
+		sch->qstats.backlog -= len;
+		sch->qstats.drops += drops;
+	}
+}
+
+void qdisc_reset(struct Qdisc *sch)
+{
+	if (sch->ops->reset)
+		sch->ops->reset(sch);
+	if (sch->gso_skb) {
+		kfree_skb(sch->gso_skb);
+		sch->gso_skb = NULL;
+	}
+	sch->q.qlen = 0;
+	sch->qstats.backlog = 0;
+}
+
+void qdisc_purge_queue(struct Qdisc *sch)
+{
+	u32 qlen = sch->q.qlen;
+	u32 backlog = sch->qstats.backlog;
+
+	qdisc_reset(sch);
+	qdisc_tree_reduce_backlog(sch, qlen, backlog);
+}
+
+struct Qdisc *qdisc_replace(struct Qdisc *sch, struct Qdisc *new,
+			    struct Qdisc **pold)
+{
+	struct Qdisc *old;
+
+	sch_tree_lock(sch);
+	old = *pold;
+	*pold = new;
+	if (old != NULL)
+		qdisc_purge_queue(old);
+	sch_tree_unlock(sch);
+	return old;
+}
+
+void qdisc_warn_nonwc(const char *txt, struct Qdisc *qdisc)
+{
+	if (!(qdisc->flags & TCQ_F_WARN_NONWC)) {
+		pr_warn("%s: %s qdisc %X: is non-work-conserving?\n",
+			txt, qdisc->ops->id, qdisc->handle >> 16);
+		qdisc->flags |= TCQ_F_WARN_NONWC;
+	}
+}
+
+static int noop_enqueue(struct sk_buff *skb, struct Qdisc *qdisc,
+			struct sk_buff **to_free)
+{
+	__qdisc_drop(skb, to_free);
+	return NET_XMIT_CN;
+}
+
+static struct sk_buff *noop_dequeue(struct Qdisc *qdisc)
+{
+	(void) qdisc;
+	return NULL;
+}
+
+static const struct Qdisc_ops noop_qdisc_ops = {
+	.id		= "noop",
+	.enqueue	= noop_enqueue,
+	.dequeue	= noop_dequeue,
+	.peek		= noop_dequeue,
+};
+
+struct Qdisc noop_qdisc = {
+	.enqueue	= noop_enqueue,
+	.dequeue	= noop_dequeue,
+	.flags		= TCQ_F_BUILTIN,
+	.ops		= &noop_qdisc_ops,
+	.dev_queue	= &sl_txq,
+};
+
+int qdisc_class_hash_init(struct Qdisc_class_hash *clhash)
+{
+	unsigned int size = 4;
+	unsigned int i;
+
+	clhash->hash = kvmalloc_array(size, sizeof(*clhash->hash), GFP_KERNEL);
+	if (clhash->hash == NULL)
+		return -ENOMEM;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&clhash->hash[i]);
+	clhash->hashsize = size;
+	clhash->hashmask = size - 1;
+	clhash->hashelems = 0;
+	return 0;
+}
+
+void qdisc_class_hash_insert(struct Qdisc_class_hash *clhash,
+			     struct Qdisc_class_common *cl)
+{
+	INIT_HLIST_NODE(&cl->hnode);
+	hlist_add_head(&cl->hnode,
+		       &clhash->hash[cl->classid & clhash->hashmask]);
+	clhash->hashelems++;
+}
+
+void qdisc_class_hash_remove(struct Qdisc_class_hash *clhash,
+			     struct Qdisc_class_common *cl)
+{
+	hlist_del(&cl->hnode);
+	clhash->hashelems--;
+}
+
+/* Double the hash when it is 75% full, like the kernel */
+void qdisc_class_hash_grow(struct Qdisc *sch, struct Qdisc_class_hash *clhash)
+{
+	struct Qdisc_class_common *cl;
+	struct hlist_node *next;
+	struct hlist_head *nhash, *ohash;
+	unsigned int nsize, nmask, osize;
+	unsigned int i;
+
+	(void) sch;
+	if (clhash->hashelems * 4 <= clhash->hashsize * 3)
+		return;
+	nsize = clhash->hashsize * 2;
+	nmask = nsize - 1;
+	nhash = kvmalloc_array(nsize, sizeof(*nhash), GFP_KERNEL);
+	if (nhash == NULL)
+		return;
+	for (i = 0; i < nsize; i++)
+		INIT_HLIST_HEAD(&nhash[i]);
+
+	ohash = clhash->hash;
+	osize = clhash->hashsize;
+	for (i = 0; i < osize; i++) {
+		hlist_for_each_entry_safe(cl, next, &ohash[i], hnode) {
+			hlist_del(&cl->hnode);
+			hlist_add_head(&cl->hnode,
+				       &nhash[cl->classid & nmask]);
+		}
+	}
+	clhash->hash = nhash;
+	clhash->hashsize = nsize;
+	clhash->hashmask = nmask;
+	kvfree(ohash);
+}
+
+void qdisc_class_hash_destroy(struct Qdisc_class_hash *clhash)
+{
+	kvfree(clhash->hash);
+}
+
+struct Qdisc *dev_graft_qdisc(struct netdev_queue *dev_queue,
+			      struct Qdisc *qdisc)
+{
+	struct Qdisc *old = dev_queue->qdisc_sleeping;
+
+	dev_queue->qdisc_sleeping = qdisc;
+	return old;
+}
+
+int qdisc_enqueue_tail(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct qdisc_skb_head *qh = &sch->q;
+
+	skb->next = NULL;
+	if (qh->tail)
+		qh->tail->next = skb;
+	else
+		qh->head = skb;
+	qh->tail = skb;
+	qh->qlen++;
+	qdisc_qstats_backlog_inc(sch, skb);
+	return NET_XMIT_SUCCESS;
+}
+
+struct sk_buff *__qdisc_dequeue_head(struct qdisc_skb_head *qh)
+{
+	struct sk_buff *skb = qh->head;
+
+	if (likely(skb != NULL)) {
+		qh->head = skb->next;
+		qh->qlen--;
+		if (qh->head == NULL)
+			qh->tail = NULL;
+		skb->next = NULL;
+	}
+	return skb;
+}
+
+struct sk_buff *qdisc_dequeue_head(struct Qdisc *sch)
+{
+	struct sk_buff *skb = __qdisc_dequeue_head(&sch->q);
+
+	if (likely(skb != NULL)) {
+		qdisc_qstats_backlog_dec(sch, skb);
+		qdisc_bstats_update(sch, skb);
+	}
+	return skb;
+}
+
+struct sk_buff *qdisc_peek_head(struct Qdisc *sch)
+{
+	return sch->q.head;
+}
+
+/* Like the kernel, the peeked packet is held in gso_skb */
+struct sk_buff *qdisc_peek_dequeued(struct Qdisc *sch)
+{
+	struct sk_buff *skb = sch->gso_skb;
+
+	if (!skb) {
+		skb = sch->dequeue(sch);
+		if (skb) {
+			sch->gso_skb = skb;
+			qdisc_qstats_backlog_inc(sch, skb);
+			sch->q.qlen++;
+		}
+	}
+	return skb;
+}
+
+struct sk_buff *qdisc_dequeue_peeked(struct Qdisc *sch)
+{
+	struct sk_buff *skb = sch->gso_skb;
+
+	if (skb) {
+		sch->gso_skb = NULL;
+		qdisc_qstats_backlog_dec(sch, skb);
+		sch->q.qlen--;
+	} else {
+		skb = sch->dequeue(sch);
+	}
+	return skb;
+}
+
+void qdisc_reset_queue(struct Qdisc *sch)
+{
+	rtnl_kfree_skbs(sch->q.head, sch->q.tail);
+	sch->q.head = NULL;
+	sch->q.tail = NULL;
+	sch->q.qlen = 0;
+	sch->qstats.backlog = 0;
+}
+
+void gnet_stats_add_basic(struct gnet_stats_basic_sync *bstats,
+			  struct gnet_stats_basic_sync __percpu *cpu,
+			  struct gnet_stats_basic_sync *b, bool running)
+{
+	(void) running;
+	if (cpu)
+		b = cpu;
+	bstats->bytes += b->bytes;
+	bstats->packets += b->packets;
+}
+
+void gnet_stats_add_queue(struct gnet_stats_queue *qstats,
+			  const struct gnet_stats_queue __percpu *cpu_q,
+			  const struct gnet_stats_queue *q)
+{
+	if (cpu_q)
+		q = cpu_q;
+	qstats->qlen += q->qlen;
+	qstats->backlog += q->backlog;
+	qstats->drops += q->drops;
+	qstats->requeues += q->requeues;
+	qstats->overlimits += q->overlimits;
+}
+
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len)
+{
+	if (d->xstats) {
+		memcpy(d->xstats, st, min(len, d->xstats_len));
+		d->xstats_copied = len;
+	}
+	return 0;
+}
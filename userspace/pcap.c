@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * pcap.c : read packet traces in classic pcap format.
+ *
+ * Only the headers matter, traces captured with a small snaplen work
+ * fine. We support Ethernet (with VLAN tags), raw IP and Linux cooked
+ * captures, which covers most public datasets. pcapng must be converted
+ * first, for example with "editcap -F pcap".
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define PCAP_MAGIC_US		0xA1B2C3D4
+#define PCAP_MAGIC_NS		0xA1B23C4D
+#define PCAP_SNAPLEN_MAX	262144
+
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW_OLD	12
+#define LINKTYPE_RAW_OLD2	14
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+
+#define ETH_P_8021Q		0x8100
+#define ETH_P_8021AD		0x88A8
+
+struct pcap_file_hdr {
+	u32	magic;
+	u16	version_major;
+	u16	version_minor;
+	s32	thiszone;
+	u32	sigfigs;
+	u32	snaplen;
+	u32	linktype;
+};
+
+struct pcap_rec_hdr {
+	u32	ts_sec;
+	u32	ts_frac;
+	u32	caplen;
+	u32	len;
+};
+
+static inline u32 pcap_u32(const struct trace *tr, u32 v)
+{
+	return tr->swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline u16 get_be16(const unsigned char *p)
+{
+	return (u16) (p[0] << 8 | p[1]);
+}
+
+static inline u32 get_u32(const unsigned char *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Finalizer of murmur3, good enough to spread the 5-tuple */
+static inline u32 mix32(u32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+int trace_open(struct trace *tr, const char *path)
+{
+	struct pcap_file_hdr fh;
+
+	memset(tr, 0, sizeof(*tr));
+	tr->f = fopen(path, "rb");
+	if (!tr->f)
+		return -ENOENT;
+	if (fread(&fh, sizeof(fh), 1, tr->f) != 1)
+		goto err_format;
+
+	if (fh.magic == PCAP_MAGIC_US || fh.magic == PCAP_MAGIC_NS) {
+		tr->nsec = fh.magic == PCAP_MAGIC_NS;
+	} else if (__builtin_bswap32(fh.magic) == PCAP_MAGIC_US ||
+		   __builtin_bswap32(fh.magic) == PCAP_MAGIC_NS) {
+		tr->swapped = 1;
+		tr->nsec = __builtin_bswap32(fh.magic) == PCAP_MAGIC_NS;
+	} else
+		goto err_format;
+
+	tr->linktype = pcap_u32(tr, fh.linktype) & 0x0FFFFFFF;
+	switch (tr->linktype) {
+	case LINKTYPE_ETHERNET:
+	case LINKTYPE_RAW_OLD:
+	case LINKTYPE_RAW_OLD2:
+	case LINKTYPE_RAW:
+	case LINKTYPE_LINUX_SLL:
+		break;
+	default:
+		goto err_format;
+	}
+
+	tr->buflen = PCAP_SNAPLEN_MAX;
+	tr->buf = malloc(tr->buflen);
+	if (!tr->buf) {
+		fclose(tr->f);
+		return -ENOMEM;
+	}
+	tr->first_ns = ~0ULL;
+	return 0;
+
+err_format:
+	fclose(tr->f);
+	tr->f = NULL;
+	return -EINVAL;
+}
+
+/* Parse the headers, return 0 if this is not IP */
+static int trace_parse(struct trace *tr, const unsigned char *p, u32 caplen,
+		       struct trace_pkt *pkt)
+{
+	const unsigned char *end = p + caplen;
+	u32 h = 0;
+	u16 proto;
+	int l4off;
+
+	switch (tr->linktype) {
+	case LINKTYPE_ETHERNET:
+		if (caplen < 14)
+			return 0;
+		proto = get_be16(p + 12);
+		p += 14;
+		while ((proto == ETH_P_8021Q || proto == ETH_P_8021AD) &&
+		       p + 4 <= end) {
+			proto = get_be16(p + 2);
+			p += 4;
+		}
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (caplen < 16)
+			return 0;
+		proto = get_be16(p + 14);
+		p += 16;
+		break;
+	default:
+		if (caplen < 1)
+			return 0;
+		proto = (p[0] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP;
+		break;
+	}
+
+	if (proto == ETH_P_IP) {
+		if (p + 20 > end || (p[0] >> 4) != 4)
+			return 0;
+		pkt->dsfield = p[1];
+		pkt->l4proto = p[9];
+		h = mix32(get_u32(p + 12) ^ mix32(get_u32(p + 16)));
+		/* Fragments other than the first have no ports */
+		l4off = (get_be16(p + 6) & 0x1FFF) ? -1 : (p[0] & 0x0F) * 4;
+	} else if (proto == ETH_P_IPV6) {
+		int i;
+
+		if (p + 40 > end || (p[0] >> 4) != 6)
+			return 0;
+		pkt->dsfield = (u8) (get_be16(p) >> 4);
+		pkt->l4proto = p[6];
+		for (i = 8; i < 40; i += 4)
+			h = mix32(h ^ get_u32(p + i));
+		/* Extension headers are not parsed, hash on addresses */
+		l4off = 40;
+	} else
+		return 0;
+
+	if (l4off > 0 && p + l4off + 4 <= end &&
+	    (pkt->l4proto == IPPROTO_TCP || pkt->l4proto == IPPROTO_UDP))
+		h = mix32(h ^ get_u32(p + l4off));
+	h = mix32(h ^ pkt->l4proto);
+
+	pkt->protocol = proto;
+	pkt->hash = h ? h : 1;
+	return 1;
+}
+
+int trace_next(struct trace *tr, struct trace_pkt *pkt)
+{
+	struct pcap_rec_hdr rh;
+	u32 caplen;
+	u64 ts;
+
+	while (fread(&rh, sizeof(rh), 1, tr->f) == 1) {
+		caplen = pcap_u32(tr, rh.caplen);
+		if (caplen > tr->buflen)
+			return -EINVAL;
+		if (caplen && fread(tr->buf, caplen, 1, tr->f) != 1)
+			return 0;
+
+		ts = (u64) pcap_u32(tr, rh.ts_sec) * NSEC_PER_SEC +
+			(u64) pcap_u32(tr, rh.ts_frac) *
+			(tr->nsec ? 1 : NSEC_PER_USEC);
+		if (!trace_parse(tr, tr->buf, caplen, pkt)) {
+			tr->skipped++;
+			continue;
+		}
+		if (tr->first_ns == ~0ULL)
+			tr->first_ns = ts;
+		/* Captures are not always in order, the caller clamps it */
+		pkt->tstamp_ns = ts > tr->first_ns ? ts - tr->first_ns : 0;
+		pkt->len = pcap_u32(tr, rh.len);
+		return 1;
+	}
+	return 0;
+}
+
+void trace_close(struct trace *tr)
+{
+	if (tr->f)
+		fclose(tr->f);
+	free(tr->buf);
+	tr->f = NULL;
+	tr->buf = NULL;
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_aifo_stfq.c : AIFO for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_aifo_stfq.c"
+
+static const char * const aifo_opt_names[TCA_AIFO_MAX + 1] = {
+	[TCA_AIFO_PLIMIT]		= "plimit",
+	[TCA_AIFO_BURST]		= "burst",
+	[TCA_AIFO_BUCKETS_LOG]		= "buckets_log",
+	[TCA_AIFO_HASH_MASK]		= "hash_mask",
+	[TCA_AIFO_FLOW_PLIMIT]		= "flow_plimit",
+	[TCA_AIFO_SAMPLE_SIZE]		= "sample_size",
+	[TCA_AIFO_SAMPLE_PERIOD]	= "sample_period",
+	[TCA_AIFO_FLAGS]		= "flags",
+};
+
+static struct sl_sched_opts aifo_sl_opts = {
+	.ops = &aifo_qdisc_ops, .policy = aifo_policy,
+	.names = aifo_opt_names, .maxtype = TCA_AIFO_MAX
+};
+
+static void __attribute__((constructor)) aifo_sl_register(void)
+{
+	sl_register_opts(&aifo_sl_opts);
+}
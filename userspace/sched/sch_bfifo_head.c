@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_bfifo_head.c : byte FIFO with head drop for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names. Like
+ * bfifo, the options are a struct tc_fifo_qopt, the limit in bytes.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_bfifo_head.c"
+
+static const char * const bfifo_head_opt_names[] = {
+	[1]	= "limit",
+};
+
+#define BFIFO_HEAD_SL_OPTS(_ops)					\
+	{ .ops = &_ops, .names = bfifo_head_opt_names,			\
+	  .maxtype = ARRAY_SIZE(bfifo_head_opt_names) - 1, .flat = true }
+
+static struct sl_sched_opts bfifo_head_sl_opts[] = {
+	BFIFO_HEAD_SL_OPTS(bfifo_head_drop_qdisc_ops),
+	BFIFO_HEAD_SL_OPTS(bfifo_tail_drop_qdisc_ops),
+};
+
+static void __attribute__((constructor)) bfifo_head_sl_register(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bfifo_head_sl_opts); i++)
+		sl_register_opts(&bfifo_head_sl_opts[i]);
+}
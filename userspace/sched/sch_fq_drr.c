@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_fq_drr.c : FQ-DRR for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_fq_drr.c"
+
+static const char * const fq_opt_names[TCA_FQ_MAX + 1] = {
+	[TCA_FQ_PLIMIT]			= "plimit",
+	[TCA_FQ_FLOW_PLIMIT]		= "flow_plimit",
+	[TCA_FQ_QUANTUM]		= "quantum",
+	[TCA_FQ_INITIAL_QUANTUM]	= "initial_quantum",
+	[TCA_FQ_RATE_ENABLE]		= "rate_enable",
+	[TCA_FQ_FLOW_DEFAULT_RATE]	= "flow_default_rate",
+	[TCA_FQ_FLOW_MAX_RATE]		= "flow_max_rate",
+	[TCA_FQ_BUCKETS_LOG]		= "buckets_log",
+	[TCA_FQ_FLOW_REFILL_DELAY]	= "flow_refill_delay",
+	[TCA_FQ_ORPHAN_MASK]		= "orphan_mask",
+	[TCA_FQ_LOW_RATE_THRESHOLD]	= "low_rate_threshold",
+	[TCA_FQ_CE_THRESHOLD]		= "ce_threshold",
+	[TCA_FQ_TIMER_SLACK]		= "timer_slack",
+	[TCA_FQ_HORIZON]		= "horizon",
+	[TCA_FQ_HORIZON_DROP]		= "horizon_drop",
+};
+
+static struct sl_sched_opts fq_sl_opts[] = {
+	{ .ops = &fq_qdisc_ops, .policy = fq_policy,
+	  .names = fq_opt_names, .maxtype = TCA_FQ_MAX },
+	{ .ops = &fq_basic_qdisc_ops, .policy = fq_policy,
+	  .names = fq_opt_names, .maxtype = TCA_FQ_MAX },
+};
+
+static void __attribute__((constructor)) fq_sl_register(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fq_sl_opts); i++)
+		sl_register_opts(&fq_sl_opts[i]);
+}
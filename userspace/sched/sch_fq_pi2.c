@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_fq_pi2.c : FQ-PI2 for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ * The clock option takes the number of the source, 0 is ktime.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_fq_pi2.c"
+
+static const char * const fq_pi2_opt_names[TCA_FQ_PI2_MAX + 1] = {
+	[TCA_FQ_PI2_PLIMIT]		= "plimit",
+	[TCA_FQ_PI2_FLOW_PLIMIT]	= "flow_plimit",
+	[TCA_FQ_PI2_QUANTUM]		= "quantum",
+	[TCA_FQ_PI2_INITIAL_QUANTUM]	= "initial_quantum",
+	[TCA_FQ_PI2_FLOW_REFILL_DELAY]	= "flow_refill_delay",
+	[TCA_FQ_PI2_BUCKETS_LOG]	= "buckets_log",
+	[TCA_FQ_PI2_HASH_MASK]		= "hash_mask",
+	[TCA_FQ_PI2_TARGET]		= "target",
+	[TCA_FQ_PI2_TUPDATE]		= "tupdate",
+	[TCA_FQ_PI2_ALPHA]		= "alpha",
+	[TCA_FQ_PI2_BETA]		= "beta",
+	[TCA_FQ_PI2_COUPLING]		= "coupling",
+	[TCA_FQ_PI2_FLAGS]		= "flags",
+	[TCA_FQ_PI2_MON_FL_PORT]	= "mon_fl_port",
+	[TCA_FQ_PI2_UDP_PLIMIT]		= "udp_plimit",
+	[TCA_FQ_PI2_CLOCK]		= "clock",
+};
+
+#define FQ_PI2_SL_OPTS(_ops)						\
+	{ .ops = &_ops, .policy = fq_pi2_policy,			\
+	  .names = fq_pi2_opt_names, .maxtype = TCA_FQ_PI2_MAX }
+
+static struct sl_sched_opts fq_pi2_sl_opts[] = {
+	FQ_PI2_SL_OPTS(fq_pi2_tail_qdisc_ops),
+	FQ_PI2_SL_OPTS(fq_pi2_head_qdisc_ops),
+};
+
+static void __attribute__((constructor)) fq_pi2_sl_register(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fq_pi2_sl_opts); i++)
+		sl_register_opts(&fq_pi2_sl_opts[i]);
+}
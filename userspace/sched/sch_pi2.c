@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_pi2.c : PI2 for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ * The clock option takes the number of the source, 0 is ktime.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_pi2.c"
+
+static const char * const pi2_opt_names[TCA_PI2_MAX + 1] = {
+	[TCA_PI2_LIMIT]			= "limit",
+	[TCA_PI2_TARGET]		= "target",
+	[TCA_PI2_TUPDATE]		= "tupdate",
+	[TCA_PI2_ALPHA]			= "alpha",
+	[TCA_PI2_BETA]			= "beta",
+	[TCA_PI2_COUPLING]		= "coupling",
+	[TCA_PI2_PI2_FLAGS]		= "pi2_flags",
+	[TCA_PI2_CLOCK]			= "clock",
+};
+
+#define PI2_SL_OPTS(_ops)						\
+	{ .ops = &_ops, .policy = pi2_policy,				\
+	  .names = pi2_opt_names, .maxtype = TCA_PI2_MAX }
+
+static struct sl_sched_opts pi2_sl_opts[] = {
+	PI2_SL_OPTS(pi2_tail_qdisc_ops),
+	PI2_SL_OPTS(pi2_head_qdisc_ops),
+#ifdef PI2_BOB_BRISCOE
+	PI2_SL_OPTS(pi2_rapid_qdisc_ops),
+#endif	/* PI2_BOB_BRISCOE */
+};
+
+static void __attribute__((constructor)) pi2_sl_register(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pi2_sl_opts); i++)
+		sl_register_opts(&pi2_sl_opts[i]);
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_scrr.c : SCRR for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_scrr.c"
+
+static const char * const scrr_opt_names[TCA_SCRR_MAX + 1] = {
+	[TCA_SCRR_PLIMIT]		= "plimit",
+	[TCA_SCRR_BUCKETS_LOG]		= "buckets_log",
+	[TCA_SCRR_HASH_MASK]		= "hash_mask",
+	[TCA_SCRR_FLOW_PLIMIT]		= "flow_plimit",
+	[TCA_SCRR_FLAGS]		= "flags",
+	[TCA_SCRR_CLASSIFIER]		= "classifier",
+	[TCA_SCRR_HASH_LOAD]		= "hash_load",
+	[TCA_SCRR_GC_AGE]		= "gc_age",
+	[TCA_SCRR_TARGET]		= "target",
+	[TCA_SCRR_TUPDATE]		= "tupdate",
+	[TCA_SCRR_ALPHA]		= "alpha",
+	[TCA_SCRR_BETA]			= "beta",
+	[TCA_SCRR_COUPLING]		= "coupling",
+	[TCA_SCRR_UDP_PLIMIT]		= "udp_plimit",
+	[TCA_SCRR_MAX_FLOWS]		= "max_flows",
+	[TCA_SCRR_WEIGHT_SRC]		= "weight_src",
+	[TCA_SCRR_WEIGHTS]		= "weights",
+	[TCA_SCRR_GSO_SPLIT]		= "gso_split",
+	[TCA_SCRR_SK_CACHE]		= "sk_cache",
+	[TCA_SCRR_FLOW_BLIMIT]		= "flow_blimit",
+	[TCA_SCRR_HORIZON]		= "horizon",
+	[TCA_SCRR_TELEMETRY]		= "telemetry",
+};
+
+static const char * const hscrr_opt_names[TCA_HSCRR_MAX + 1] = {
+	[TCA_HSCRR_WEIGHT]		= "weight",
+	[TCA_HSCRR_DEFAULT]		= "default",
+};
+
+#define SCRR_SL_OPTS(_ops)						\
+	{ .ops = &_ops, .policy = scrr_policy,				\
+	  .names = scrr_opt_names, .maxtype = TCA_SCRR_MAX }
+
+static struct sl_sched_opts scrr_sl_opts[] = {
+	SCRR_SL_OPTS(scrr_qdisc_ops),
+	SCRR_SL_OPTS(scrr_npm_qdisc_ops),
+	SCRR_SL_OPTS(scrr_nmia_qdisc_ops),
+	SCRR_SL_OPTS(scrr_nmne_qdisc_ops),
+	SCRR_SL_OPTS(scrr_neia_qdisc_ops),
+	SCRR_SL_OPTS(scrr_basic_qdisc_ops),
+	SCRR_SL_OPTS(scrr_pi2_qdisc_ops),
+	SCRR_SL_OPTS(scrr_mq_qdisc_ops),
+	{ .ops = &hscrr_qdisc_ops, .policy = hscrr_policy,
+	  .names = hscrr_opt_names, .maxtype = TCA_HSCRR_MAX },
+};
+
+static void __attribute__((constructor)) scrr_sl_register(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(scrr_sl_opts); i++)
+		sl_register_opts(&scrr_sl_opts[i]);
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_sppifo_stfq.c : SP-PIFO for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_sppifo_stfq.c"
+
+static const char * const sppifo_opt_names[TCA_SPPIFO_MAX + 1] = {
+	[TCA_SPPIFO_PLIMIT]		= "plimit",
+	[TCA_SPPIFO_BUCKETS_LOG]	= "buckets_log",
+	[TCA_SPPIFO_HASH_MASK]		= "hash_mask",
+	[TCA_SPPIFO_BAND_PLIMIT]	= "band_plimit",
+	[TCA_SPPIFO_FLAGS]		= "flags",
+	[TCA_SPPIFO_BANDS]		= "bands",
+};
+
+static struct sl_sched_opts sppifo_sl_opts = {
+	.ops = &sppifo_qdisc_ops, .policy = sppifo_policy,
+	.names = sppifo_opt_names, .maxtype = TCA_SPPIFO_MAX
+};
+
+static void __attribute__((constructor)) sppifo_sl_register(void)
+{
+	sl_register_opts(&sppifo_sl_opts);
+}
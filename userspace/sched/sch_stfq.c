@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sch_stfq.c : STFQ for the userspace library.
+ *
+ * Build the kernel module as is, and register its option names.
+ */
+
+#include "schedlib.h"
+#include "../../linux-6.01-l4s/sch_stfq.c"
+
+static const char * const stfq_opt_names[TCA_STFQ_MAX + 1] = {
+	[TCA_STFQ_PLIMIT]		= "plimit",
+	[TCA_STFQ_BUCKETS_LOG]		= "buckets_log",
+	[TCA_STFQ_HASH_MASK]		= "hash_mask",
+	[TCA_STFQ_FLOW_PLIMIT]		= "flow_plimit",
+	[TCA_STFQ_FLAGS]		= "flags",
+	[TCA_STFQ_CAL_GRAN_LOG]		= "cal_gran_log",
+};
+
+static struct sl_sched_opts stfq_sl_opts = {
+	.ops = &stfq_qdisc_ops, .policy = stfq_policy,
+	.names = stfq_opt_names, .maxtype = TCA_STFQ_MAX
+};
+
+static void __attribute__((constructor)) stfq_sl_register(void)
+{
+	sl_register_opts(&stfq_sl_opts);
+}
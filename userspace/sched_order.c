@@ -0,0 +1,384 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * sched_order.c : check that schedulers keep the same schedule.
+ *
+ * Replay a fixed sequence of enqueues and dequeues, the same on every
+ * run, through each scheduler and hash the order in which packets come
+ * out, or are dropped. A digest is taken every SO_CHECKPOINT packets,
+ * so that a difference can be located. With -g the digests are written
+ * to a reference file, with -c they are compared with it.
+ *
+ * The sequence mixes packet sizes, a few heavy flows that stay backlogged
+ * with many light flows that go idle and come back, so that the new and
+ * old lists, the initial advance and the empty flow handling of the SCRR
+ * variants all make a difference. "make check" compares the SCRR variants
+ * with sched_order.ref, which was generated with the hand written
+ * dequeue functions, before the variants were generated from one core,
+ * except scrr_pi2, which came later.
+ *
+ * After every step, the qlen and backlog of the scheduler must match the
+ * packets it was given and has not released. With -r the scheduler is
+ * reset every few steps, and with -k every other reset is replaced by a
+ * change of its options, to check that resizing keeps them right too.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "schedlib.h"
+
+#define SO_SCHED_MAX		32
+#define SO_FLOWS		64
+#define SO_HEAVY_FLOWS		8
+#define SO_FLOW_QLEN_MAX	80	/* Below flow_plimit, no drops */
+#define SO_CHECKPOINT		2000
+#define SO_STEPS_DEFLT		20000
+#define SO_LINE_MAX		256
+
+struct so_run {
+	u64		rnd;
+	u64		digest;
+	u64		now_ns;
+	u64		seq;
+	u64		out;		/* Packets dequeued or dropped */
+	u64		hold_bytes;	/* Given to the scheduler, not out */
+	u32		hold_pkts;
+	u32		flow_qlen[SO_FLOWS];
+	FILE		*print;		/* Every packet, with -p */
+	FILE		*ref_out;	/* -g */
+	FILE		*ref_in;	/* -c */
+	const char	*sched;
+	const char	*opts;
+	const char	*change_opts;	/* -k */
+	u32		reset_steps;	/* -r */
+	int		mismatch;
+};
+
+static struct so_run *so_cur;
+
+/* xorshift64*, independent of the random numbers of the schedulers */
+static u32 so_rand(struct so_run *r)
+{
+	r->rnd ^= r->rnd >> 12;
+	r->rnd ^= r->rnd << 25;
+	r->rnd ^= r->rnd >> 27;
+	return (u32) ((r->rnd * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* FNV-1a */
+static void so_digest(struct so_run *r, u64 val)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		r->digest ^= (val >> (i * 8)) & 0xFF;
+		r->digest *= 0x100000001B3ULL;
+	}
+}
+
+static void so_checkpoint(struct so_run *r, int last)
+{
+	char line[SO_LINE_MAX];
+	char want[SO_LINE_MAX];
+
+	if (!last && (r->out % SO_CHECKPOINT) != 0)
+		return;
+	snprintf(line, sizeof(line), "%s %llu %016llx\n", r->sched,
+		 (unsigned long long) r->out, (unsigned long long) r->digest);
+	if (r->ref_out)
+		fputs(line, r->ref_out);
+	if (r->ref_in && !r->mismatch) {
+		/* Skip the other schedulers of the reference */
+		while (fgets(want, sizeof(want), r->ref_in)) {
+			if (strncmp(want, r->sched, strlen(r->sched)) == 0 &&
+			    want[strlen(r->sched)] == ' ')
+				break;
+			want[0] = '\0';
+		}
+		if (strcmp(line, want) != 0) {
+			fprintf(stderr, "%s: differs after %llu packets\n"
+				"  got  %s  want %s", r->sched,
+				(unsigned long long) r->out, line,
+				want[0] ? want : "(nothing)\n");
+			r->mismatch = 1;
+		}
+	}
+}
+
+static void so_packet_out(struct so_run *r, struct sk_buff *skb, int drop)
+{
+	r->flow_qlen[skb->sl_flow]--;
+	r->hold_pkts--;
+	r->hold_bytes -= skb->len;
+	so_digest(r, ((u64) skb->sl_flow << 48) |
+		     ((u64) drop << 47) | skb->sl_tstamp);
+	if (r->print)
+		fprintf(r->print, "%s %u %llu %u\n", drop ? "drop" : "out",
+			skb->sl_flow, (unsigned long long) skb->sl_tstamp,
+			skb->len);
+	r->out++;
+	so_checkpoint(r, 0);
+}
+
+static void so_skb_free(struct sk_buff *skb)
+{
+	so_packet_out(so_cur, skb, 1);
+	free(skb);
+}
+
+static int so_enqueue(struct so_run *r, struct sl_qdisc *q, u32 flow)
+{
+	/* One hash per flow, distinct in the low bits, so that flows
+	 * never share a bucket */
+	u32 hash = (flow + 1) * 0x9E3779B1U;
+	struct sk_buff *skb;
+	u32 len;
+
+	if (r->flow_qlen[flow] >= SO_FLOW_QLEN_MAX)
+		return 0;
+	skb = calloc(1, sizeof(*skb));
+	if (!skb)
+		return -ENOMEM;
+	/* Light flows are mostly small, heavy flows mostly full size */
+	if (flow < SO_HEAVY_FLOWS)
+		len = (so_rand(r) % 4) ? 1514 : 64 + so_rand(r) % 1451;
+	else
+		len = (so_rand(r) % 4) ? 64 + so_rand(r) % 200 : 1514;
+	skb->len = len;
+	skb->hash = hash;
+	skb->protocol = htons(ETH_P_IP);
+	skb->l4proto = IPPROTO_TCP;
+	skb->iph.protocol = IPPROTO_TCP;
+	skb->iph.saddr = hash;
+	skb->iph.daddr = ~hash;
+	skb->th.source = (u16) hash;
+	skb->th.dest = (u16) (hash >> 16);
+	skb->sl_flow = flow;
+	skb->sl_tstamp = r->seq++;
+	r->flow_qlen[flow]++;
+	r->hold_pkts++;
+	r->hold_bytes += len;
+	sl_qdisc_enqueue(q, skb);
+	return 0;
+}
+
+static int so_dequeue(struct so_run *r, struct sl_qdisc *q)
+{
+	struct sk_buff *skb = sl_qdisc_dequeue(q);
+
+	if (!skb)
+		return 0;
+	so_packet_out(r, skb, 0);
+	free(skb);
+	return 1;
+}
+
+static int so_check_hold(struct so_run *r, struct sl_qdisc *q, u32 step)
+{
+	if (sl_qdisc_qlen(q) == r->hold_pkts &&
+	    sl_qdisc_backlog(q) == r->hold_bytes)
+		return 0;
+	fprintf(stderr, "%s: step %u, qlen %u backlog %u, holds %u packets "
+		"%llu bytes\n", r->sched, step, sl_qdisc_qlen(q),
+		sl_qdisc_backlog(q), r->hold_pkts,
+		(unsigned long long) r->hold_bytes);
+	return -EINVAL;
+}
+
+/* Reset the scheduler, or with -k, every other time change its options
+ * to change_opts and back */
+static int so_reset(struct so_run *r, struct sl_qdisc *q, u32 step)
+{
+	const char *msg = NULL;
+	u32 nth = step / r->reset_steps;
+	int err;
+
+	if (!r->change_opts || (nth % 2) == 0) {
+		sl_qdisc_reset(q);
+		return 0;
+	}
+	err = sl_qdisc_change(q, (nth % 4) == 1 ? r->change_opts : r->opts,
+			      &msg);
+	if (err)
+		fprintf(stderr, "%s: change failed: %s (%d)\n", r->sched,
+			msg ? msg : strerror(-err), err);
+	return err;
+}
+
+static int so_run_sched(const char *sched, const char *opts, u32 steps,
+			struct so_run *r)
+{
+	struct sl_qdisc *q;
+	const char *msg = NULL;
+	u32 step, i, n;
+	int err;
+
+	sl_random_seed(0);
+	sl_clock_set(10 * NSEC_PER_SEC);
+	err = sl_qdisc_create(sched, opts, &q, &msg);
+	if (err) {
+		fprintf(stderr, "%s: create failed: %s (%d)\n", sched,
+			msg ? msg : strerror(-err), err);
+		return err;
+	}
+	r->rnd = 0x9E3779B97F4A7C15ULL;
+	r->now_ns = 10 * NSEC_PER_SEC;
+	r->digest = 0xCBF29CE484222325ULL;
+	so_cur = r;
+	sl_skb_free_hook = so_skb_free;
+
+	for (step = 0; step < steps && !err; step++) {
+		r->now_ns += 1000 + so_rand(r) % 20000;
+		sl_clock_set(r->now_ns);
+		if (so_rand(r) % 100 < 55) {
+			/* A burst, mostly from the heavy flows */
+			u32 flow = (so_rand(r) % 10 < 7) ?
+				so_rand(r) % SO_HEAVY_FLOWS :
+				SO_HEAVY_FLOWS +
+				so_rand(r) % (SO_FLOWS - SO_HEAVY_FLOWS);
+
+			n = 1 + so_rand(r) % 8;
+			for (i = 0; i < n && !err; i++)
+				err = so_enqueue(r, q, flow);
+		} else {
+			n = 1 + so_rand(r) % 12;
+			for (i = 0; i < n; i++)
+				if (!so_dequeue(r, q))
+					break;
+		}
+		sl_qdisc_run_work();
+		if (!err && r->reset_steps && ((step + 1) % r->reset_steps) == 0)
+			err = so_reset(r, q, step + 1);
+		if (!err)
+			err = so_check_hold(r, q, step);
+	}
+	while (!err && so_dequeue(r, q))
+		;
+	if (!err)
+		err = so_check_hold(r, q, step);
+	so_checkpoint(r, 1);
+
+	sl_qdisc_destroy(q);
+	sl_skb_free_hook = NULL;
+	so_cur = NULL;
+	return err;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -q SCHED[:OPTS]  Scheduler, repeat (default the SCRR variants)\n"
+		"  -n STEPS         Steps of the sequence (default %d)\n"
+		"  -g FILE          Write the digests to FILE\n"
+		"  -c FILE          Compare the digests with FILE\n"
+		"  -r STEPS         Reset the scheduler every STEPS steps\n"
+		"  -k OPTS          Every other reset, change the options to OPTS and back\n"
+		"  -p               Print every packet out\n",
+		prog, SO_STEPS_DEFLT);
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const sched_dflt[] = {
+		"scrr", "scrr_npm", "scrr_nmia", "scrr_nmne", "scrr_neia",
+		"scrr_basic", "scrr_pi2",
+	};
+	const char *sched[SO_SCHED_MAX];
+	const char *opts[SO_SCHED_MAX];
+	const char *gen_path = NULL;
+	const char *check_path = NULL;
+	const char *change_opts = NULL;
+	u32 reset_steps = 0;
+	u32 steps = SO_STEPS_DEFLT;
+	int sched_num = 0;
+	int print = 0;
+	int failed = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "q:n:g:c:r:k:ph")) != -1) {
+		switch (opt) {
+		case 'q': {
+			char *colon;
+
+			if (sched_num >= SO_SCHED_MAX) {
+				fprintf(stderr, "Too many schedulers\n");
+				return 1;
+			}
+			colon = strchr(optarg, ':');
+			if (colon)
+				*colon++ = '\0';
+			sched[sched_num] = optarg;
+			opts[sched_num++] = colon;
+			break;
+		}
+		case 'n':
+			steps = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gen_path = optarg;
+			break;
+		case 'c':
+			check_path = optarg;
+			break;
+		case 'r':
+			reset_steps = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			change_opts = optarg;
+			break;
+		case 'p':
+			print = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!sched_num) {
+		for (i = 0; i < ARRAY_SIZE(sched_dflt); i++) {
+			sched[sched_num] = sched_dflt[i];
+			opts[sched_num++] = NULL;
+		}
+	}
+
+	for (i = 0; i < sched_num; i++) {
+		struct so_run r = {
+			.sched		= sched[i],
+			.opts		= opts[i],
+			.change_opts	= change_opts,
+			.reset_steps	= reset_steps,
+			.print		= print ? stdout : NULL,
+		};
+
+		if (gen_path) {
+			r.ref_out = fopen(gen_path, i ? "a" : "w");
+			if (!r.ref_out) {
+				perror(gen_path);
+				return 1;
+			}
+		}
+		if (check_path) {
+			r.ref_in = fopen(check_path, "r");
+			if (!r.ref_in) {
+				perror(check_path);
+				return 1;
+			}
+		}
+		if (so_run_sched(sched[i], opts[i], steps, &r) || r.mismatch)
+			failed = 1;
+		else if (check_path)
+			printf("%s: same schedule, %llu packets\n", sched[i],
+			       (unsigned long long) r.out);
+		else if (!print)
+			printf("%s: %llu packets\n", sched[i],
+			       (unsigned long long) r.out);
+		if (r.ref_out)
+			fclose(r.ref_out);
+		if (r.ref_in)
+			fclose(r.ref_in);
+	}
+	return failed;
+}
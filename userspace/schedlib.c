@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * schedlib.c : create and configure the schedulers, see schedlib.h.
+ *
+ * Options are converted to netlink attributes and given to the
+ * scheduler init() and change(), so they go through the exact same
+ * validation as with tc.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "schedlib.h"
+
+#define SL_OPTS_BUF	1024
+#define SL_OPTS_BIN_MAX	64	/* Bytes of a binary option */
+
+static struct sl_sched_opts *sl_opts_base;
+
+void sl_register_opts(struct sl_sched_opts *opts)
+{
+	opts->next = sl_opts_base;
+	sl_opts_base = opts;
+}
+
+static const struct sl_sched_opts *sl_find_opts(const struct Qdisc_ops *ops)
+{
+	const struct sl_sched_opts *opts;
+
+	for (opts = sl_opts_base; opts; opts = opts->next)
+		if (opts->ops == ops)
+			return opts;
+	return NULL;
+}
+
+static const struct Qdisc_ops *sl_find_ops(const char *id)
+{
+	const struct Qdisc_ops *ops = NULL;
+
+	while ((ops = sl_sched_next(ops)))
+		if (!strcmp(ops->id, id))
+			return ops;
+	return NULL;
+}
+
+static struct nlattr *sl_nla_add(char *buf, int *off, int type,
+				 const void *data, int len)
+{
+	struct nlattr *nla = (struct nlattr *) (buf + *off);
+
+	if (*off + NLA_HDRLEN + NLA_ALIGN(len) > SL_OPTS_BUF)
+		return NULL;
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy(nla_data(nla), data, len);
+	*off += NLA_ALIGN(nla->nla_len);
+	return nla;
+}
+
+/* Build the TCA_OPTIONS nest from "name=value,..." */
+static int sl_opts_build(const struct sl_sched_opts *opts, const char *str,
+			 char *buf, const char **errmsg)
+{
+	struct nlattr *nest = (struct nlattr *) buf;
+	char *dup, *tok, *save;
+	int off = NLA_HDRLEN;
+	int err = 0;
+
+	nest->nla_type = TCA_OPTIONS;
+	if (opts && opts->flat)
+		memset(buf + NLA_HDRLEN, 0, opts->maxtype * sizeof(u32));
+	if (!str || !*str)
+		goto done;
+	if (!opts) {
+		*errmsg = "Scheduler has no option table";
+		return -EOPNOTSUPP;
+	}
+
+	dup = strdup(str);
+	if (!dup)
+		return -ENOMEM;
+	for (tok = strtok_r(dup, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		unsigned long long v;
+		char *end;
+		int type;
+
+		if (!val) {
+			*errmsg = "Option without value";
+			err = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+		for (type = 1; type <= opts->maxtype; type++)
+			if (opts->names[type] &&
+			    !strcasecmp(opts->names[type], tok))
+				break;
+		if (type > opts->maxtype) {
+			*errmsg = "Unknown option";
+			err = -ENOENT;
+			break;
+		}
+		/* Binaries are a list of bytes, "1:2:4" */
+		if (!opts->flat && opts->policy[type].type == NLA_BINARY) {
+			u8 bin[SL_OPTS_BIN_MAX];
+			int len = 0;
+
+			for (end = val; *end && len < SL_OPTS_BIN_MAX; ) {
+				bin[len++] = (u8) strtoul(end, &end, 0);
+				if (*end == ':')
+					end++;
+				else if (*end)
+					break;
+			}
+			if (*end) {
+				*errmsg = "Invalid option value";
+				err = -EINVAL;
+				break;
+			}
+			if (!sl_nla_add(buf, &off, type, bin, len)) {
+				*errmsg = "Too many options";
+				err = -E2BIG;
+				break;
+			}
+			continue;
+		}
+
+		v = strtoull(val, &end, 0);
+		if (*end || end == val) {
+			*errmsg = "Invalid option value";
+			err = -EINVAL;
+			break;
+		}
+
+		if (opts->flat) {
+			u32 v32 = v;
+
+			memcpy(buf + NLA_HDRLEN + (type - 1) * sizeof(v32),
+			       &v32, sizeof(v32));
+			off = NLA_HDRLEN + opts->maxtype * sizeof(v32);
+			continue;
+		}
+
+		switch (opts->policy[type].type) {
+		case NLA_U8: {
+			u8 v8 = v;
+
+			if (!sl_nla_add(buf, &off, type, &v8, sizeof(v8)))
+				err = -E2BIG;
+			break;
+		}
+		case NLA_U16: {
+			u16 v16 = v;
+
+			if (!sl_nla_add(buf, &off, type, &v16, sizeof(v16)))
+				err = -E2BIG;
+			break;
+		}
+		case NLA_U64: {
+			u64 v64 = v;
+
+			if (!sl_nla_add(buf, &off, type, &v64, sizeof(v64)))
+				err = -E2BIG;
+			break;
+		}
+		default: {
+			u32 v32 = v;
+
+			if (!sl_nla_add(buf, &off, type, &v32, sizeof(v32)))
+				err = -E2BIG;
+			break;
+		}
+		}
+		if (err) {
+			*errmsg = "Too many options";
+			break;
+		}
+	}
+	free(dup);
+
+done:
+	nest->nla_len = off;
+	return err;
+}
+
+/* The options built by sl_opts_build(), NULL if a flat struct is empty */
+static struct nlattr *sl_opts_nla(const struct sl_sched_opts *opts, char *buf)
+{
+	struct nlattr *nest = (struct nlattr *) buf;
+
+	if (opts && opts->flat && nest->nla_len == NLA_HDRLEN)
+		return NULL;
+	return nest;
+}
+
+int sl_qdisc_create(const char *id, const char *opts_str,
+		    struct sl_qdisc **qp, const char **errmsg)
+{
+	struct netlink_ext_ack extack = { NULL };
+	const struct Qdisc_ops *ops;
+	char buf[SL_OPTS_BUF] __aligned(8);
+	struct sl_qdisc *q;
+	const char *dummy;
+	int err;
+
+	if (!errmsg)
+		errmsg = &dummy;
+	*errmsg = NULL;
+	ops = sl_find_ops(id);
+	if (!ops) {
+		*errmsg = "Unknown scheduler";
+		return -ENOENT;
+	}
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+	q->opts = sl_find_opts(ops);
+
+	err = sl_opts_build(q->opts, opts_str, buf, errmsg);
+	if (err)
+		goto err_free;
+
+	q->sch = sl_qdisc_alloc(ops, NULL, TC_H_ROOT, sl_opts_nla(q->opts, buf),
+				&extack, &err);
+	if (!q->sch) {
+		*errmsg = extack._msg;
+		goto err_free;
+	}
+	q->sch->handle = TC_H_MAKE(0x80000000U, 0);
+	sl_qdisc_run_work();
+	*qp = q;
+	return 0;
+
+err_free:
+	free(q);
+	return err;
+}
+
+int sl_qdisc_change(struct sl_qdisc *q, const char *opts_str,
+		    const char **errmsg)
+{
+	struct netlink_ext_ack extack = { NULL };
+	char buf[SL_OPTS_BUF] __aligned(8);
+	const char *dummy;
+	int err;
+
+	if (!errmsg)
+		errmsg = &dummy;
+	*errmsg = NULL;
+	if (!q->sch->ops->change) {
+		*errmsg = "Scheduler can't be changed";
+		return -EOPNOTSUPP;
+	}
+	err = sl_opts_build(q->opts, opts_str, buf, errmsg);
+	if (err)
+		return err;
+	err = q->sch->ops->change(q->sch, sl_opts_nla(q->opts, buf), &extack);
+	if (err)
+		*errmsg = extack._msg;
+	sl_qdisc_run_work();
+	return err;
+}
+
+/* Create or change a class, like 'tc class replace' */
+int sl_class_change(struct sl_qdisc *q, u32 minor, const char *opts_str,
+		    const char **errmsg)
+{
+	const struct Qdisc_class_ops *cops = q->sch->ops->cl_ops;
+	struct netlink_ext_ack extack = { NULL };
+	char buf[SL_OPTS_BUF] __aligned(8);
+	struct nlattr *tca[TCA_OPTIONS + 1] = { NULL };
+	u32 classid = TC_H_MAKE(q->sch->handle, minor);
+	unsigned long cl;
+	const char *dummy;
+	int err;
+
+	if (!errmsg)
+		errmsg = &dummy;
+	*errmsg = NULL;
+	if (!cops || !cops->change) {
+		*errmsg = "Scheduler has no classes";
+		return -EOPNOTSUPP;
+	}
+	err = sl_opts_build(q->opts, opts_str, buf, errmsg);
+	if (err)
+		return err;
+	tca[TCA_OPTIONS] = sl_opts_nla(q->opts, buf);
+	cl = cops->find(q->sch, classid);
+	err = cops->change(q->sch, classid, q->sch->handle, tca, &cl, &extack);
+	if (err)
+		*errmsg = extack._msg;
+	sl_qdisc_run_work();
+	return err;
+}
+
+void sl_qdisc_reset(struct sl_qdisc *q)
+{
+	qdisc_reset(q->sch);
+	sl_qdisc_run_work();
+}
+
+void sl_qdisc_destroy(struct sl_qdisc *q)
+{
+	qdisc_put(q->sch);
+	free(q);
+}
+
+int sl_qdisc_xstats(struct sl_qdisc *q, void *buf, int len)
+{
+	struct gnet_dump d = { .xstats = buf, .xstats_len = len };
+	int err;
+
+	if (!q->sch->ops->dump_stats)
+		return -EOPNOTSUPP;
+	err = q->sch->ops->dump_stats(q->sch, &d);
+	if (err)
+		return err;
+	return d.xstats_copied;
+}